@@ -0,0 +1,154 @@
+#include "ActivityRing.h"
+
+#include <cstring>
+#include <type_traits>
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+#include <unistd.h>
+#endif
+
+static_assert(std::is_trivially_copyable<ActivityEvent>::value, "Events are copied in and out of slots byte by byte.");
+
+namespace
+{
+	// Copies text into a fixed buffer, cut short at a UTF-8 character boundary if it doesn't fit
+	void copyText(char* buffer, size_t bufferSize, const std::string& text)
+	{
+		size_t length = text.size();
+		if (length >= bufferSize)
+		{
+			length = bufferSize - 1;
+			while (length > 0 && (static_cast<unsigned char>(text[length]) & 0xC0) == 0x80)
+			{
+				--length;
+			}
+		}
+
+		memcpy(buffer, text.data(), length);
+		buffer[length] = '\0';
+	}
+}
+
+ActivityEvent::ActivityEvent(Kind kind, uint64_t entryID, const std::string& text, double progress, const std::string& detail) :
+	kind(kind), entryID(entryID), progress(progress)
+{
+	copyText(this->text, TEXT_SIZE, text);
+	copyText(this->detail, DETAIL_SIZE, detail);
+}
+
+ActivityRing::ActivityRing() : ownedLayout(std::make_unique<Layout>()), layout(ownedLayout.get())
+{
+	initialize();
+}
+
+void ActivityRing::initialize()
+{
+	layout->header.magic = MAGIC;
+	layout->header.version = VERSION;
+	layout->header.capacity = CAPACITY;
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+	layout->header.ownerProcessID = getpid();
+#endif
+	layout->header.nextSequence.store(0, std::memory_order_release);
+}
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+ActivityRing::ActivityRing(std::unique_ptr<SharedMemoryRegion> region) : region(std::move(region)),
+	layout(static_cast<Layout*>(this->region->data()))
+{}
+
+std::string ActivityRing::defaultName()
+{
+	return userSharedMemoryName("activity");
+}
+
+std::unique_ptr<ActivityRing> ActivityRing::createShared(const std::string& name)
+{
+	// The region starts out zeroed, which leaves every slot without an event
+	std::unique_ptr<ActivityRing> ring(new ActivityRing(SharedMemoryRegion::create(name, sizeof(Layout))));
+	ring->initialize();
+	return ring;
+}
+
+std::unique_ptr<ActivityRing> ActivityRing::openShared(const std::string& name)
+{
+	auto region = SharedMemoryRegion::openReadOnly(name, sizeof(Layout));
+	if (region == nullptr)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<ActivityRing> ring(new ActivityRing(std::move(region)));
+	const Header& header = ring->layout->header;
+	if (header.magic != MAGIC || header.version != VERSION || header.capacity != CAPACITY)
+	{
+		return nullptr;
+	}
+
+	uint64_t published = header.nextSequence.load(std::memory_order_acquire);
+	ring->readSequence = (published > CAPACITY) ? published - CAPACITY : 0;
+	return ring;
+}
+
+bool ActivityRing::ownerRunning() const
+{
+	return processRunning(static_cast<long>(layout->header.ownerProcessID));
+}
+#endif
+
+void ActivityRing::publish(const ActivityEvent& event)
+{
+	uint64_t sequence = layout->header.nextSequence.fetch_add(1, std::memory_order_relaxed);
+	Slot& slot = layout->slots[sequence % CAPACITY];
+
+	// Marked as being written before the event is touched, so a reader copying it meanwhile can tell
+	slot.state.store(2 * sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&slot.event, &event, sizeof(ActivityEvent));
+	slot.state.store(2 * sequence + 2, std::memory_order_release);
+}
+
+uint64_t ActivityRing::consume(std::vector<ActivityEvent>& events)
+{
+	uint64_t published = layout->header.nextSequence.load(std::memory_order_acquire),
+		missed = 0;
+
+	if (published - readSequence > CAPACITY)
+	{
+		missed = published - CAPACITY - readSequence;
+		readSequence = published - CAPACITY;
+	}
+
+	while (readSequence < published)
+	{
+		const Slot& slot = layout->slots[readSequence % CAPACITY];
+		uint64_t expectedState = 2 * readSequence + 2,
+			stateBefore = slot.state.load(std::memory_order_acquire);
+
+		if (stateBefore < expectedState)
+		{
+			// Claimed but still being written; it is read next time
+			break;
+		}
+
+		if (stateBefore == expectedState)
+		{
+			// A seqlock read: the copy only counts if the slot wasn't rewritten while it was made
+			ActivityEvent event;
+			memcpy(&event, &slot.event, sizeof(ActivityEvent));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.state.load(std::memory_order_relaxed) == expectedState)
+			{
+				events.push_back(event);
+				++readSequence;
+				continue;
+			}
+		}
+
+		// Overwritten by a publisher that has gone around the ring since
+		++missed;
+		++readSequence;
+	}
+
+	return missed;
+}
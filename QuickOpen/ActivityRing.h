@@ -0,0 +1,132 @@
+#pragma once
+
+#include "PlatformUtils.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// One change to what the tray window lists, as published by the server process
+struct ActivityEvent
+{
+	enum Kind : uint32_t
+	{
+		WEBPAGE_OPENED,
+		UPLOAD_STARTED,
+		UPLOAD_PROGRESS,
+		// progress is 1 while the upload waits for its turn and 0 once it continues
+		UPLOAD_WAITING,
+		UPLOAD_COMPLETED,
+		UPLOAD_FAILED,
+		UPLOAD_CANCELLED,
+		UPLOAD_DEDUPLICATED,
+		// entryID is the prompt's ID in the server's ConsentApprovalQueue
+		CONSENT_PROMPT
+	};
+
+	static constexpr size_t TEXT_SIZE = 256,
+		DETAIL_SIZE = 128;
+
+	Kind kind = WEBPAGE_OPENED;
+	uint32_t reserved = 0;
+	// Identifies the upload across its events
+	uint64_t entryID = 0;
+	double progress = 0.0;
+	// UTF-8 and null-terminated; long text is cut short. The URL, the upload's full path, or the requester.
+	char text[TEXT_SIZE] = {};
+	// The error of UPLOAD_FAILED
+	char detail[DETAIL_SIZE] = {};
+
+	ActivityEvent() = default;
+	ActivityEvent(Kind kind, uint64_t entryID, const std::string& text, double progress = 0.0, const std::string& detail = {});
+
+	std::string getText() const
+	{
+		return text;
+	}
+
+	std::string getDetail() const
+	{
+		return detail;
+	}
+};
+
+// Activity of the server process, published for a tray GUI in another process to show. The ring lives in
+// shared memory as fixed-size slots, each with a sequence number that tells readers whether it holds the event
+// they expect, so publishing never waits for (or locks against) the reader. A reader that falls more than
+// CAPACITY events behind skips the ones that were overwritten, which costs it progress updates that later ones
+// supersede anyway, rather than slowing transfers down. Any number of threads may publish; one reads.
+class ActivityRing
+{
+public:
+	static constexpr uint32_t CAPACITY = 1024;
+
+	struct Header
+	{
+		uint64_t magic;
+		uint32_t version, capacity;
+		// The server process, for readers to tell whether it is still running
+		int64_t ownerProcessID;
+		// How many events have been claimed by publishers
+		std::atomic<uint64_t> nextSequence;
+	};
+
+	struct Slot
+	{
+		// 2 * n + 1 while event n is being written into the slot, 2 * n + 2 once it has been
+		std::atomic<uint64_t> state;
+		ActivityEvent event;
+	};
+
+	struct Layout
+	{
+		Header header;
+		Slot slots[CAPACITY];
+	};
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared memory needs address-free atomics.");
+
+private:
+	static constexpr uint64_t MAGIC = 0x517569636b4f7052; // "QuickOpR"
+	static constexpr uint32_t VERSION = 1;
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+	std::unique_ptr<SharedMemoryRegion> region;
+#endif
+	std::unique_ptr<Layout> ownedLayout;
+	Layout* layout = nullptr;
+	uint64_t readSequence = 0;
+
+	void initialize();
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+	explicit ActivityRing(std::unique_ptr<SharedMemoryRegion> region);
+#endif
+
+public:
+	// A ring in this process's memory only
+	ActivityRing();
+	ActivityRing(const ActivityRing&) = delete;
+	ActivityRing& operator=(const ActivityRing&) = delete;
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+	// The name the server publishes its activity under
+	static std::string defaultName();
+	// Creates the ring for other processes to read, replacing one left behind by a server that crashed
+	static std::unique_ptr<ActivityRing> createShared(const std::string& name = defaultName());
+	// Opens the ring of a running server for reading, or returns nothing if there is none. Reading starts at
+	// the oldest event it still holds.
+	static std::unique_ptr<ActivityRing> openShared(const std::string& name = defaultName());
+
+	// Whether the process that created the ring is still running
+	bool ownerRunning() const;
+#endif
+
+	void publish(const ActivityEvent& event);
+
+	// Appends the events published since the last call to events, and returns how many were overwritten before
+	// they could be read. Only to be called from one thread, of one process, at a time.
+	uint64_t consume(std::vector<ActivityEvent>& events);
+};
@@ -1,5 +1,7 @@
 #include "AppConfig.h"
 
+#include <iostream>
+
 using namespace SettingRetrieval;
 
 namespace SettingRetrieval
@@ -36,13 +38,32 @@ bool getSettingWarn(const nlohmann::json& config, const std::string& key, wxFile
 	return successVal;
 }
 
-void AppConfig::saveConfig(const wxFileName& filePath)
+nlohmann::json AppConfig::toJSON() const
 {
-	const wxFileName& effectiveFilePath = (filePath != wxFileName()) ? filePath : defaultConfigPath();
-
-	nlohmann::json jsonConfig = {
+	return {
 		// {"runAtStartup", runAtStartup},
 		{"serverPort", serverPort},
+		{
+			"timeouts", {
+				{"headerTimeoutSeconds", headerTimeoutSeconds},
+				{"consentTimeoutSeconds", consentTimeoutSeconds},
+				{"uploadIdleTimeoutSeconds", uploadIdleTimeoutSeconds},
+				{"minUploadBytesPerSecond", minUploadBytesPerSecond},
+				{"serverHandoffTimeoutSeconds", serverHandoffTimeoutSeconds}
+			}
+		},
+		{
+			"throttling", {
+				{"globalUploadLimit", globalUploadLimit},
+				{"perSenderUploadLimit", perSenderUploadLimit},
+				{"subnetUploadLimits", subnetUploadLimits}
+			}
+		},
+		{
+			"consentPolicy", {
+				{"rules", consentRules}
+			}
+		},
 		{
 			"webpageOpen", {
 				{"browserID", browserID},
@@ -52,10 +73,27 @@ void AppConfig::saveConfig(const wxFileName& filePath)
 		{
 			"openSaveFile", {
 				{"saveUseLastFolder", saveUseLastFolder},
-				{"savePath", fileSavePath.GetPath()}
+				{"savePath", fileSavePath.GetPath()},
+				{"speculativeUploadsEnabled", speculativeUploadsEnabled},
+				{"speculativeUploadBudget", speculativeUploadBudget},
+				{"deduplicationEnabled", deduplicationEnabled},
+				{"deduplicationUseHardlinks", deduplicationUseHardlinks},
+				{"maxConcurrentUploads", maxConcurrentUploads},
+				{"maxDiskWriters", maxDiskWriters},
+				{"diskWriterPriority", diskWriterPriority},
+				{"uploadDurability", uploadDurability},
+				{"diskSpaceSafetyMargin", diskSpaceSafetyMargin},
+				{"streamingOpenHandlers", streamingOpenHandlers},
+				{"ephemeralReceive", ephemeralReceive}
 			}
 		}
 	};
+}
+
+void AppConfig::saveConfig(const wxFileName& filePath)
+{
+	const wxFileName& effectiveFilePath = (filePath != wxFileName()) ? filePath : defaultConfigPath();
+	nlohmann::json jsonConfig = toJSON();
 
 	wxFileName dirName = getDirName(effectiveFilePath);
 	if(!dirName.DirExists() && !dirName.Mkdir())
@@ -98,6 +136,30 @@ AppConfig AppConfig::loadConfig(const wxFileName& filePath)
 
 	getSettingWarn(jsonConfig, "serverPort", newConfig.serverPort);
 
+	nlohmann::json timeoutSettings;
+	if (getSettingWarn(jsonConfig, "timeouts", timeoutSettings))
+	{
+		getSettingWarn(timeoutSettings, "headerTimeoutSeconds", newConfig.headerTimeoutSeconds);
+		getSettingWarn(timeoutSettings, "consentTimeoutSeconds", newConfig.consentTimeoutSeconds);
+		getSettingWarn(timeoutSettings, "uploadIdleTimeoutSeconds", newConfig.uploadIdleTimeoutSeconds);
+		getSettingWarn(timeoutSettings, "minUploadBytesPerSecond", newConfig.minUploadBytesPerSecond);
+		getSettingWarn(timeoutSettings, "serverHandoffTimeoutSeconds", newConfig.serverHandoffTimeoutSeconds);
+	}
+
+	nlohmann::json throttlingSettings;
+	if (getSettingWarn(jsonConfig, "throttling", throttlingSettings))
+	{
+		getSettingWarn(throttlingSettings, "globalUploadLimit", newConfig.globalUploadLimit);
+		getSettingWarn(throttlingSettings, "perSenderUploadLimit", newConfig.perSenderUploadLimit);
+		getSettingWarn(throttlingSettings, "subnetUploadLimits", newConfig.subnetUploadLimits);
+	}
+
+	nlohmann::json consentPolicySettings;
+	if (getSettingWarn(jsonConfig, "consentPolicy", consentPolicySettings))
+	{
+		getSettingWarn(consentPolicySettings, "rules", newConfig.consentRules);
+	}
+
 	nlohmann::json openWebpageSettings;
 	if (getSettingWarn(jsonConfig, "webpageOpen", openWebpageSettings))
 	{
@@ -110,7 +172,102 @@ AppConfig AppConfig::loadConfig(const wxFileName& filePath)
 	{
 		getSettingWarn(openSaveFileSettings, "saveUseLastFolder", newConfig.saveUseLastFolder);
 		getSettingWarn(openSaveFileSettings, "savePath", newConfig.fileSavePath, true);
+		getSettingWarn(openSaveFileSettings, "speculativeUploadsEnabled", newConfig.speculativeUploadsEnabled);
+		getSettingWarn(openSaveFileSettings, "speculativeUploadBudget", newConfig.speculativeUploadBudget);
+		getSettingWarn(openSaveFileSettings, "deduplicationEnabled", newConfig.deduplicationEnabled);
+		getSettingWarn(openSaveFileSettings, "deduplicationUseHardlinks", newConfig.deduplicationUseHardlinks);
+		getSettingWarn(openSaveFileSettings, "maxConcurrentUploads", newConfig.maxConcurrentUploads);
+		getSettingWarn(openSaveFileSettings, "maxDiskWriters", newConfig.maxDiskWriters);
+		getSettingWarn(openSaveFileSettings, "diskWriterPriority", newConfig.diskWriterPriority);
+		getSettingWarn(openSaveFileSettings, "uploadDurability", newConfig.uploadDurability);
+		getSettingWarn(openSaveFileSettings, "diskSpaceSafetyMargin", newConfig.diskSpaceSafetyMargin);
+		getSettingWarn(openSaveFileSettings, "streamingOpenHandlers", newConfig.streamingOpenHandlers);
+		getSettingWarn(openSaveFileSettings, "ephemeralReceive", newConfig.ephemeralReceive);
 	}
 
 	return newConfig;
 }
+
+ConfigChanges ConfigChanges::between(const AppConfig& oldConfig, const AppConfig& newConfig)
+{
+	// Compared in their saved form, which every setting already has
+	nlohmann::json oldJSON = oldConfig.toJSON(),
+		newJSON = newConfig.toJSON();
+
+	ConfigChanges changes;
+	changes.serverPort = (oldConfig.serverPort.effectiveValue() != newConfig.serverPort.effectiveValue());
+	changes.webpageOpen = (oldJSON["webpageOpen"] != newJSON["webpageOpen"]);
+
+	nlohmann::json& oldFileSettings = oldJSON["openSaveFile"];
+	nlohmann::json& newFileSettings = newJSON["openSaveFile"];
+	for (const char* key : { "savePath", "saveUseLastFolder" })
+	{
+		changes.fileSavePath |= (oldFileSettings[key] != newFileSettings[key]);
+		oldFileSettings.erase(key);
+		newFileSettings.erase(key);
+	}
+
+	for (const char* key : { "maxDiskWriters", "diskWriterPriority" })
+	{
+		changes.diskWriters |= (oldFileSettings[key] != newFileSettings[key]);
+		oldFileSettings.erase(key);
+		newFileSettings.erase(key);
+	}
+
+	for (const char* key : { "serverPort", "webpageOpen" })
+	{
+		oldJSON.erase(key);
+		newJSON.erase(key);
+	}
+
+	changes.otherSettings = (oldJSON != newJSON);
+	return changes;
+}
+
+std::vector<std::string> ConfigChanges::describe() const
+{
+	std::vector<std::string> names;
+	if (serverPort) names.emplace_back("server port");
+	if (diskWriters) names.emplace_back("disk writers");
+	if (webpageOpen) names.emplace_back("webpage opening");
+	if (fileSavePath) names.emplace_back("save folder");
+	if (otherSettings) names.emplace_back("other settings");
+	return names;
+}
+
+ConfigChanges ConfigChanges::apply(WriterReadersLock<AppConfig>& config, AppConfig newConfig,
+	const std::function<void(unsigned newPort)>& onServerPortChanged)
+{
+	// Compared under the read lock, so that requests reading the configuration meanwhile aren't held up; the
+	// write lock is only taken to swap the new configuration in
+	ConfigChanges changes = between(*WriterReadersLock<AppConfig>::ReadableReference(config), newConfig);
+	if (!changes.any())
+	{
+		return changes;
+	}
+
+	unsigned newPort = newConfig.serverPort;
+	{
+		WriterReadersLock<AppConfig>::WritableReference configLock(config);
+		*configLock = std::move(newConfig);
+	}
+
+	std::cout << "Configuration reloaded; changed:";
+	for (const auto& thisChange : changes.describe())
+	{
+		std::cout << " " << thisChange;
+	}
+	std::cout << std::endl;
+
+	if (changes.serverPort)
+	{
+		onServerPortChanged(newPort);
+	}
+
+	if (changes.diskWriters)
+	{
+		std::cerr << "WARNING: Changes to maxDiskWriters and diskWriterPriority take effect when QuickOpen restarts." << std::endl;
+	}
+
+	return changes;
+}
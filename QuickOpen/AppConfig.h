@@ -1,6 +1,10 @@
 #pragma once
 
 #include "PlatformUtils.h"
+#include "ConsentPolicy.h"
+#include "EphemeralStore.h"
+#include "StagedFile.h"
+#include "StreamingOpen.h"
 
 #include <wx/wx.h>
 #include <wx/filename.h>
@@ -12,6 +16,7 @@
 #include <fstream>
 #include <filesystem>
 #include <map>
+#include <vector>
 
 namespace SettingRetrieval
 {
@@ -31,6 +36,15 @@ namespace SettingRetrieval
     }
 }
 
+struct SubnetUploadLimit
+{
+	// An address or a subnet in CIDR notation, e.g. "192.168.1.0/24"
+	std::string subnet;
+	unsigned long long bytesPerSecond = 0;
+
+	NLOHMANN_DEFINE_TYPE_INTRUSIVE(SubnetUploadLimit, subnet, bytesPerSecond)
+};
+
 struct AppConfig
 {
 	// static const std::map<ConfigKey, wxString> CONFIG_KEY_NAMES;
@@ -43,16 +57,94 @@ struct AppConfig
 	bool saveUseLastFolder = true;
 	wxFileName fileSavePath;
 
+	// Speculative uploads let clients stream file data into a quarantine folder while the consent
+	// dialog is open; the budget bounds the total number of quarantined bytes across all pending requests.
+	bool speculativeUploadsEnabled = true;
+	WithStaticDefault<unsigned long long, (64ULL << 20)> speculativeUploadBudget;
+	// Files whose content hash matches a previously received file are copied locally instead of being sent
+	// again; hard links are only used when explicitly allowed, since edits to one copy would affect the other.
+	bool deduplicationEnabled = true,
+		deduplicationUseHardlinks = false;
+	// Uploads beyond this many at once are turned away with 503 and retried by the client; the same number
+	// is suggested to clients as how many files to send in parallel.
+	WithStaticDefault<unsigned, 4> maxConcurrentUploads;
+	// How many writes to the disk may run at once across all uploads; takes effect when QuickOpen restarts
+	WithStaticDefault<unsigned, 2> maxDiskWriters;
+	// How the threads doing those writes are scheduled; also takes effect when QuickOpen restarts
+	ThreadPriority diskWriterPriority;
+	// When received files are synced to disk; see DurabilityPolicy
+	DurabilityPolicy uploadDurability;
+	// Requests are turned away with 507 when their files would leave less than this much free space on the
+	// destination's filesystem, counting the space already promised to uploads in progress
+	WithStaticDefault<unsigned long long, (256ULL << 20)> diskSpaceSafetyMargin;
+	// Programs that open files of their types while they are still being received
+	std::vector<StreamingOpenHandler> streamingOpenHandlers;
+	// Which files are received only to be opened, without being kept
+	EphemeralReceivePolicy ephemeralReceive;
+
 	WithStaticDefault<unsigned, 8080> serverPort;
 
+	// Clients that take longer than these to send a request head or to keep an upload moving are disconnected,
+	// and requests left waiting on the consent dialog for longer than consentTimeoutSeconds are turned away.
+	// Uploads must also average minUploadBytesPerSecond once they have run for uploadIdleTimeoutSeconds.
+	WithStaticDefault<unsigned, 15> headerTimeoutSeconds;
+	WithStaticDefault<unsigned, 300> consentTimeoutSeconds;
+	WithStaticDefault<unsigned, 30> uploadIdleTimeoutSeconds;
+	WithStaticDefault<unsigned, 1024> minUploadBytesPerSecond;
+	// When the server port changes, the server on the old port stays up for transfers it already started, but
+	// for no longer than this
+	WithStaticDefault<unsigned, 3600> serverHandoffTimeoutSeconds;
+
+	// Upload bandwidth limits in bytes per second, with 0 meaning unlimited: one shared by all uploads, one applied
+	// to each sender separately and any number shared by the senders in a subnet. Changes apply to uploads
+	// already in progress within a second.
+	unsigned long long globalUploadLimit = 0,
+		perSenderUploadLimit = 0;
+	std::vector<SubnetUploadLimit> subnetUploadLimits;
+
+	// Rules that accept or deny requests without asking, tried in order before any consent dialog is shown;
+	// requests no rule matches are prompted for. Changes apply within a second.
+	std::vector<ConsentRule> consentRules;
+
 	static inline wxFileName defaultConfigPath()
 	{
 		return InstallationInfo::detectInstallation().configFolder / wxFileName(wxT("."), wxT("config.json"));
 	}
 
+	// The settings as they are saved, in sections
+	nlohmann::json toJSON() const;
 	void saveConfig(const wxFileName& filePath = wxFileName());
 
 	static AppConfig loadConfig(const wxFileName& filePath = wxFileName());
 };
 
+// Which parts of the application a configuration change concerns. Most settings are read where they are used
+// and need nothing more than the new configuration; the others need the part that caches them told.
+struct ConfigChanges
+{
+	// The web server has to move to the new port
+	bool serverPort = false,
+		// Settings the upload scheduler only reads when the server starts
+		diskWriters = false,
+		webpageOpen = false,
+		fileSavePath = false,
+		// Anything else, which takes effect as it is next read
+		otherSettings = false;
+
+	static ConfigChanges between(const AppConfig& oldConfig, const AppConfig& newConfig);
+
+	bool any() const
+	{
+		return serverPort || diskWriters || webpageOpen || fileSavePath || otherSettings;
+	}
+
+	// The names of the settings sections that changed, for logging
+	std::vector<std::string> describe() const;
+
+	// Swaps newConfig into config if anything changed, logs what did, and calls onServerPortChanged with the
+	// new port if it has to move. Returns what changed.
+	static ConfigChanges apply(WriterReadersLock<AppConfig>& config, AppConfig newConfig,
+		const std::function<void(unsigned newPort)>& onServerPortChanged);
+};
+
 // const std::map<AppConfig::ConfigKey, wxString> AppConfig::CONFIG_KEY_NAMES = { { RUN_AT_STARTUP, wxT("runAtStartup") } };
@@ -4,6 +4,9 @@
 
 #include "AppGUI.h"
 
+#include <algorithm>
+#include <limits>
+
 wxBoxSizer* makeLabeledSizer(wxWindow* control, const wxString& labelText, wxWindow* parent, int spacing)
 {
 	auto sizer = new wxBoxSizer(wxHORIZONTAL);
@@ -291,6 +294,23 @@ QuickOpenSettings(QuickOpenApplication& appRef): wxFrame(nullptr, wxID_ANY, wxT(
 	saveUseLastFolderCheckbox->Bind(wxEVT_CHECKBOX, &QuickOpenSettings::OnSaveUseLastFolderCheckboxChecked, this);
 	saveUseLastFolderCheckbox->SetValue(config->saveUseLastFolder);
 
+	fileOpenSaveGroupSizer->AddSpacer(DEFAULT_CONTROL_SPACING);
+
+	// Limits are shown in KiB/s; limits for particular subnets are only set in the configuration file
+	fileOpenSaveGroupSizer->Add(
+		makeLabeledSizer(globalUploadLimitCtrl = new wxSpinCtrl(topLevelPanel, wxID_ANY,
+			wxString() << (config->globalUploadLimit / 1024), wxDefaultPosition, wxDefaultSize, wxSP_ARROW_KEYS, 0, 1 << 20),
+			wxT("Total upload speed limit in KiB/s (0 for no limit):"), topLevelPanel),
+		wxSizerFlags(0).Expand());
+
+	fileOpenSaveGroupSizer->AddSpacer(DEFAULT_CONTROL_SPACING);
+
+	fileOpenSaveGroupSizer->Add(
+		makeLabeledSizer(perSenderUploadLimitCtrl = new wxSpinCtrl(topLevelPanel, wxID_ANY,
+			wxString() << (config->perSenderUploadLimit / 1024), wxDefaultPosition, wxDefaultSize, wxSP_ARROW_KEYS, 0, 1 << 20),
+			wxT("Upload speed limit per device in KiB/s (0 for no limit):"), topLevelPanel),
+		wxSizerFlags(0).Expand());
+
 	topLevelSizer->AddSpacer(DEFAULT_CONTROL_SPACING);
 
 	this->saveButton = new wxButton(topLevelPanel, wxID_OK);
@@ -355,9 +375,12 @@ void QuickOpenSettings::OnSaveButton(wxCommandEvent& event)
 			config->serverPort = this->serverPortCtrl->GetValue();
 		}
 
-		if(oldServerPort.effectiveValue() != config->serverPort.effectiveValue())
+		if(oldServerPort.effectiveValue() != config->serverPort.effectiveValue() && !this->appRef.attachedToDaemon())
 		{
-			this->appRef.setupServer(config->serverPort);
+			// The new server reads the configuration as it starts, so it waits for the lock held here to be released
+			unsigned newServerPort = config->serverPort;
+			QuickOpenApplication& app = this->appRef;
+			app.CallAfter([&app, newServerPort] { app.setupServer(newServerPort); });
 		}
 
 		config->browserID = selectionIsInstalledBrowser
@@ -372,11 +395,27 @@ void QuickOpenSettings::OnSaveButton(wxCommandEvent& event)
 		config->fileSavePath = dynamic_cast<FilePathValidator*>(this->saveFolderPicker->GetValidator())->fileName;
 		config->saveUseLastFolder = this->saveUseLastFolderCheckbox->IsChecked();
 
+		// Running uploads pick up new limits by themselves; untouched controls keep limits that aren't whole KiB/s
+		if (static_cast<unsigned long long>(this->globalUploadLimitCtrl->GetValue()) != config->globalUploadLimit / 1024)
+		{
+			config->globalUploadLimit = this->globalUploadLimitCtrl->GetValue() * 1024ULL;
+		}
+
+		if (static_cast<unsigned long long>(this->perSenderUploadLimitCtrl->GetValue()) != config->perSenderUploadLimit / 1024)
+		{
+			config->perSenderUploadLimit = this->perSenderUploadLimitCtrl->GetValue() * 1024ULL;
+		}
+
 		bool saveSuccessful = false;
 		try
 		{
 			config->saveConfig();
 			saveSuccessful = true;
+
+			if (this->appRef.attachedToDaemon())
+			{
+				ManagementClient::sendReload();
+			}
 		}
 		catch (const std::exception& ex)
 		{
@@ -468,10 +507,28 @@ ConsentDialog::ConsentDialog(wxWindow* parent, wxWindowID id, const wxString& ti
 	acceptButton->Bind(wxEVT_BUTTON, &ConsentDialog::OnAcceptClicked, this);
 	rejectButton->Bind(wxEVT_BUTTON, &ConsentDialog::OnDeclineClicked, this);
 
+	deadlineTimer.SetOwner(this);
+	this->Bind(wxEVT_TIMER, &ConsentDialog::OnDeadlineTimer, this, deadlineTimer.GetId());
+
 	setSizerWithPadding(this, topLevelSizer);
 	this->Fit();
 }
 
+void ConsentDialog::declineAt(std::chrono::steady_clock::time_point deadline)
+{
+	auto remainingTime = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+	// A deadline that has already passed still waits for the modal loop to start, so that EndModal applies to it
+	deadlineTimer.StartOnce(static_cast<int>(std::clamp<long long>(remainingTime.count(), 1, std::numeric_limits<int>::max())));
+}
+
+void ConsentDialog::OnDeadlineTimer(wxTimerEvent& event)
+{
+	if (this->IsModal())
+	{
+		this->EndModal(DECLINE);
+	}
+}
+
 WebpageOpenConsentDialog::WebpageOpenConsentDialog(const wxString& URL, const wxString& requesterName):
 	ConsentDialog(nullptr, wxID_ANY, wxT("Webpage Open Request"), requesterName)
 {
@@ -495,7 +552,7 @@ void FileOpenSaveConsentDialog::OnAcceptClicked(wxCommandEvent& event)
 			useLastPath = config->saveUseLastFolder;
 		}
 
-		if(useLastPath)
+		if(useLastPath && !openOnlyRequested())
 		{
 			wxFileName newLastPath = (this->multiFileLayout ? getValidator<FilePathValidator>(destFolderNameInput).fileName
 															: getDirName(getValidator<FilePathValidator>(destFilenameInput).fileName));
@@ -581,9 +638,59 @@ FileOpenSaveConsentDialog::FileOpenSaveConsentDialog(const wxFileName& defaultDe
 		destFolderNameInput->SetValidator(FilePathValidator(defaultDestinationFolder, true));
 	}
 
+	EphemeralReceivePolicy ephemeralPolicy;
+	{
+		WriterReadersLock<AppConfig>::ReadableReference config(*configRef);
+		ephemeralPolicy = config->ephemeralReceive;
+	}
+
+	bool allFit = true,
+		allEphemeral = true;
+	for (const auto& thisFile : requestInfo.fileList)
+	{
+		allFit &= ephemeralPolicy.fits(thisFile.fileSize);
+		allEphemeral &= thisFile.ephemeral;
+	}
+
+	if (allFit)
+	{
+		contentSizer->AddSpacer(DEFAULT_CONTROL_SPACING);
+		contentSizer->Add(openOnlyCheckbox = new wxCheckBox(contentWindow, wxID_ANY, wxString()
+			<< (requestInfo.fileList.size() > 1 ? wxT("Only open these files") : wxT("Only open this file"))
+			<< wxT(", without keeping a copy (removed after ") << ephemeralPolicy.lifetimeMinutes << wxT(" minutes)")),
+			wxSizerFlags(0).Expand());
+		openOnlyCheckbox->SetValue(allEphemeral);
+		openOnlyCheckbox->Bind(wxEVT_CHECKBOX, &FileOpenSaveConsentDialog::OnOpenOnlyCheckboxChecked, this);
+	}
+
 	contentWindow->SetSizerAndFit(contentSizer);
 	contentWindow->TransferDataToWindow();
 	this->setContent(contentWindow);
+
+	if (openOnlyCheckbox != nullptr)
+	{
+		wxCommandEvent initialState;
+		OnOpenOnlyCheckboxChecked(initialState);
+	}
+}
+
+void FileOpenSaveConsentDialog::OnOpenOnlyCheckboxChecked(wxCommandEvent& event)
+{
+	// The destination doesn't matter for files that aren't kept
+	bool chooseDestination = !openOnlyCheckbox->IsChecked();
+	if (destFilenameInput != nullptr)
+	{
+		destFilenameInput->Enable(chooseDestination);
+	}
+	if (destFolderNameInput != nullptr)
+	{
+		destFolderNameInput->Enable(chooseDestination);
+	}
+}
+
+bool FileOpenSaveConsentDialog::openOnlyRequested() const
+{
+	return openOnlyCheckbox != nullptr && openOnlyCheckbox->IsChecked();
 }
 
 std::vector<wxFileName> FileOpenSaveConsentDialog::getConsentedFilenames() const
@@ -681,17 +788,18 @@ const std::vector<wxCmdLineEntryDesc> QuickOpenApplication::COMMAND_LINE_DESC =
 
 void QuickOpenApplication::triggerConfigUpdate()
 {
-    unsigned newPort;
-    {
-        WriterReadersLock<AppConfig>::WritableReference configLock(*configRef);
-        *configLock = AppConfig::loadConfig();
-        newPort = configLock->serverPort;
-    }
+    applyConfig(AppConfig::loadConfig());
+}
 
-    if(newPort != server->getPort())
+void QuickOpenApplication::applyConfig(AppConfig newConfig)
+{
+    ConfigChanges::apply(*configRef, std::move(newConfig), [this](unsigned newPort)
     {
-        setupServer(newPort);
-    }
+        if (server != nullptr && newPort != server->getPort())
+        {
+            setupServer(newPort);
+        }
+    });
 }
 
 bool QuickOpenApplication::OnInit()
@@ -734,33 +842,35 @@ bool QuickOpenApplication::OnInit()
 
     configRef = std::make_shared<WriterReadersLock<AppConfig>>(config);
 
-    setupServer(configRef->obj->serverPort);
+    bool daemonRunning = false;
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+    daemonRunning = attachToDaemon();
+#endif
 
-    unsigned attempts = 0;
-    while (true)
+    if (!daemonRunning)
     {
-        try
-        {
-            mgmtServer = std::make_unique<ManagementServer>(*this, generateCryptoRandomInteger<uint16_t>() % 32768 + 32768);
-            break;
-        }
-        catch (const CivetException& ex)
-        {
-            ++attempts;
+        setupServer(configRef->obj->serverPort);
 
-            if (std::string(ex.what()).find("binding to port") == std::string::npos)
-            {
-                throw;
-            }
-            else if(attempts >= 100)
-            {
-                throw std::runtime_error("Could not find free port to bind management server");
-            }
-        }
+        mgmtServer = ManagementServer::startOnFreePort(*this);
     }
 
     assert(configRef != nullptr);
     this->icon = new QuickOpenTaskbarIcon(*this);
+
+    configWatcher = std::make_unique<ConfigWatcher>([this](AppConfig newConfig)
+    {
+        this->CallAfter([this, newConfig] { applyConfig(newConfig); });
+    });
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+    if (daemonRunning)
+    {
+        daemonPollTimer.SetOwner(this);
+        this->Bind(wxEVT_TIMER, &QuickOpenApplication::OnDaemonPollTimer, this, daemonPollTimer.GetId());
+        daemonPollTimer.Start(DAEMON_POLL_INTERVAL_MS);
+        fetchDaemonPrompts();
+    }
+#endif
     // this->settingsWindow->Show();
     return true;
 }
@@ -805,32 +915,315 @@ void QuickOpenApplication::notifyUser(MessageSeverity severity, const wxString&
     }
 }
 
+void QuickOpenApplication::openReceivedFile(const wxFileName& fileName)
+{
+    shellExecuteFile(fileName, nullptr);
+}
+
 void QuickOpenApplication::setupServer(unsigned newPort)
 {
-    server = std::make_unique<QuickOpenWebServer>(*this, newPort);
+    if (serverHandoff == nullptr)
+    {
+        serverHandoff = std::make_unique<ServerHandoff>();
+    }
+
+    // Switching back to a port whose server is still handing off takes that server back
+    std::unique_ptr<QuickOpenWebServer> newServer = serverHandoff->reclaim(newPort);
+    if (newServer == nullptr)
+    {
+        newServer = std::make_unique<QuickOpenWebServer>(*this, newPort, (server != nullptr) ? server->getState() : nullptr);
+    }
+
+    if (server != nullptr)
+    {
+        std::chrono::seconds handoffTimeout(WriterReadersLock<AppConfig>::ReadableReference(*configRef)->serverHandoffTimeoutSeconds);
+        serverHandoff->retire(std::move(server), newPort, handoffTimeout);
+    }
+
+    server = std::move(newServer);
+}
+
+bool QuickOpenApplication::attachedToDaemon() const
+{
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+    return daemonActivity != nullptr;
+#else
+    return false;
+#endif
+}
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+bool QuickOpenApplication::attachToDaemon()
+{
+    auto ring = ActivityRing::openShared();
+    if (ring == nullptr || !ring->ownerRunning())
+    {
+        return false;
+    }
+
+    // Upload and prompt IDs start over with each daemon
+    daemonActivity = std::move(ring);
+    daemonUploads.clear();
+    daemonPrompts.clear();
+    daemonPromptsSeen.clear();
+    return true;
+}
+
+void QuickOpenApplication::OnDaemonPollTimer(wxTimerEvent& event)
+{
+    if (!daemonActivity->ownerRunning())
+    {
+        // Until the service manager restarts the daemon, which then publishes a new ring
+        if (!attachToDaemon())
+        {
+            return;
+        }
+
+        fetchDaemonPrompts();
+    }
+
+    std::vector<ActivityEvent> events;
+    daemonActivity->consume(events);
+
+    bool promptsAdded = false;
+    for (const auto& thisEvent : events)
+    {
+        if (thisEvent.kind == ActivityEvent::CONSENT_PROMPT)
+        {
+            promptsAdded = true;
+        }
+        else
+        {
+            applyDaemonEvent(thisEvent);
+        }
+    }
+
+    if (promptsAdded)
+    {
+        fetchDaemonPrompts();
+    }
+
+    sendDaemonCancellations();
+}
+
+void QuickOpenApplication::applyDaemonEvent(const ActivityEvent& event)
+{
+    TrayStatusWindow* trayWindow = getTrayWindow();
+    wxString text = wxString::FromUTF8(event.getText());
+
+    if (event.kind == ActivityEvent::WEBPAGE_OPENED)
+    {
+        trayWindow->addWebpageOpenedActivity(text);
+        return;
+    }
+
+    auto uploadIt = daemonUploads.find(event.entryID);
+    if (uploadIt == daemonUploads.end())
+    {
+        // Also reached for uploads that were under way before the GUI started, since every event names its file
+        DaemonUpload upload{ nullptr, std::make_unique<std::atomic<bool>>(false) };
+        upload.entry = (event.kind == ActivityEvent::UPLOAD_DEDUPLICATED)
+            ? trayWindow->addDeduplicatedFileActivity(wxFileName(text))
+            : trayWindow->addFileUploadActivity(wxFileName(text), *upload.cancelRequestFlag);
+        uploadIt = daemonUploads.emplace(event.entryID, std::move(upload)).first;
+
+        if (event.kind == ActivityEvent::UPLOAD_STARTED || event.kind == ActivityEvent::UPLOAD_DEDUPLICATED)
+        {
+            return;
+        }
+    }
+
+    TrayStatusWindow::FileUploadActivityEntry* entry = uploadIt->second.entry;
+    switch (event.kind)
+    {
+    case ActivityEvent::UPLOAD_PROGRESS:
+        entry->setProgress(event.progress);
+        break;
+    case ActivityEvent::UPLOAD_WAITING:
+        entry->setWaiting(event.progress != 0.0);
+        break;
+    case ActivityEvent::UPLOAD_COMPLETED:
+        entry->setCompleted(true);
+        break;
+    case ActivityEvent::UPLOAD_FAILED:
+    {
+        std::runtime_error error(event.getDetail());
+        entry->setError(&error);
+        break;
+    }
+    case ActivityEvent::UPLOAD_CANCELLED:
+        *uploadIt->second.cancelRequestFlag = true;
+        uploadIt->second.cancelSent = true;
+        entry->setCancelCompleted();
+        break;
+    case ActivityEvent::UPLOAD_DEDUPLICATED:
+        entry->setDeduplicated();
+        break;
+    default:
+        break;
+    }
 }
 
-bool QuickOpenApplication::promptForWebpageOpen(std::string URL, const wxString& requesterName, bool& banRequested)
+void QuickOpenApplication::sendDaemonCancellations()
 {
-    auto messageBoxLambda = [URL, &requesterName, &banRequested] {
+    for (auto& [entryID, upload] : daemonUploads)
+    {
+        if (!*upload.cancelRequestFlag || upload.cancelSent)
+        {
+            continue;
+        }
+
+        upload.cancelSent = true;
+        getContinuationPool().post([entryID = entryID]
+        {
+            try
+            {
+                // 404 means the upload ended before the request arrived
+                if (ManagementClient::sendRequest("POST", "/api/cancel", nlohmann::json{ {"entryID", entryID} }.dump()) != 200)
+                {
+                    std::cerr << "WARNING: The daemon could not cancel upload " << entryID << ", which may have already ended." << std::endl;
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                std::cerr << "WARNING: Could not send the cancellation to the daemon: " << ex.what() << std::endl;
+            }
+        });
+    }
+}
+
+void QuickOpenApplication::fetchDaemonPrompts()
+{
+    getContinuationPool().post([this]
+    {
+        std::vector<ConsentApprovalQueue::Prompt> prompts;
+        try
+        {
+            std::string responseBody;
+            if (ManagementClient::sendRequest("GET", "/api/consent", "", &responseBody) != 200)
+            {
+                return;
+            }
+
+            prompts = nlohmann::json::parse(responseBody).get<std::vector<ConsentApprovalQueue::Prompt>>();
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "WARNING: Could not fetch the daemon's consent prompts: " << ex.what() << std::endl;
+            return;
+        }
+
+        this->CallAfter([this, prompts]
+        {
+            for (const auto& thisPrompt : prompts)
+            {
+                if (daemonPromptsSeen.insert(thisPrompt.id).second)
+                {
+                    daemonPrompts.push_back(thisPrompt);
+                }
+            }
+
+            showNextDaemonPrompt();
+        });
+    });
+}
+
+void QuickOpenApplication::showNextDaemonPrompt()
+{
+    // Prompts fetched while a dialog is open wait for it to close, as they do when the GUI serves
+    if (daemonPromptShown || daemonPrompts.empty())
+    {
+        return;
+    }
+
+    ConsentApprovalQueue::Prompt prompt = daemonPrompts.front();
+    daemonPrompts.pop_front();
+    daemonPromptShown = true;
+
+    wxString requesterName = wxString::FromUTF8(prompt.requester);
+    nlohmann::json answer = { {"id", prompt.id} };
+    if (prompt.details.contains("url"))
+    {
+        auto dialog = WebpageOpenConsentDialog(wxString::FromUTF8(prompt.details["url"].get<std::string>()), requesterName);
+        dialog.RequestUserAttention();
+        answer["accept"] = (static_cast<ConsentDialog::ResultCode>(dialog.ShowModal()) == ConsentDialog::ACCEPT);
+        answer["ban"] = dialog.denyFutureRequestsRequested();
+    }
+    else
+    {
+        FileConsentRequestInfo requestInfo;
+        for (const auto& thisFile : prompt.details["files"])
+        {
+            FileConsentRequestInfo::RequestedFileInfo fileInfo;
+            fileInfo.filename = wxString::FromUTF8(thisFile["filename"].get<std::string>());
+            fileInfo.fileSize = thisFile["fileSize"].get<unsigned long long>();
+            fileInfo.ephemeral = thisFile.value("ephemeral", false);
+            requestInfo.fileList.push_back(fileInfo);
+        }
+
+        wxFileName defaultDestDir = WriterReadersLock<AppConfig>::ReadableReference(*configRef)->fileSavePath;
+        auto dialog = FileOpenSaveConsentDialog(defaultDestDir, requestInfo, configRef, requesterName);
+        dialog.Show();
+        dialog.RequestUserAttention();
+        bool accepted = (static_cast<FileOpenSaveConsentDialog::ResultCode>(dialog.ShowModal()) == ConsentDialog::ACCEPT);
+        answer["accept"] = accepted;
+        answer["ban"] = dialog.denyFutureRequestsRequested();
+
+        if (accepted)
+        {
+            nlohmann::json destinations = nlohmann::json::array();
+            for (const auto& thisFileName : dialog.getConsentedFilenames())
+            {
+                destinations.push_back(std::string(thisFileName.GetFullPath().ToUTF8()));
+            }
+
+            answer["choices"] = { {"destinations", destinations}, {"openOnly", dialog.openOnlyRequested()} };
+        }
+    }
+
+    getContinuationPool().post([answer]
+    {
+        try
+        {
+            // 404 means the prompt has expired, or was answered from elsewhere, while the dialog was open
+            if (ManagementClient::sendRequest("POST", "/api/consent", answer.dump()) != 200)
+            {
+                std::cerr << "WARNING: The daemon no longer waits for an answer to consent prompt " << answer["id"] << "." << std::endl;
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "WARNING: Could not send the consent answer to the daemon: " << ex.what() << std::endl;
+        }
+    });
+
+    daemonPromptShown = false;
+    showNextDaemonPrompt();
+}
+#endif
+
+GUITask<std::pair<bool, bool>> QuickOpenApplication::promptForWebpageOpen(std::string URL, const wxString& requesterName,
+                                                                          std::chrono::steady_clock::time_point deadline)
+{
+    return callOnGUIThread(*this, [URL, requesterName, deadline]
+    {
         auto dialog = WebpageOpenConsentDialog(URL, requesterName);
+        dialog.declineAt(deadline);
         dialog.RequestUserAttention();
         auto result = static_cast<ConsentDialog::ResultCode>(dialog.ShowModal());
-        banRequested = dialog.denyFutureRequestsRequested();
-        return result;
-        // return wxMessageBox(wxT("Do you want to open the following webpage?\n") + wxString::FromUTF8(URL), wxT("Webpage Open Request"), wxYES_NO);
-    };
-
-    auto response = wxCallAfterSync<QuickOpenApplication, decltype(messageBoxLambda), ConsentDialog::ResultCode>(*this, messageBoxLambda);
-    return (response == ConsentDialog::ACCEPT);
+        return std::pair{ result == ConsentDialog::ACCEPT, dialog.denyFutureRequestsRequested() };
+    });
 }
 
-std::pair<ConsentDialog::ResultCode, bool> QuickOpenApplication::promptForFileSave(const wxFileName& defaultDestDir,
-                                                                                   const wxString& requesterName, FileConsentRequestInfo& rqFileInfo)
+void QuickOpenApplication::promptForFileSave(const wxFileName& defaultDestDir, const wxString& requesterName,
+                                             std::shared_ptr<FileConsentRequestInfo> rqFileInfo,
+                                             std::chrono::steady_clock::time_point deadline,
+                                             std::function<void(std::pair<ConsentDialog::ResultCode, bool>)> onDecision)
 {
-    auto dlgLambda = [this, &defaultDestDir, &requesterName, &rqFileInfo]
+    auto dlgLambda = [this, defaultDestDir, requesterName, rqFileInfo, deadline]
     {
-        auto consentDlg = FileOpenSaveConsentDialog(defaultDestDir, rqFileInfo, this->configRef, requesterName);
+        auto consentDlg = FileOpenSaveConsentDialog(defaultDestDir, *rqFileInfo, this->configRef, requesterName);
+        consentDlg.declineAt(deadline);
         consentDlg.Show();
         consentDlg.RequestUserAttention();
         auto resultVal = static_cast<FileOpenSaveConsentDialog::ResultCode>(consentDlg.ShowModal());
@@ -838,24 +1231,29 @@ std::pair<ConsentDialog::ResultCode, bool> QuickOpenApplication::promptForFileSa
 
         for (size_t i = 0; i < consentedFileNames.size(); ++i)
         {
-            rqFileInfo.fileList[i].consentedFileName = consentedFileNames[i];
+            rqFileInfo->fileList[i].consentedFileName = consentedFileNames[i];
+            rqFileInfo->fileList[i].ephemeral = consentDlg.openOnlyRequested();
         }
 
         return std::pair{ resultVal, consentDlg.denyFutureRequestsRequested() };
     };
 
-    if (wxIsMainThread())
-    {
-        return dlgLambda();
-    }
-    else
-    {
-        return wxCallAfterSync<decltype(*this), decltype(dlgLambda), std::pair<ConsentDialog::ResultCode, bool>>(*this, dlgLambda);
-    }
+    wxCallAfterAsync<QuickOpenApplication, decltype(dlgLambda), std::pair<ConsentDialog::ResultCode, bool>>(*this, dlgLambda, std::move(onDecision));
+}
+
+TaskPool& getContinuationPool()
+{
+    static TaskPool continuationPool(2);
+    return continuationPool;
 }
 
 int QuickOpenApplication::OnExit()
 {
+    configWatcher.reset();
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+    daemonPollTimer.Stop();
+#endif
+
     if (this->icon != nullptr)
     {
         this->icon->RemoveIcon();
@@ -863,6 +1261,13 @@ int QuickOpenApplication::OnExit()
         this->icon = nullptr;
     }
 
+    // The dialogs for requests still waiting on the prompt queue won't be shown now, so they are turned away;
+    // the servers can't stop until those requests are finished
+    if (server != nullptr)
+    {
+        server->getState()->consentPrompts.shutdown();
+    }
+
     mg_exit_library();
 
     return 0;
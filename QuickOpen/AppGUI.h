@@ -23,6 +23,7 @@
 #include <wx/aboutdlg.h>
 #include <wx/snglinst.h>
 #include <wx/cmdline.h>
+#include <wx/timer.h>
 //#include <wx/gauge.h>
 // #include <wx/scrolwin.h>
 
@@ -30,12 +31,19 @@
 #include <iostream>
 
 #include "TrayStatusWindow.h"
+#include "ActivityRing.h"
+#include "ConsentApprovalQueue.h"
 // #include "WebServer.h"
 #include "AppConfig.h"
+#include "ConfigWatcher.h"
+#include "GUITask.h"
 #include "GUIUtils.h"
 #include "Utils.h"
 #include <atomic>
 #include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
 #include "CivetWebIncludes.h"
 #include <wx/url.h>
 
@@ -45,6 +53,7 @@
 #include "WebServer.h"
 
 class QuickOpenWebServer;
+class ServerHandoff;
 class QuickOpenApplication;
 struct FileConsentRequestInfo;
 
@@ -93,28 +102,21 @@ public:
 	}
 };
 
+// Threads that continuations of wxCallAfterAsync run on
+TaskPool& getContinuationPool();
+
+// Like callOnGUIThread, but instead of being waited for, the result is given to continuation on a pool thread
+// rather than the GUI thread, so it may block (e.g. while writing a response) without stalling the GUI.
 template<typename AppType, typename FuncType, typename ResultType>
-ResultType wxCallAfterSync(AppType& app, FuncType func)
+void wxCallAfterAsync(AppType& app, FuncType func, std::function<void(ResultType)> continuation)
 {
-	std::optional<ResultType> resultVal;
-	std::condition_variable resultFlag;
-	std::mutex resultMutex;
-	std::unique_lock<std::mutex> resultLock(resultMutex);
-
-	app.CallAfter([&resultMutex, &resultFlag, &func, &resultVal]
+	auto queuedTime = std::chrono::steady_clock::now();
+	app.CallAfter([func, continuation, queuedTime]
 	{
+		GUIQueueLatency::global().record(std::chrono::steady_clock::now() - queuedTime);
 		ResultType result = func();
-		std::lock_guard<std::mutex> resultSetLock(resultMutex);
-		resultVal = result;
-		resultFlag.notify_all();
+		getContinuationPool().post([continuation, result] { continuation(result); });
 	});
-
-	while (!resultVal.has_value())
-	{
-		resultFlag.wait(resultLock);
-	}
-
-	return resultVal.value();
 }
 
 inline wxFileName getAppIconPath()
@@ -144,6 +146,8 @@ class QuickOpenSettings : public wxFrame
 	wxStaticBoxSizer* fileOpenSaveGroupSizer;
 	wxDirPickerCtrl* saveFolderPicker;
 	wxCheckBox* saveUseLastFolderCheckbox;
+	wxSpinCtrl* globalUploadLimitCtrl;
+	wxSpinCtrl* perSenderUploadLimitCtrl;
 	
 	wxButton* cancelButton;
 	wxButton* saveButton;
@@ -179,6 +183,10 @@ protected:
 	wxBoxSizer* topLevelSizer = nullptr;
 	wxWindow* content = nullptr;
 
+	wxTimer deadlineTimer;
+
+	void OnDeadlineTimer(wxTimerEvent& event);
+
 	virtual void OnAcceptClicked(wxCommandEvent& event)
 	{
 		this->EndModal(ACCEPT);
@@ -209,6 +217,9 @@ public:
 		return this->denyFutureRequestsCheckbox->IsChecked();
 	}
 
+	// Declines on the user's behalf if the dialog is still open at deadline, when the requester stops waiting
+	void declineAt(std::chrono::steady_clock::time_point deadline);
+
 	enum ResultCode
 	{
 		ACCEPT,
@@ -230,18 +241,23 @@ class FileOpenSaveConsentDialog : public ConsentDialog
 	wxFileName defaultDestinationFolder;
 	wxFilePickerCtrl* destFilenameInput = nullptr;
 	wxDirPickerCtrl* destFolderNameInput = nullptr;
+	// Only shown when every file is small enough to be received without being kept
+	wxCheckBox* openOnlyCheckbox = nullptr;
 
 	std::unique_ptr<FileConsentRequestInfo> requestInfo;
 
 	bool multiFileLayout = false;
 
 	virtual void OnAcceptClicked(wxCommandEvent& event);
+	void OnOpenOnlyCheckboxChecked(wxCommandEvent& event);
 
 public:
 	FileOpenSaveConsentDialog(const wxFileName& defaultDestinationFolder, const FileConsentRequestInfo& requestInfo,
 		std::shared_ptr<WriterReadersLock<AppConfig>> configRef, const wxString& requesterName);
 
 	std::vector<wxFileName> getConsentedFilenames() const;
+	// Whether the files are to be opened without being kept
+	bool openOnlyRequested() const;
 };
 
 //wxBEGIN_EVENT_TABLE(TrayStatusWindow::ActivityList, wxScrolledWindow)
@@ -368,13 +384,48 @@ private:
 class QuickOpenApplication : public wxApp
 {
     std::shared_ptr<WriterReadersLock<AppConfig>> configRef;
+    // Applies edits made to the configuration file outside the settings window
+    std::unique_ptr<ConfigWatcher> configWatcher;
     QuickOpenTaskbarIcon* icon = nullptr;
+    // Declared before server so that the servers it still holds for a port change are closed after it
+    std::unique_ptr<ServerHandoff> serverHandoff;
     std::unique_ptr<QuickOpenWebServer> server;
     std::unique_ptr<ManagementServer> mgmtServer;
 
     std::unique_ptr<wxSingleInstanceChecker> singleInstanceChecker;
 
     std::optional<wxFileName> cliNewDefaultUploadFolder;
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+    // Set while a QuickOpenDaemon serves from its own process, in which case the GUI runs no servers and only
+    // shows the daemon's activity and answers its consent prompts. Transfers then don't wait for the GUI, and
+    // carry on while it is closed or restarted.
+    std::unique_ptr<ActivityRing> daemonActivity;
+    wxTimer daemonPollTimer;
+    struct DaemonUpload
+    {
+        TrayStatusWindow::FileUploadActivityEntry* entry;
+        // Set by the entry's Cancel button; the poll timer passes it on to the daemon
+        std::unique_ptr<std::atomic<bool>> cancelRequestFlag;
+        bool cancelSent = false;
+    };
+    std::map<uint64_t, DaemonUpload> daemonUploads;
+    std::deque<ConsentApprovalQueue::Prompt> daemonPrompts;
+    std::set<uint64_t> daemonPromptsSeen;
+    bool daemonPromptShown = false;
+
+    static constexpr int DAEMON_POLL_INTERVAL_MS = 100;
+
+    // Opens the activity of a running daemon, returning false if none is running
+    bool attachToDaemon();
+    void OnDaemonPollTimer(wxTimerEvent& event);
+    void applyDaemonEvent(const ActivityEvent& event);
+    // Asks the daemon to cancel the uploads whose Cancel button was clicked since the last poll
+    void sendDaemonCancellations();
+    // Fetches the daemon's pending prompts on a pool thread, then shows the new ones one at a time
+    void fetchDaemonPrompts();
+    void showNextDaemonPrompt();
+#endif
     // QuickOpenSettings* settingsWindow = nullptr;
 
     //class MainWindow : public wxFrame
@@ -398,7 +449,10 @@ class QuickOpenApplication : public wxApp
     //MainWindow* mainWindow = nullptr;
     static const std::vector<wxCmdLineEntryDesc> COMMAND_LINE_DESC;
 public:
+    // Loads the configuration file and applies it
     void triggerConfigUpdate();
+    // Replaces the configuration, and tells the parts that keep settings of their own about the ones that changed
+    void applyConfig(AppConfig newConfig);
 
     bool OnInit() override;
 
@@ -422,12 +476,25 @@ public:
     }
 
     void notifyUser(MessageSeverity severity, const wxString& title, const wxString& text);
+    // Opens a file that was received only to be opened, with the program registered for its type
+    void openReceivedFile(const wxFileName& fileName);
 
+    // Starts the web server on newPort, taking over the state of the one it replaces; that one keeps running
+    // for the transfers it started until they finish or serverHandoffTimeoutSeconds pass
     void setupServer(unsigned newPort);
 
-    bool promptForWebpageOpen(std::string URL, const wxString& requesterName, bool& banRequested);
+    // Whether a QuickOpenDaemon is serving in place of this process
+    bool attachedToDaemon() const;
+
+    // The result is whether opening was allowed, and whether the user asked to ban the requester
+    GUITask<std::pair<bool, bool>> promptForWebpageOpen(std::string URL, const wxString& requesterName,
+                                                        std::chrono::steady_clock::time_point deadline);
 
-    std::pair<ConsentDialog::ResultCode, bool> promptForFileSave(const wxFileName& defaultDestDir, const wxString& requesterName, FileConsentRequestInfo& rqFileInfo);
+    // Shows the consent dialog without waiting for it; onDecision is called from a pool thread once the user has answered,
+    // or with DECLINE once the dialog has been open until deadline
+    void promptForFileSave(const wxFileName& defaultDestDir, const wxString& requesterName, std::shared_ptr<FileConsentRequestInfo> rqFileInfo,
+                           std::chrono::steady_clock::time_point deadline,
+                           std::function<void(std::pair<ConsentDialog::ResultCode, bool>)> onDecision);
 
     std::shared_ptr<WriterReadersLock<AppConfig>> getConfigRef()
     {
@@ -7,6 +7,8 @@
 
 #ifdef MOCK_GUI
 #include "MockGUI.h"
+#elif defined(QUICKOPEN_DAEMON)
+#include "DaemonApp.h"
 #else
 #include "AppGUI.h"
 #include "TrayStatusWindow.h"
@@ -0,0 +1,313 @@
+#include "BandwidthLimiter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#ifdef WIN32
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+TokenBucket::TokenBucket(unsigned long long bytesPerSecond, std::chrono::steady_clock::time_point now)
+{
+	setRate(bytesPerSecond, now);
+}
+
+void TokenBucket::refill(std::chrono::steady_clock::time_point now)
+{
+	std::chrono::duration<double> elapsed = now - lastRefill;
+	if (elapsed.count() > 0)
+	{
+		tokens = std::min(rate, tokens + elapsed.count() * rate);
+		lastRefill = now;
+	}
+}
+
+void TokenBucket::setRate(unsigned long long bytesPerSecond, std::chrono::steady_clock::time_point now)
+{
+	if (rate == 0)
+	{
+		// A bucket that wasn't limiting anything starts out full
+		tokens = static_cast<double>(bytesPerSecond);
+		lastRefill = now;
+	}
+	else
+	{
+		refill(now);
+		tokens = std::min(tokens, static_cast<double>(bytesPerSecond));
+	}
+
+	rate = static_cast<double>(bytesPerSecond);
+}
+
+std::chrono::steady_clock::duration TokenBucket::take(unsigned long long bytes, std::chrono::steady_clock::time_point now)
+{
+	if (rate == 0)
+	{
+		return std::chrono::steady_clock::duration::zero();
+	}
+
+	refill(now);
+	tokens -= static_cast<double>(bytes);
+
+	if (tokens >= 0)
+	{
+		return std::chrono::steady_clock::duration::zero();
+	}
+
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-tokens / rate));
+}
+
+bool TokenBucket::isFull(std::chrono::steady_clock::time_point now)
+{
+	refill(now);
+	return tokens >= rate;
+}
+
+std::optional<BandwidthLimiter::Address> BandwidthLimiter::parseAddress(const std::string& text)
+{
+	Address address{};
+
+	in_addr address4;
+	if (inet_pton(AF_INET, text.c_str(), &address4) == 1)
+	{
+		address[10] = address[11] = 0xff;
+		std::memcpy(&address[12], &address4, 4);
+		return address;
+	}
+
+	in6_addr address6;
+	if (inet_pton(AF_INET6, text.c_str(), &address6) == 1)
+	{
+		std::memcpy(address.data(), &address6, 16);
+		return address;
+	}
+
+	return std::nullopt;
+}
+
+std::optional<std::pair<BandwidthLimiter::Address, unsigned>> BandwidthLimiter::parseSubnet(const std::string& text)
+{
+	size_t slashPos = text.find('/');
+	auto network = parseAddress(text.substr(0, slashPos));
+	unsigned prefixLength = 128;
+
+	if (network && slashPos != std::string::npos)
+	{
+		try
+		{
+			size_t parsedLength;
+			prefixLength = std::stoul(text.substr(slashPos + 1), &parsedLength);
+			if (parsedLength != text.size() - slashPos - 1)
+			{
+				network.reset();
+			}
+		}
+		catch (const std::logic_error&)
+		{
+			network.reset();
+		}
+
+		// IPv4 prefix lengths count from the start of the mapped address
+		if (text.find(':') == std::string::npos)
+		{
+			prefixLength += 96;
+		}
+	}
+
+	if (!network || prefixLength > 128)
+	{
+		return std::nullopt;
+	}
+
+	return std::pair{ *network, prefixLength };
+}
+
+bool BandwidthLimiter::subnetContains(const Address& network, unsigned prefixLength, const Address& address)
+{
+	unsigned fullBytes = prefixLength / 8,
+		remainingBits = prefixLength % 8;
+
+	if (!std::equal(network.begin(), network.begin() + fullBytes, address.begin()))
+	{
+		return false;
+	}
+
+	if (remainingBits == 0)
+	{
+		return true;
+	}
+
+	uint8_t mask = static_cast<uint8_t>(0xff << (8 - remainingBits));
+	return (network[fullBytes] & mask) == (address[fullBytes] & mask);
+}
+
+bool BandwidthLimiter::SubnetRule::contains(const Address& address) const
+{
+	return subnetContains(network, prefixLength, address);
+}
+
+BandwidthLimiter::BandwidthLimiter(LimitsSource limitsSource) : limitsSource(std::move(limitsSource)),
+	lastRefresh(std::chrono::steady_clock::now())
+{
+	if (this->limitsSource)
+	{
+		setLimits(this->limitsSource());
+	}
+}
+
+void BandwidthLimiter::setLimits(const BandwidthLimits& newLimits)
+{
+	auto now = std::chrono::steady_clock::now();
+	std::lock_guard<std::mutex> lock(limiterMutex);
+
+	globalBucket.setRate(newLimits.globalBytesPerSecond, now);
+
+	if (newLimits.perSenderBytesPerSecond != limits.perSenderBytesPerSecond)
+	{
+		for (auto& senderBucket : senderBuckets)
+		{
+			senderBucket.second.setRate(newLimits.perSenderBytesPerSecond, now);
+		}
+	}
+
+	if (newLimits.subnetLimits != limits.subnetLimits)
+	{
+		// Changed rules start over with full buckets
+		subnetRules.clear();
+		for (const auto& subnetLimit : newLimits.subnetLimits)
+		{
+			auto subnet = parseSubnet(subnetLimit.subnet);
+			if (!subnet)
+			{
+				std::cerr << "WARNING: Ignoring upload limit for invalid subnet \"" << subnetLimit.subnet << "\"." << std::endl;
+				continue;
+			}
+
+			subnetRules.push_back({ subnet->first, subnet->second, subnetLimit.bytesPerSecond, TokenBucket(subnetLimit.bytesPerSecond, now) });
+		}
+	}
+
+	limits = newLimits;
+}
+
+BandwidthLimits BandwidthLimiter::getLimits()
+{
+	std::lock_guard<std::mutex> lock(limiterMutex);
+	return limits;
+}
+
+void BandwidthLimiter::refreshLimits()
+{
+	auto now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(limiterMutex);
+		if (!limitsSource || now - lastRefresh < REFRESH_INTERVAL)
+		{
+			return;
+		}
+
+		lastRefresh = now;
+
+		// Senders that have been quiet long enough to be back at full allowance don't need their own buckets
+		for (auto senderIt = senderBuckets.begin(); senderIt != senderBuckets.end();)
+		{
+			senderIt = senderIt->second.isFull(now) ? senderBuckets.erase(senderIt) : std::next(senderIt);
+		}
+	}
+
+	BandwidthLimits newLimits = limitsSource();
+	if (newLimits != getLimits())
+	{
+		setLimits(newLimits);
+	}
+}
+
+unsigned long long BandwidthLimiter::senderRate(const std::string& sender, SubnetRule** subnetRule)
+{
+	*subnetRule = nullptr;
+	if (!subnetRules.empty())
+	{
+		if (auto address = parseAddress(sender))
+		{
+			for (auto& rule : subnetRules)
+			{
+				if (rule.contains(*address) && (*subnetRule == nullptr || rule.prefixLength > (*subnetRule)->prefixLength))
+				{
+					*subnetRule = &rule;
+				}
+			}
+		}
+	}
+
+	unsigned long long rate = 0;
+	for (unsigned long long applicableRate : { limits.globalBytesPerSecond, limits.perSenderBytesPerSecond,
+		*subnetRule ? (*subnetRule)->bytesPerSecond : 0ULL })
+	{
+		if (applicableRate > 0 && (rate == 0 || applicableRate < rate))
+		{
+			rate = applicableRate;
+		}
+	}
+
+	return rate;
+}
+
+size_t BandwidthLimiter::readSizeFor(const std::string& sender, size_t maxLength)
+{
+	std::lock_guard<std::mutex> lock(limiterMutex);
+
+	SubnetRule* subnetRule;
+	unsigned long long rate = senderRate(sender, &subnetRule);
+	if (rate == 0)
+	{
+		return maxLength;
+	}
+
+	auto sliceBytes = static_cast<size_t>(rate * READ_SLICE.count() / 1000);
+	return std::min(maxLength, std::max(sliceBytes, MIN_READ_SIZE));
+}
+
+std::chrono::steady_clock::duration BandwidthLimiter::consume(const std::string& sender, size_t bytes)
+{
+	refreshLimits();
+
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::duration wait;
+	{
+		std::lock_guard<std::mutex> lock(limiterMutex);
+
+		SubnetRule* subnetRule;
+		if (senderRate(sender, &subnetRule) == 0)
+		{
+			return std::chrono::steady_clock::duration::zero();
+		}
+
+		wait = globalBucket.take(bytes, now);
+		if (subnetRule)
+		{
+			wait = std::max(wait, subnetRule->bucket.take(bytes, now));
+		}
+
+		if (limits.perSenderBytesPerSecond > 0)
+		{
+			auto senderIt = senderBuckets.find(sender);
+			if (senderIt == senderBuckets.end())
+			{
+				senderIt = senderBuckets.emplace(sender, TokenBucket(limits.perSenderBytesPerSecond, now)).first;
+			}
+
+			wait = std::max(wait, senderIt->second.take(bytes, now));
+		}
+	}
+
+	if (wait > std::chrono::steady_clock::duration::zero())
+	{
+		++globalStats().throttledReads;
+		globalStats().throttledMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+	}
+
+	return wait;
+}
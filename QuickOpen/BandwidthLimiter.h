@@ -0,0 +1,146 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Upload rate limits in bytes per second; 0 means unlimited
+struct BandwidthLimits
+{
+	struct SubnetLimit
+	{
+		// An address ("192.168.1.7") or a subnet in CIDR notation ("192.168.1.0/24", "fd00::/8")
+		std::string subnet;
+		unsigned long long bytesPerSecond = 0;
+
+		bool operator==(const SubnetLimit& rhs) const
+		{
+			return subnet == rhs.subnet && bytesPerSecond == rhs.bytesPerSecond;
+		}
+	};
+
+	// Shared by all uploads
+	unsigned long long globalBytesPerSecond = 0;
+	// Applied to each sender separately
+	unsigned long long perSenderBytesPerSecond = 0;
+	// Shared by all senders in the subnet; a sender only falls under the most specific subnet containing it
+	std::vector<SubnetLimit> subnetLimits;
+
+	bool operator==(const BandwidthLimits& rhs) const
+	{
+		return globalBytesPerSecond == rhs.globalBytesPerSecond
+			&& perSenderBytesPerSecond == rhs.perSenderBytesPerSecond
+			&& subnetLimits == rhs.subnetLimits;
+	}
+
+	bool operator!=(const BandwidthLimits& rhs) const
+	{
+		return !(*this == rhs);
+	}
+};
+
+// Lets bytes through at rate on average, and up to a second's worth at once after being idle. Takes never
+// block: a take the bucket can't cover puts it into debt, and the taker waits for the debt to be paid off,
+// so later takers also wait their turn.
+class TokenBucket
+{
+	double rate = 0,
+		tokens = 0;
+	std::chrono::steady_clock::time_point lastRefill;
+
+	void refill(std::chrono::steady_clock::time_point now);
+
+public:
+	TokenBucket() {}
+	TokenBucket(unsigned long long bytesPerSecond, std::chrono::steady_clock::time_point now);
+
+	void setRate(unsigned long long bytesPerSecond, std::chrono::steady_clock::time_point now);
+
+	// Returns how long the caller must wait before sending more
+	std::chrono::steady_clock::duration take(unsigned long long bytes, std::chrono::steady_clock::time_point now);
+
+	// Whether the bucket has refilled completely, so dropping it would change nothing
+	bool isFull(std::chrono::steady_clock::time_point now);
+};
+
+// Applies BandwidthLimits to the uploads of every sender. Limits are read from limitsSource when the limiter is
+// created and again at most every REFRESH_INTERVAL, so changes to them apply to uploads already in progress.
+class BandwidthLimiter
+{
+public:
+	typedef std::function<BandwidthLimits()> LimitsSource;
+
+	static constexpr std::chrono::milliseconds REFRESH_INTERVAL{ 1000 };
+	// Reads are cut down to about this much time at the sender's rate, so that the waits between them stay short
+	static constexpr std::chrono::milliseconds READ_SLICE{ 100 };
+	static constexpr size_t MIN_READ_SIZE = 4096;
+
+	// Totals across all limiters, for metrics
+	struct GlobalStats
+	{
+		std::atomic<unsigned long long> throttledReads = 0,
+			throttledMicroseconds = 0;
+	};
+
+	// An address as 16 bytes, with IPv4 addresses mapped into IPv6 (::ffff:a.b.c.d)
+	typedef std::array<uint8_t, 16> Address;
+
+	// Returns nothing if text is not an IPv4 or IPv6 address
+	static std::optional<Address> parseAddress(const std::string& text);
+	// Parses an address or a subnet in CIDR notation into its network and a prefix length counted over the
+	// mapped address; returns nothing if text is neither
+	static std::optional<std::pair<Address, unsigned>> parseSubnet(const std::string& text);
+	static bool subnetContains(const Address& network, unsigned prefixLength, const Address& address);
+
+private:
+	struct SubnetRule
+	{
+		Address network;
+		unsigned prefixLength;
+		unsigned long long bytesPerSecond;
+		TokenBucket bucket;
+
+		bool contains(const Address& address) const;
+	};
+
+	LimitsSource limitsSource;
+	std::chrono::steady_clock::time_point lastRefresh;
+
+	std::mutex limiterMutex;
+	BandwidthLimits limits;
+	TokenBucket globalBucket;
+	std::map<std::string, TokenBucket> senderBuckets;
+	std::vector<SubnetRule> subnetRules;
+
+	void refreshLimits();
+	// Called with limiterMutex held; returns the rate of the slowest bucket that applies to sender, or 0 if none do
+	unsigned long long senderRate(const std::string& sender, SubnetRule** subnetRule);
+
+public:
+	explicit BandwidthLimiter(LimitsSource limitsSource);
+
+	// Replaces the limits at once. Subnets that can't be parsed are skipped with a warning.
+	void setLimits(const BandwidthLimits& newLimits);
+	BandwidthLimits getLimits();
+
+	// How many bytes sender should read at once, out of the maxLength it has room for
+	size_t readSizeFor(const std::string& sender, size_t maxLength);
+
+	// Charges bytes that were just received from sender against every limit that applies to it, and returns
+	// how long the sender must wait before reading more
+	std::chrono::steady_clock::duration consume(const std::string& sender, size_t bytes);
+
+	static GlobalStats& globalStats()
+	{
+		static GlobalStats instance;
+		return instance;
+	}
+};
@@ -1,6 +1,8 @@
 #pragma once
 #ifdef MOCK_CIVETWEB
 #include "MGMocks.h"
+#elif defined(QUICKOPEN_NATIVE_HTTP)
+#include "NativeHTTPServer.h"
 #else
 #include <CivetServer.h>
 #endif
\ No newline at end of file
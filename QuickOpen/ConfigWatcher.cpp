@@ -0,0 +1,92 @@
+#include "ConfigWatcher.h"
+
+#include <iostream>
+
+ConfigWatcher::ConfigWatcher(LoadCallback onLoaded, const wxFileName& configFile) : configFile(configFile),
+	onLoaded(std::move(onLoaded))
+{
+	loadThread = std::thread(&ConfigWatcher::loadLoop, this);
+
+	try
+	{
+		changeWatcher = std::make_unique<DirectoryChangeWatcher>([this](const wxFileName& fileName) { onFileChanged(fileName); });
+		changeWatcher->watchDirectory(getDirName(this->configFile));
+	}
+	catch (const std::exception& ex)
+	{
+		// Changes then only apply through the settings window or an explicit reload
+		std::cerr << "WARNING: Could not watch the configuration file for changes: " << ex.what() << std::endl;
+	}
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+	changeWatcher.reset();
+
+	{
+		std::lock_guard<std::mutex> lock(changeMutex);
+		stopping = true;
+	}
+
+	changed.notify_all();
+	loadThread.join();
+}
+
+void ConfigWatcher::onFileChanged(const wxFileName& fileName)
+{
+	// Other files in the configuration folder, such as the content index, change far more often
+	if (fileName.GetFullName() != configFile.GetFullName())
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(changeMutex);
+		changePending = true;
+		lastChangeTime = std::chrono::steady_clock::now();
+	}
+
+	changed.notify_all();
+}
+
+void ConfigWatcher::loadLoop()
+{
+	std::unique_lock<std::mutex> lock(changeMutex);
+	while (true)
+	{
+		changed.wait(lock, [this] { return stopping || changePending; });
+		if (stopping)
+		{
+			return;
+		}
+
+		// Later changes push the load back further
+		if (changed.wait_until(lock, lastChangeTime + SETTLE_TIME, [this] { return stopping; }))
+		{
+			return;
+		}
+
+		if (std::chrono::steady_clock::now() < lastChangeTime + SETTLE_TIME)
+		{
+			continue;
+		}
+
+		changePending = false;
+		lock.unlock();
+
+		if (configFile.FileExists())
+		{
+			try
+			{
+				onLoaded(AppConfig::loadConfig(configFile));
+			}
+			catch (const std::exception& ex)
+			{
+				std::cerr << "WARNING: Could not reload configuration file \"" << configFile.GetFullPath() << "\": "
+					<< ex.what() << std::endl;
+			}
+		}
+
+		lock.lock();
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "AppConfig.h"
+#include "PlatformUtils.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// Reloads the configuration file whenever it changes on disk, e.g. when it is edited by hand. Loading happens on
+// a thread of its own once the file has been left alone for SETTLE_TIME, so that an editor saving in several
+// writes causes one reload rather than several of a half-written file. A file that can't be parsed is reported
+// and skipped, keeping the configuration in effect until the next change.
+class ConfigWatcher
+{
+public:
+	typedef std::function<void(AppConfig)> LoadCallback;
+
+	static constexpr std::chrono::milliseconds SETTLE_TIME{ 200 };
+
+private:
+	const wxFileName configFile;
+	LoadCallback onLoaded;
+
+	std::mutex changeMutex;
+	std::condition_variable changed;
+	bool changePending = false,
+		stopping = false;
+	std::chrono::steady_clock::time_point lastChangeTime;
+
+	std::thread loadThread;
+	// Declared last so that it stops reporting changes before anything it reports them to is destroyed
+	std::unique_ptr<DirectoryChangeWatcher> changeWatcher;
+
+	void onFileChanged(const wxFileName& fileName);
+	void loadLoop();
+
+public:
+	// onLoaded is called on the watcher's thread with each configuration loaded
+	ConfigWatcher(LoadCallback onLoaded, const wxFileName& configFile = AppConfig::defaultConfigPath());
+	~ConfigWatcher();
+
+	ConfigWatcher(const ConfigWatcher&) = delete;
+	ConfigWatcher& operator=(const ConfigWatcher&) = delete;
+};
@@ -0,0 +1,84 @@
+#include "ConsentApprovalQueue.h"
+
+uint64_t ConsentApprovalQueue::add(const std::string& requester, const nlohmann::json& details,
+	std::chrono::steady_clock::time_point deadline, Answer answer, AbandonedCheck abandoned)
+{
+	std::lock_guard<std::mutex> lock(queueMutex);
+	uint64_t id = nextID++;
+	entries.emplace(id, Entry{ { id, requester, details }, deadline, std::move(answer), std::move(abandoned) });
+	return id;
+}
+
+std::vector<ConsentApprovalQueue::Prompt> ConsentApprovalQueue::pending()
+{
+	std::vector<Prompt> prompts;
+	std::vector<Answer> abandonedAnswers;
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		for (auto entryIt = entries.begin(); entryIt != entries.end();)
+		{
+			if (entryIt->second.abandoned && entryIt->second.abandoned())
+			{
+				abandonedAnswers.push_back(std::move(entryIt->second.answer));
+				entryIt = entries.erase(entryIt);
+			}
+			else
+			{
+				prompts.push_back(entryIt->second.prompt);
+				++entryIt;
+			}
+		}
+	}
+
+	// Nobody is waiting for these any more, but each answer is still called once so that it can clean up
+	for (auto& abandonedAnswer : abandonedAnswers)
+	{
+		abandonedAnswer(false, false, nlohmann::json::object());
+	}
+
+	return prompts;
+}
+
+bool ConsentApprovalQueue::answer(uint64_t id, bool accepted, bool banSender, const nlohmann::json& choices)
+{
+	Answer promptAnswer;
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		auto entryIt = entries.find(id);
+		if (entryIt == entries.end())
+		{
+			return false;
+		}
+
+		promptAnswer = std::move(entryIt->second.answer);
+		entries.erase(entryIt);
+	}
+
+	promptAnswer(accepted, banSender, choices);
+	return true;
+}
+
+void ConsentApprovalQueue::expire(std::chrono::steady_clock::time_point now)
+{
+	std::vector<Answer> expiredAnswers;
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		for (auto entryIt = entries.begin(); entryIt != entries.end();)
+		{
+			if (entryIt->second.deadline <= now || (entryIt->second.abandoned && entryIt->second.abandoned()))
+			{
+				expiredAnswers.push_back(std::move(entryIt->second.answer));
+				entryIt = entries.erase(entryIt);
+			}
+			else
+			{
+				++entryIt;
+			}
+		}
+	}
+
+	for (auto& expiredAnswer : expiredAnswers)
+	{
+		expiredAnswer(false, false, nlohmann::json::object());
+	}
+}
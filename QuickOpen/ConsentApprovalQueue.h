@@ -0,0 +1,60 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Consent prompts waiting to be answered from outside the process, for when there is no dialog to show them in
+// (as in the headless daemon). Prompts are listed and answered through the management server, and declined once
+// they have waited past their deadline.
+class ConsentApprovalQueue
+{
+public:
+	// Called exactly once per prompt, without the queue's lock held. choices holds whatever else the approver
+	// decided, e.g. where to save files; it is empty for prompts that were declined without being answered.
+	typedef std::function<void(bool accepted, bool banSender, const nlohmann::json& choices)> Answer;
+	// Whether the request behind a prompt has gone away, e.g. because its client disconnected
+	typedef std::function<bool()> AbandonedCheck;
+
+	struct Prompt
+	{
+		uint64_t id;
+		std::string requester;
+		// "url" for webpage requests, or "files" with each file's filename, fileSize and whether it is ephemeral
+		nlohmann::json details;
+
+		NLOHMANN_DEFINE_TYPE_INTRUSIVE(Prompt, id, requester, details)
+	};
+
+private:
+	struct Entry
+	{
+		Prompt prompt;
+		std::chrono::steady_clock::time_point deadline;
+		Answer answer;
+		AbandonedCheck abandoned;
+	};
+
+	std::mutex queueMutex;
+	std::map<uint64_t, Entry> entries;
+	uint64_t nextID = 1;
+
+public:
+	uint64_t add(const std::string& requester, const nlohmann::json& details, std::chrono::steady_clock::time_point deadline,
+		Answer answer, AbandonedCheck abandoned = {});
+
+	// Prompts still waiting for an answer, oldest first; abandoned ones are dropped
+	std::vector<Prompt> pending();
+
+	// Returns false if there is no such prompt, e.g. because it was already answered or has expired
+	bool answer(uint64_t id, bool accepted, bool banSender, const nlohmann::json& choices = nlohmann::json::object());
+
+	// Declines the prompts whose deadline has passed as of now, along with abandoned ones
+	void expire(std::chrono::steady_clock::time_point now);
+};
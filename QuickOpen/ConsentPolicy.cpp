@@ -0,0 +1,352 @@
+#include "ConsentPolicy.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+
+namespace
+{
+	std::string toLowerASCII(std::string text)
+	{
+		std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return text;
+	}
+
+	bool endsWith(const std::string& text, const std::string& suffix)
+	{
+		return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	const char* actionName(ConsentRule::Action action)
+	{
+		switch (action)
+		{
+		case ConsentRule::ACCEPT:
+			return "accept";
+		case ConsentRule::DENY:
+			return "deny";
+		default:
+			return "prompt";
+		}
+	}
+}
+
+std::string ConsentPolicy::urlHost(const std::string& url)
+{
+	// Webpage requests may leave out the slashes after the scheme ("https:example.com")
+	size_t hostStart = url.find(':');
+	hostStart = (hostStart == std::string::npos) ? 0 : hostStart + 1;
+	if (url.compare(hostStart, 2, "//") == 0)
+	{
+		hostStart += 2;
+	}
+
+	std::string authority = url.substr(hostStart, url.find_first_of("/?#", hostStart) - hostStart);
+
+	size_t userInfoEnd = authority.rfind('@');
+	if (userInfoEnd != std::string::npos)
+	{
+		authority.erase(0, userInfoEnd + 1);
+	}
+
+	std::string host;
+	if (!authority.empty() && authority.front() == '[')
+	{
+		host = authority.substr(0, authority.find(']') + 1);
+	}
+	else
+	{
+		host = authority.substr(0, authority.find(':'));
+	}
+
+	if (!host.empty() && host.back() == '.')
+	{
+		host.pop_back();
+	}
+
+	return toLowerASCII(host);
+}
+
+bool ConsentPolicy::CompiledRule::matches(const ConsentRequest& request,
+	const std::optional<BandwidthLimiter::Address>& senderAddress, const std::string& host) const
+{
+	if ((webpageOnly && request.kind != ConsentRequest::WEBPAGE) || (filesOnly && request.kind != ConsentRequest::FILES))
+	{
+		return false;
+	}
+
+	if (!subnets.empty())
+	{
+		if (!senderAddress || std::none_of(subnets.begin(), subnets.end(), [&senderAddress](const auto& subnet)
+		{
+			return BandwidthLimiter::subnetContains(subnet.first, subnet.second, *senderAddress);
+		}))
+		{
+			return false;
+		}
+	}
+
+	if (!exactDomains.empty() || !domainSuffixes.empty())
+	{
+		if (exactDomains.count(host) == 0 && std::none_of(domainSuffixes.begin(), domainSuffixes.end(),
+			[&host](const std::string& suffix) { return endsWith(host, suffix); }))
+		{
+			return false;
+		}
+	}
+
+	if (request.kind == ConsentRequest::FILES)
+	{
+		if (maxFileCount > 0 && request.files.size() > maxFileCount)
+		{
+			return false;
+		}
+
+		unsigned long long totalSize = 0;
+		for (const auto& thisFile : request.files)
+		{
+			if (maxFileSize > 0 && thisFile.fileSize > maxFileSize)
+			{
+				return false;
+			}
+
+			if (!extensions.empty() && extensions.count(std::string(wxFileName(thisFile.filename).GetExt().Lower().ToUTF8())) == 0)
+			{
+				return false;
+			}
+
+			totalSize += thisFile.fileSize;
+		}
+
+		if (maxTotalSize > 0 && totalSize > maxTotalSize)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+std::shared_ptr<const ConsentPolicy::CompiledRules> ConsentPolicy::compile(const std::vector<ConsentRule>& rules)
+{
+	auto compiled = std::make_shared<CompiledRules>();
+
+	for (const auto& rule : rules)
+	{
+		CompiledRule compiledRule{ rule.name, rule.action, {}, {}, {}, {}, rule.maxFileSize, rule.maxTotalSize, rule.maxFileCount,
+			!rule.urlDomains.empty(), false };
+
+		bool valid = true;
+		for (const auto& subnetText : rule.senderSubnets)
+		{
+			auto subnet = BandwidthLimiter::parseSubnet(subnetText);
+			if (!subnet)
+			{
+				std::cerr << "WARNING: Ignoring consent rule \"" << rule.name << "\" for its invalid subnet \"" << subnetText << "\"." << std::endl;
+				valid = false;
+				break;
+			}
+
+			compiledRule.subnets.push_back(*subnet);
+		}
+
+		if (!valid)
+		{
+			continue;
+		}
+
+		for (const auto& domain : rule.urlDomains)
+		{
+			std::string pattern = toLowerASCII(domain);
+			if (pattern.compare(0, 2, "*.") == 0)
+			{
+				compiledRule.domainSuffixes.push_back(pattern.substr(1));
+			}
+			else
+			{
+				compiledRule.exactDomains.insert(pattern);
+			}
+		}
+
+		for (const auto& extension : rule.fileExtensions)
+		{
+			std::string normalizedExtension = toLowerASCII(extension);
+			if (!normalizedExtension.empty() && normalizedExtension.front() == '.')
+			{
+				normalizedExtension.erase(0, 1);
+			}
+
+			compiledRule.extensions.insert(normalizedExtension);
+		}
+
+		compiledRule.filesOnly = !compiledRule.extensions.empty() || rule.maxFileSize > 0 || rule.maxTotalSize > 0 || rule.maxFileCount > 0;
+		if (compiledRule.webpageOnly && compiledRule.filesOnly)
+		{
+			std::cerr << "WARNING: Consent rule \"" << rule.name << "\" has both URL and file conditions, so it can never match." << std::endl;
+		}
+
+		compiled->push_back(std::move(compiledRule));
+	}
+
+	return compiled;
+}
+
+ConsentPolicy::ConsentPolicy(RulesSource rulesSource, const wxFileName& auditLogFile, unsigned long long maxAuditLogBytes) :
+	rulesSource(std::move(rulesSource)), lastRefresh(std::chrono::steady_clock::now()),
+	compiledRules(std::make_shared<CompiledRules>()), auditLogFile(auditLogFile), maxAuditLogBytes(maxAuditLogBytes)
+{
+	{
+		std::lock_guard<std::mutex> lock(auditMutex);
+		openAuditLog();
+	}
+
+	if (this->rulesSource)
+	{
+		setRules(this->rulesSource());
+	}
+}
+
+void ConsentPolicy::setRules(const std::vector<ConsentRule>& newRules)
+{
+	auto newCompiledRules = compile(newRules);
+
+	std::lock_guard<std::mutex> lock(policyMutex);
+	rules = newRules;
+	compiledRules = std::move(newCompiledRules);
+}
+
+std::vector<ConsentRule> ConsentPolicy::getRules()
+{
+	std::lock_guard<std::mutex> lock(policyMutex);
+	return rules;
+}
+
+void ConsentPolicy::refreshRules()
+{
+	{
+		auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(policyMutex);
+		if (!rulesSource || now - lastRefresh < REFRESH_INTERVAL)
+		{
+			return;
+		}
+
+		lastRefresh = now;
+	}
+
+	std::vector<ConsentRule> newRules = rulesSource();
+	if (newRules != getRules())
+	{
+		setRules(newRules);
+	}
+}
+
+ConsentDecision ConsentPolicy::evaluate(const ConsentRequest& request)
+{
+	refreshRules();
+
+	std::shared_ptr<const CompiledRules> currentRules;
+	{
+		std::lock_guard<std::mutex> lock(policyMutex);
+		currentRules = compiledRules;
+	}
+
+	auto senderAddress = BandwidthLimiter::parseAddress(request.sender);
+	std::string host = (request.kind == ConsentRequest::WEBPAGE) ? urlHost(request.url) : std::string();
+
+	ConsentDecision decision{ ConsentRule::PROMPT, {} };
+	for (const auto& rule : *currentRules)
+	{
+		if (rule.matches(request, senderAddress, host))
+		{
+			decision = { rule.action, rule.name };
+			break;
+		}
+	}
+
+	switch (decision.action)
+	{
+	case ConsentRule::ACCEPT:
+		++globalStats().autoAccepted;
+		break;
+	case ConsentRule::DENY:
+		++globalStats().autoDenied;
+		break;
+	default:
+		++globalStats().prompted;
+		break;
+	}
+
+	writeAuditEntry(request, actionName(decision.action), "policy", decision.ruleName);
+	return decision;
+}
+
+void ConsentPolicy::recordAnswer(const ConsentRequest& request, bool accepted)
+{
+	writeAuditEntry(request, accepted ? "accept" : "deny", "user", "");
+}
+
+void ConsentPolicy::writeAuditEntry(const ConsentRequest& request, const std::string& decision, const std::string& decidedBy,
+	const std::string& ruleName)
+{
+	nlohmann::json entry = {
+		{"time", std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()},
+		{"sender", request.sender},
+		{"decision", decision},
+		{"decidedBy", decidedBy},
+		{"rule", ruleName}
+	};
+
+	if (request.kind == ConsentRequest::WEBPAGE)
+	{
+		entry["url"] = request.url;
+	}
+	else
+	{
+		entry["files"] = nlohmann::json::array();
+		for (const auto& thisFile : request.files)
+		{
+			entry["files"].push_back({ {"filename", std::string(thisFile.filename.ToUTF8())}, {"fileSize", thisFile.fileSize} });
+		}
+	}
+
+	std::string line = entry.dump() + "\n";
+
+	std::lock_guard<std::mutex> lock(auditMutex);
+	if (auditLogSize > 0 && auditLogSize + line.size() > maxAuditLogBytes)
+	{
+		auditLog.close();
+		wxString rotatedPath = auditLogFile.GetFullPath() + wxT(".1");
+		if (!wxRenameFile(auditLogFile.GetFullPath(), rotatedPath, true))
+		{
+			std::cerr << "WARNING: Couldn't move \"" << auditLogFile.GetFullPath() << "\" to \"" << rotatedPath
+				<< "\"; older consent decisions will be discarded." << std::endl;
+			wxRemoveFile(auditLogFile.GetFullPath());
+		}
+		openAuditLog();
+	}
+
+	if (auditLog.is_open())
+	{
+		auditLog << line << std::flush;
+		auditLogSize += line.size();
+	}
+}
+
+void ConsentPolicy::openAuditLog()
+{
+#ifdef WIN32
+	auditLog.open(wxStringToTString(auditLogFile.GetFullPath()), std::ios::app);
+#else
+	auditLog.open(auditLogFile.GetFullPath(), std::ios::app);
+#endif
+	if (!auditLog.is_open())
+	{
+		std::cerr << "WARNING: Couldn't open \"" << auditLogFile.GetFullPath() << "\"; consent decisions won't be logged." << std::endl;
+		auditLogSize = 0;
+		return;
+	}
+
+	wxULongLong existingSize = auditLogFile.GetSize();
+	auditLogSize = (existingSize == wxInvalidSize) ? 0 : existingSize.GetValue();
+}
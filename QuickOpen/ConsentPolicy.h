@@ -0,0 +1,185 @@
+#pragma once
+
+#include "BandwidthLimiter.h"
+#include "Utils.h"
+
+#include <wx/filename.h>
+
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// A rule for answering consent requests without showing the user a dialog. Each condition that is set must hold
+// for the rule to match, and conditions left empty (or 0) hold for any request. A rule with URL domains only
+// matches requests to open a webpage, and one with file extensions or limits only matches requests to send files.
+struct ConsentRule
+{
+	enum Action
+	{
+		ACCEPT,
+		DENY,
+		PROMPT
+	};
+
+	// Identifies the rule in the audit log
+	std::string name;
+	Action action = PROMPT;
+
+	// Addresses or subnets in CIDR notation ("192.168.1.0/24", "fd00::/8"), one of which must contain the sender
+	std::vector<std::string> senderSubnets;
+	// Hosts, one of which the webpage must be on; "*.example.com" stands for any subdomain of example.com
+	std::vector<std::string> urlDomains;
+	// Extensions, without the dot, one of which every file must have
+	std::vector<std::string> fileExtensions;
+	unsigned long long maxFileSize = 0,
+		maxTotalSize = 0;
+	unsigned maxFileCount = 0;
+
+	bool operator==(const ConsentRule& rhs) const
+	{
+		return name == rhs.name && action == rhs.action && senderSubnets == rhs.senderSubnets && urlDomains == rhs.urlDomains
+			&& fileExtensions == rhs.fileExtensions && maxFileSize == rhs.maxFileSize && maxTotalSize == rhs.maxTotalSize
+			&& maxFileCount == rhs.maxFileCount;
+	}
+
+	bool operator!=(const ConsentRule& rhs) const
+	{
+		return !(*this == rhs);
+	}
+
+	NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ConsentRule, name, action, senderSubnets, urlDomains, fileExtensions,
+		maxFileSize, maxTotalSize, maxFileCount)
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(ConsentRule::Action, {
+	{ ConsentRule::ACCEPT, "accept" },
+	{ ConsentRule::DENY, "deny" },
+	{ ConsentRule::PROMPT, "prompt" }
+})
+
+// What a consent request asks for, as far as rules are concerned
+struct ConsentRequest
+{
+	enum Kind
+	{
+		WEBPAGE,
+		FILES
+	};
+
+	struct File
+	{
+		wxString filename;
+		unsigned long long fileSize;
+	};
+
+	Kind kind;
+	std::string sender;
+	// Set for WEBPAGE requests
+	std::string url;
+	// Set for FILES requests
+	std::vector<File> files;
+};
+
+struct ConsentDecision
+{
+	ConsentRule::Action action;
+	// Empty if no rule matched, in which case the user is asked
+	std::string ruleName;
+};
+
+// Decides consent requests by the first rule that matches them, before any dialog is shown, and records every
+// decision (along with the user's answer to requests that still had to be prompted for) in an audit log of JSON
+// lines. Once the log reaches maxAuditLogBytes it is moved to "<name>.1", replacing the previous one, and a new
+// log is started, so that no more than twice that is kept. Rules are read from rulesSource when the policy is created and again at most every REFRESH_INTERVAL;
+// each time they change they are compiled into a form that is quick to match against.
+class ConsentPolicy
+{
+public:
+	typedef std::function<std::vector<ConsentRule>()> RulesSource;
+
+	static constexpr std::chrono::milliseconds REFRESH_INTERVAL{ 1000 };
+	static constexpr unsigned long long MAX_AUDIT_LOG_BYTES = 4 << 20;
+
+	// Totals across all policies, for metrics
+	struct GlobalStats
+	{
+		std::atomic<unsigned long long> autoAccepted = 0,
+			autoDenied = 0,
+			prompted = 0;
+	};
+
+	// Returns the lowercased host part of url, or an empty string if it has none
+	static std::string urlHost(const std::string& url);
+
+private:
+	struct CompiledRule
+	{
+		std::string name;
+		ConsentRule::Action action;
+		std::vector<std::pair<BandwidthLimiter::Address, unsigned>> subnets;
+		std::unordered_set<std::string> exactDomains;
+		// From "*.example.com" patterns, kept as ".example.com"
+		std::vector<std::string> domainSuffixes;
+		std::unordered_set<std::string> extensions;
+		unsigned long long maxFileSize, maxTotalSize;
+		unsigned maxFileCount;
+		bool webpageOnly, filesOnly;
+
+		bool matches(const ConsentRequest& request, const std::optional<BandwidthLimiter::Address>& senderAddress,
+			const std::string& host) const;
+	};
+
+	typedef std::vector<CompiledRule> CompiledRules;
+
+	RulesSource rulesSource;
+	std::chrono::steady_clock::time_point lastRefresh;
+
+	std::mutex policyMutex;
+	std::vector<ConsentRule> rules;
+	std::shared_ptr<const CompiledRules> compiledRules;
+
+	std::mutex auditMutex;
+	wxFileName auditLogFile;
+	unsigned long long maxAuditLogBytes;
+	std::ofstream auditLog;
+	unsigned long long auditLogSize = 0;
+
+	// Rules that can't be compiled (for an invalid subnet) are left out with a warning, since matching them any
+	// other way could let through requests they weren't meant for
+	static std::shared_ptr<const CompiledRules> compile(const std::vector<ConsentRule>& rules);
+
+	void refreshRules();
+	// Expects auditMutex to be held
+	void openAuditLog();
+	void writeAuditEntry(const ConsentRequest& request, const std::string& decision, const std::string& decidedBy,
+		const std::string& ruleName);
+
+public:
+	ConsentPolicy(RulesSource rulesSource, const wxFileName& auditLogFile,
+		unsigned long long maxAuditLogBytes = MAX_AUDIT_LOG_BYTES);
+
+	// Replaces the rules at once
+	void setRules(const std::vector<ConsentRule>& newRules);
+	std::vector<ConsentRule> getRules();
+
+	// Decides request by the first matching rule, or returns PROMPT if none match, and logs the decision
+	ConsentDecision evaluate(const ConsentRequest& request);
+
+	// Logs the user's answer to a request that evaluate() left to them
+	void recordAnswer(const ConsentRequest& request, bool accepted);
+
+	static GlobalStats& globalStats()
+	{
+		static GlobalStats instance;
+		return instance;
+	}
+};
@@ -0,0 +1,218 @@
+#include "ContentIndex.h"
+
+#include <filesystem>
+
+namespace
+{
+	std::filesystem::path toPath(const wxFileName& fileName)
+	{
+#ifdef WIN32
+		return fileName.GetFullPath().ToStdWstring();
+#else
+		return std::string(fileName.GetFullPath().ToUTF8());
+#endif
+	}
+}
+
+ContentIndex::ContentIndex(const wxFileName& indexFile) : indexFile(indexFile)
+{
+	try
+	{
+		changeWatcher = std::make_unique<DirectoryChangeWatcher>([this](const wxFileName& fileName) { onFileChanged(fileName); });
+	}
+	catch (const std::system_error&)
+	{
+		// Without change notifications, stale entries are still caught when they are looked up.
+	}
+
+	loadIndex();
+}
+
+std::optional<ContentIndex::Entry> ContentIndex::describeFile(const wxFileName& fileName)
+{
+	std::error_code error;
+	auto filePath = toPath(fileName);
+
+	if (!std::filesystem::is_regular_file(filePath, error))
+	{
+		return std::nullopt;
+	}
+
+	Entry fileEntry;
+	fileEntry.path = fileName.GetFullPath();
+	fileEntry.fileSize = std::filesystem::file_size(filePath, error);
+	fileEntry.modificationTime = std::filesystem::last_write_time(filePath, error).time_since_epoch().count();
+
+	if (error)
+	{
+		return std::nullopt;
+	}
+
+	return fileEntry;
+}
+
+void ContentIndex::loadIndex()
+{
+	std::lock_guard<std::mutex> lock(indexMutex);
+
+	if (!indexFile.FileExists())
+	{
+		return;
+	}
+
+	std::vector<Entry> savedEntries;
+	try
+	{
+		savedEntries = nlohmann::json::parse(fileReadAll(indexFile)).get<std::vector<Entry>>();
+	}
+	catch (const std::exception&)
+	{
+		// The index is only a cache; start over if it cannot be read.
+		return;
+	}
+
+	for (const Entry& thisEntry : savedEntries)
+	{
+		auto currentState = describeFile(wxFileName(thisEntry.path));
+
+		if (currentState.has_value() && currentState->fileSize == thisEntry.fileSize
+			&& currentState->modificationTime == thisEntry.modificationTime)
+		{
+			entries.insert({ thisEntry.contentHash, thisEntry });
+			watchParentDirectory(wxFileName(thisEntry.path));
+		}
+	}
+}
+
+void ContentIndex::saveIndex()
+{
+	std::vector<Entry> savedEntries;
+	for (const auto& thisEntry : entries)
+	{
+		savedEntries.push_back(thisEntry.second);
+	}
+
+	try
+	{
+		std::ofstream fileOutput;
+		fileOutput.exceptions(std::ofstream::failbit);
+#ifdef WIN32
+		fileOutput.open(indexFile.GetFullPath().ToStdWstring(), std::ofstream::trunc);
+#else
+		fileOutput.open(indexFile.GetFullPath(), std::ofstream::trunc);
+#endif
+		fileOutput << nlohmann::json(savedEntries);
+	}
+	catch (const std::ios_base::failure&)
+	{
+		// Losing the index only costs future deduplication opportunities.
+	}
+}
+
+void ContentIndex::watchParentDirectory(const wxFileName& fileName)
+{
+	wxString dirPath = getDirName(fileName).GetFullPath();
+
+	if (changeWatcher == nullptr || watchedDirs.count(dirPath) > 0)
+	{
+		return;
+	}
+
+	try
+	{
+		changeWatcher->watchDirectory(getDirName(fileName));
+		watchedDirs.insert(dirPath);
+	}
+	catch (const std::system_error&)
+	{}
+}
+
+void ContentIndex::onFileChanged(const wxFileName& fileName)
+{
+	std::lock_guard<std::mutex> lock(indexMutex);
+
+	wxString changedPath = fileName.GetFullPath();
+	auto currentState = describeFile(fileName);
+	bool entriesRemoved = false;
+
+	for (auto entryIter = entries.begin(); entryIter != entries.end();)
+	{
+		const Entry& thisEntry = entryIter->second;
+
+		if (thisEntry.path == changedPath && (!currentState.has_value() || currentState->fileSize != thisEntry.fileSize
+			|| currentState->modificationTime != thisEntry.modificationTime))
+		{
+			entryIter = entries.erase(entryIter);
+			entriesRemoved = true;
+		}
+		else
+		{
+			++entryIter;
+		}
+	}
+
+	if (entriesRemoved)
+	{
+		saveIndex();
+	}
+}
+
+void ContentIndex::recordFile(const std::string& contentHash, const wxFileName& fileName)
+{
+	auto newEntry = describeFile(fileName);
+	if (!newEntry.has_value())
+	{
+		return;
+	}
+
+	newEntry->contentHash = contentHash;
+
+	std::lock_guard<std::mutex> lock(indexMutex);
+
+	for (auto entryIter = entries.begin(); entryIter != entries.end();)
+	{
+		entryIter = (entryIter->second.path == newEntry->path) ? entries.erase(entryIter) : std::next(entryIter);
+	}
+
+	entries.insert({ contentHash, *newEntry });
+	watchParentDirectory(fileName);
+	saveIndex();
+}
+
+std::optional<wxFileName> ContentIndex::findFile(const std::string& contentHash, unsigned long long fileSize)
+{
+	std::lock_guard<std::mutex> lock(indexMutex);
+
+	auto matchRange = entries.equal_range(contentHash);
+	for (auto entryIter = matchRange.first; entryIter != matchRange.second; ++entryIter)
+	{
+		const Entry& thisEntry = entryIter->second;
+		auto currentState = describeFile(wxFileName(thisEntry.path));
+
+		// Check the file again in case a change notification is still in flight
+		if (thisEntry.fileSize == fileSize && currentState.has_value() && currentState->fileSize == thisEntry.fileSize
+			&& currentState->modificationTime == thisEntry.modificationTime)
+		{
+			return wxFileName(thisEntry.path);
+		}
+	}
+
+	return std::nullopt;
+}
+
+void ContentIndex::materialize(const wxFileName& sourceFile, const wxFileName& destFile, bool allowHardlink)
+{
+	if (allowHardlink)
+	{
+		std::error_code error;
+		std::filesystem::remove(toPath(destFile), error);
+		std::filesystem::create_hard_link(toPath(sourceFile), toPath(destFile), error);
+
+		if (!error)
+		{
+			return;
+		}
+	}
+
+	cloneFileContents(sourceFile, destFile);
+}
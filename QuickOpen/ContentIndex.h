@@ -0,0 +1,51 @@
+#pragma once
+
+#include "PlatformUtils.h"
+#include "Utils.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+
+// Remembers the SHA-256 of files that were received, so that sending the same content again can be satisfied
+// from the copy already on disk. Entries are dropped as soon as the file they refer to changes or disappears.
+class ContentIndex
+{
+public:
+	struct Entry
+	{
+		std::string contentHash;
+		wxString path;
+		unsigned long long fileSize = 0;
+		long long modificationTime = 0;
+
+		NLOHMANN_DEFINE_TYPE_INTRUSIVE(Entry, contentHash, path, fileSize, modificationTime)
+	};
+
+private:
+	const wxFileName indexFile;
+
+	std::mutex indexMutex;
+	std::multimap<std::string, Entry> entries;
+	std::set<wxString> watchedDirs;
+	std::unique_ptr<DirectoryChangeWatcher> changeWatcher;
+
+	static std::optional<Entry> describeFile(const wxFileName& fileName);
+
+	void loadIndex();
+	void saveIndex();
+	void watchParentDirectory(const wxFileName& fileName);
+	void onFileChanged(const wxFileName& fileName);
+
+public:
+	explicit ContentIndex(const wxFileName& indexFile =
+		InstallationInfo::detectInstallation().configFolder / wxFileName(".", "contentIndex.json"));
+
+	void recordFile(const std::string& contentHash, const wxFileName& fileName);
+	std::optional<wxFileName> findFile(const std::string& contentHash, unsigned long long fileSize);
+
+	// Creates destFile with the contents of sourceFile by cloning or, if allowed, hard linking it
+	static void materialize(const wxFileName& sourceFile, const wxFileName& destFile, bool allowHardlink);
+};
@@ -0,0 +1,384 @@
+#include "DaemonApp.h"
+
+#include "ManagementServer.h"
+#include "WebServer.h"
+
+#include <algorithm>
+#include <iostream>
+
+void TrayStatusWindow::FileUploadActivityEntry::publish(ActivityEvent::Kind kind, double progress, const std::string& detail)
+{
+    // Every event names the file, so that a GUI that starts in the middle of an upload can still list it
+    window.publish(ActivityEvent(kind, entryID, std::string(fileName.GetFullPath().ToUTF8()), progress, detail));
+}
+
+void TrayStatusWindow::FileUploadActivityEntry::finish(ActivityEvent::Kind kind, const wxString& outcome, const std::string& detail)
+{
+    if (finished)
+    {
+        return;
+    }
+
+    finished = true;
+    finishTime = std::chrono::steady_clock::now();
+    std::cout << "\"" << fileName.GetFullPath() << "\": " << outcome << std::endl;
+    publish(kind, 1.0, detail);
+}
+
+void TrayStatusWindow::FileUploadActivityEntry::setProgress(double progress)
+{
+    publish(ActivityEvent::UPLOAD_PROGRESS, progress);
+}
+
+void TrayStatusWindow::FileUploadActivityEntry::setWaiting(bool waiting)
+{
+    publish(ActivityEvent::UPLOAD_WAITING, waiting ? 1.0 : 0.0);
+}
+
+void TrayStatusWindow::FileUploadActivityEntry::setCompleted(bool completed)
+{
+    if (completed)
+    {
+        finish(ActivityEvent::UPLOAD_COMPLETED, wxT("received"));
+    }
+}
+
+void TrayStatusWindow::FileUploadActivityEntry::setError(const std::exception* error)
+{
+    std::string message = (error != nullptr) ? error->what() : "";
+    finish(ActivityEvent::UPLOAD_FAILED, message.empty() ? wxString(wxT("failed")) : wxT("failed: ") + wxString::FromUTF8(message),
+        message);
+}
+
+void TrayStatusWindow::FileUploadActivityEntry::setCancelCompleted()
+{
+    finish(ActivityEvent::UPLOAD_CANCELLED, wxT("cancelled"));
+}
+
+void TrayStatusWindow::FileUploadActivityEntry::setDeduplicated()
+{
+    finish(ActivityEvent::UPLOAD_DEDUPLICATED, wxT("copied from an identical file already received"));
+}
+
+bool TrayStatusWindow::FileUploadActivityEntry::requestCancel()
+{
+    if (finished || cancelRequestFlag == nullptr)
+    {
+        return false;
+    }
+
+    *cancelRequestFlag = true;
+    return true;
+}
+
+void TrayStatusWindow::publish(const ActivityEvent& event)
+{
+    if (activityRing != nullptr)
+    {
+        activityRing->publish(event);
+    }
+}
+
+TrayStatusWindow::FileUploadActivityEntry* TrayStatusWindow::addEntry(const wxFileName& fileName, ActivityEvent::Kind kind,
+                                                                      std::atomic<bool>* cancelRequestFlag)
+{
+    auto expiredBefore = std::chrono::steady_clock::now() - FINISHED_ENTRY_LIFETIME;
+    entries.remove_if([expiredBefore](const std::unique_ptr<FileUploadActivityEntry>& entry)
+    {
+        return entry->finishedBefore(expiredBefore);
+    });
+
+    uint64_t entryID = nextEntryID++;
+    entries.push_back(std::make_unique<FileUploadActivityEntry>(*this, entryID, fileName, cancelRequestFlag));
+    publish(ActivityEvent(kind, entryID, std::string(fileName.GetFullPath().ToUTF8())));
+    return entries.back().get();
+}
+
+void TrayStatusWindow::addWebpageOpenedActivity(const wxString& url)
+{
+    std::cout << "Opened webpage " << url << std::endl;
+    publish(ActivityEvent(ActivityEvent::WEBPAGE_OPENED, 0, std::string(url.ToUTF8())));
+}
+
+TrayStatusWindow::FileUploadActivityEntry* TrayStatusWindow::addFileUploadActivity(const wxFileName& filename,
+                                                                                   std::atomic<bool>& cancelRequestFlag)
+{
+    std::cout << "Receiving \"" << filename.GetFullPath() << "\"" << std::endl;
+    return addEntry(filename, ActivityEvent::UPLOAD_STARTED, &cancelRequestFlag);
+}
+
+TrayStatusWindow::FileUploadActivityEntry* TrayStatusWindow::addDeduplicatedFileActivity(const wxFileName& filename)
+{
+    std::cout << "\"" << filename.GetFullPath() << "\": copied from an identical file already received" << std::endl;
+    return addEntry(filename, ActivityEvent::UPLOAD_DEDUPLICATED, nullptr);
+}
+
+bool TrayStatusWindow::requestCancel(uint64_t entryID)
+{
+    for (const auto& entry : entries)
+    {
+        if (entry->getEntryID() == entryID)
+        {
+            return entry->requestCancel();
+        }
+    }
+
+    return false;
+}
+
+QuickOpenApplication::QuickOpenApplication()
+{
+    std::unique_ptr<AppConfig> config = std::make_unique<AppConfig>();
+
+    try
+    {
+        *config = AppConfig::loadConfig();
+    }
+    catch (const std::ios_base::failure&)
+    {
+        std::cerr << "WARNING: Could not open configuration file \"" << AppConfig::defaultConfigPath().GetFullPath() << "\"." << std::endl;
+    }
+
+    configRef = std::make_shared<WriterReadersLock<AppConfig>>(config);
+}
+
+QuickOpenApplication::~QuickOpenApplication()
+{
+    configWatcher.reset();
+    // Requests still waiting for an answer are declined, so that the servers' threads can finish them
+    if (server != nullptr)
+    {
+        server->getState()->consentPrompts.shutdown();
+    }
+    approvalQueue.expire(std::chrono::steady_clock::time_point::max());
+    mgmtServer.reset();
+    server.reset();
+    serverHandoff.reset();
+}
+
+void QuickOpenApplication::start()
+{
+    try
+    {
+        activityLog.setActivityRing(ActivityRing::createShared());
+    }
+    catch (const std::exception& ex)
+    {
+        std::cerr << "WARNING: Could not share activity with the tray GUI: " << ex.what() << std::endl;
+    }
+
+    setupServer(WriterReadersLock<AppConfig>::ReadableReference(*configRef)->serverPort);
+    configWatcher = std::make_unique<ConfigWatcher>([this](AppConfig newConfig)
+    {
+        this->CallAfter([this, newConfig] { applyConfig(newConfig); });
+    });
+
+    mgmtServer = ManagementServer::startOnFreePort(*this);
+
+    mgmtServer->addConsentApprover(approvalQueue);
+    mgmtServer->addUploadCanceller([this](uint64_t entryID)
+    {
+        // The activity entries belong to the thread in run(), which may already have stopped
+        auto cancelTask = callOnGUIThread(*this, [this, entryID] { return activityLog.requestCancel(entryID); });
+        auto cancelled = cancelTask.waitUntil(std::chrono::steady_clock::now() + std::chrono::seconds(5));
+        if (!cancelled && !cancelTask.cancel())
+        {
+            return cancelTask.get();
+        }
+
+        return cancelled.value_or(false);
+    });
+}
+
+void QuickOpenApplication::run()
+{
+    std::unique_lock<std::mutex> lock(callMutex);
+    while (!stopping)
+    {
+        if (queuedCalls.empty())
+        {
+            callQueued.wait_for(lock, EXPIRY_INTERVAL);
+        }
+
+        std::deque<std::function<void()>> calls;
+        calls.swap(queuedCalls);
+        lock.unlock();
+
+        for (auto& call : calls)
+        {
+            call();
+        }
+
+        approvalQueue.expire(std::chrono::steady_clock::now());
+        lock.lock();
+    }
+}
+
+void QuickOpenApplication::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(callMutex);
+        stopping = true;
+    }
+    callQueued.notify_one();
+}
+
+void QuickOpenApplication::triggerConfigUpdate()
+{
+    try
+    {
+        applyConfig(AppConfig::loadConfig());
+    }
+    catch (const std::exception& ex)
+    {
+        // Unlike the GUI, nobody would see the daemon exit, so it keeps running with the configuration it has
+        std::cerr << "WARNING: Could not reload configuration file \"" << AppConfig::defaultConfigPath().GetFullPath()
+            << "\": " << ex.what() << std::endl;
+    }
+}
+
+void QuickOpenApplication::applyConfig(AppConfig newConfig)
+{
+    ConfigChanges::apply(*configRef, std::move(newConfig), [this](unsigned newPort)
+    {
+        if (server != nullptr && newPort != server->getPort())
+        {
+            setupServer(newPort);
+        }
+    });
+}
+
+void QuickOpenApplication::notifyUser(MessageSeverity severity, const wxString& title, const wxString& text)
+{
+    switch (severity)
+    {
+    case MessageSeverity::MSG_ERROR:
+        std::cerr << "ERROR: " << title << ": " << text << std::endl;
+        break;
+    case MessageSeverity::MSG_WARNING:
+        std::cerr << "WARNING: " << title << ": " << text << std::endl;
+        break;
+    default:
+        std::cout << title << ": " << text << std::endl;
+        break;
+    }
+}
+
+void QuickOpenApplication::openReceivedFile(const wxFileName& fileName)
+{
+    shellExecuteFile(fileName, nullptr);
+}
+
+void QuickOpenApplication::setupServer(unsigned newPort)
+{
+    if (serverHandoff == nullptr)
+    {
+        serverHandoff = std::make_unique<ServerHandoff>();
+    }
+
+    // Switching back to a port whose server is still handing off takes that server back
+    std::unique_ptr<QuickOpenWebServer> newServer = serverHandoff->reclaim(newPort);
+    if (newServer == nullptr)
+    {
+        newServer = std::make_unique<QuickOpenWebServer>(*this, newPort, (server != nullptr) ? server->getState() : nullptr);
+    }
+
+    if (server != nullptr)
+    {
+        std::chrono::seconds handoffTimeout(WriterReadersLock<AppConfig>::ReadableReference(*configRef)->serverHandoffTimeoutSeconds);
+        serverHandoff->retire(std::move(server), newPort, handoffTimeout);
+    }
+
+    server = std::move(newServer);
+}
+
+void QuickOpenApplication::applyFileChoices(FileConsentRequestInfo& requestInfo, const wxFileName& defaultDestDir,
+                                            const nlohmann::json& choices)
+{
+    const nlohmann::json& destinations = choices.contains("destinations") ? choices["destinations"] : nlohmann::json();
+    bool useDestinations = destinations.is_array() && destinations.size() == requestInfo.fileList.size()
+        && std::all_of(destinations.begin(), destinations.end(), [](const nlohmann::json& destination)
+    {
+        return destination.is_string() && wxFileName(wxString::FromUTF8(destination.get<std::string>())).IsAbsolute();
+    });
+
+    std::vector<wxFileName> chosenFileNames;
+    for (size_t i = 0; i < requestInfo.fileList.size(); ++i)
+    {
+        auto& thisFile = requestInfo.fileList[i];
+        if (choices.contains("openOnly") && choices["openOnly"].is_boolean())
+        {
+            thisFile.ephemeral = choices["openOnly"].get<bool>();
+        }
+
+        if (thisFile.ephemeral)
+        {
+            continue;
+        }
+
+        if (useDestinations)
+        {
+            thisFile.consentedFileName = wxFileName(wxString::FromUTF8(destinations[i].get<std::string>()));
+        }
+        else
+        {
+            // Saved where the consent dialog would have suggested, without replacing anything, since the approver
+            // wasn't shown where that is
+            thisFile.consentedFileName = nonConflictingFileName(defaultDestDir, thisFile.filename, chosenFileNames);
+            chosenFileNames.push_back(thisFile.consentedFileName);
+        }
+    }
+}
+
+GUITask<std::pair<bool, bool>> QuickOpenApplication::promptForWebpageOpen(std::string URL, const wxString& requesterName,
+                                                                          std::chrono::steady_clock::time_point deadline)
+{
+    typedef GUITask<std::pair<bool, bool>>::State StateType;
+    auto state = std::make_shared<StateType>();
+
+    uint64_t promptID = approvalQueue.add(std::string(requesterName.ToUTF8()), { {"url", URL} }, deadline,
+        [state](bool accepted, bool banSender, const nlohmann::json& choices)
+    {
+        std::lock_guard<std::mutex> lock(state->stateMutex);
+        state->started = true;
+        state->result = std::pair{ accepted, banSender };
+        state->finished = true;
+        state->finishedFlag.notify_all();
+    }, [state]
+    {
+        std::lock_guard<std::mutex> lock(state->stateMutex);
+        return state->cancelled;
+    });
+
+    std::cout << "Consent prompt " << promptID << ": " << requesterName << " asks to open " << URL << std::endl;
+    activityLog.publish(ActivityEvent(ActivityEvent::CONSENT_PROMPT, promptID, std::string(requesterName.ToUTF8())));
+    return GUITask<std::pair<bool, bool>>(state);
+}
+
+void QuickOpenApplication::promptForFileSave(const wxFileName& defaultDestDir, const wxString& requesterName,
+                                             std::shared_ptr<FileConsentRequestInfo> rqFileInfo,
+                                             std::chrono::steady_clock::time_point deadline,
+                                             std::function<void(std::pair<ConsentDialog::ResultCode, bool>)> onDecision)
+{
+    nlohmann::json files = nlohmann::json::array();
+    for (const auto& thisFile : rqFileInfo->fileList)
+    {
+        files.push_back({ {"filename", std::string(thisFile.filename.ToUTF8())}, {"fileSize", thisFile.fileSize},
+            {"ephemeral", thisFile.ephemeral} });
+    }
+
+    uint64_t promptID = approvalQueue.add(std::string(requesterName.ToUTF8()), { {"files", files} }, deadline,
+        [defaultDestDir, rqFileInfo, onDecision](bool accepted, bool banSender, const nlohmann::json& choices)
+    {
+        if (accepted)
+        {
+            applyFileChoices(*rqFileInfo, defaultDestDir, choices);
+        }
+
+        onDecision({ accepted ? ConsentDialog::ACCEPT : ConsentDialog::DECLINE, banSender });
+    });
+
+    std::cout << "Consent prompt " << promptID << ": " << requesterName << " asks to send " << rqFileInfo->fileList.size()
+        << " file(s)" << std::endl;
+    activityLog.publish(ActivityEvent(ActivityEvent::CONSENT_PROMPT, promptID, std::string(requesterName.ToUTF8())));
+}
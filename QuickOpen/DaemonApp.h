@@ -0,0 +1,194 @@
+#ifndef QUICKOPEN_DAEMONAPP_H
+#define QUICKOPEN_DAEMONAPP_H
+
+// The application of the headless daemon build (QUICKOPEN_DAEMON), standing in for the wxWidgets one the way
+// MockGUI.h does for tests. Calls meant for the GUI thread run on the thread in run(), activity is logged for
+// the service manager to collect and published in an ActivityRing for a tray GUI to show, and requests the
+// consent policy leaves to a person wait in a ConsentApprovalQueue to be answered through the management server.
+
+#include <wx/string.h>
+
+#include "ActivityRing.h"
+#include "AppConfig.h"
+#include "ConfigWatcher.h"
+#include "ConsentApprovalQueue.h"
+#include "GUITask.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+
+struct FileConsentRequestInfo;
+class ManagementServer;
+class QuickOpenWebServer;
+class ServerHandoff;
+
+class ConsentDialog
+{
+public:
+    enum ResultCode
+    {
+        ACCEPT,
+        DECLINE
+    };
+};
+
+// Logs the activity the tray window would list, and publishes it for a tray GUI in another process
+class TrayStatusWindow
+{
+public:
+    class FileUploadActivityEntry
+    {
+        TrayStatusWindow& window;
+        uint64_t entryID;
+        wxFileName fileName;
+        // The upload's, set to have it cancelled; nullptr for files that aren't transferred
+        std::atomic<bool>* cancelRequestFlag;
+        bool finished = false;
+        std::chrono::steady_clock::time_point finishTime;
+
+        void publish(ActivityEvent::Kind kind, double progress = 0.0, const std::string& detail = {});
+        void finish(ActivityEvent::Kind kind, const wxString& outcome, const std::string& detail = {});
+
+    public:
+        FileUploadActivityEntry(TrayStatusWindow& window, uint64_t entryID, const wxFileName& fileName,
+                                std::atomic<bool>* cancelRequestFlag) :
+            window(window), entryID(entryID), fileName(fileName), cancelRequestFlag(cancelRequestFlag)
+        {}
+
+        uint64_t getEntryID() const
+        {
+            return entryID;
+        }
+
+        // Asks the upload to stop, as the tray window's Cancel button would; returns false if it has already ended
+        bool requestCancel();
+
+        void setProgress(double progress);
+        void setWaiting(bool waiting);
+
+        void setCompleted(bool completed);
+        void setError(const std::exception* error);
+        void setCancelCompleted();
+        void setDeduplicated();
+
+        bool finishedBefore(std::chrono::steady_clock::time_point time) const
+        {
+            return finished && finishTime < time;
+        }
+    };
+
+private:
+    // How long finished entries are kept, since calls already queued for them may still arrive
+    static constexpr std::chrono::seconds FINISHED_ENTRY_LIFETIME{ 60 };
+
+    std::list<std::unique_ptr<FileUploadActivityEntry>> entries;
+    uint64_t nextEntryID = 1;
+    std::unique_ptr<ActivityRing> activityRing;
+
+    FileUploadActivityEntry* addEntry(const wxFileName& fileName, ActivityEvent::Kind kind, std::atomic<bool>* cancelRequestFlag);
+
+public:
+    void setActivityRing(std::unique_ptr<ActivityRing> ring)
+    {
+        activityRing = std::move(ring);
+    }
+
+    // Does nothing without an activity ring
+    void publish(const ActivityEvent& event);
+
+    void addWebpageOpenedActivity(const wxString& url);
+    FileUploadActivityEntry* addFileUploadActivity(const wxFileName& filename, std::atomic<bool>& cancelRequestFlag);
+    FileUploadActivityEntry* addDeduplicatedFileActivity(const wxFileName& filename);
+
+    // Cancels the upload whose events carry entryID, for a tray GUI; returns false if there is no such upload running
+    bool requestCancel(uint64_t entryID);
+};
+
+class QuickOpenApplication
+{
+    std::shared_ptr<WriterReadersLock<AppConfig>> configRef;
+    // Applies edits made to the configuration file outside the settings window
+    std::unique_ptr<ConfigWatcher> configWatcher;
+    // Declared before server so that the servers it still holds for a port change are closed after it
+    std::unique_ptr<ServerHandoff> serverHandoff;
+    std::unique_ptr<QuickOpenWebServer> server;
+    std::unique_ptr<ManagementServer> mgmtServer;
+    TrayStatusWindow activityLog;
+    ConsentApprovalQueue approvalQueue;
+
+    std::mutex callMutex;
+    std::condition_variable callQueued;
+    std::deque<std::function<void()>> queuedCalls;
+    bool stopping = false;
+
+    // Applies what the approver chose ("destinations", one absolute path per file, and "openOnly") to an accepted
+    // request, leaving files without a valid choice where the consent dialog would have suggested
+    static void applyFileChoices(FileConsentRequestInfo& requestInfo, const wxFileName& defaultDestDir,
+                                 const nlohmann::json& choices);
+
+public:
+    // How often run() declines consent prompts that have waited past the consent timeout
+    static constexpr std::chrono::seconds EXPIRY_INTERVAL{ 1 };
+
+    // Loads the configuration; nothing is started until start()
+    QuickOpenApplication();
+    ~QuickOpenApplication();
+
+    // Starts the web and management servers
+    void start();
+    // Runs calls posted with CallAfter on the calling thread until stop()
+    void run();
+    // Callable from any thread
+    void stop();
+
+    // Loads the configuration file and applies it
+    void triggerConfigUpdate();
+    // Replaces the configuration, and tells the parts that keep settings of their own about the ones that changed
+    void applyConfig(AppConfig newConfig);
+
+    TrayStatusWindow* getTrayWindow()
+    {
+        return &activityLog;
+    }
+
+    void notifyUser(MessageSeverity severity, const wxString& title, const wxString& text);
+    // Opens a file that was received only to be opened, with the program registered for its type
+    void openReceivedFile(const wxFileName& fileName);
+
+    // Starts the web server on newPort, taking over the state of the one it replaces; that one keeps running
+    // for the transfers it started until they finish or serverHandoffTimeoutSeconds pass
+    void setupServer(unsigned newPort);
+
+    // The result is whether opening was allowed, and whether the approver asked to ban the requester
+    GUITask<std::pair<bool, bool>> promptForWebpageOpen(std::string URL, const wxString& requesterName,
+                                                        std::chrono::steady_clock::time_point deadline);
+
+    // Queues the request for approval; onDecision is called from whichever thread answers it, or declines it
+    // once it has waited past deadline
+    void promptForFileSave(const wxFileName& defaultDestDir, const wxString& requesterName, std::shared_ptr<FileConsentRequestInfo> rqFileInfo,
+                           std::chrono::steady_clock::time_point deadline,
+                           std::function<void(std::pair<ConsentDialog::ResultCode, bool>)> onDecision);
+
+    std::shared_ptr<WriterReadersLock<AppConfig>> getConfigRef()
+    {
+        return configRef;
+    }
+
+    template<typename T>
+    void CallAfter(T&& callable)
+    {
+        {
+            std::lock_guard<std::mutex> lock(callMutex);
+            queuedCalls.emplace_back(std::forward<T>(callable));
+        }
+        callQueued.notify_one();
+    }
+};
+
+#endif //QUICKOPEN_DAEMONAPP_H
@@ -0,0 +1,190 @@
+//
+// Entry point of the headless daemon. It runs in the foreground as service managers expect: SIGHUP reloads the
+// configuration, SIGTERM or SIGINT stops it, and systemd is told once it is ready. Run with an option instead, it
+// answers the consent prompts of the daemon that is already running.
+//
+
+#ifndef QUICKOPEN_DAEMON
+#error "The daemon entry point requires QUICKOPEN_DAEMON."
+#else
+#include "DaemonApp.h"
+#include "ManagementServer.h"
+
+#include <wx/init.h>
+
+#include <csignal>
+#include <iostream>
+#include <thread>
+
+static const char USAGE[] =
+    "Usage: QuickOpenDaemon [option]\n"
+    "Without an option, runs the daemon in the foreground.\n"
+    "  --pending            List the consent prompts waiting for an answer\n"
+    "  --approve ID         Accept a consent prompt\n"
+    "  --deny ID [--ban]    Decline a consent prompt, optionally banning its sender\n"
+    "  --reload             Make the running daemon reload its configuration\n"
+    "  --help               Show this message\n";
+
+static void printPendingPrompts(const nlohmann::json& prompts)
+{
+    if (prompts.empty())
+    {
+        std::cout << "No consent prompts are waiting." << std::endl;
+        return;
+    }
+
+    for (const auto& prompt : prompts.get<std::vector<ConsentApprovalQueue::Prompt>>())
+    {
+        std::cout << prompt.id << "\t" << prompt.requester << "\t";
+        if (prompt.details.contains("url"))
+        {
+            std::cout << "open " << prompt.details["url"].get<std::string>();
+        }
+        else
+        {
+            std::cout << "save";
+            for (const auto& thisFile : prompt.details["files"])
+            {
+                std::cout << " \"" << thisFile["filename"].get<std::string>() << "\" (" << thisFile["fileSize"] << " bytes)";
+            }
+        }
+        std::cout << std::endl;
+    }
+}
+
+// Runs an option against the running daemon and returns the exit status
+static int runClientCommand(const std::vector<std::string>& args)
+{
+    std::string responseBody;
+    int statusCode;
+
+    if (args[0] == "--pending" && args.size() == 1)
+    {
+        statusCode = ManagementClient::sendRequest("GET", "/api/consent", "", &responseBody);
+        if (statusCode == 200)
+        {
+            printPendingPrompts(nlohmann::json::parse(responseBody));
+            return 0;
+        }
+    }
+    else if ((args[0] == "--approve" && args.size() == 2) || (args[0] == "--deny" && (args.size() == 2
+        || (args.size() == 3 && args[2] == "--ban"))))
+    {
+        uint64_t promptID;
+        try
+        {
+            size_t parsedLength;
+            promptID = std::stoull(args[1], &parsedLength);
+            if (parsedLength != args[1].size())
+            {
+                throw std::invalid_argument(args[1]);
+            }
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Invalid prompt ID \"" << args[1] << "\"." << std::endl;
+            return 2;
+        }
+
+        nlohmann::json answer = { {"id", promptID}, {"accept", args[0] == "--approve"}, {"ban", args.size() == 3} };
+        statusCode = ManagementClient::sendRequest("POST", "/api/consent", answer.dump(), &responseBody);
+        if (statusCode == 200)
+        {
+            return 0;
+        }
+    }
+    else if (args[0] == "--reload" && args.size() == 1)
+    {
+        statusCode = ManagementClient::sendRequest("POST", "/api/config/reload", "");
+        if (statusCode == 200)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        std::cerr << USAGE;
+        return (args[0] == "--help") ? 0 : 2;
+    }
+
+    if (statusCode != 0)
+    {
+        std::cerr << "The daemon answered with status " << statusCode << ": " << responseBody << std::endl;
+    }
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    // Only wxBase is initialized; there is no display to connect to
+    wxInitializer wxRuntime;
+    if (!wxRuntime.IsOk())
+    {
+        std::cerr << "ERROR: Could not initialize wxWidgets." << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (!args.empty())
+    {
+        mg_init_library(0);
+        int exitStatus;
+        try
+        {
+            exitStatus = runClientCommand(args);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "ERROR: Could not reach the running daemon: " << ex.what() << std::endl;
+            exitStatus = 1;
+        }
+        mg_exit_library();
+        return exitStatus;
+    }
+
+    // While the process is still small, and before the service signals are blocked, so that the helper stops
+    // along with the daemon
+    startSpawnHelper();
+    // Before any server thread starts, so that the signals are only taken by the thread waiting for them
+    blockServiceSignals();
+    mg_init_library(0);
+
+    {
+        QuickOpenApplication app;
+        try
+        {
+            app.start();
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "ERROR: Could not start the servers: " << ex.what() << std::endl;
+            mg_exit_library();
+            return 1;
+        }
+
+        std::thread signalThread([&app]
+        {
+            while (true)
+            {
+                if (waitForServiceSignal() == SIGHUP)
+                {
+                    app.CallAfter([&app] { app.triggerConfigUpdate(); });
+                }
+                else
+                {
+                    notifyServiceManager("STOPPING=1");
+                    app.stop();
+                    return;
+                }
+            }
+        });
+
+        notifyServiceManager("READY=1");
+        app.run();
+        signalThread.join();
+    }
+
+    mg_exit_library();
+    return 0;
+}
+#endif
@@ -0,0 +1,85 @@
+#include "DeltaTransfer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <thread>
+
+uint32_t DeltaTransfer::chooseBlockSize(unsigned long long baseSize)
+{
+	// Like rsync, grow the block size with the square root of the file size so that the signature stays small
+	static const uint32_t MIN_BLOCK_SIZE = 2048, MAX_BLOCK_SIZE = 128 * 1024;
+
+	auto blockSize = static_cast<uint32_t>(std::sqrt(static_cast<double>(baseSize)));
+	blockSize = (blockSize + 1023) & ~1023U;
+	return std::clamp(blockSize, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+}
+
+uint32_t DeltaTransfer::weakChecksum(const uint8_t* data, size_t length)
+{
+	uint32_t a = 0, b = 0;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		a += data[i];
+		b += static_cast<uint32_t>(length - i) * data[i];
+	}
+
+	return (a & 0xFFFF) | (b << 16);
+}
+
+std::string DeltaTransfer::strongChecksum(const uint8_t* data, size_t length)
+{
+	SHA256Hasher hasher;
+	hasher.update(data, length);
+	return hasher.finishHex().substr(0, 32);
+}
+
+DeltaTransfer::FileSignature DeltaTransfer::computeSignature(const wxFileName& baseFile)
+{
+	FileSignature signature;
+	signature.baseSize = baseFile.GetSize().GetValue();
+	signature.blockSize = chooseBlockSize(signature.baseSize);
+
+	size_t blockCount = (signature.baseSize + signature.blockSize - 1) / signature.blockSize;
+	signature.weakChecksums.resize(blockCount);
+	signature.strongChecksums.resize(blockCount);
+
+	size_t workerCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 16);
+	size_t blocksPerWorker = (blockCount + workerCount - 1) / std::max<size_t>(workerCount, 1);
+
+	std::vector<std::future<void>> workers;
+	for (size_t firstBlock = 0; firstBlock < blockCount; firstBlock += blocksPerWorker)
+	{
+		size_t endBlock = std::min(firstBlock + blocksPerWorker, blockCount);
+
+		workers.push_back(std::async(std::launch::async, [&signature, &baseFile, firstBlock, endBlock]
+		{
+			std::ifstream baseInput;
+			baseInput.exceptions(std::ifstream::badbit);
+#ifdef WIN32
+			baseInput.open(baseFile.GetFullPath().ToStdWstring(), std::ifstream::binary);
+#else
+			baseInput.open(baseFile.GetFullPath(), std::ifstream::binary);
+#endif
+			baseInput.seekg(static_cast<std::streamoff>(firstBlock) * signature.blockSize);
+
+			std::vector<uint8_t> blockBuffer(signature.blockSize);
+			for (size_t blockIndex = firstBlock; blockIndex < endBlock; ++blockIndex)
+			{
+				baseInput.read(reinterpret_cast<char*>(blockBuffer.data()), signature.blockSize);
+				size_t blockLength = baseInput.gcount();
+
+				signature.weakChecksums[blockIndex] = weakChecksum(blockBuffer.data(), blockLength);
+				signature.strongChecksums[blockIndex] = strongChecksum(blockBuffer.data(), blockLength);
+			}
+		}));
+	}
+
+	for (auto& thisWorker : workers)
+	{
+		thisWorker.get();
+	}
+
+	return signature;
+}
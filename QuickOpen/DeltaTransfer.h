@@ -0,0 +1,45 @@
+#pragma once
+
+#include "Utils.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// rsync-style delta transfer: the receiver describes an existing file as per-block checksums, and the sender
+// replies with a stream of literal data and references to blocks of that file.
+namespace DeltaTransfer
+{
+	// Record types of the delta body; integers are little-endian
+	enum RecordType : uint8_t
+	{
+		// followed by a uint32 length and that many bytes of data
+		LITERAL_RECORD = 1,
+		// followed by a uint32 index of a block of the base file
+		BLOCK_RECORD = 2
+	};
+
+	static constexpr uint32_t MAX_LITERAL_LENGTH = 1U << 24;
+
+	struct FileSignature
+	{
+		uint32_t blockSize = 0;
+		unsigned long long baseSize = 0;
+		std::vector<uint32_t> weakChecksums;
+		std::vector<std::string> strongChecksums;
+
+		NLOHMANN_DEFINE_TYPE_INTRUSIVE(FileSignature, blockSize, baseSize, weakChecksums, strongChecksums)
+	};
+
+	uint32_t chooseBlockSize(unsigned long long baseSize);
+
+	// rsync's weak checksum: a = sum of bytes, b = sum of (length - i) * byte, both mod 2^16.
+	// Written as plain reductions so the compiler can vectorize it.
+	uint32_t weakChecksum(const uint8_t* data, size_t length);
+
+	// First 128 bits of the block's SHA-256, as hex
+	std::string strongChecksum(const uint8_t* data, size_t length);
+
+	// Reads the file once, splitting the blocks across worker threads
+	FileSignature computeSignature(const wxFileName& baseFile);
+}
@@ -0,0 +1,152 @@
+#include "DiskSpaceLedger.h"
+#include "PlatformUtils.h"
+
+#include <iostream>
+#include <system_error>
+
+DiskSpaceLedger::DiskSpaceLedger(SpaceSource spaceSource) :
+	spaceSource(spaceSource ? std::move(spaceSource) : SpaceSource(getFilesystemSpace))
+{}
+
+std::optional<FilesystemSpace> DiskSpaceLedger::querySpace(const wxFileName& destination)
+{
+	wxFileName folder = wxFileName::DirName(destination.GetPath());
+	while (!folder.DirExists() && folder.GetDirCount() > 0)
+	{
+		folder.RemoveLastDir();
+	}
+
+	try
+	{
+		return spaceSource(folder);
+	}
+	catch (const std::system_error& ex)
+	{
+		std::cerr << "WARNING: Couldn't find the free space in \"" << folder.GetPath() << "\": " << ex.what() << std::endl;
+		return std::nullopt;
+	}
+}
+
+void DiskSpaceLedger::releaseExpired(std::chrono::steady_clock::time_point now)
+{
+	for (auto reservationIt = reservations.begin(); reservationIt != reservations.end();)
+	{
+		auto thisReservation = reservationIt++;
+		if (thisReservation->second.expiresAt <= now)
+		{
+			releaseLocked(thisReservation);
+		}
+	}
+}
+
+void DiskSpaceLedger::releaseLocked(std::map<std::pair<uint64_t, size_t>, Reservation>::iterator reservationIt)
+{
+	const Reservation& reservation = reservationIt->second;
+	auto reservedIt = reservedBytes.find(reservation.filesystemID);
+	reservedIt->second -= reservation.bytes;
+	if (reservedIt->second == 0)
+	{
+		reservedBytes.erase(reservedIt);
+	}
+
+	globalStats().reservedBytes -= reservation.bytes;
+	reservations.erase(reservationIt);
+}
+
+std::optional<DiskSpaceLedger::Shortfall> DiskSpaceLedger::reserve(uint64_t owner, const std::vector<FileReservation>& files,
+	unsigned long long safetyMargin, std::chrono::steady_clock::time_point expiresAt)
+{
+	std::lock_guard<std::mutex> lock(ledgerMutex);
+	releaseExpired(std::chrono::steady_clock::now());
+
+	struct FilesystemDemand
+	{
+		FilesystemSpace space;
+		wxFileName folder;
+		unsigned long long bytes = 0;
+	};
+
+	// Files going to the same filesystem are checked against its space together
+	std::map<std::string, FilesystemDemand> demands;
+	std::vector<std::pair<size_t, Reservation>> newReservations;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (files[i].bytes == 0)
+		{
+			continue;
+		}
+
+		auto space = querySpace(files[i].destination);
+		if (!space)
+		{
+			continue;
+		}
+
+		auto& demand = demands[space->filesystemID];
+		if (demand.bytes == 0)
+		{
+			demand.space = *space;
+			demand.folder = wxFileName::DirName(files[i].destination.GetPath());
+		}
+
+		demand.bytes += files[i].bytes;
+		newReservations.push_back({ i, { space->filesystemID, files[i].bytes, expiresAt } });
+	}
+
+	for (const auto& [filesystemID, demand] : demands)
+	{
+		unsigned long long unavailableBytes = reservedBytes[filesystemID] + safetyMargin;
+		unsigned long long usableBytes = (demand.space.availableBytes > unavailableBytes) ? demand.space.availableBytes - unavailableBytes : 0;
+
+		if (demand.bytes > usableBytes)
+		{
+			++globalStats().refusedRequests;
+			return Shortfall{ demand.folder, demand.bytes, usableBytes };
+		}
+	}
+
+	for (const auto& [fileIndex, reservation] : newReservations)
+	{
+		reservedBytes[reservation.filesystemID] += reservation.bytes;
+		globalStats().reservedBytes += reservation.bytes;
+		reservations[{ owner, fileIndex }] = reservation;
+	}
+
+	return std::nullopt;
+}
+
+void DiskSpaceLedger::hold(uint64_t owner, size_t fileIndex)
+{
+	std::lock_guard<std::mutex> lock(ledgerMutex);
+
+	auto reservationIt = reservations.find({ owner, fileIndex });
+	if (reservationIt != reservations.end())
+	{
+		reservationIt->second.expiresAt = std::chrono::steady_clock::time_point::max();
+	}
+}
+
+void DiskSpaceLedger::release(uint64_t owner, size_t fileIndex)
+{
+	std::lock_guard<std::mutex> lock(ledgerMutex);
+
+	auto reservationIt = reservations.find({ owner, fileIndex });
+	if (reservationIt != reservations.end())
+	{
+		releaseLocked(reservationIt);
+	}
+}
+
+unsigned long long DiskSpaceLedger::reservedOn(const wxFileName& folder)
+{
+	auto space = querySpace(folder);
+
+	std::lock_guard<std::mutex> lock(ledgerMutex);
+	releaseExpired(std::chrono::steady_clock::now());
+	if (!space || reservedBytes.count(space->filesystemID) == 0)
+	{
+		return 0;
+	}
+
+	return reservedBytes.at(space->filesystemID);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <wx/filename.h>
+
+#include "Utils.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Keeps track of the disk space promised to uploads that have been consented to but not finished, so that
+// requests are turned away up front when their files can't fit alongside the uploads already promised space,
+// instead of failing partway through with the disk full. Free space is checked per filesystem, less what is
+// reserved on it and a safety margin left for everything else on the system. Space is held until each file's
+// upload ends, or until the reservation expires for a file whose upload hasn't started by then; while a file is
+// being written, its data is counted both as reserved and as used, which errs on the side of refusing.
+class DiskSpaceLedger
+{
+public:
+	typedef std::function<FilesystemSpace(const wxFileName& folder)> SpaceSource;
+
+	struct FileReservation
+	{
+		// The file's destination; the space is taken from the filesystem of its folder
+		wxFileName destination;
+		// 0 for files that don't need space, e.g. ones that were deduplicated
+		unsigned long long bytes;
+	};
+
+	// Why a reservation was refused
+	struct Shortfall
+	{
+		wxFileName folder;
+		unsigned long long requiredBytes,
+			// What is left after other reservations and the safety margin
+			usableBytes;
+	};
+
+	// Totals across all ledgers, for metrics
+	struct GlobalStats
+	{
+		std::atomic<unsigned long long> reservedBytes = 0,
+			refusedRequests = 0;
+	};
+
+private:
+	struct Reservation
+	{
+		std::string filesystemID;
+		unsigned long long bytes;
+		std::chrono::steady_clock::time_point expiresAt;
+	};
+
+	SpaceSource spaceSource;
+
+	std::mutex ledgerMutex;
+	std::map<std::pair<uint64_t, size_t>, Reservation> reservations;
+	std::map<std::string, unsigned long long> reservedBytes;
+
+	// Examines the nearest folder of destination that exists, since the destination's own folder may be created later
+	std::optional<FilesystemSpace> querySpace(const wxFileName& destination);
+	// Called with ledgerMutex held
+	void releaseExpired(std::chrono::steady_clock::time_point now);
+	void releaseLocked(std::map<std::pair<uint64_t, size_t>, Reservation>::iterator reservationIt);
+
+public:
+	// spaceSource defaults to getFilesystemSpace
+	explicit DiskSpaceLedger(SpaceSource spaceSource = {});
+
+	// Reserves space for all of owner's files, whose indices are their positions in files, or for none of them.
+	// Files whose filesystem can't be examined are let through, since writing them will report the problem.
+	// The space of files that haven't been held by expiresAt is given back then.
+	std::optional<Shortfall> reserve(uint64_t owner, const std::vector<FileReservation>& files, unsigned long long safetyMargin,
+		std::chrono::steady_clock::time_point expiresAt = std::chrono::steady_clock::time_point::max());
+	// Keeps a file's space past its expiry while its upload runs; does nothing if it holds none
+	void hold(uint64_t owner, size_t fileIndex);
+	// Returns a file's space once its upload has ended or been abandoned; does nothing if it holds none
+	void release(uint64_t owner, size_t fileIndex);
+
+	// Bytes reserved on the filesystem holding folder, which is given as a folder name (wxFileName::DirName)
+	unsigned long long reservedOn(const wxFileName& folder);
+
+	static GlobalStats& globalStats()
+	{
+		static GlobalStats instance;
+		return instance;
+	}
+};
@@ -0,0 +1,151 @@
+#include "EphemeralStore.h"
+
+#include "PlatformUtils.h"
+
+#include <wx/dir.h>
+#include <wx/process.h>
+#include <wx/utils.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+
+bool EphemeralReceivePolicy::appliesTo(const wxString& filename, unsigned long long fileSize) const
+{
+	if (!fits(fileSize))
+	{
+		return false;
+	}
+
+	wxFileName fileName(filename);
+	for (const auto& extension : extensions)
+	{
+		if (fileName.GetExt().IsSameAs(extension, false))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Errors are only reported, since a file that can't be deleted now is deleted with the rest of the store later
+static void removeFolder(const wxFileName& folder)
+{
+	std::error_code error;
+	std::filesystem::remove_all(std::filesystem::u8path(std::string(folder.GetPath().ToUTF8())), error);
+	if (error)
+	{
+		std::cerr << "WARNING: Couldn't delete received files in \"" << folder.GetPath() << "\": " << error.message() << std::endl;
+	}
+}
+
+// Resolves "." and ".." and makes a path absolute, so that paths can be compared
+static const int NORMALIZE_FLAGS = wxPATH_NORM_DOTS | wxPATH_NORM_ABSOLUTE | wxPATH_NORM_TILDE;
+
+// Deletes the folders of stores whose process is no longer running, left over from runs that didn't exit cleanly
+static void removeStaleStores(const wxFileName& rootFolder)
+{
+	wxDir rootDir(rootFolder.GetPath());
+	if (!rootDir.IsOpened())
+	{
+		return;
+	}
+
+	std::vector<wxString> staleFolders;
+	wxString folderName;
+	for (bool found = rootDir.GetFirst(&folderName, wxEmptyString, wxDIR_DIRS | wxDIR_HIDDEN); found; found = rootDir.GetNext(&folderName))
+	{
+		// Anything not named like a store's folder is from an older version, which kept files directly in rootFolder
+		long ownerProcessID;
+		if (!folderName.Contains(wxT(".")) || !folderName.BeforeFirst(wxT('.')).ToLong(&ownerProcessID)
+			|| !wxProcess::Exists(static_cast<int>(ownerProcessID)))
+		{
+			staleFolders.push_back(folderName);
+		}
+	}
+
+	for (const auto& staleFolder : staleFolders)
+	{
+		removeFolder(rootFolder / wxFileName(staleFolder, ""));
+	}
+}
+
+EphemeralStore::EphemeralStore(const wxFileName& rootFolder)
+{
+	wxFileName normalizedRoot(rootFolder);
+	normalizedRoot.Normalize(NORMALIZE_FLAGS);
+	removeStaleStores(normalizedRoot);
+
+	storeFolder = normalizedRoot / wxFileName(wxString() << wxGetProcessId() << wxT(".") << generateCryptoRandomInteger<uint32_t>(), "");
+	if (!storeFolder.Mkdir(0700, wxPATH_MKDIR_FULL))
+	{
+		std::cerr << "WARNING: Couldn't create \"" << storeFolder.GetPath() << "\" for files that are only opened." << std::endl;
+	}
+
+	sweeper = std::thread([this] { runSweeper(); });
+}
+
+EphemeralStore::~EphemeralStore()
+{
+	{
+		std::lock_guard<std::mutex> lock(storeMutex);
+		stopping = true;
+	}
+	entriesChanged.notify_all();
+	sweeper.join();
+
+	removeFolder(storeFolder);
+}
+
+void EphemeralStore::runSweeper()
+{
+	std::unique_lock<std::mutex> lock(storeMutex);
+	while (!stopping)
+	{
+		if (entries.empty())
+		{
+			entriesChanged.wait(lock);
+			continue;
+		}
+
+		if (entries.front().expiry > std::chrono::steady_clock::now())
+		{
+			entriesChanged.wait_until(lock, entries.front().expiry);
+			continue;
+		}
+
+		wxFileName expiredFolder = entries.front().folder;
+		entries.pop_front();
+
+		lock.unlock();
+		removeFolder(expiredFolder);
+		lock.lock();
+	}
+}
+
+wxFileName EphemeralStore::allocate(const wxString& filename, std::chrono::minutes lifetime)
+{
+	wxFileName folder = storeFolder / wxFileName(wxString() << generateCryptoRandomInteger<uint32_t>(), "");
+	folder.Mkdir(0700, wxPATH_MKDIR_FULL);
+
+	{
+		std::lock_guard<std::mutex> lock(storeMutex);
+		Entry newEntry{ std::chrono::steady_clock::now() + lifetime, folder };
+		auto insertPos = std::upper_bound(entries.begin(), entries.end(), newEntry, [](const Entry& lhs, const Entry& rhs)
+		{
+			return lhs.expiry < rhs.expiry;
+		});
+		entries.insert(insertPos, newEntry);
+	}
+	entriesChanged.notify_all();
+
+	return folder / wxFileName("", filename);
+}
+
+bool EphemeralStore::contains(const wxFileName& file) const
+{
+	wxFileName normalizedFile(file);
+	normalizedFile.Normalize(NORMALIZE_FLAGS);
+	return normalizedFile.GetFullPath().StartsWith(storeFolder.GetPathWithSep());
+}
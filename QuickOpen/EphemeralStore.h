@@ -0,0 +1,79 @@
+#pragma once
+
+#include <wx/filename.h>
+
+#include <nlohmann/json.hpp>
+
+#include "Utils.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// When files are received only to be opened (e.g. a PDF to print) instead of being saved
+struct EphemeralReceivePolicy
+{
+	// Larger files are always saved normally, since ephemeral files are kept in memory where possible
+	unsigned long long maxFileSize = 64ULL << 20;
+	// Files with these extensions (without the dot) are received this way unless the user chooses otherwise
+	std::vector<wxString> extensions;
+	// How long a file is kept for the program opening it
+	unsigned lifetimeMinutes = 30;
+
+	bool fits(unsigned long long fileSize) const
+	{
+		return fileSize <= maxFileSize;
+	}
+
+	// Whether a file should be received ephemerally without being asked for
+	bool appliesTo(const wxString& filename, unsigned long long fileSize) const;
+
+	NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(EphemeralReceivePolicy, maxFileSize, extensions, lifetimeMinutes)
+};
+
+// Holds files received only to be opened, in a folder of its own under getEphemeralFolder(), and deletes each
+// one once its lifetime is up. Each file gets a folder of its own, so that it keeps its name (which programs may
+// go by) without clashing with others. The store's folder is deleted when the store is destroyed; the folders
+// of stores whose process has exited without doing so are deleted when another store is created.
+class EphemeralStore
+{
+	struct Entry
+	{
+		std::chrono::steady_clock::time_point expiry;
+		wxFileName folder;
+	};
+
+	// Named "<process ID>.<random number>", so that stores in the same process or in other processes that share
+	// rootFolder (e.g. a daemon and a GUI run by the same user) leave each other alone
+	wxFileName storeFolder;
+
+	std::mutex storeMutex;
+	std::condition_variable entriesChanged;
+	// Ordered by expiry
+	std::deque<Entry> entries;
+	bool stopping = false;
+	std::thread sweeper;
+
+	void runSweeper();
+
+public:
+	explicit EphemeralStore(const wxFileName& rootFolder);
+	~EphemeralStore();
+
+	EphemeralStore(const EphemeralStore&) = delete;
+	EphemeralStore& operator=(const EphemeralStore&) = delete;
+
+	// Returns where to receive a file called filename, which is deleted after lifetime
+	wxFileName allocate(const wxString& filename, std::chrono::minutes lifetime);
+
+	// Whether file is kept in this store
+	bool contains(const wxFileName& file) const;
+
+	const wxFileName& getFolder() const
+	{
+		return storeFolder;
+	}
+};
@@ -0,0 +1,157 @@
+#pragma once
+// Calls from server threads onto the GUI thread. The caller gets a GUITask that it can wait on with a deadline
+// and cancel once it stops caring about the result, e.g. because its client disconnected. A cancelled call
+// that the GUI thread hasn't started is skipped; one that already started runs to completion, but nothing
+// waits for it any more.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+// How long calls wait in the GUI thread's queue before it gets to them
+class GUIQueueLatency
+{
+	std::atomic<unsigned long long> callCount = 0,
+		totalMicroseconds = 0,
+		maxMicroseconds = 0;
+
+public:
+	struct Snapshot
+	{
+		unsigned long long callCount, totalMicroseconds, maxMicroseconds;
+	};
+
+	void record(std::chrono::steady_clock::duration queueDelay)
+	{
+		auto microseconds = static_cast<unsigned long long>(
+			std::chrono::duration_cast<std::chrono::microseconds>(queueDelay).count());
+
+		++callCount;
+		totalMicroseconds += microseconds;
+
+		unsigned long long previousMax = maxMicroseconds;
+		while (previousMax < microseconds && !maxMicroseconds.compare_exchange_weak(previousMax, microseconds))
+		{
+		}
+	}
+
+	Snapshot snapshot() const
+	{
+		return { callCount, totalMicroseconds, maxMicroseconds };
+	}
+
+	static GUIQueueLatency& global()
+	{
+		static GUIQueueLatency instance;
+		return instance;
+	}
+};
+
+template<typename ResultType>
+class GUITask
+{
+public:
+	struct State
+	{
+		std::mutex stateMutex;
+		std::condition_variable finishedFlag;
+		std::optional<ResultType> result;
+		std::exception_ptr error;
+		bool started = false,
+			finished = false,
+			cancelled = false;
+	};
+
+private:
+	std::shared_ptr<State> state;
+
+	// Called with stateMutex held, once the call has finished
+	std::optional<ResultType> takeResult()
+	{
+		if (state->error)
+		{
+			std::rethrow_exception(state->error);
+		}
+
+		return state->result;
+	}
+
+public:
+	explicit GUITask(std::shared_ptr<State> state) : state(std::move(state))
+	{}
+
+	// Returns the result, or nothing if the deadline passed first. Rethrows an exception thrown by the call.
+	std::optional<ResultType> waitUntil(std::chrono::steady_clock::time_point deadline)
+	{
+		std::unique_lock<std::mutex> lock(state->stateMutex);
+		if (!state->finishedFlag.wait_until(lock, deadline, [this] { return state->finished; }))
+		{
+			return std::nullopt;
+		}
+
+		return takeResult();
+	}
+
+	ResultType get()
+	{
+		std::unique_lock<std::mutex> lock(state->stateMutex);
+		state->finishedFlag.wait(lock, [this] { return state->finished; });
+
+		return *takeResult();
+	}
+
+	// Returns true if the call will not run, or false if the GUI thread has already started it
+	bool cancel()
+	{
+		std::lock_guard<std::mutex> lock(state->stateMutex);
+		state->cancelled = true;
+		return !state->started;
+	}
+};
+
+template<typename AppType, typename FuncType>
+auto callOnGUIThread(AppType& app, FuncType func) -> GUITask<decltype(func())>
+{
+	typedef typename GUITask<decltype(func())>::State StateType;
+	auto state = std::make_shared<StateType>();
+	auto queuedTime = std::chrono::steady_clock::now();
+
+	app.CallAfter([state, func, queuedTime]
+	{
+		GUIQueueLatency::global().record(std::chrono::steady_clock::now() - queuedTime);
+
+		{
+			std::lock_guard<std::mutex> lock(state->stateMutex);
+			if (state->cancelled)
+			{
+				return;
+			}
+
+			state->started = true;
+		}
+
+		std::optional<decltype(func())> result;
+		std::exception_ptr error;
+		try
+		{
+			result = func();
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> lock(state->stateMutex);
+		state->result = std::move(result);
+		state->error = error;
+		state->finished = true;
+		state->finishedFlag.notify_all();
+	});
+
+	return GUITask<decltype(func())>(state);
+}
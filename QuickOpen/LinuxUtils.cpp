@@ -2,19 +2,41 @@
 // Created by sdk on 8/30/21.
 //
 
+#include <wx/cmdline.h>
 #include <wx/stdpaths.h>
 
 #include "LinuxUtils.h"
 #include "Utils.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <csignal>
 #include <ifaddrs.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
 #include <arpa/inet.h>
+#include <algorithm>
 #include <climits>
+#include <condition_variable>
+#include <cstring>
 
 #include <regex>
 #include <set>
 #include <iostream>
+#include <optional>
 
 void handleLinuxSystemError(bool errCond)
 {
@@ -52,42 +74,635 @@ wxFileName getAppExecutablePath()
 //    }
 //}
 
+namespace
+{
+    // Waits for the programs this process starts once they exit, so that they don't linger as zombies. Nothing
+    // wants their exit statuses, and they tend to run for a long time (a browser, say), so checking on them every
+    // REAP_INTERVAL is plenty.
+    class ChildReaper
+    {
+        static constexpr std::chrono::seconds REAP_INTERVAL{ 1 };
+
+        std::mutex childrenMutex;
+        std::condition_variable childrenChanged;
+        std::vector<pid_t> children;
+        bool stopping = false;
+        std::thread reapThread;
+
+        void reapLoop()
+        {
+            std::unique_lock<std::mutex> lock(childrenMutex);
+            while (!stopping)
+            {
+                children.erase(std::remove_if(children.begin(), children.end(), [](pid_t child)
+                {
+                    pid_t waitResult = waitpid(child, nullptr, WNOHANG);
+                    // ECHILD means someone else has already waited for it
+                    return waitResult == child || (waitResult == -1 && errno == ECHILD);
+                }), children.end());
+
+                if (children.empty())
+                {
+                    childrenChanged.wait(lock);
+                }
+                else
+                {
+                    childrenChanged.wait_for(lock, REAP_INTERVAL);
+                }
+            }
+        }
+
+    public:
+        ChildReaper() : reapThread(&ChildReaper::reapLoop, this)
+        {}
+
+        ~ChildReaper()
+        {
+            {
+                std::lock_guard<std::mutex> lock(childrenMutex);
+                stopping = true;
+            }
+
+            childrenChanged.notify_all();
+            reapThread.join();
+        }
+
+        void add(pid_t child)
+        {
+            {
+                std::lock_guard<std::mutex> lock(childrenMutex);
+                children.push_back(child);
+            }
+
+            childrenChanged.notify_all();
+        }
+
+        static ChildReaper& global()
+        {
+            static ChildReaper instance;
+            return instance;
+        }
+    };
+
+    // A request to the spawn helper is a single message holding a SpawnRequestHeader followed by the working
+    // directory, the program and its arguments, and the environment, each ending in a null character, along with
+    // the descriptor for the program's standard input (SCM_RIGHTS) when it has one. The helper was forked before
+    // the application started, so the working directory and environment are sent along with every request for
+    // programs to get the application's current ones rather than those it started with.
+    constexpr size_t SPAWN_REQUEST_MAX = 64 * 1024,
+        SPAWN_MAX_ARGS = 1024,
+        SPAWN_MAX_ENVIRONMENT = 4096;
+
+    struct SpawnRequestHeader
+    {
+        uint32_t argCount;
+        uint32_t environmentCount;
+    };
+
+    struct SpawnReply
+    {
+        pid_t processID;
+        // The errno value from starting the program, or 0
+        int error;
+    };
+
+    std::mutex spawnHelperMutex;
+    int spawnHelperSocket = -1;
+    pid_t spawnHelperPID = -1;
+
+    // Signals this process ignores (SIGPIPE, and SIGCHLD in the spawn helper) or blocks (the daemon's service
+    // signals) would otherwise stay that way in the programs it starts
+    void resetSignalsForExec()
+    {
+        struct sigaction defaultAction = {};
+        defaultAction.sa_handler = SIG_DFL;
+        sigaction(SIGPIPE, &defaultAction, nullptr);
+        sigaction(SIGCHLD, &defaultAction, nullptr);
+
+        sigset_t noSignals;
+        sigemptyset(&noSignals);
+        sigprocmask(SIG_SETMASK, &noSignals, nullptr);
+    }
+
+    // Closes every descriptor from firstFD up other than keptFD
+    void closeDescriptorsFrom(int firstFD, int keptFD)
+    {
+#ifdef SYS_close_range
+        if ((keptFD <= firstFD || syscall(SYS_close_range, firstFD, keptFD - 1, 0) == 0)
+            && syscall(SYS_close_range, std::max(firstFD, keptFD + 1), ~0U, 0) == 0)
+        {
+            return;
+        }
+#endif
+
+        for (int fd = firstFD; fd < 1024; ++fd)
+        {
+            if (fd != keptFD)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    // Starts a program from the spawn helper, with the helper's environment. vfork() leaves the child running on
+    // the helper's memory until the exec, so the child can report a failed exec through execError.
+    SpawnReply vforkExec(char* const argv[], const char* workingDirectory, int inputFD)
+    {
+        volatile int execError = 0;
+        pid_t childPID = vfork();
+        if (childPID == 0)
+        {
+            if ((inputFD != -1 && dup2(inputFD, STDIN_FILENO) == -1) || chdir(workingDirectory) == -1)
+            {
+                execError = errno;
+                _exit(127);
+            }
+
+            resetSignalsForExec();
+            execvp(argv[0], argv);
+            execError = errno;
+            _exit(127);
+        }
+
+        if (childPID == -1)
+        {
+            return { -1, errno };
+        }
+
+        // A child whose exec failed has already exited, and is reaped along with the rest
+        return (execError == 0) ? SpawnReply{ childPID, 0 } : SpawnReply{ -1, execError };
+    }
+
+    // The spawn helper's main loop, which runs in a child forked by startSpawnHelper(). It only makes
+    // async-signal-safe calls (no allocation in particular), since the process it was forked from may have had
+    // other threads holding locks that will never be released in this copy.
+    [[noreturn]] void spawnHelperLoop(int socketFD)
+    {
+        static char request[SPAWN_REQUEST_MAX];
+        static char* argv[SPAWN_MAX_ARGS + 1];
+        static char* environment[SPAWN_MAX_ENVIRONMENT + 1];
+
+        // Descriptors the application had open without O_CLOEXEC aren't the programs' business
+        closeDescriptorsFrom(STDERR_FILENO + 1, socketFD);
+
+        // The kernel reaps the programs once they exit
+        struct sigaction noChildWait = {};
+        noChildWait.sa_handler = SIG_IGN;
+        noChildWait.sa_flags = SA_NOCLDWAIT;
+        sigaction(SIGCHLD, &noChildWait, nullptr);
+
+        while (true)
+        {
+            iovec requestData = { request, sizeof(request) };
+            alignas(cmsghdr) char controlBuffer[CMSG_SPACE(sizeof(int))];
+            msghdr message = {};
+            message.msg_iov = &requestData;
+            message.msg_iovlen = 1;
+            message.msg_control = controlBuffer;
+            message.msg_controllen = sizeof(controlBuffer);
+
+            ssize_t requestLength = recvmsg(socketFD, &message, MSG_CMSG_CLOEXEC);
+            if (requestLength < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if (requestLength <= 0)
+            {
+                // The application has exited
+                _exit(0);
+            }
+
+            int inputFD = -1;
+            cmsghdr* control = CMSG_FIRSTHDR(&message);
+            if (control != nullptr && control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_RIGHTS)
+            {
+                memcpy(&inputFD, CMSG_DATA(control), sizeof(int));
+            }
+
+            SpawnRequestHeader header = {};
+            bool validRequest = !(message.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+                && requestLength > static_cast<ssize_t>(sizeof(header)) && request[requestLength - 1] == '\0';
+            if (validRequest)
+            {
+                memcpy(&header, request, sizeof(header));
+                validRequest = header.argCount >= 1 && header.argCount <= SPAWN_MAX_ARGS
+                    && header.environmentCount <= SPAWN_MAX_ENVIRONMENT;
+            }
+
+            const char* workingDirectory = nullptr;
+            size_t stringCount = 0;
+            for (ssize_t i = sizeof(header); validRequest && i < requestLength; i += strlen(request + i) + 1)
+            {
+                if (stringCount == 0)
+                {
+                    workingDirectory = request + i;
+                }
+                else if (stringCount <= header.argCount)
+                {
+                    argv[stringCount - 1] = request + i;
+                }
+                else if (stringCount <= header.argCount + header.environmentCount)
+                {
+                    environment[stringCount - 1 - header.argCount] = request + i;
+                }
+                else
+                {
+                    validRequest = false;
+                }
+
+                ++stringCount;
+            }
+
+            SpawnReply reply = { -1, EINVAL };
+            if (validRequest && stringCount == 1 + header.argCount + header.environmentCount)
+            {
+                argv[header.argCount] = nullptr;
+                environment[header.environmentCount] = nullptr;
+
+                // Also makes execvp() look the program up on the application's PATH
+                environ = environment;
+                reply = vforkExec(argv, workingDirectory, inputFD);
+            }
+
+            if (inputFD != -1)
+            {
+                close(inputFD);
+            }
+
+            while (send(socketFD, &reply, sizeof(reply), MSG_NOSIGNAL) == -1 && errno == EINTR)
+            {
+            }
+        }
+    }
+
+    // Returns nothing if there is no spawn helper to ask (or the request is too big for it), so that the caller
+    // starts the program itself
+    std::optional<pid_t> spawnThroughHelper(const std::vector<std::string>& args, int inputFD)
+    {
+        // A working directory that has been removed can't be passed on, but is still inherited by a program
+        // started directly
+        char workingDirectory[PATH_MAX];
+        if (getcwd(workingDirectory, sizeof(workingDirectory)) == nullptr)
+        {
+            return std::nullopt;
+        }
+
+        SpawnRequestHeader header = { static_cast<uint32_t>(args.size()), 0 };
+        std::string request(sizeof(header), '\0');
+        request.append(workingDirectory, strlen(workingDirectory) + 1);
+        for (const auto& thisArg : args)
+        {
+            request.append(thisArg.c_str(), thisArg.size() + 1);
+        }
+
+        for (char** variable = environ; *variable != nullptr; ++variable)
+        {
+            request.append(*variable, strlen(*variable) + 1);
+            ++header.environmentCount;
+        }
+
+        if (request.size() > SPAWN_REQUEST_MAX || args.size() > SPAWN_MAX_ARGS
+            || header.environmentCount > SPAWN_MAX_ENVIRONMENT)
+        {
+            return std::nullopt;
+        }
+
+        memcpy(request.data(), &header, sizeof(header));
+
+        std::lock_guard<std::mutex> lock(spawnHelperMutex);
+        if (spawnHelperSocket == -1)
+        {
+            return std::nullopt;
+        }
+
+        iovec requestData = { request.data(), request.size() };
+        alignas(cmsghdr) char controlBuffer[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message = {};
+        message.msg_iov = &requestData;
+        message.msg_iovlen = 1;
+        if (inputFD != -1)
+        {
+            message.msg_control = controlBuffer;
+            message.msg_controllen = sizeof(controlBuffer);
+
+            cmsghdr* control = CMSG_FIRSTHDR(&message);
+            control->cmsg_level = SOL_SOCKET;
+            control->cmsg_type = SCM_RIGHTS;
+            control->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(control), &inputFD, sizeof(int));
+        }
+
+        ssize_t sendResult, receiveResult = 0;
+        SpawnReply reply = {};
+        while ((sendResult = sendmsg(spawnHelperSocket, &message, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+        {
+        }
+
+        if (sendResult != -1)
+        {
+            while ((receiveResult = recv(spawnHelperSocket, &reply, sizeof(reply), 0)) == -1 && errno == EINTR)
+            {
+            }
+        }
+
+        if (receiveResult != sizeof(reply))
+        {
+            std::cerr << "WARNING: The spawn helper has stopped; programs will be started directly from now on." << std::endl;
+            close(spawnHelperSocket);
+            spawnHelperSocket = -1;
+            ChildReaper::global().add(spawnHelperPID);
+            return std::nullopt;
+        }
+
+        if (reply.error != 0)
+        {
+            throw LinuxException(reply.error, strerror(reply.error));
+        }
+
+        return reply.processID;
+    }
+
+    // posix_spawn() doesn't copy this process's page tables the way fork() would, which matters once the
+    // process has grown large
+    pid_t spawnDirectly(std::vector<std::string>& args, int inputFD)
+    {
+        std::vector<char*> argv;
+        for (auto& thisArg : args)
+        {
+            argv.push_back(thisArg.data());
+        }
+
+        argv.push_back(nullptr);
+
+        sigset_t noSignals, allSignals;
+        sigemptyset(&noSignals);
+        sigfillset(&allSignals);
+
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setsigmask(&attributes, &noSignals);
+        posix_spawnattr_setsigdefault(&attributes, &allSignals);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+        posix_spawn_file_actions_t fileActions;
+        posix_spawn_file_actions_init(&fileActions);
+        if (inputFD != -1)
+        {
+            posix_spawn_file_actions_adddup2(&fileActions, inputFD, STDIN_FILENO);
+        }
+
+#if defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 34)
+        // Descriptors that libraries opened without O_CLOEXEC would otherwise leak into the program
+        posix_spawn_file_actions_addclosefrom_np(&fileActions, STDERR_FILENO + 1);
+#endif
+#endif
+
+        pid_t childPID;
+        int spawnResult = posix_spawnp(&childPID, argv[0], &fileActions, &attributes, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&fileActions);
+        posix_spawnattr_destroy(&attributes);
+
+        if (spawnResult != 0)
+        {
+            throw LinuxException(spawnResult, strerror(spawnResult));
+        }
+
+        ChildReaper::global().add(childPID);
+        return childPID;
+    }
+
+    pid_t spawnSubprocess(const wxString& exePath, const std::vector<wxString>& args, int inputFD)
+    {
+        std::vector<std::string> argStrings = { std::string(exePath.ToUTF8()) };
+        for (const auto& thisArg : args)
+        {
+            argStrings.emplace_back(thisArg.ToUTF8());
+        }
+
+        if (auto helperChildPID = spawnThroughHelper(argStrings, inputFD))
+        {
+            return *helperChildPID;
+        }
+
+        return spawnDirectly(argStrings, inputFD);
+    }
+}
+
+void startSpawnHelper()
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0)
+    {
+        std::cerr << "WARNING: Couldn't start the spawn helper: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    pid_t helperPID = fork();
+    if (helperPID == 0)
+    {
+        close(sockets[0]);
+        spawnHelperLoop(sockets[1]);
+    }
+
+    close(sockets[1]);
+    if (helperPID == -1)
+    {
+        std::cerr << "WARNING: Couldn't start the spawn helper: " << strerror(errno) << std::endl;
+        close(sockets[0]);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(spawnHelperMutex);
+    if (spawnHelperSocket != -1)
+    {
+        close(spawnHelperSocket);
+        ChildReaper::global().add(spawnHelperPID);
+    }
+
+    spawnHelperSocket = sockets[0];
+    spawnHelperPID = helperPID;
+}
+
+void stopSpawnHelper()
+{
+    std::lock_guard<std::mutex> lock(spawnHelperMutex);
+    if (spawnHelperSocket != -1)
+    {
+        // The helper exits once it sees the end of its requests
+        close(spawnHelperSocket);
+        spawnHelperSocket = -1;
+        ChildReaper::global().add(spawnHelperPID);
+    }
+}
+
 pid_t startSubprocess(const wxString& commandLine)
 {
-    return wxExecute(commandLine, wxEXEC_ASYNC);
+    // Split the way wxExecute would, and like it, report failure as 0
+    wxArrayString args = wxCmdLineParser::ConvertStringToArgs(commandLine, wxCMD_LINE_SPLIT_UNIX);
+    if (args.empty())
+    {
+        return 0;
+    }
+
+    try
+    {
+        return spawnSubprocess(args[0], std::vector<wxString>(args.begin() + 1, args.end()), -1);
+    }
+    catch (const LinuxException& ex)
+    {
+        std::cerr << "WARNING: Couldn't start \"" << args[0] << "\": " << ex.what() << std::endl;
+        return 0;
+    }
 }
 
 pid_t startSubprocess(const wxString& exePath, const std::vector<wxString>& args)
 {
-    pid_t childPID = fork();
-    handleLinuxSystemError(childPID == -1);
-    if(childPID == 0)
+    return spawnSubprocess(exePath, args, -1);
+}
+
+namespace
+{
+    // Holds back the SIGPIPE that writing to a reader which has exited raises on the calling thread, so that the
+    // write fails with EPIPE instead of taking the whole application down, without changing how the rest of the
+    // process handles the signal
+    class SIGPIPEBlocker
     {
-        char* argvArray[args.size() + 2];
-        argvArray[0] = strdup(exePath.ToUTF8());
+        sigset_t pipeSignal, previousMask;
+        bool alreadyPending;
 
-        for(unsigned i = 0; i < args.size(); ++i)
+    public:
+        SIGPIPEBlocker()
         {
-            argvArray[i + 1] = strdup(args[i].ToUTF8());
+            sigemptyset(&pipeSignal);
+            sigaddset(&pipeSignal, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipeSignal, &previousMask);
+
+            sigset_t pendingSignals;
+            sigpending(&pendingSignals);
+            alreadyPending = sigismember(&pendingSignals, SIGPIPE);
         }
 
-        argvArray[args.size() + 1] = nullptr;
+        ~SIGPIPEBlocker()
+        {
+            pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+        }
 
-        execvp(exePath.c_str(), argvArray);
-        try
+        // Discards the SIGPIPE raised by a write that failed with EPIPE, so it isn't delivered once unblocked
+        void discardRaised()
         {
-            handleLinuxSystemError(true); // If this point is reached, something went wrong.
+            if (alreadyPending)
+            {
+                return;
+            }
+
+            timespec noWait = { 0, 0 };
+            while (sigtimedwait(&pipeSignal, nullptr, &noWait) == -1 && errno == EINTR)
+            {}
+        }
+    };
+}
+
+PipeWriter::PipeWriter(int pipeFD) : pipeFD(pipeFD)
+{
+    // Writes wait in poll instead, so that they can give up on a reader that has stopped
+    int flags = fcntl(pipeFD, F_GETFL);
+    handleLinuxSystemError(flags == -1 || fcntl(pipeFD, F_SETFL, flags | O_NONBLOCK) == -1);
+}
+
+PipeWriter::~PipeWriter()
+{
+    close(pipeFD);
+}
+
+bool PipeWriter::write(const char* data, size_t length, std::chrono::milliseconds timeout)
+{
+    SIGPIPEBlocker pipeSignalBlocker;
+
+    while (length > 0)
+    {
+        // With SIGPIPE blocked, a reader that has exited shows up as EPIPE
+        ssize_t bytesWritten = ::write(pipeFD, data, length);
+        if (bytesWritten > 0)
+        {
+            data += bytesWritten;
+            length -= bytesWritten;
+            continue;
         }
-        catch(LinuxException& ex)
+
+        if (errno == EPIPE)
         {
-            std::cerr << "ERROR: Child process failed to load new program: " << ex.what() << std::endl;
+            pipeSignalBlocker.discardRaised();
+            return false;
         }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else if (errno != EAGAIN)
+        {
+            handleLinuxSystemError(true);
+        }
+
+        pollfd pipePoll = { pipeFD, POLLOUT, 0 };
+        int pollResult = poll(&pipePoll, 1, static_cast<int>(timeout.count()));
+        if (pollResult == 0 || (pollResult > 0 && (pipePoll.revents & (POLLERR | POLLHUP))))
+        {
+            return false;
+        }
+
+        handleLinuxSystemError(pollResult < 0 && errno != EINTR);
+    }
 
-        exit(1);
+    return true;
+}
+
+std::unique_ptr<PipeWriter> startSubprocessWithInput(const wxString& exePath, const std::vector<wxString>& args)
+{
+    int pipeFDs[2];
+    handleLinuxSystemError(pipe2(pipeFDs, O_CLOEXEC) != 0);
+
+    try
+    {
+        spawnSubprocess(exePath, args, pipeFDs[0]);
     }
-    else
+    catch (const LinuxException&)
     {
-        return childPID;
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+        throw;
+    }
+
+    close(pipeFDs[0]);
+    return std::make_unique<PipeWriter>(pipeFDs[1]);
+}
+
+void createFIFO(const wxFileName& path)
+{
+    handleLinuxSystemError(mkfifo(path.GetFullPath().ToUTF8(), S_IRUSR | S_IWUSR) != 0);
+}
+
+std::unique_ptr<PipeWriter> openFIFOWriter(const wxFileName& path, std::chrono::milliseconds timeout)
+{
+    static const std::chrono::milliseconds OPEN_RETRY_INTERVAL{ 50 };
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    while (true)
+    {
+        // Opening a FIFO for writing without blocking fails with ENXIO until there is a reader
+        int fifoFD = open(path.GetFullPath().ToUTF8(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fifoFD >= 0)
+        {
+            return std::make_unique<PipeWriter>(fifoFD);
+        }
+
+        handleLinuxSystemError(errno != ENXIO);
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            return nullptr;
+        }
+
+        std::this_thread::sleep_for(OPEN_RETRY_INTERVAL);
     }
 }
 
@@ -97,7 +712,14 @@ void shellExecuteFile(const wxFileName& filePath, const wxWindow* window)
     // const char* argv[2] = {  "xdg-open", filePathStr.c_str() };
     // wxExecute(argv, wxEXEC_ASYNC);
 
-    startSubprocess(wxT("xdg-open"), { filePath.GetFullPath() });
+    try
+    {
+        startSubprocess(wxT("xdg-open"), { filePath.GetFullPath() });
+    }
+    catch (const LinuxException& ex)
+    {
+        std::cerr << "WARNING: Couldn't start xdg-open to open \"" << filePath.GetFullPath() << "\": " << ex.what() << std::endl;
+    }
 }
 
 void openExplorerFolder(const wxFileName& folder, const wxFileName* selectedFile)
@@ -222,6 +844,433 @@ std::vector<WebBrowserInfo> getInstalledWebBrowsers()
     return results;
 }
 
+void cloneFileContents(const wxFileName& source, const wxFileName& dest)
+{
+    int sourceFD = open(source.GetFullPath().ToUTF8(), O_RDONLY | O_CLOEXEC);
+    handleLinuxSystemError(sourceFD == -1);
+
+    int destFD = open(dest.GetFullPath().ToUTF8(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(destFD == -1)
+    {
+        int errID = errno;
+        close(sourceFD);
+        throw LinuxException(errID, strerror(errID));
+    }
+
+    try
+    {
+        if(ioctl(destFD, FICLONE, sourceFD) != 0)
+        {
+            // Not a reflink-capable filesystem (or the files are on different filesystems); let the kernel
+            // copy the data without bouncing it through userspace.
+            struct stat sourceStat = {};
+            handleLinuxSystemError(fstat(sourceFD, &sourceStat) == -1);
+
+            off_t bytesRemaining = sourceStat.st_size;
+            while(bytesRemaining > 0)
+            {
+                ssize_t bytesCopied = copy_file_range(sourceFD, nullptr, destFD, nullptr, bytesRemaining, 0);
+
+                if(bytesCopied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL))
+                {
+                    char copyBuffer[1 << 16];
+                    ssize_t bytesRead;
+                    while((bytesRead = read(sourceFD, copyBuffer, sizeof(copyBuffer))) > 0)
+                    {
+                        handleLinuxSystemError(write(destFD, copyBuffer, bytesRead) != bytesRead);
+                    }
+                    handleLinuxSystemError(bytesRead == -1);
+                    break;
+                }
+
+                handleLinuxSystemError(bytesCopied == -1);
+                if(bytesCopied == 0)
+                {
+                    break;
+                }
+
+                bytesRemaining -= bytesCopied;
+            }
+        }
+    }
+    catch(const LinuxException&)
+    {
+        close(sourceFD);
+        close(destFD);
+        throw;
+    }
+
+    close(sourceFD);
+    handleLinuxSystemError(close(destFD) == -1);
+}
+
+FileSyncHandle::FileSyncHandle(const wxFileName& file)
+{
+    fileFD = open(file.GetFullPath().ToUTF8(), O_WRONLY | O_CLOEXEC);
+    handleLinuxSystemError(fileFD < 0);
+}
+
+FileSyncHandle::~FileSyncHandle()
+{
+    close(fileFD);
+}
+
+void FileSyncHandle::startWriteback(unsigned long long offset, unsigned long long length)
+{
+    handleLinuxSystemError(sync_file_range(fileFD, static_cast<off64_t>(offset), static_cast<off64_t>(length),
+        SYNC_FILE_RANGE_WRITE) != 0);
+}
+
+void FileSyncHandle::finishWriteback(unsigned long long offset, unsigned long long length)
+{
+    handleLinuxSystemError(sync_file_range(fileFD, static_cast<off64_t>(offset), static_cast<off64_t>(length),
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0);
+    posix_fadvise(fileFD, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_DONTNEED);
+}
+
+void FileSyncHandle::syncData()
+{
+    handleLinuxSystemError(fdatasync(fileFD) != 0);
+}
+
+void syncDirectory(const wxFileName& folder)
+{
+    wxString folderPath = folder.GetPath();
+    int folderFD = open(folderPath.empty() ? "." : static_cast<const char*>(folderPath.ToUTF8()), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    handleLinuxSystemError(folderFD < 0);
+
+    int result = fsync(folderFD);
+    int errorCode = errno;
+    close(folderFD);
+
+    errno = errorCode;
+    handleLinuxSystemError(result != 0);
+}
+
+FilesystemSpace getFilesystemSpace(const wxFileName& folder)
+{
+    wxString folderPath = folder.GetPath();
+    std::string folderPathUTF8 = folderPath.empty() ? std::string(".") : std::string(folderPath.ToUTF8());
+
+    struct statvfs filesystemInfo;
+    handleLinuxSystemError(statvfs(folderPathUTF8.c_str(), &filesystemInfo) != 0);
+
+    struct stat folderInfo;
+    handleLinuxSystemError(stat(folderPathUTF8.c_str(), &folderInfo) != 0);
+
+    // f_bavail leaves out the blocks reserved for root, which an upload can't use
+    return { std::to_string(folderInfo.st_dev),
+        static_cast<unsigned long long>(filesystemInfo.f_bavail) * filesystemInfo.f_frsize };
+}
+
+wxFileName getEphemeralFolder()
+{
+    wxString runtimeFolder;
+    if (wxGetEnv(wxT("XDG_RUNTIME_DIR"), &runtimeFolder) && !runtimeFolder.empty())
+    {
+        return wxFileName(runtimeFolder, "") / wxFileName("QuickOpen-Received", "");
+    }
+
+    return wxFileName(wxString() << wxT("/dev/shm/QuickOpen-Received-") << getuid(), "");
+}
+
+static sigset_t serviceSignalSet()
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    return signals;
+}
+
+void blockServiceSignals()
+{
+    sigset_t signals = serviceSignalSet();
+    int error = pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    if (error != 0)
+    {
+        throw std::system_error(error, std::system_category());
+    }
+}
+
+int waitForServiceSignal()
+{
+    sigset_t signals = serviceSignalSet();
+    int signalNumber;
+    int error;
+    while ((error = sigwait(&signals, &signalNumber)) == EINTR)
+    {
+    }
+
+    if (error != 0)
+    {
+        throw std::system_error(error, std::system_category());
+    }
+
+    return signalNumber;
+}
+
+void notifyServiceManager(const std::string& state)
+{
+    const char* socketPath = getenv("NOTIFY_SOCKET");
+    if (socketPath == nullptr || (socketPath[0] != '/' && socketPath[0] != '@'))
+    {
+        return;
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    size_t pathLength = strlen(socketPath);
+    if (pathLength >= sizeof(address.sun_path))
+    {
+        return;
+    }
+
+    memcpy(address.sun_path, socketPath, pathLength);
+    // A leading '@' stands for an abstract socket, whose name starts with a null byte
+    if (address.sun_path[0] == '@')
+    {
+        address.sun_path[0] = '\0';
+    }
+
+    int notifyFD = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (notifyFD < 0)
+    {
+        return;
+    }
+
+    if (sendto(notifyFD, state.data(), state.size(), MSG_NOSIGNAL, reinterpret_cast<sockaddr*>(&address),
+        static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + pathLength)) < 0)
+    {
+        std::cerr << "WARNING: Couldn't notify the service manager: " << strerror(errno) << std::endl;
+    }
+
+    close(notifyFD);
+}
+
+SharedMemoryRegion::SharedMemoryRegion(std::string name, void* memory, size_t size, bool owner) : name(std::move(name)),
+    memory(memory), size(size), owner(owner)
+{}
+
+SharedMemoryRegion::~SharedMemoryRegion()
+{
+    munmap(memory, size);
+    if (owner)
+    {
+        shm_unlink(name.c_str());
+    }
+}
+
+std::unique_ptr<SharedMemoryRegion> SharedMemoryRegion::create(const std::string& name, size_t size)
+{
+    // Readers that still have a stale region mapped keep it, while new ones find this one
+    shm_unlink(name.c_str());
+
+    int regionFD = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    handleLinuxSystemError(regionFD < 0);
+
+    void* memory = MAP_FAILED;
+    if (ftruncate(regionFD, static_cast<off_t>(size)) == 0)
+    {
+        memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, regionFD, 0);
+    }
+
+    int errID = errno;
+    close(regionFD);
+    if (memory == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        throw LinuxException(errID, strerror(errID));
+    }
+
+    return std::unique_ptr<SharedMemoryRegion>(new SharedMemoryRegion(name, memory, size, true));
+}
+
+std::unique_ptr<SharedMemoryRegion> SharedMemoryRegion::openReadOnly(const std::string& name, size_t size)
+{
+    int regionFD = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (regionFD < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat regionInfo{};
+    void* memory = MAP_FAILED;
+    if (fstat(regionFD, &regionInfo) == 0 && static_cast<size_t>(regionInfo.st_size) >= size)
+    {
+        memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, regionFD, 0);
+    }
+
+    close(regionFD);
+    if (memory == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    return std::unique_ptr<SharedMemoryRegion>(new SharedMemoryRegion(name, memory, size, false));
+}
+
+std::string userSharedMemoryName(const std::string& purpose)
+{
+    return "/QuickOpen-" + purpose + "-" + std::to_string(getuid());
+}
+
+bool processRunning(long processID)
+{
+    // EPERM means the process exists but belongs to someone else
+    return processID > 0 && (kill(static_cast<pid_t>(processID), 0) == 0 || errno == EPERM);
+}
+
+void applyThreadPriority(const ThreadPriority& priority)
+{
+    // ioprio_set has no glibc wrapper; these values are from linux/ioprio.h
+    static const int IOPRIO_WHO_PROCESS = 1,
+        IOPRIO_CLASS_BE = 2,
+        IOPRIO_CLASS_IDLE = 3,
+        IOPRIO_CLASS_SHIFT = 13,
+        IOPRIO_BE_LOWEST = 7;
+
+    // On Linux, both I/O priority and nice values apply to single threads when given a thread ID
+    auto threadID = static_cast<pid_t>(syscall(SYS_gettid));
+
+    int ioPriority = -1;
+    switch (priority.ioClass)
+    {
+    case ThreadPriority::IO_LOW:
+        ioPriority = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_BE_LOWEST;
+        break;
+    case ThreadPriority::IO_IDLE:
+        ioPriority = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+        break;
+    case ThreadPriority::IO_NORMAL:
+        break;
+    }
+
+    if (ioPriority >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, threadID, ioPriority) != 0)
+    {
+        std::cerr << "WARNING: Could not set thread I/O priority: " << std::strerror(errno) << std::endl;
+    }
+
+    if (priority.niceLevel > 0 && setpriority(PRIO_PROCESS, static_cast<id_t>(threadID), std::min(priority.niceLevel, 19)) != 0)
+    {
+        std::cerr << "WARNING: Could not set thread nice value: " << std::strerror(errno) << std::endl;
+    }
+
+    if (!priority.cpuAffinity.empty())
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        for (unsigned cpu : priority.cpuAffinity)
+        {
+            if (cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &cpuSet);
+            }
+        }
+
+        int errorCode = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (errorCode != 0)
+        {
+            std::cerr << "WARNING: Could not set thread CPU affinity: " << std::strerror(errorCode) << std::endl;
+        }
+    }
+}
+
+DirectoryChangeWatcher::DirectoryChangeWatcher(std::function<void(const wxFileName&)> onFileChanged):
+    onFileChanged(std::move(onFileChanged))
+{
+    inotifyFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    handleLinuxSystemError(inotifyFD == -1);
+
+    stopEventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(stopEventFD == -1)
+    {
+        int errID = errno;
+        close(inotifyFD);
+        throw LinuxException(errID, strerror(errID));
+    }
+
+    watchThread = std::thread(&DirectoryChangeWatcher::watchLoop, this);
+}
+
+DirectoryChangeWatcher::~DirectoryChangeWatcher()
+{
+    uint64_t stopValue = 1;
+    write(stopEventFD, &stopValue, sizeof(stopValue));
+    watchThread.join();
+
+    close(stopEventFD);
+    close(inotifyFD);
+}
+
+void DirectoryChangeWatcher::watchDirectory(const wxFileName& directory)
+{
+    int watchDescriptor = inotify_add_watch(inotifyFD, directory.GetFullPath().ToUTF8(),
+        IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    handleLinuxSystemError(watchDescriptor == -1);
+
+    std::lock_guard<std::mutex> lock(watchMutex);
+    watchedDirs[watchDescriptor] = directory;
+}
+
+void DirectoryChangeWatcher::watchLoop()
+{
+    pollfd pollFDs[2] = {
+        { inotifyFD, POLLIN, 0 },
+        { stopEventFD, POLLIN, 0 }
+    };
+
+    alignas(inotify_event) char eventBuffer[4096];
+
+    while(true)
+    {
+        if(poll(pollFDs, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        if(pollFDs[1].revents != 0)
+        {
+            break;
+        }
+
+        ssize_t bytesRead;
+        while((bytesRead = read(inotifyFD, eventBuffer, sizeof(eventBuffer))) > 0)
+        {
+            for(char* eventPtr = eventBuffer; eventPtr < eventBuffer + bytesRead;)
+            {
+                const auto* event = reinterpret_cast<const inotify_event*>(eventPtr);
+                eventPtr += sizeof(inotify_event) + event->len;
+
+                if(event->len == 0)
+                {
+                    continue;
+                }
+
+                wxFileName changedFile;
+                {
+                    std::lock_guard<std::mutex> lock(watchMutex);
+                    auto dirIter = watchedDirs.find(event->wd);
+                    if(dirIter == watchedDirs.end())
+                    {
+                        continue;
+                    }
+
+                    changedFile = wxFileName(dirIter->second.GetFullPath(), wxString::FromUTF8(event->name));
+                }
+
+                onFileChanged(changedFile);
+            }
+        }
+    }
+}
+
 InstallationInfo InstallationInfo::detectInstallation()
 {
 	wxFileName thisFolder = getAppExecutablePath();
@@ -10,6 +10,12 @@
 
 #include <fstream>
 #include <filesystem>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include "Utils.h"
 
@@ -22,10 +28,45 @@ public:
 
 void handleLinuxSystemError(bool errCond);
 
+// Programs are started with posix_spawn(), with default signal handling, only the standard descriptors and
+// nothing to wait for: they are reaped in the background once they exit. A program that can't be started
+// throws LinuxException, except through the command line version, which returns 0 as wxExecute does.
 // void startSubprocess(const wxString& executable, const std::vector<wxString>& args);
 pid_t startSubprocess(const wxString& commandLine);
 pid_t startSubprocess(const wxString& exePath, const std::vector<wxString>& args);
 
+// Forks a small helper process that starts programs on this one's behalf from then on, so that launching one
+// doesn't cost time in proportion to this process's memory. Best called first thing in main(), while the
+// process is still small; programs are started directly again if the helper goes away. Programs still get this
+// process's current working directory and environment, which are sent along with each of them.
+void startSpawnHelper();
+void stopSpawnHelper();
+
+// The writing end of a pipe or FIFO that a program reads from. The program sees the end of its input once
+// this is destroyed.
+class PipeWriter
+{
+    int pipeFD = -1;
+
+public:
+    explicit PipeWriter(int pipeFD);
+    ~PipeWriter();
+
+    PipeWriter(const PipeWriter&) = delete;
+    PipeWriter& operator=(const PipeWriter&) = delete;
+
+    // Returns false if the reader has gone away, or has taken none of the data for as long as timeout
+    bool write(const char* data, size_t length, std::chrono::milliseconds timeout);
+};
+
+// Starts exePath with args, reading its standard input from the returned pipe
+std::unique_ptr<PipeWriter> startSubprocessWithInput(const wxString& exePath, const std::vector<wxString>& args);
+
+// Makes a FIFO (named pipe) at path, for a program to be told to read from
+void createFIFO(const wxFileName& path);
+// Waits up to timeout for a program to open the FIFO at path for reading; returns nothing if none did
+std::unique_ptr<PipeWriter> openFIFOWriter(const wxFileName& path, std::chrono::milliseconds timeout);
+
 wxFileName getAppExecutablePath();
 void shellExecuteFile(const wxFileName& filePath, const wxWindow* window = nullptr);
 void openExplorerFolder(const wxFileName& folder, const wxFileName* selectedFile = nullptr);
@@ -92,6 +133,118 @@ T generateCryptoRandomInteger()
     return *reinterpret_cast<T*>(inputBytes);
 }
 
+// Copies a file's contents into a new file, sharing the source's extents (FICLONE) when the filesystem
+// supports it and falling back to an in-kernel copy otherwise
+void cloneFileContents(const wxFileName& source, const wxFileName& dest);
+
+// Regions of a file that are seeked over rather than written are left as holes on Linux filesystems, so there
+// is nothing to do up front
+inline void markFileSparse(const wxFileName& file)
+{}
+
+// A second handle on a file that is being written through a stream, for pushing its data to disk as it is
+// written instead of leaving it all to the kernel's writeback. Data must be flushed from the stream first.
+class FileSyncHandle
+{
+    int fileFD = -1;
+
+public:
+    explicit FileSyncHandle(const wxFileName& file);
+    ~FileSyncHandle();
+
+    FileSyncHandle(const FileSyncHandle&) = delete;
+    FileSyncHandle& operator=(const FileSyncHandle&) = delete;
+
+    // Starts writing back a range of the file without waiting for it (sync_file_range)
+    void startWriteback(unsigned long long offset, unsigned long long length);
+    // Waits for writeback of a range started earlier, then drops the range from the page cache, since an
+    // upload won't read it again
+    void finishWriteback(unsigned long long offset, unsigned long long length);
+    // Waits until all of the file's data is on disk (fdatasync)
+    void syncData();
+};
+
+// Makes file creations and renames in a folder durable
+void syncDirectory(const wxFileName& folder);
+
+// Throws LinuxException if the folder can't be examined
+FilesystemSpace getFilesystemSpace(const wxFileName& folder);
+
+// Where files received only to be opened are kept: the user's runtime folder, or /dev/shm without one. Both
+// are memory-backed (tmpfs) on most systems, so the files never reach the disk.
+wxFileName getEphemeralFolder();
+
+// Blocks SIGTERM, SIGINT and SIGHUP in the calling thread and the threads it starts afterwards, so that
+// waitForServiceSignal() can take them instead. Call before starting any threads.
+void blockServiceSignals();
+// Waits for one of the signals blocked by blockServiceSignals() and returns it
+int waitForServiceSignal();
+// Tells systemd about the service's state ("READY=1", "RELOADING=1", "STOPPING=1") through $NOTIFY_SOCKET;
+// does nothing when not started by systemd
+void notifyServiceManager(const std::string& state);
+
+#define PLATFORM_SHARED_MEMORY_SUPPORTED
+
+// A named block of memory (POSIX shared memory) that other processes of the same user can map
+class SharedMemoryRegion
+{
+    std::string name;
+    void* memory = nullptr;
+    size_t size = 0;
+    // The creator removes the name again once it is done with the region
+    bool owner = false;
+
+    SharedMemoryRegion(std::string name, void* memory, size_t size, bool owner);
+
+public:
+    ~SharedMemoryRegion();
+
+    SharedMemoryRegion(const SharedMemoryRegion&) = delete;
+    SharedMemoryRegion& operator=(const SharedMemoryRegion&) = delete;
+
+    // Creates a zeroed region readable and writable only by this user, replacing any a crashed process left
+    // under the same name. Throws LinuxException on failure.
+    static std::unique_ptr<SharedMemoryRegion> create(const std::string& name, size_t size);
+    // Maps an existing region read-only, or returns nothing if there is none of at least size bytes
+    static std::unique_ptr<SharedMemoryRegion> openReadOnly(const std::string& name, size_t size);
+
+    void* data() const
+    {
+        return memory;
+    }
+};
+
+// A shared memory name for purpose that is distinct for each user
+std::string userSharedMemoryName(const std::string& purpose);
+
+bool processRunning(long processID);
+
+// Sets the calling thread's I/O scheduling class (ioprio_set), nice value and CPU affinity. Settings the
+// system refuses are reported as warnings, since the thread works the same either way. Raising the nice value
+// can't be undone without privileges, so this is meant for threads that stay in the background.
+void applyThreadPriority(const ThreadPriority& priority);
+
+// Reports files that are created, modified, moved or deleted in a set of directories, from a background
+// thread. Backed by inotify.
+class DirectoryChangeWatcher
+{
+    int inotifyFD = -1,
+        stopEventFD = -1;
+
+    std::mutex watchMutex;
+    std::map<int, wxFileName> watchedDirs;
+    std::function<void(const wxFileName&)> onFileChanged;
+    std::thread watchThread;
+
+    void watchLoop();
+
+public:
+    explicit DirectoryChangeWatcher(std::function<void(const wxFileName&)> onFileChanged);
+    ~DirectoryChangeWatcher();
+
+    void watchDirectory(const wxFileName& directory);
+};
+
 struct InstallationInfo
 {
     enum InstallationType
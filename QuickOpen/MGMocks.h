@@ -3,6 +3,15 @@
 #include <vector>
 #include <algorithm>
 #include <optional>
+#include <cstdarg>
+#include <cstdio>
+#include <cctype>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #define CIVETWEB_VERSION "1.0.0.0-MOCK"
 
@@ -14,6 +23,7 @@ struct mg_request_info
 	const char* query_string = nullptr;
 	const char* request_uri = nullptr;
 	char remote_addr[48];
+	long long content_length = -1;
 };
 
 struct mg_response_info
@@ -26,11 +36,20 @@ struct mg_connection
 	bool isOpen = true;
 	std::optional<int> responseStatus;
 	std::optional<std::string> responseMimeType;
+	std::vector<std::pair<std::string, std::string>> responseHeaders;
 	std::string outputBuffer;
 	std::string inputBuffer;
 
 	std::vector<std::pair<std::string, std::optional<std::string>>> sentFiles;
 	mg_request_info requestInfo;
+	std::vector<std::pair<std::string, std::string>> requestHeaders;
+
+	bool suspended = false;
+	// Signalled when a suspended request is resumed, for tests that wait on its continuation; see waitUntilResumed
+	std::shared_ptr<std::pair<std::mutex, std::condition_variable>> resumeSignal = std::make_shared<std::pair<std::mutex, std::condition_variable>>();
+	bool clientDisconnected = false;
+	// Once inputBuffer has been read, mg_wait_for_body times out instead of reporting the end of the body
+	bool bodyStallsWhenDrained = false;
 };
 
 class CivetServer
@@ -168,6 +187,10 @@ inline int mg_response_header_add(struct mg_connection *conn,
 	{
 		conn->responseMimeType = std::string(value);
 	}
+	else
+	{
+		conn->responseHeaders.emplace_back(headerName, value);
+	}
 
 	return 0;
 }
@@ -224,6 +247,49 @@ inline void mg_send_mime_file(struct mg_connection *conn,
 	}
 }
 
+#define MG_CAN_SUSPEND_REQUESTS 1
+
+inline void mg_suspend_request(struct mg_connection *conn)
+{
+	std::lock_guard<std::mutex> lock(conn->resumeSignal->first);
+	conn->suspended = true;
+}
+
+inline void mg_resume_request(struct mg_connection *conn)
+{
+	std::lock_guard<std::mutex> lock(conn->resumeSignal->first);
+	conn->suspended = false;
+	conn->resumeSignal->second.notify_all();
+}
+
+// Not part of CivetWeb: returns once the request's handler and any continuation it suspended the request for have
+// answered it, for up to timeout
+inline bool waitUntilResumed(struct mg_connection *conn, std::chrono::milliseconds timeout = std::chrono::seconds(10))
+{
+	std::unique_lock<std::mutex> lock(conn->resumeSignal->first);
+	return conn->resumeSignal->second.wait_for(lock, timeout, [conn] { return !conn->suspended; });
+}
+
+#define MG_CAN_WAIT_FOR_BODY 1
+
+inline int mg_wait_for_body(struct mg_connection *conn, int timeout_ms)
+{
+	if (conn->inputBuffer.empty() && conn->bodyStallsWhenDrained)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+		return 0;
+	}
+
+	return 1;
+}
+
+#define MG_CAN_DETECT_DISCONNECT 1
+
+inline int mg_client_disconnected(const struct mg_connection *conn)
+{
+	return conn->clientDisconnected ? 1 : 0;
+}
+
 inline const struct mg_request_info *mg_get_request_info(const struct mg_connection* conn) { return &conn->requestInfo; }
 
 inline mg_connection *mg_connect_client(const char *host,
@@ -235,11 +301,34 @@ inline mg_connection *mg_connect_client(const char *host,
 	return nullptr; // TODO: Mock this
 }
 
-inline int mg_printf(struct mg_connection *,
+inline int mg_printf(struct mg_connection *conn,
 	const char *fmt,
 	...)
 {
-	return 0; // TODO: Mock this
+	va_list args;
+	va_start(args, fmt);
+	char formatted[1024];
+	int length = vsnprintf(formatted, sizeof(formatted), fmt, args);
+	va_end(args);
+
+	if (length > 0)
+	{
+		conn->outputBuffer.append(formatted, std::min<size_t>(length, sizeof(formatted) - 1));
+	}
+
+	return length;
+}
+
+inline const char* mg_get_header(const struct mg_connection* conn, const char* name)
+{
+	auto nameMatches = [name](const std::pair<std::string, std::string>& header)
+	{
+		return std::equal(header.first.begin(), header.first.end(), name, name + strlen(name),
+			[](char a, char b) { return tolower(a) == tolower(b); });
+	};
+
+	auto headerIter = std::find_if(conn->requestHeaders.begin(), conn->requestHeaders.end(), nameMatches);
+	return (headerIter != conn->requestHeaders.end()) ? headerIter->second.c_str() : nullptr;
 }
 
 inline int mg_get_response(struct mg_connection *conn,
@@ -1,6 +1,11 @@
 #include "ManagementServer.h"
 
 #include "AppGUIIncludes.h"
+#include "BandwidthLimiter.h"
+#include "ConsentApprovalQueue.h"
+#include "ConsentPolicy.h"
+#include "DiskSpaceLedger.h"
+#include "UploadScheduler.h"
 #include "WebServerUtils.h"
 
 bool ManagementServer::ConfigReloadHandler::handlePost(CivetServer* server, mg_connection* conn)
@@ -9,10 +14,158 @@ bool ManagementServer::ConfigReloadHandler::handlePost(CivetServer* server, mg_c
 	return true;
 }
 
+static nlohmann::json throttlingSettingsJSON(const AppConfig& config)
+{
+	return {
+		{"globalUploadLimit", config.globalUploadLimit},
+		{"perSenderUploadLimit", config.perSenderUploadLimit},
+		{"subnetUploadLimits", config.subnetUploadLimits}
+	};
+}
+
+bool ManagementServer::ThrottleHandler::handleGet(CivetServer* server, mg_connection* conn)
+{
+	auto configRef = appRef.getConfigRef()->snapshot();
+	sendJSONResponse(conn, 200, throttlingSettingsJSON(*configRef));
+	return true;
+}
+
+bool ManagementServer::ThrottleHandler::handlePost(CivetServer* server, mg_connection* conn)
+{
+	nlohmann::json newSettings = nlohmann::json::parse(MGReadAll(conn), nullptr, false);
+	if (!newSettings.is_object())
+	{
+		sendJSONResponse(conn, 400, FormErrorList{ {
+			{"", "The request body must be a JSON object."}
+		} });
+		return true;
+	}
+
+	AppConfig updatedConfig = *appRef.getConfigRef()->snapshot();
+	try
+	{
+		if (newSettings.contains("globalUploadLimit"))
+		{
+			updatedConfig.globalUploadLimit = newSettings.at("globalUploadLimit").get<unsigned long long>();
+		}
+
+		if (newSettings.contains("perSenderUploadLimit"))
+		{
+			updatedConfig.perSenderUploadLimit = newSettings.at("perSenderUploadLimit").get<unsigned long long>();
+		}
+
+		if (newSettings.contains("subnetUploadLimits"))
+		{
+			updatedConfig.subnetUploadLimits = newSettings.at("subnetUploadLimits").get<std::vector<SubnetUploadLimit>>();
+		}
+	}
+	catch (const nlohmann::json::exception&)
+	{
+		sendJSONResponse(conn, 400, FormErrorList{ {
+			{"", "Limits must be numbers of bytes per second, and subnet limits objects with subnet and bytesPerSecond."}
+		} });
+		return true;
+	}
+
+	for (const auto& subnetLimit : updatedConfig.subnetUploadLimits)
+	{
+		if (!BandwidthLimiter::parseSubnet(subnetLimit.subnet))
+		{
+			sendJSONResponse(conn, 400, FormErrorList{ {
+				{"subnetUploadLimits", "\"" + subnetLimit.subnet + "\" is not an address or subnet."}
+			} });
+			return true;
+		}
+	}
+
+	// Only the limits are swapped in, so that a configuration reload meanwhile isn't undone; the file is written
+	// once the lock is released, so that requests reading the configuration aren't held up by the disk
+	{
+		WriterReadersLock<AppConfig>::WritableReference configRef(*appRef.getConfigRef());
+		configRef->globalUploadLimit = updatedConfig.globalUploadLimit;
+		configRef->perSenderUploadLimit = updatedConfig.perSenderUploadLimit;
+		configRef->subnetUploadLimits = updatedConfig.subnetUploadLimits;
+		updatedConfig = *configRef;
+	}
+
+	try
+	{
+		updatedConfig.saveConfig();
+	}
+	catch (const std::exception& ex)
+	{
+		sendJSONResponse(conn, 500, FormErrorList{ {
+			{"", std::string("The limits apply until QuickOpen restarts, but could not be saved: ") + ex.what()}
+		} });
+		return true;
+	}
+
+	sendJSONResponse(conn, 200, throttlingSettingsJSON(updatedConfig));
+	return true;
+}
+
+bool ManagementServer::StatsHandler::handleGet(CivetServer* server, mg_connection* conn)
+{
+	const auto& evictions = EvictionStats::global();
+	auto guiLatency = GUIQueueLatency::global().snapshot();
+	const auto& uploads = UploadScheduler::globalStats();
+
+	nlohmann::json stats = {
+		{
+			"evictions", {
+				{"consentTimeouts", evictions.count(EvictionStats::CONSENT_TIMEOUT)},
+				{"idleUploads", evictions.count(EvictionStats::BODY_IDLE)},
+				{"slowUploads", evictions.count(EvictionStats::BODY_TOO_SLOW)}
+			}
+		},
+		{
+			"uploadScheduler", {
+				{"queuedWrites", uploads.queuedWrites.load()},
+				{"queuedBytes", uploads.queuedBytes.load()},
+				{"activeWrites", uploads.activeWrites.load()},
+				{"writtenBytes", uploads.writtenBytes.load()}
+			}
+		},
+		{
+			"throttling", {
+				{"throttledReads", BandwidthLimiter::globalStats().throttledReads.load()},
+				{"throttledMicroseconds", BandwidthLimiter::globalStats().throttledMicroseconds.load()}
+			}
+		},
+		{
+			"diskSpace", {
+				{"reservedBytes", DiskSpaceLedger::globalStats().reservedBytes.load()},
+				{"refusedRequests", DiskSpaceLedger::globalStats().refusedRequests.load()}
+			}
+		},
+		{
+			"consentPolicy", {
+				{"autoAccepted", ConsentPolicy::globalStats().autoAccepted.load()},
+				{"autoDenied", ConsentPolicy::globalStats().autoDenied.load()},
+				{"prompted", ConsentPolicy::globalStats().prompted.load()}
+			}
+		},
+		{
+			"guiQueue", {
+				{"calls", guiLatency.callCount},
+				{"averageMicroseconds", (guiLatency.callCount > 0) ? guiLatency.totalMicroseconds / guiLatency.callCount : 0},
+				{"maxMicroseconds", guiLatency.maxMicroseconds}
+			}
+		}
+	};
+
+#ifdef MG_CAN_LIMIT_HEADER_TIME
+	stats["evictions"]["headerTimeouts"] = mg_get_header_timeout_count();
+#endif
+
+	sendJSONResponse(conn, 200, stats);
+	return true;
+}
+
 ManagementServer::ManagementServer(QuickOpenApplication& appRef, unsigned port) : CivetServer({
 		"listening_ports", "127.0.0.1:" + std::to_string(port),
 		"num_threads", "1"
-	}), configReloadHandler(appRef)
+	}), configReloadHandler(appRef), throttleHandler(appRef)
 {
 	std::ofstream mgmtFileOut;
 	mgmtFileOut.exceptions(std::ios::failbit);
@@ -26,24 +179,128 @@ ManagementServer::ManagementServer(QuickOpenApplication& appRef, unsigned port)
 
 	addAuthHandler("/", authHandler);
 	addHandler("/api/config/reload", configReloadHandler);
+	addHandler("/api/throttle", throttleHandler);
+	addHandler("/api/stats", statsHandler);
 }
 
-void ManagementClient::sendReload()
+std::unique_ptr<ManagementServer> ManagementServer::startOnFreePort(QuickOpenApplication& appRef)
+{
+	unsigned attempts = 0;
+	while (true)
+	{
+		try
+		{
+			return std::make_unique<ManagementServer>(appRef, generateCryptoRandomInteger<uint16_t>() % 32768 + 32768);
+		}
+		catch (const CivetException& ex)
+		{
+			++attempts;
+
+			if (std::string(ex.what()).find("binding to port") == std::string::npos)
+			{
+				throw;
+			}
+			else if (attempts >= 100)
+			{
+				throw std::runtime_error("Could not find free port to bind management server");
+			}
+		}
+	}
+}
+
+void ManagementServer::addConsentApprover(ConsentApprovalQueue& approvalQueue)
+{
+	consentApprovalHandler = std::make_unique<ConsentApprovalHandler>(approvalQueue);
+	addHandler("/api/consent", *consentApprovalHandler);
+}
+
+void ManagementServer::addUploadCanceller(std::function<bool(uint64_t entryID)> cancelUpload)
+{
+	uploadCancelHandler = std::make_unique<UploadCancelHandler>(std::move(cancelUpload));
+	addHandler("/api/cancel", *uploadCancelHandler);
+}
+
+bool ManagementServer::ConsentApprovalHandler::handleGet(CivetServer* server, mg_connection* conn)
+{
+	sendJSONResponse(conn, 200, nlohmann::json(approvalQueue.pending()));
+	return true;
+}
+
+bool ManagementServer::ConsentApprovalHandler::handlePost(CivetServer* server, mg_connection* conn)
+{
+	nlohmann::json answer = nlohmann::json::parse(MGReadAll(conn), nullptr, false);
+	if (!answer.is_object() || !answer.contains("id") || !answer["id"].is_number_unsigned()
+		|| !answer.contains("accept") || !answer["accept"].is_boolean())
+	{
+		sendJSONResponse(conn, 400, FormErrorList{ { {"", "Expected an object with a prompt id and whether to accept it."} } });
+		return true;
+	}
+
+	if (!approvalQueue.answer(answer["id"].get<uint64_t>(), answer["accept"].get<bool>(), answer.value("ban", false),
+		answer.value("choices", nlohmann::json::object())))
+	{
+		sendJSONResponse(conn, 404, FormErrorList{ { {"id", "No consent prompt with this id is waiting for an answer."} } });
+		return true;
+	}
+
+	mg_send_http_ok(conn, "text/plain", 0);
+	return true;
+}
+
+bool ManagementServer::UploadCancelHandler::handlePost(CivetServer* server, mg_connection* conn)
+{
+	nlohmann::json request = nlohmann::json::parse(MGReadAll(conn), nullptr, false);
+	if (!request.is_object() || !request.contains("entryID") || !request["entryID"].is_number_unsigned())
+	{
+		sendJSONResponse(conn, 400, FormErrorList{ { {"", "Expected an object with the entryID of an upload."} } });
+		return true;
+	}
+
+	if (!cancelUpload(request["entryID"].get<uint64_t>()))
+	{
+		sendJSONResponse(conn, 404, FormErrorList{ { {"entryID", "No upload with this entryID is running."} } });
+		return true;
+	}
+
+	mg_send_http_ok(conn, "text/plain", 0);
+	return true;
+}
+
+int ManagementClient::sendRequest(const std::string& method, const std::string& path, const std::string& body, std::string* responseBody)
 {
 	std::string serverDataString = fileReadAll(InstallationInfo::detectInstallation().configFolder / wxFileName(".", "mgmtServer.json"));
 	auto serverData = MgmtServerFileData(nlohmann::json::parse(serverDataString));
 
 	char errorBuf[250];
 	mg_connection* conn = mg_connect_client("127.0.0.1", serverData.port, false, errorBuf, sizeof(errorBuf));
-	mg_printf(conn, ("POST /api/config/reload?csrfToken=" + std::to_string(serverData.csrfToken) + " HTTP/1.1\r\n").c_str());
-	mg_printf(conn, "Connection: close\r\n\r\n");
+	if (conn == nullptr)
+	{
+		std::cerr << "WARNING: Couldn't reach the management server: " << errorBuf << std::endl;
+		return 0;
+	}
 
-	mg_get_response(conn, errorBuf, sizeof(errorBuf), 1000);
+	mg_printf(conn, "%s %s?csrfToken=%s HTTP/1.1\r\n", method.c_str(), path.c_str(), std::to_string(serverData.csrfToken).c_str());
+	mg_printf(conn, "Content-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+	mg_write(conn, body.data(), body.size());
 
-	if (mg_get_response_info(conn)->status_code != 200)
+	int statusCode = 0;
+	if (mg_get_response(conn, errorBuf, sizeof(errorBuf), 1000) >= 0)
 	{
-		std::cerr << "WARNING: API returned unexpected status code." << std::endl;
+		statusCode = mg_get_response_info(conn)->status_code;
+		if (responseBody != nullptr)
+		{
+			*responseBody = MGReadAll(conn);
+		}
 	}
 
 	mg_close_connection(conn);
+	return statusCode;
+}
+
+void ManagementClient::sendReload()
+{
+	if (sendRequest("POST", "/api/config/reload", "") != 200)
+	{
+		std::cerr << "WARNING: API returned unexpected status code." << std::endl;
+	}
 }
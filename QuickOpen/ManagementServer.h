@@ -3,7 +3,11 @@
 #include "WebServerUtils.h"
 #include "CivetWebIncludes.h"
 
+#include <functional>
+#include <memory>
+
 class QuickOpenApplication;
+class ConsentApprovalQueue;
 
 struct MgmtServerFileData
 {
@@ -27,15 +31,82 @@ public:
 		bool handlePost(CivetServer* server, mg_connection* conn) override;
 	};
 
+	// Reads (GET) or changes (POST) the upload bandwidth limits. A POST takes a JSON object with any of
+	// globalUploadLimit, perSenderUploadLimit and subnetUploadLimits, saves them to the configuration and has
+	// them apply to running uploads within a second.
+	class ThrottleHandler : public CivetHandler
+	{
+		QuickOpenApplication& appRef;
+
+	public:
+		ThrottleHandler(QuickOpenApplication& appRef) : appRef(appRef)
+		{}
+
+		bool handleGet(CivetServer* server, mg_connection* conn) override;
+		bool handlePost(CivetServer* server, mg_connection* conn) override;
+	};
+
+	// Lists the consent prompts waiting for an answer (GET), or answers one (POST a JSON object with id, accept and
+	// optionally ban, and choices such as where to save files). Only registered where prompts are answered through
+	// the management server.
+	class ConsentApprovalHandler : public CivetHandler
+	{
+		ConsentApprovalQueue& approvalQueue;
+
+	public:
+		ConsentApprovalHandler(ConsentApprovalQueue& approvalQueue) : approvalQueue(approvalQueue)
+		{}
+
+		bool handleGet(CivetServer* server, mg_connection* conn) override;
+		bool handlePost(CivetServer* server, mg_connection* conn) override;
+	};
+
+	// Cancels a running upload (POST a JSON object with the entryID its activity events carry). Only registered
+	// where uploads are shown by another process's tray window.
+	class UploadCancelHandler : public CivetHandler
+	{
+		std::function<bool(uint64_t entryID)> cancelUpload;
+
+	public:
+		UploadCancelHandler(std::function<bool(uint64_t entryID)> cancelUpload) : cancelUpload(std::move(cancelUpload))
+		{}
+
+		bool handlePost(CivetServer* server, mg_connection* conn) override;
+	};
+
+	// Reports connection evictions, the upload scheduler's queue, throttling and GUI queue latency, for diagnosing stalls
+	class StatsHandler : public CivetHandler
+	{
+	public:
+		bool handleGet(CivetServer* server, mg_connection* conn) override;
+	};
+
 private:
 	ConfigReloadHandler configReloadHandler;
+	ThrottleHandler throttleHandler;
+	StatsHandler statsHandler;
+	std::unique_ptr<ConsentApprovalHandler> consentApprovalHandler;
+	std::unique_ptr<UploadCancelHandler> uploadCancelHandler;
 	CSRFAuthHandler authHandler;
 
 public:
 	ManagementServer(QuickOpenApplication& appRef, unsigned port);
+
+	// Starts a management server on a random free port above 32767; throws std::runtime_error if none is found
+	static std::unique_ptr<ManagementServer> startOnFreePort(QuickOpenApplication& appRef);
+
+	// Serves /api/consent from approvalQueue
+	void addConsentApprover(ConsentApprovalQueue& approvalQueue);
+	// Serves /api/cancel, which has cancelUpload stop the upload with the given activity entry ID, returning false if
+	// there is no such upload running
+	void addUploadCanceller(std::function<bool(uint64_t entryID)> cancelUpload);
 };
 
 namespace ManagementClient
 {
+	// Sends a request to the running instance's management server and returns the response's status code,
+	// or 0 if the server couldn't be reached
+	int sendRequest(const std::string& method, const std::string& path, const std::string& body, std::string* responseBody = nullptr);
+
 	void sendReload();
 }
@@ -5,23 +5,36 @@
 #include "MockGUI.h"
 #include "WebServer.h"
 
-std::pair<ConsentDialog::ResultCode, bool>
-QuickOpenApplication::promptForFileSave(const wxFileName &defaultDestDir, const wxString &requesterName,
-                                        FileConsentRequestInfo &rqFileInfo) {
+#include <thread>
+
+void QuickOpenApplication::promptForFileSave(const wxFileName &defaultDestDir, const wxString &requesterName,
+                                             std::shared_ptr<FileConsentRequestInfo> rqFileInfo,
+                                             std::chrono::steady_clock::time_point deadline,
+                                             std::function<void(std::pair<ConsentDialog::ResultCode, bool>)> onDecision) {
     this->promptedForFileSave = true;
     wxFileName destFolder = fileDestFolder.value_or(defaultDestDir);
 
-    if(confirmPrompts)
+    // Like the real dialog, one left open past the deadline declines by itself
+    std::this_thread::sleep_for(answerDelay);
+    if (std::chrono::steady_clock::now() >= deadline)
+    {
+        onDecision({ ConsentDialog::ResultCode::DECLINE, false });
+    }
+    else if(confirmPrompts)
     {
-        for (auto& thisFile : rqFileInfo.fileList)
+        for (auto& thisFile : rqFileInfo->fileList)
         {
             thisFile.consentedFileName = destFolder / wxFileName("", thisFile.filename);
+            if (openOnlyChoice.has_value())
+            {
+                thisFile.ephemeral = *openOnlyChoice;
+            }
         }
 
-        return { ConsentDialog::ResultCode::ACCEPT, requestBan };
+        onDecision({ ConsentDialog::ResultCode::ACCEPT, requestBan });
     }
     else
     {
-        return { ConsentDialog::ResultCode::DECLINE, requestBan };
+        onDecision({ ConsentDialog::ResultCode::DECLINE, requestBan });
     }
 }
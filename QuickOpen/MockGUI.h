@@ -8,13 +8,14 @@
 #include <wx/string.h>
 
 #include "AppConfig.h"
+#include "GUITask.h"
 
 struct FileConsentRequestInfo;
 
 template<typename AppType, typename FuncType, typename ResultType>
-ResultType wxCallAfterSync(AppType& app, FuncType func)
+void wxCallAfterAsync(AppType& app, FuncType func, std::function<void(ResultType)> continuation)
 {
-    return func();
+    continuation(func());
 }
 
 class ConsentDialog
@@ -33,7 +34,7 @@ public:
     class FileUploadActivityEntry
     {
     public:
-        bool completed = false, errored = false, cancelCompleted = false;
+        bool completed = false, errored = false, cancelCompleted = false, deduplicated = false, waiting = false;
         double progress = 0.0;
 
         void setCompleted(bool completed)
@@ -46,6 +47,11 @@ public:
             cancelCompleted = true;
         }
 
+        void setDeduplicated()
+        {
+            deduplicated = true;
+        }
+
         void setError(const std::exception* ex)
         {
             errored = true;
@@ -55,6 +61,11 @@ public:
         {
             progress = progress;
         }
+
+        void setWaiting(bool waiting)
+        {
+            this->waiting = waiting;
+        }
     };
 
     std::vector<wxString> webpageActivities;
@@ -68,6 +79,13 @@ public:
     {
         return new FileUploadActivityEntry();
     }
+
+    FileUploadActivityEntry* addDeduplicatedFileActivity(const wxFileName& filename)
+    {
+        auto* newActivity = new FileUploadActivityEntry();
+        newActivity->setDeduplicated();
+        return newActivity;
+    }
 };
 
 class QuickOpenApplication
@@ -89,23 +107,34 @@ public:
 
     void notifyUser(MessageSeverity severity, const wxString& title, const wxString& text) {}
     void setupServer(unsigned newPort) {}
-    bool promptForWebpageOpen(std::string URL, const wxString& requesterName, bool& banRequested)
+    GUITask<std::pair<bool, bool>> promptForWebpageOpen(std::string URL, const wxString& requesterName,
+                                                        std::chrono::steady_clock::time_point deadline)
     {
-        this->promptedForWebpage = true;
-        this->webpagePromptInfo = { URL, requesterName };
-        banRequested = requestBan;
-        return confirmPrompts;
+        return callOnGUIThread(*this, [this, URL, requesterName]
+        {
+            this->promptedForWebpage = true;
+            this->webpagePromptInfo = { URL, requesterName };
+            return std::pair{ confirmPrompts, requestBan };
+        });
     }
 
     std::optional<wxFileName> fileDestFolder;
     bool promptedForFileSave = false;
+    // When set, stands in for the user checking or unchecking "open only" in the consent dialog
+    std::optional<bool> openOnlyChoice;
+    // How long the user takes to answer the file consent dialog
+    std::chrono::milliseconds answerDelay{ 0 };
 
-    std::pair<ConsentDialog::ResultCode, bool> promptForFileSave(const wxFileName& defaultDestDir, const wxString& requesterName, FileConsentRequestInfo& rqFileInfo)
+    std::vector<wxFileName> openedFiles;
+    void openReceivedFile(const wxFileName& fileName)
     {
-        this->promptedForFileSave = true;
-        return { (this->confirmPrompts ? ConsentDialog::ACCEPT : ConsentDialog::DECLINE), requestBan };
+        openedFiles.push_back(fileName);
     }
 
+    void promptForFileSave(const wxFileName& defaultDestDir, const wxString& requesterName, std::shared_ptr<FileConsentRequestInfo> rqFileInfo,
+                           std::chrono::steady_clock::time_point deadline,
+                           std::function<void(std::pair<ConsentDialog::ResultCode, bool>)> onDecision);
+
     bool configUpdateTriggered = false;
     void triggerConfigUpdate()
     {
@@ -117,10 +146,31 @@ public:
         return configRef;
     }
 
+    // When set, CallAfter queues calls until runDeferredCalls(), standing in for a busy GUI thread
+    bool deferCalls = false;
+    std::vector<std::function<void()>> deferredCalls;
+
     template<typename T>
     void CallAfter(T&& callable)
     {
-        callable();
+        if (deferCalls)
+        {
+            deferredCalls.emplace_back(std::forward<T>(callable));
+        }
+        else
+        {
+            callable();
+        }
+    }
+
+    void runDeferredCalls()
+    {
+        auto calls = std::move(deferredCalls);
+        deferredCalls.clear();
+        for (auto& call : calls)
+        {
+            call();
+        }
     }
 
     TrayStatusWindow* getTrayWindow() const
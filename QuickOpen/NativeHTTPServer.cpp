@@ -0,0 +1,1448 @@
+#include "NativeHTTPServer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+	constexpr size_t MAX_HEAD_SIZE = 16 * 1024;
+	constexpr size_t MAX_CHUNK_LINE_SIZE = 1024;
+	constexpr size_t READ_CHUNK_SIZE = 4096;
+	constexpr int MAX_EPOLL_EVENTS = 256;
+	constexpr unsigned DEFAULT_WORKER_COUNT = 16;
+	constexpr int DEFAULT_REQUEST_TIMEOUT_MS = 30000;
+	constexpr int DEFAULT_HEADER_TIMEOUT_MS = 15000;
+	constexpr auto IDLE_SWEEP_INTERVAL = std::chrono::seconds(1);
+	constexpr uint32_t CONNECTION_EVENTS = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+
+	using Clock = std::chrono::steady_clock;
+
+	const char* const HEAD_TERMINATOR = "\r\n\r\n";
+
+	std::atomic<unsigned long long> headerTimeoutCount = 0;
+
+	bool equalsIgnoreCase(const std::string& a, const char* b)
+	{
+		return std::equal(a.begin(), a.end(), b, b + strlen(b),
+			[](char x, char y) { return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y)); });
+	}
+
+	std::string toLower(std::string str)
+	{
+		std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return std::tolower(c); });
+		return str;
+	}
+
+	std::string trimWhitespace(const std::string& str)
+	{
+		size_t start = str.find_first_not_of(" \t");
+		if (start == std::string::npos) return {};
+		return str.substr(start, str.find_last_not_of(" \t") - start + 1);
+	}
+
+	bool percentDecode(const std::string& encoded, std::string& decoded)
+	{
+		decoded.clear();
+		for (size_t i = 0; i < encoded.size(); ++i)
+		{
+			if (encoded[i] != '%')
+			{
+				decoded += encoded[i];
+				continue;
+			}
+
+			if (i + 2 >= encoded.size() || !isxdigit(static_cast<unsigned char>(encoded[i + 1]))
+				|| !isxdigit(static_cast<unsigned char>(encoded[i + 2])))
+			{
+				return false;
+			}
+
+			char decodedChar = static_cast<char>(std::stoi(encoded.substr(i + 1, 2), nullptr, 16));
+			if (decodedChar == '\0') return false;
+
+			decoded += decodedChar;
+			i += 2;
+		}
+
+		return true;
+	}
+
+	// Parses "Name: value" lines starting at lineStart, up to the end of head
+	bool parseHeaderLines(const std::string& head, size_t lineStart, std::vector<std::pair<std::string, std::string>>& headers)
+	{
+		while (lineStart < head.size())
+		{
+			size_t lineEnd = head.find("\r\n", lineStart);
+			if (lineEnd == std::string::npos) lineEnd = head.size();
+
+			std::string line = head.substr(lineStart, lineEnd - lineStart);
+			size_t colonPos = line.find(':');
+			if (colonPos == std::string::npos || colonPos == 0) return false;
+
+			headers.emplace_back(line.substr(0, colonPos), trimWhitespace(line.substr(colonPos + 1)));
+			lineStart = lineEnd + 2;
+		}
+
+		return true;
+	}
+
+	const char* reasonPhrase(int status)
+	{
+		switch (status)
+		{
+		case 100: return "Continue";
+		case 200: return "OK";
+		case 201: return "Created";
+		case 204: return "No Content";
+		case 206: return "Partial Content";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 408: return "Request Timeout";
+		case 409: return "Conflict";
+		case 411: return "Length Required";
+		case 413: return "Payload Too Large";
+		case 429: return "Too Many Requests";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		case 503: return "Service Unavailable";
+		case 507: return "Insufficient Storage";
+		default: return "Unknown";
+		}
+	}
+
+	const char* guessMimeType(const std::string& path)
+	{
+		static const std::pair<const char*, const char*> MIME_TYPES[] = {
+			{".html", "text/html"},
+			{".htm", "text/html"},
+			{".js", "application/javascript"},
+			{".css", "text/css"},
+			{".json", "application/json"},
+			{".svg", "image/svg+xml"},
+			{".png", "image/png"},
+			{".ico", "image/x-icon"},
+			{".txt", "text/plain"}
+		};
+
+		std::string lowerPath = toLower(path);
+		for (const auto& [extension, mimeType] : MIME_TYPES)
+		{
+			size_t extLength = strlen(extension);
+			if (lowerPath.size() >= extLength && lowerPath.compare(lowerPath.size() - extLength, extLength, extension) == 0)
+			{
+				return mimeType;
+			}
+		}
+
+		return "application/octet-stream";
+	}
+
+	void setSocketTimeouts(int fd, int timeoutMS)
+	{
+		timeval timeout{ timeoutMS / 1000, (timeoutMS % 1000) * 1000 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+
+	void formatRemoteAddress(const sockaddr_storage& address, char* out, size_t outSize)
+	{
+		if (address.ss_family == AF_INET6)
+		{
+			const auto& address6 = reinterpret_cast<const sockaddr_in6&>(address);
+			// Report IPv4 clients of a dual-stack listener the same way an IPv4 listener would
+			if (IN6_IS_ADDR_V4MAPPED(&address6.sin6_addr))
+			{
+				inet_ntop(AF_INET, &address6.sin6_addr.s6_addr[12], out, outSize);
+			}
+			else
+			{
+				inet_ntop(AF_INET6, &address6.sin6_addr, out, outSize);
+			}
+		}
+		else
+		{
+			inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in&>(address).sin_addr, out, outSize);
+		}
+	}
+}
+
+struct mg_connection
+{
+	int fd = -1;
+	bool isClient = false;
+
+	// Bytes received but not yet consumed. While a request is being served, its head occupies the start of the
+	// buffer and body bytes that arrived with it follow from bodyOffset.
+	std::string buffer;
+	size_t bodyOffset = 0;
+	long long bodyRemaining = 0;
+	// For chunked bodies, bodyRemaining stays at LLONG_MAX until the last chunk has been read
+	bool chunkedBody = false,
+		chunkStarted = false;
+	unsigned long long chunkRemaining = 0;
+
+	std::string method, uri, queryString, httpVersion;
+	bool hasQueryString = false;
+	std::vector<std::pair<std::string, std::string>> headers;
+	mg_request_info requestInfo;
+	mg_response_info responseInfo;
+
+	bool clientKeepAlive = false;
+	bool closeRequested = false;
+	bool responseStarted = false;
+	bool responseDelimited = false;
+	int pendingStatus = 0;
+	std::vector<std::pair<std::string, std::string>> pendingHeaders;
+
+	CivetServer::Engine* engine = nullptr;
+
+	// Set while a worker owns the connection, or while its request is suspended; the event loop leaves such
+	// connections alone
+	bool inWorker = false;
+	Clock::time_point lastActivity = Clock::now();
+	// When the head now being received started arriving; trickling it in doesn't extend its deadline
+	Clock::time_point headStarted = Clock::now();
+
+	// Guarded by the engine's connectionMutex
+	bool handlerRunning = false,
+		suspended = false,
+		resumedEarly = false;
+
+	void resetForRequest()
+	{
+		bodyOffset = 0;
+		bodyRemaining = 0;
+		chunkedBody = chunkStarted = false;
+		chunkRemaining = 0;
+		method.clear();
+		uri.clear();
+		queryString.clear();
+		httpVersion.clear();
+		hasQueryString = false;
+		headers.clear();
+		clientKeepAlive = false;
+		closeRequested = false;
+		responseStarted = false;
+		responseDelimited = false;
+		pendingStatus = 0;
+		pendingHeaders.clear();
+	}
+
+	const char* findHeader(const char* name) const
+	{
+		auto headerIter = std::find_if(headers.begin(), headers.end(),
+			[name](const std::pair<std::string, std::string>& header) { return equalsIgnoreCase(header.first, name); });
+		return (headerIter != headers.end()) ? headerIter->second.c_str() : nullptr;
+	}
+
+	bool hasCompleteHead() const
+	{
+		return buffer.find(HEAD_TERMINATOR) != std::string::npos;
+	}
+
+	bool parseRequestHead()
+	{
+		size_t headEnd = buffer.find(HEAD_TERMINATOR);
+		std::string head = buffer.substr(0, headEnd);
+
+		resetForRequest();
+		bodyOffset = headEnd + strlen(HEAD_TERMINATOR);
+
+		size_t requestLineEnd = std::min(head.find("\r\n"), head.size());
+		std::string requestLine = head.substr(0, requestLineEnd);
+
+		size_t firstSpace = requestLine.find(' '), lastSpace = requestLine.rfind(' ');
+		if (firstSpace == std::string::npos || firstSpace == lastSpace) return false;
+
+		method = requestLine.substr(0, firstSpace);
+		std::string target = requestLine.substr(firstSpace + 1, lastSpace - firstSpace - 1);
+		httpVersion = requestLine.substr(lastSpace + 1);
+		if (httpVersion.compare(0, 7, "HTTP/1.") != 0 || target.empty() || target[0] != '/') return false;
+
+		size_t queryStart = target.find('?');
+		if (queryStart != std::string::npos)
+		{
+			queryString = target.substr(queryStart + 1);
+			hasQueryString = true;
+			target.resize(queryStart);
+		}
+
+		if (!percentDecode(target, uri)) return false;
+		if (!parseHeaderLines(head, requestLineEnd + 2, headers)) return false;
+
+		long long contentLength = -1;
+		if (const char* lengthHeader = findHeader("Content-Length"))
+		{
+			char* endPtr;
+			errno = 0;
+			contentLength = strtoll(lengthHeader, &endPtr, 10);
+			if (*lengthHeader == '\0' || *endPtr != '\0' || contentLength < 0 || errno != 0) return false;
+		}
+		bodyRemaining = std::max(contentLength, 0LL);
+
+		// Like CivetWeb, chunked bodies are decoded by mg_read and reported with an unknown length. A length
+		// sent alongside them can't be trusted, and no other transfer coding is supported.
+		if (const char* encodingHeader = findHeader("Transfer-Encoding"))
+		{
+			if (toLower(trimWhitespace(encodingHeader)) != "chunked" || contentLength >= 0) return false;
+
+			chunkedBody = true;
+			bodyRemaining = LLONG_MAX;
+		}
+
+		const char* connectionHeader = findHeader("Connection");
+		std::string connectionValue = toLower(connectionHeader ? connectionHeader : "");
+		clientKeepAlive = (httpVersion == "HTTP/1.0")
+			? connectionValue.find("keep-alive") != std::string::npos
+			: connectionValue.find("close") == std::string::npos;
+
+		requestInfo.request_method = method.c_str();
+		requestInfo.request_uri = uri.c_str();
+		requestInfo.query_string = hasQueryString ? queryString.c_str() : nullptr;
+		requestInfo.http_version = httpVersion.c_str() + strlen("HTTP/");
+		requestInfo.content_length = contentLength;
+		return true;
+	}
+
+	// Whether the socket can carry another request once the current one has been answered
+	bool isReusable() const
+	{
+		return clientKeepAlive && responseDelimited && !closeRequested && bodyRemaining == 0;
+	}
+};
+
+struct CivetServer::Engine
+{
+	CivetServer& owner;
+	int requestTimeoutMS = DEFAULT_REQUEST_TIMEOUT_MS;
+	int headerTimeoutMS = DEFAULT_HEADER_TIMEOUT_MS;
+	unsigned workerCount = DEFAULT_WORKER_COUNT;
+
+	std::vector<int> listenerFDs;
+	int epollFD = -1;
+	int wakeFD = -1;
+
+	std::shared_mutex handlerMutex;
+	std::vector<std::pair<std::string, CivetHandler*>> handlers;
+	std::vector<std::pair<std::string, CivetAuthHandler*>> authHandlers;
+
+	// Guards the connection table and the inWorker flags. A socket is closed with this held, so its descriptor
+	// can't be reused by accept() while a stale entry for it is still in the table.
+	std::mutex connectionMutex;
+	std::unordered_map<int, std::unique_ptr<mg_connection>> connections;
+
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::deque<mg_connection*> pendingRequests;
+
+	// Requests suspended by their handlers that haven't been resumed yet; stop() waits for these to finish
+	unsigned suspendedCount = 0;
+	std::condition_variable suspendedDrained;
+
+	std::atomic<bool> stopping = false;
+	bool stopped = false;
+	std::thread loopThread;
+	std::vector<std::thread> workers;
+
+	Engine(CivetServer& owner, const std::vector<std::string>& options) : owner(owner)
+	{
+		if (options.size() % 2 != 0)
+		{
+			throw CivetException("Server options must be given as name/value pairs.");
+		}
+
+		std::string listeningPorts = "8080";
+		for (size_t i = 0; i < options.size(); i += 2)
+		{
+			const std::string& name = options[i];
+			const std::string& value = options[i + 1];
+
+			try
+			{
+				if (name == "listening_ports") listeningPorts = value;
+				else if (name == "num_threads") workerCount = std::max(1, std::stoi(value));
+				else if (name == "request_timeout_ms") requestTimeoutMS = std::max(1, std::stoi(value));
+				else if (name == "header_timeout_ms") headerTimeoutMS = std::max(1, std::stoi(value));
+				else if (name != "document_root") throw CivetException("Unsupported server option \"" + name + "\".");
+			}
+			catch (const std::logic_error&)
+			{
+				throw CivetException("Invalid value for server option \"" + name + "\".");
+			}
+		}
+
+		epollFD = epoll_create1(EPOLL_CLOEXEC);
+		wakeFD = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (epollFD < 0 || wakeFD < 0)
+		{
+			closeDescriptors();
+			throw CivetException(std::string("Could not create the event loop: ") + strerror(errno));
+		}
+
+		try
+		{
+			openListeners(listeningPorts);
+		}
+		catch (...)
+		{
+			closeDescriptors();
+			throw;
+		}
+
+		for (int fd : listenerFDs)
+		{
+			addToEpoll(fd, EPOLLIN);
+		}
+		addToEpoll(wakeFD, EPOLLIN);
+
+		loopThread = std::thread(&Engine::runEventLoop, this);
+		for (unsigned i = 0; i < workerCount; ++i)
+		{
+			workers.emplace_back(&Engine::runWorker, this);
+		}
+	}
+
+	~Engine()
+	{
+		stop();
+	}
+
+	void addToEpoll(int fd, uint32_t events)
+	{
+		epoll_event event{};
+		event.events = events;
+		event.data.fd = fd;
+		epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &event);
+	}
+
+	void openListener(const std::string& spec)
+	{
+		std::string portSpec = spec;
+		if (!portSpec.empty() && portSpec.back() == 's')
+		{
+			throw CivetException("TLS listening ports are not supported by the native HTTP backend.");
+		}
+		if (!portSpec.empty() && portSpec.back() == 'r') portSpec.pop_back();
+
+		bool dualStack = !portSpec.empty() && portSpec[0] == '+';
+		if (dualStack) portSpec.erase(0, 1);
+
+		std::string host;
+		size_t portSeparator = portSpec.rfind(':');
+		if (portSeparator != std::string::npos)
+		{
+			host = portSpec.substr(0, portSeparator);
+			portSpec.erase(0, portSeparator + 1);
+			if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+		}
+
+		int port;
+		try
+		{
+			port = std::stoi(portSpec);
+		}
+		catch (const std::logic_error&)
+		{
+			throw CivetException("Invalid listening port \"" + spec + "\".");
+		}
+
+		sockaddr_storage address{};
+		socklen_t addressLength;
+		auto& address4 = reinterpret_cast<sockaddr_in&>(address);
+		auto& address6 = reinterpret_cast<sockaddr_in6&>(address);
+
+		if (host.empty() ? dualStack : host.find(':') != std::string::npos)
+		{
+			address6.sin6_family = AF_INET6;
+			address6.sin6_port = htons(port);
+			address6.sin6_addr = in6addr_any;
+			addressLength = sizeof(address6);
+			if (!host.empty() && inet_pton(AF_INET6, host.c_str(), &address6.sin6_addr) != 1)
+			{
+				throw CivetException("Invalid listening address \"" + spec + "\".");
+			}
+		}
+		else
+		{
+			address4.sin_family = AF_INET;
+			address4.sin_port = htons(port);
+			address4.sin_addr.s_addr = htonl(INADDR_ANY);
+			addressLength = sizeof(address4);
+			if (!host.empty() && inet_pton(AF_INET, host.c_str(), &address4.sin_addr) != 1)
+			{
+				throw CivetException("Invalid listening address \"" + spec + "\".");
+			}
+		}
+
+		int fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0 && address.ss_family == AF_INET6 && host.empty())
+		{
+			// No IPv6 support on this machine, so fall back to serving IPv4 only
+			address4 = sockaddr_in{};
+			address4.sin_family = AF_INET;
+			address4.sin_port = htons(port);
+			address4.sin_addr.s_addr = htonl(INADDR_ANY);
+			addressLength = sizeof(address4);
+			fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		}
+		if (fd < 0)
+		{
+			throw CivetException("Could not create a socket for \"" + spec + "\": " + strerror(errno));
+		}
+		listenerFDs.push_back(fd);
+
+		int enable = 1, disable = 0;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+		if (address.ss_family == AF_INET6)
+		{
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, dualStack ? &disable : &enable, sizeof(int));
+		}
+
+		if (bind(fd, reinterpret_cast<sockaddr*>(&address), addressLength) != 0 || listen(fd, SOMAXCONN) != 0)
+		{
+			throw CivetException("Could not listen on \"" + spec + "\": " + strerror(errno));
+		}
+	}
+
+	void openListeners(const std::string& listeningPorts)
+	{
+		size_t specStart = 0;
+		while (specStart <= listeningPorts.size())
+		{
+			size_t specEnd = std::min(listeningPorts.find(',', specStart), listeningPorts.size());
+			std::string spec = trimWhitespace(listeningPorts.substr(specStart, specEnd - specStart));
+			if (!spec.empty()) openListener(spec);
+			specStart = specEnd + 1;
+		}
+
+		if (listenerFDs.empty())
+		{
+			throw CivetException("No listening ports were specified.");
+		}
+	}
+
+	void closeDescriptors()
+	{
+		for (int fd : listenerFDs) ::close(fd);
+		listenerFDs.clear();
+		if (epollFD >= 0) ::close(epollFD);
+		if (wakeFD >= 0) ::close(wakeFD);
+		epollFD = wakeFD = -1;
+	}
+
+	void stop()
+	{
+		if (stopped) return;
+		stopped = true;
+
+		stopping = true;
+		uint64_t wakeValue = 1;
+		[[maybe_unused]] ssize_t written = write(wakeFD, &wakeValue, sizeof(wakeValue));
+		if (loopThread.joinable()) loopThread.join();
+
+		{
+			std::lock_guard<std::mutex> queueLock(queueMutex);
+			pendingRequests.clear();
+		}
+		queueCondition.notify_all();
+
+		{
+			// Unblock workers and suspended requests that are waiting on a client so they can finish promptly
+			std::lock_guard<std::mutex> connectionLock(connectionMutex);
+			for (auto& [fd, conn] : connections)
+			{
+				if (conn->inWorker) shutdown(fd, SHUT_RDWR);
+			}
+		}
+
+		for (auto& worker : workers) worker.join();
+		workers.clear();
+
+		// Suspended requests are finished by whatever they wait on (the consent prompts), which the owner has to
+		// wind down first; see ConsentPromptQueue::shutdown()
+		{
+			std::unique_lock<std::mutex> connectionLock(connectionMutex);
+			suspendedDrained.wait(connectionLock, [this] { return suspendedCount == 0; });
+		}
+
+		for (auto& [fd, conn] : connections) ::close(fd);
+		connections.clear();
+		closeDescriptors();
+	}
+
+	void runEventLoop()
+	{
+		epoll_event events[MAX_EPOLL_EVENTS];
+		auto lastSweep = Clock::now();
+
+		while (!stopping)
+		{
+			int eventCount = epoll_wait(epollFD, events, MAX_EPOLL_EVENTS,
+				static_cast<int>(std::chrono::milliseconds(IDLE_SWEEP_INTERVAL).count()));
+
+			for (int i = 0; i < eventCount; ++i)
+			{
+				int fd = events[i].data.fd;
+				if (fd == wakeFD)
+				{
+					uint64_t wakeValue;
+					[[maybe_unused]] ssize_t readBytes = read(wakeFD, &wakeValue, sizeof(wakeValue));
+				}
+				else if (std::find(listenerFDs.begin(), listenerFDs.end(), fd) != listenerFDs.end())
+				{
+					acceptConnections(fd);
+				}
+				else
+				{
+					receiveRequestHead(fd);
+				}
+			}
+
+			if (Clock::now() - lastSweep >= IDLE_SWEEP_INTERVAL)
+			{
+				closeIdleConnections();
+				lastSweep = Clock::now();
+			}
+		}
+	}
+
+	void acceptConnections(int listenerFD)
+	{
+		while (true)
+		{
+			sockaddr_storage remoteAddress{};
+			socklen_t addressLength = sizeof(remoteAddress);
+
+			// Accepted sockets stay blocking so handlers can use them directly; the loop only ever reads them with MSG_DONTWAIT
+			int fd = accept4(listenerFD, reinterpret_cast<sockaddr*>(&remoteAddress), &addressLength, SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				if (errno == EINTR || errno == ECONNABORTED) continue;
+				return; // EAGAIN, or out of descriptors until some connections close
+			}
+
+			int enable = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+			setSocketTimeouts(fd, requestTimeoutMS);
+
+			auto conn = std::make_unique<mg_connection>();
+			conn->fd = fd;
+			conn->engine = this;
+			formatRemoteAddress(remoteAddress, conn->requestInfo.remote_addr, sizeof(conn->requestInfo.remote_addr));
+
+			{
+				std::lock_guard<std::mutex> connectionLock(connectionMutex);
+				connections[fd] = std::move(conn);
+			}
+			addToEpoll(fd, CONNECTION_EVENTS);
+		}
+	}
+
+	mg_connection* findConnection(int fd)
+	{
+		std::lock_guard<std::mutex> connectionLock(connectionMutex);
+		auto connIter = connections.find(fd);
+		return (connIter != connections.end()) ? connIter->second.get() : nullptr;
+	}
+
+	void receiveRequestHead(int fd)
+	{
+		// The one-shot registration has fired, so nothing else touches this connection until it is rearmed or dispatched
+		mg_connection* conn = findConnection(fd);
+		if (conn == nullptr) return;
+
+		char chunk[READ_CHUNK_SIZE];
+		while (!conn->hasCompleteHead() && conn->buffer.size() <= MAX_HEAD_SIZE)
+		{
+			ssize_t received = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+			if (received > 0)
+			{
+				if (conn->buffer.empty()) conn->headStarted = Clock::now();
+				conn->buffer.append(chunk, received);
+			}
+			else if (received < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				break;
+			}
+			else
+			{
+				closeConnection(conn);
+				return;
+			}
+		}
+
+		conn->lastActivity = Clock::now();
+
+		if (conn->hasCompleteHead())
+		{
+			dispatch(conn);
+		}
+		else if (conn->buffer.size() > MAX_HEAD_SIZE)
+		{
+			static const char TOO_LARGE_RESPONSE[] = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+			send(fd, TOO_LARGE_RESPONSE, sizeof(TOO_LARGE_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+			closeConnection(conn);
+		}
+		else
+		{
+			rearm(conn);
+		}
+	}
+
+	void dispatch(mg_connection* conn)
+	{
+		{
+			std::lock_guard<std::mutex> connectionLock(connectionMutex);
+			conn->inWorker = true;
+		}
+		{
+			std::lock_guard<std::mutex> queueLock(queueMutex);
+			pendingRequests.push_back(conn);
+		}
+		queueCondition.notify_one();
+	}
+
+	void rearm(mg_connection* conn)
+	{
+		{
+			std::lock_guard<std::mutex> connectionLock(connectionMutex);
+			conn->inWorker = false;
+			conn->lastActivity = Clock::now();
+		}
+
+		epoll_event event{};
+		event.events = CONNECTION_EVENTS;
+		event.data.fd = conn->fd;
+		epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &event);
+	}
+
+	void closeConnection(mg_connection* conn)
+	{
+		std::lock_guard<std::mutex> connectionLock(connectionMutex);
+		int fd = conn->fd;
+		epoll_ctl(epollFD, EPOLL_CTL_DEL, fd, nullptr);
+		::close(fd);
+		connections.erase(fd);
+	}
+
+	void closeIdleConnections()
+	{
+		auto now = Clock::now();
+		auto timeout = std::chrono::milliseconds(requestTimeoutMS);
+		auto headerTimeout = std::chrono::milliseconds(headerTimeoutMS);
+
+		std::lock_guard<std::mutex> connectionLock(connectionMutex);
+		for (auto connIter = connections.begin(); connIter != connections.end();)
+		{
+			const mg_connection& conn = *connIter->second;
+			bool headOverdue = !conn.inWorker && !conn.buffer.empty() && now - conn.headStarted > headerTimeout;
+			if (headOverdue)
+			{
+				static const char TIMEOUT_RESPONSE[] = "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+				send(conn.fd, TIMEOUT_RESPONSE, sizeof(TIMEOUT_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+				++headerTimeoutCount;
+			}
+
+			if (headOverdue || (!conn.inWorker && now - conn.lastActivity > timeout))
+			{
+				epoll_ctl(epollFD, EPOLL_CTL_DEL, conn.fd, nullptr);
+				::close(conn.fd);
+				connIter = connections.erase(connIter);
+			}
+			else
+			{
+				++connIter;
+			}
+		}
+	}
+
+	void runWorker()
+	{
+		while (true)
+		{
+			mg_connection* conn;
+			{
+				std::unique_lock<std::mutex> queueLock(queueMutex);
+				queueCondition.wait(queueLock, [this] { return stopping || !pendingRequests.empty(); });
+				if (stopping) return;
+
+				conn = pendingRequests.front();
+				pendingRequests.pop_front();
+			}
+
+			serveConnection(conn);
+		}
+	}
+
+	enum class RequestOutcome
+	{
+		REUSABLE,
+		CLOSE,
+		SUSPENDED
+	};
+
+	void serveConnection(mg_connection* conn)
+	{
+		// Requests pipelined behind this one are answered here instead of taking a trip through the event loop
+		RequestOutcome outcome;
+		do
+		{
+			outcome = serveRequest(*conn);
+		} while (outcome == RequestOutcome::REUSABLE && !stopping && conn->hasCompleteHead());
+
+		if (outcome != RequestOutcome::SUSPENDED)
+		{
+			finishConnection(conn, outcome == RequestOutcome::REUSABLE);
+		}
+	}
+
+	// Hands a connection whose response is complete back to the event loop, or closes it
+	void finishConnection(mg_connection* conn, bool reusable)
+	{
+		if (stopping) return; // stop() closes whatever is left
+
+		if (!reusable) closeConnection(conn);
+		else if (conn->hasCompleteHead()) dispatch(conn);
+		else
+		{
+			// Part of the next head may already have arrived; its deadline starts now
+			conn->headStarted = Clock::now();
+			rearm(conn);
+		}
+	}
+
+	RequestOutcome serveRequest(mg_connection& conn)
+	{
+		if (!conn.parseRequestHead())
+		{
+			conn.clientKeepAlive = false;
+			mg_send_http_error(&conn, 400, "%s", "The request could not be parsed.");
+			return RequestOutcome::CLOSE;
+		}
+
+		{
+			std::lock_guard<std::mutex> connectionLock(connectionMutex);
+			conn.handlerRunning = true;
+		}
+
+		handleRequest(conn);
+
+		{
+			std::lock_guard<std::mutex> connectionLock(connectionMutex);
+			conn.handlerRunning = false;
+			if (conn.suspended && !conn.resumedEarly) return RequestOutcome::SUSPENDED;
+
+			conn.suspended = conn.resumedEarly = false;
+		}
+
+		if (!conn.responseStarted) conn.closeRequested = true;
+		return completeRequest(conn) ? RequestOutcome::REUSABLE : RequestOutcome::CLOSE;
+	}
+
+	// Discards the answered request from the buffer if the connection can carry another one
+	static bool completeRequest(mg_connection& conn)
+	{
+		if (!conn.isReusable()) return false;
+
+		conn.buffer.erase(0, conn.bodyOffset);
+		conn.bodyOffset = 0;
+		return true;
+	}
+
+	template <typename HandlerType>
+	static HandlerType* findHandler(const std::vector<std::pair<std::string, HandlerType*>>& registered, const std::string& uri)
+	{
+		// Like CivetWeb, a handler covers its own path and everything beneath it, and the most specific one wins
+		HandlerType* bestMatch = nullptr;
+		size_t bestLength = 0;
+		for (const auto& [prefix, handler] : registered)
+		{
+			bool matches = uri == prefix
+				|| (!prefix.empty() && uri.compare(0, prefix.size(), prefix) == 0
+					&& (prefix.back() == '/' || uri[prefix.size()] == '/'));
+
+			if (matches && (bestMatch == nullptr || prefix.size() > bestLength))
+			{
+				bestMatch = handler;
+				bestLength = prefix.size();
+			}
+		}
+
+		return bestMatch;
+	}
+
+	void handleRequest(mg_connection& conn)
+	{
+		CivetHandler* handler;
+		CivetAuthHandler* authHandler;
+		{
+			std::shared_lock<std::shared_mutex> handlerLock(handlerMutex);
+			handler = findHandler(handlers, conn.uri);
+			authHandler = findHandler(authHandlers, conn.uri);
+		}
+
+		try
+		{
+			if (authHandler != nullptr && !authHandler->authorize(&owner, &conn))
+			{
+				conn.closeRequested = true;
+				return;
+			}
+
+			if (handler == nullptr)
+			{
+				mg_send_http_error(&conn, 404, "%s", "Nothing is served at this path.");
+				return;
+			}
+
+			bool handled;
+			if (conn.method == "GET") handled = handler->handleGet(&owner, &conn);
+			else if (conn.method == "POST") handled = handler->handlePost(&owner, &conn);
+			else if (conn.method == "HEAD") handled = handler->handleHead(&owner, &conn);
+			else if (conn.method == "PUT") handled = handler->handlePut(&owner, &conn);
+			else if (conn.method == "DELETE") handled = handler->handleDelete(&owner, &conn);
+			else if (conn.method == "OPTIONS") handled = handler->handleOptions(&owner, &conn);
+			else if (conn.method == "PATCH") handled = handler->handlePatch(&owner, &conn);
+			else handled = false;
+
+			if (!handled && !conn.responseStarted)
+			{
+				mg_send_http_error(&conn, 405, "%s", "The method is not supported at this path.");
+			}
+		}
+		catch (const std::exception&)
+		{
+			if (!conn.responseStarted)
+			{
+				mg_send_http_error(&conn, 500, "%s", "The request could not be completed.");
+			}
+			conn.closeRequested = true;
+		}
+	}
+};
+
+CivetServer::CivetServer(const std::vector<std::string>& options) : engine(std::make_unique<Engine>(*this, options))
+{}
+
+void CivetServer::addHandler(const std::string& uri, CivetHandler& handler)
+{
+	std::unique_lock<std::shared_mutex> handlerLock(engine->handlerMutex);
+	auto& handlers = engine->handlers;
+	auto existing = std::find_if(handlers.begin(), handlers.end(), [&uri](const auto& entry) { return entry.first == uri; });
+	if (existing != handlers.end()) existing->second = &handler;
+	else handlers.emplace_back(uri, &handler);
+}
+
+void CivetServer::addAuthHandler(const std::string& uri, CivetAuthHandler& handler)
+{
+	std::unique_lock<std::shared_mutex> handlerLock(engine->handlerMutex);
+	auto& authHandlers = engine->authHandlers;
+	auto existing = std::find_if(authHandlers.begin(), authHandlers.end(), [&uri](const auto& entry) { return entry.first == uri; });
+	if (existing != authHandlers.end()) existing->second = &handler;
+	else authHandlers.emplace_back(uri, &handler);
+}
+
+void CivetServer::close()
+{
+	engine->stop();
+}
+
+CivetServer::~CivetServer()
+{
+	this->close();
+}
+
+unsigned mg_init_library(unsigned features)
+{
+	return features;
+}
+
+unsigned mg_exit_library(void)
+{
+	return 1;
+}
+
+const struct mg_request_info* mg_get_request_info(const struct mg_connection* conn)
+{
+	return &conn->requestInfo;
+}
+
+const char* mg_get_header(const struct mg_connection* conn, const char* name)
+{
+	return conn->findHeader(name);
+}
+
+namespace
+{
+	// Takes up to wanted body bytes from those that arrived with the head, or else straight from the socket into
+	// buf; returns what recv would
+	ssize_t receiveBodyBytes(mg_connection* conn, void* buf, size_t wanted)
+	{
+		size_t buffered = conn->buffer.size() - conn->bodyOffset;
+		if (buffered > 0)
+		{
+			size_t fromBuffer = std::min(wanted, buffered);
+			memcpy(buf, conn->buffer.data() + conn->bodyOffset, fromBuffer);
+			conn->bodyOffset += fromBuffer;
+			return static_cast<ssize_t>(fromBuffer);
+		}
+
+		ssize_t received;
+		do
+		{
+			received = recv(conn->fd, buf, wanted, 0);
+		} while (received < 0 && errno == EINTR);
+
+		return received;
+	}
+
+	// Reads a CRLF-terminated line of a chunked body, receiving more of the body as needed
+	bool readChunkLine(mg_connection* conn, std::string& line)
+	{
+		size_t lineEnd;
+		while ((lineEnd = conn->buffer.find("\r\n", conn->bodyOffset)) == std::string::npos)
+		{
+			if (conn->buffer.size() - conn->bodyOffset > MAX_CHUNK_LINE_SIZE) return false;
+
+			char chunk[READ_CHUNK_SIZE];
+			ssize_t received;
+			do
+			{
+				received = recv(conn->fd, chunk, sizeof(chunk), 0);
+			} while (received < 0 && errno == EINTR);
+			if (received <= 0) return false;
+
+			conn->buffer.append(chunk, received);
+		}
+
+		line = conn->buffer.substr(conn->bodyOffset, lineEnd - conn->bodyOffset);
+		conn->bodyOffset = lineEnd + 2;
+		return true;
+	}
+
+	int readChunkedBody(mg_connection* conn, void* buf, size_t len)
+	{
+		auto failBody = [conn]
+		{
+			conn->closeRequested = true;
+			return -1;
+		};
+
+		if (conn->chunkRemaining == 0)
+		{
+			// Each chunk's data is followed by a line break of its own
+			std::string line;
+			if (conn->chunkStarted && (!readChunkLine(conn, line) || !line.empty())) return failBody();
+			if (!readChunkLine(conn, line)) return failBody();
+
+			// Chunk extensions, after ';', are ignored
+			std::string sizeText = trimWhitespace(line.substr(0, line.find(';')));
+			char* endPtr;
+			errno = 0;
+			unsigned long long chunkSize = strtoull(sizeText.c_str(), &endPtr, 16);
+			if (sizeText.empty() || !isxdigit(static_cast<unsigned char>(sizeText[0])) || *endPtr != '\0' || errno != 0)
+			{
+				return failBody();
+			}
+			conn->chunkStarted = true;
+
+			if (chunkSize == 0)
+			{
+				// Trailer fields aren't passed on to handlers
+				do
+				{
+					if (!readChunkLine(conn, line)) return failBody();
+				} while (!line.empty());
+
+				conn->bodyRemaining = 0;
+				return 0;
+			}
+
+			conn->chunkRemaining = chunkSize;
+		}
+
+		size_t wanted = static_cast<size_t>(std::min<unsigned long long>({ len, conn->chunkRemaining, INT_MAX }));
+		ssize_t received = receiveBodyBytes(conn, buf, wanted);
+		if (received <= 0) return failBody();
+
+		conn->chunkRemaining -= received;
+		return static_cast<int>(received);
+	}
+}
+
+int mg_read(struct mg_connection* conn, void* buf, size_t len)
+{
+	if (conn->bodyRemaining <= 0 || len == 0) return 0;
+	if (conn->chunkedBody) return readChunkedBody(conn, buf, len);
+
+	size_t wanted = static_cast<size_t>(std::min<long long>({ static_cast<long long>(len), conn->bodyRemaining, INT_MAX }));
+
+	ssize_t received = receiveBodyBytes(conn, buf, wanted);
+
+	if (received == 0 && conn->isClient && conn->bodyRemaining == LLONG_MAX)
+	{
+		conn->bodyRemaining = 0; // Response without a length, delimited by the server closing the connection
+		return 0;
+	}
+	if (received <= 0)
+	{
+		conn->closeRequested = true;
+		return -1;
+	}
+
+	conn->bodyRemaining -= received;
+	return static_cast<int>(received);
+}
+
+int mg_write(struct mg_connection* conn, const void* buf, size_t len)
+{
+	const char* data = static_cast<const char*>(buf);
+	size_t sentTotal = 0;
+	while (sentTotal < len)
+	{
+		ssize_t sent = send(conn->fd, data + sentTotal, len - sentTotal, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0)
+		{
+			conn->closeRequested = true;
+			return -1;
+		}
+		sentTotal += sent;
+	}
+
+	return static_cast<int>(len);
+}
+
+int mg_printf(struct mg_connection* conn, const char* fmt, ...)
+{
+	va_list args, argsCopy;
+	va_start(args, fmt);
+	va_copy(argsCopy, args);
+	int length = vsnprintf(nullptr, 0, fmt, argsCopy);
+	va_end(argsCopy);
+
+	std::string formatted(std::max(length, 0), '\0');
+	if (length > 0) vsnprintf(formatted.data(), formatted.size() + 1, fmt, args);
+	va_end(args);
+
+	return (length < 0) ? -1 : mg_write(conn, formatted.data(), formatted.size());
+}
+
+int mg_response_header_start(struct mg_connection* conn, int status)
+{
+	if (conn->responseStarted) return -1;
+
+	conn->responseStarted = true;
+	conn->pendingStatus = status;
+	conn->pendingHeaders.clear();
+	return 0;
+}
+
+int mg_response_header_add(struct mg_connection* conn, const char* header, const char* value, int value_len)
+{
+	if (!conn->responseStarted) return -1;
+
+	conn->pendingHeaders.emplace_back(header, (value_len < 0) ? std::string(value) : std::string(value, value_len));
+	return 0;
+}
+
+int mg_response_header_send(struct mg_connection* conn)
+{
+	if (!conn->responseStarted) return -1;
+
+	std::string head = "HTTP/1.1 " + std::to_string(conn->pendingStatus) + ' ' + reasonPhrase(conn->pendingStatus) + "\r\n";
+	bool hasLength = false;
+	for (const auto& [name, value] : conn->pendingHeaders)
+	{
+		if (equalsIgnoreCase(name, "Connection")) continue;
+		hasLength = hasLength || equalsIgnoreCase(name, "Content-Length");
+		head += name + ": " + value + "\r\n";
+	}
+
+	// Without a length, the end of the body can only be signalled by closing the connection
+	conn->responseDelimited = hasLength;
+	bool keepAlive = hasLength && conn->clientKeepAlive && !conn->closeRequested;
+	head += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+	if (!keepAlive) conn->closeRequested = true;
+
+	conn->pendingHeaders.clear();
+	return (mg_write(conn, head.data(), head.size()) < 0) ? -1 : 0;
+}
+
+int mg_send_http_ok(struct mg_connection* conn, const char* mime_type, long long content_length)
+{
+	if (mg_response_header_start(conn, 200) != 0) return -1;
+	mg_response_header_add(conn, "Content-Type", mime_type, -1);
+	if (content_length >= 0)
+	{
+		mg_response_header_add(conn, "Content-Length", std::to_string(content_length).c_str(), -1);
+	}
+	return mg_response_header_send(conn);
+}
+
+int mg_send_http_error(struct mg_connection* conn, int status_code, const char* fmt, ...)
+{
+	va_list args, argsCopy;
+	va_start(args, fmt);
+	va_copy(argsCopy, args);
+	int length = vsnprintf(nullptr, 0, fmt, argsCopy);
+	va_end(argsCopy);
+
+	std::string message(std::max(length, 0), '\0');
+	if (length > 0) vsnprintf(message.data(), message.size() + 1, fmt, args);
+	va_end(args);
+
+	if (mg_response_header_start(conn, status_code) != 0) return -1;
+	mg_response_header_add(conn, "Content-Type", "text/plain; charset=utf-8", -1);
+	mg_response_header_add(conn, "Content-Length", std::to_string(message.size()).c_str(), -1);
+	if (mg_response_header_send(conn) != 0) return -1;
+
+	if (conn->method == "HEAD") return 0;
+	return (mg_write(conn, message.data(), message.size()) < 0) ? -1 : 0;
+}
+
+void mg_send_mime_file(struct mg_connection* conn, const char* path, const char* mime_type)
+{
+	int fileFD = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat fileInfo;
+	if (fileFD < 0 || fstat(fileFD, &fileInfo) != 0 || !S_ISREG(fileInfo.st_mode))
+	{
+		if (fileFD >= 0) ::close(fileFD);
+		mg_send_http_error(conn, 404, "%s", "File not found");
+		return;
+	}
+
+	mg_response_header_start(conn, 200);
+	mg_response_header_add(conn, "Content-Type", (mime_type != nullptr) ? mime_type : guessMimeType(path), -1);
+	mg_response_header_add(conn, "Content-Length", std::to_string(fileInfo.st_size).c_str(), -1);
+
+	if (mg_response_header_send(conn) == 0 && conn->method != "HEAD")
+	{
+		off_t offset = 0;
+		while (offset < fileInfo.st_size)
+		{
+			ssize_t sent = sendfile(conn->fd, fileFD, &offset, fileInfo.st_size - offset);
+			if (sent < 0 && errno == EINTR) continue;
+			if (sent <= 0)
+			{
+				conn->closeRequested = true;
+				break;
+			}
+		}
+	}
+
+	::close(fileFD);
+}
+
+void mg_suspend_request(struct mg_connection* conn)
+{
+	std::lock_guard<std::mutex> connectionLock(conn->engine->connectionMutex);
+	if (conn->suspended) return;
+
+	conn->suspended = true;
+	conn->resumedEarly = false;
+	++conn->engine->suspendedCount;
+}
+
+void mg_resume_request(struct mg_connection* conn)
+{
+	CivetServer::Engine& engine = *conn->engine;
+	bool finishNow;
+	{
+		std::lock_guard<std::mutex> connectionLock(engine.connectionMutex);
+		if (!conn->suspended || conn->resumedEarly) return;
+
+		// If the handler is still running, the worker finishes the request as usual once it returns
+		finishNow = !conn->handlerRunning;
+		if (finishNow) conn->suspended = false;
+		else conn->resumedEarly = true;
+	}
+
+	if (finishNow)
+	{
+		engine.finishConnection(conn, CivetServer::Engine::completeRequest(*conn));
+	}
+
+	std::lock_guard<std::mutex> connectionLock(engine.connectionMutex);
+	--engine.suspendedCount;
+	engine.suspendedDrained.notify_all();
+}
+
+int mg_wait_for_body(struct mg_connection* conn, int timeout_ms)
+{
+	if (conn->bodyRemaining <= 0 || conn->buffer.size() > conn->bodyOffset) return 1;
+
+	pollfd descriptor{ conn->fd, POLLIN, 0 };
+	int ready;
+	do
+	{
+		ready = poll(&descriptor, 1, timeout_ms);
+	} while (ready < 0 && errno == EINTR);
+
+	return (ready < 0) ? -1 : (ready > 0 ? 1 : 0);
+}
+
+unsigned long long mg_get_header_timeout_count(void)
+{
+	return headerTimeoutCount;
+}
+
+int mg_client_disconnected(const struct mg_connection* conn)
+{
+	char probe;
+	ssize_t received = recv(conn->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (received == 0) return 1;
+	if (received < 0) return (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ? 1 : 0;
+	return 0;
+}
+
+void mg_close_connection(struct mg_connection* conn)
+{
+	if (conn->isClient)
+	{
+		::close(conn->fd);
+		delete conn;
+	}
+	else
+	{
+		conn->closeRequested = true;
+	}
+}
+
+mg_connection* mg_connect_client(const char* host, int port, int use_ssl, char* error_buffer, size_t error_buffer_size)
+{
+	auto reportError = [=](const std::string& message) -> mg_connection*
+	{
+		if (error_buffer != nullptr && error_buffer_size > 0)
+		{
+			snprintf(error_buffer, error_buffer_size, "%s", message.c_str());
+		}
+		return nullptr;
+	};
+
+	if (use_ssl)
+	{
+		return reportError("TLS is not supported by the native HTTP backend.");
+	}
+
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo* addresses;
+	int lookupResult = getaddrinfo(host, std::to_string(port).c_str(), &hints, &addresses);
+	if (lookupResult != 0)
+	{
+		return reportError(gai_strerror(lookupResult));
+	}
+
+	int fd = -1;
+	for (addrinfo* address = addresses; address != nullptr; address = address->ai_next)
+	{
+		fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+		if (fd < 0) continue;
+		if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) break;
+
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+
+	if (fd < 0)
+	{
+		return reportError(std::string("Could not connect: ") + strerror(errno));
+	}
+
+	auto conn = new mg_connection;
+	conn->fd = fd;
+	conn->isClient = true;
+	return conn;
+}
+
+int mg_get_response(struct mg_connection* conn, char* ebuf, size_t ebuf_len, int timeout)
+{
+	auto reportError = [=](const char* message)
+	{
+		if (ebuf != nullptr && ebuf_len > 0)
+		{
+			snprintf(ebuf, ebuf_len, "%s", message);
+		}
+		return -1;
+	};
+
+	setSocketTimeouts(conn->fd, std::max(timeout, 0));
+
+	char chunk[READ_CHUNK_SIZE];
+	while (!conn->hasCompleteHead())
+	{
+		if (conn->buffer.size() > MAX_HEAD_SIZE) return reportError("Response head is too large.");
+
+		ssize_t received = recv(conn->fd, chunk, sizeof(chunk), 0);
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0) return reportError("Connection closed before a response was received.");
+
+		conn->buffer.append(chunk, received);
+	}
+
+	size_t headEnd = conn->buffer.find(HEAD_TERMINATOR);
+	std::string head = conn->buffer.substr(0, headEnd);
+	conn->bodyOffset = headEnd + strlen(HEAD_TERMINATOR);
+
+	size_t statusLineEnd = std::min(head.find("\r\n"), head.size());
+	std::string statusLine = head.substr(0, statusLineEnd);
+	if (statusLine.compare(0, 7, "HTTP/1.") != 0 || statusLine.size() < 12)
+	{
+		return reportError("Malformed response status line.");
+	}
+
+	conn->responseInfo.status_code = atoi(statusLine.c_str() + 9);
+	conn->headers.clear();
+	if (!parseHeaderLines(head, statusLineEnd + 2, conn->headers))
+	{
+		return reportError("Malformed response headers.");
+	}
+
+	const char* lengthHeader = conn->findHeader("Content-Length");
+	conn->bodyRemaining = (lengthHeader != nullptr) ? std::max(atoll(lengthHeader), 0LL) : LLONG_MAX;
+	return 0;
+}
+
+const struct mg_response_info* mg_get_response_info(const struct mg_connection* conn)
+{
+	return &conn->responseInfo;
+}
@@ -0,0 +1,138 @@
+#pragma once
+// Native HTTP backend exposing the subset of the CivetWeb API that the handlers use, so they can be compiled
+// against either library without changes. Connections are owned by a single epoll loop while they are idle
+// or still sending their request head, and are only handed to the worker pool once a complete request has
+// arrived; an idle or slow client therefore costs a file descriptor and a small buffer instead of a thread.
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#define CIVETWEB_VERSION "1.0.0.0-NATIVE"
+
+class CivetAuthHandler;
+class CivetHandler;
+
+struct mg_connection;
+
+struct mg_request_info
+{
+	const char* request_method = nullptr;
+	const char* request_uri = nullptr;
+	const char* query_string = nullptr;
+	const char* http_version = nullptr;
+	char remote_addr[48] = {};
+	long long content_length = -1;
+};
+
+struct mg_response_info
+{
+	int status_code = 0;
+};
+
+class CivetServer
+{
+public:
+	struct Engine;
+
+	// Recognized options are "listening_ports", "num_threads", "request_timeout_ms" (how long an idle connection
+	// is kept open), "header_timeout_ms" (how long a client may take to send a request head, however slowly it
+	// trickles in) and "document_root" (accepted for compatibility; files are only ever served by handlers).
+	CivetServer(const std::vector<std::string>& options);
+
+	void addHandler(const std::string& uri, CivetHandler& handler);
+	void addAuthHandler(const std::string& uri, CivetAuthHandler& handler);
+
+	void close();
+	virtual ~CivetServer();
+
+private:
+	std::unique_ptr<Engine> engine;
+};
+
+class CivetHandler
+{
+public:
+	virtual ~CivetHandler()
+	{
+	}
+
+	virtual bool handleGet(CivetServer* server, struct mg_connection* conn) { return false; }
+	virtual bool handlePost(CivetServer* server, struct mg_connection* conn) { return false; }
+	virtual bool handleHead(CivetServer* server, struct mg_connection* conn) { return false; }
+	virtual bool handlePut(CivetServer* server, struct mg_connection* conn) { return false; }
+	virtual bool handleDelete(CivetServer* server, struct mg_connection* conn) { return false; }
+	virtual bool handleOptions(CivetServer* server, struct mg_connection* conn) { return false; }
+	virtual bool handlePatch(CivetServer* server, struct mg_connection* conn) { return false; }
+};
+
+class CivetAuthHandler
+{
+public:
+	virtual ~CivetAuthHandler()
+	{
+	}
+
+	// It is up to this handler to send the error response if authorization fails.
+	virtual bool authorize(CivetServer* server, struct mg_connection* conn) = 0;
+};
+
+class CivetException : public std::runtime_error
+{
+public:
+	CivetException(const std::string& msg) : std::runtime_error(msg)
+	{}
+};
+
+unsigned mg_init_library(unsigned features);
+unsigned mg_exit_library(void);
+
+const struct mg_request_info* mg_get_request_info(const struct mg_connection* conn);
+const char* mg_get_header(const struct mg_connection* conn, const char* name);
+
+// Reads request body bytes directly into buf, decoding chunked bodies (whose content_length is -1) as CivetWeb
+// does; returns 0 once the body has been consumed and -1 on error.
+int mg_read(struct mg_connection* conn, void* buf, size_t len);
+int mg_write(struct mg_connection* conn, const void* buf, size_t len);
+int mg_printf(struct mg_connection* conn, const char* fmt, ...);
+
+int mg_response_header_start(struct mg_connection* conn, int status);
+int mg_response_header_add(struct mg_connection* conn, const char* header, const char* value, int value_len);
+int mg_response_header_send(struct mg_connection* conn);
+
+// content_length < 0 means the length is not known up front, in which case the connection is closed after
+// the response instead of being kept alive.
+int mg_send_http_ok(struct mg_connection* conn, const char* mime_type, long long content_length);
+int mg_send_http_error(struct mg_connection* conn, int status_code, const char* fmt, ...);
+
+// Sends the file with sendfile(2), so its contents are never copied through user space.
+void mg_send_mime_file(struct mg_connection* conn, const char* path, const char* mime_type);
+
+// On a server connection this only asks for the socket to be closed once the handler returns.
+void mg_close_connection(struct mg_connection* conn);
+
+// Extension to the CivetWeb API: a handler may suspend its request and return, leaving the connection open
+// until some other thread has written the response and resumes it. Resuming before the handler has returned
+// is allowed.
+#define MG_CAN_SUSPEND_REQUESTS 1
+void mg_suspend_request(struct mg_connection* conn);
+void mg_resume_request(struct mg_connection* conn);
+
+// Extension to the CivetWeb API: returns nonzero once the client has closed its end of the connection, so a
+// handler waiting on something slow can give up early.
+#define MG_CAN_DETECT_DISCONNECT 1
+int mg_client_disconnected(const struct mg_connection* conn);
+
+// Extension to the CivetWeb API: waits up to timeout_ms for request body data to become readable. Returns 1 if
+// mg_read won't block, 0 on timeout and -1 on error.
+#define MG_CAN_WAIT_FOR_BODY 1
+int mg_wait_for_body(struct mg_connection* conn, int timeout_ms);
+
+// Extension to the CivetWeb API: how many connections, across all servers, were closed for not sending their
+// request head within header_timeout_ms.
+#define MG_CAN_LIMIT_HEADER_TIME 1
+unsigned long long mg_get_header_timeout_count(void);
+
+mg_connection* mg_connect_client(const char* host, int port, int use_ssl, char* error_buffer, size_t error_buffer_size);
+int mg_get_response(struct mg_connection* conn, char* ebuf, size_t ebuf_len, int timeout);
+const struct mg_response_info* mg_get_response_info(const struct mg_connection* conn);
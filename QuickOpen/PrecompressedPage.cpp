@@ -0,0 +1,131 @@
+#include "PrecompressedPage.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace
+{
+	// Deflates text as a raw deflate stream that ends on a byte boundary without a final block, so that more
+	// blocks can follow it; the last part of the page is finished normally instead.
+	std::string deflateText(const std::string& text, bool isLastPart)
+	{
+		z_stream stream = {};
+		if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			throw std::runtime_error("Could not initialize the page compressor.");
+		}
+
+		std::string deflated(deflateBound(&stream, text.size()) + 16, '\0');
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+		stream.avail_in = static_cast<uInt>(text.size());
+		stream.next_out = reinterpret_cast<Bytef*>(deflated.data());
+		stream.avail_out = static_cast<uInt>(deflated.size());
+
+		int result = deflate(&stream, isLastPart ? Z_FINISH : Z_FULL_FLUSH);
+		bool outputComplete = (stream.avail_out > 0);
+		deflated.resize(stream.total_out);
+		deflateEnd(&stream);
+
+		if (result != (isLastPart ? Z_STREAM_END : Z_OK) || !outputComplete)
+		{
+			throw std::runtime_error("Could not compress the page.");
+		}
+
+		return deflated;
+	}
+
+	void appendLittleEndian32(std::string& output, unsigned long value)
+	{
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			output += static_cast<char>((value >> shift) & 0xFF);
+		}
+	}
+
+	// Stored blocks hold at most 65535 bytes each
+	void appendStoredBlocks(std::string& output, const std::string& data)
+	{
+		static const size_t MAX_STORED_LENGTH = 0xFFFF;
+
+		for (size_t offset = 0; offset < data.size(); offset += MAX_STORED_LENGTH)
+		{
+			size_t length = std::min(data.size() - offset, MAX_STORED_LENGTH);
+
+			// BFINAL = 0, BTYPE = 00, padded to the byte boundary
+			output += '\0';
+			output += static_cast<char>(length & 0xFF);
+			output += static_cast<char>(length >> 8);
+			output += static_cast<char>(~length & 0xFF);
+			output += static_cast<char>((~length >> 8) & 0xFF);
+			output.append(data, offset, length);
+		}
+	}
+}
+
+PrecompressedPage::PrecompressedPage(const std::vector<std::string>& staticParts) : plainParts(staticParts)
+{
+	if (staticParts.empty())
+	{
+		throw std::invalid_argument("A page needs at least one static part.");
+	}
+
+	for (size_t i = 0; i < staticParts.size(); ++i)
+	{
+		DeflatedText& thisPart = deflatedParts.emplace_back();
+		thisPart.deflated = deflateText(staticParts[i], i + 1 == staticParts.size());
+		thisPart.crc = crc32(0, reinterpret_cast<const Bytef*>(staticParts[i].data()), static_cast<uInt>(staticParts[i].size()));
+		thisPart.length = staticParts[i].size();
+	}
+}
+
+std::string PrecompressedPage::renderGzip(const std::vector<std::string>& values) const
+{
+	if (values.size() != valueCount())
+	{
+		throw std::invalid_argument("The number of values does not match the page.");
+	}
+
+	// ID1, ID2, CM = deflate, no flags, no modification time, no extra flags, OS unknown
+	std::string output("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+	unsigned long crc = crc32(0, nullptr, 0);
+	unsigned long long totalLength = 0;
+
+	for (size_t i = 0; i < deflatedParts.size(); ++i)
+	{
+		if (i > 0)
+		{
+			const std::string& value = values[i - 1];
+			appendStoredBlocks(output, value);
+			crc = crc32_combine(crc, crc32(0, reinterpret_cast<const Bytef*>(value.data()), static_cast<uInt>(value.size())),
+				static_cast<z_off_t>(value.size()));
+			totalLength += value.size();
+		}
+
+		output += deflatedParts[i].deflated;
+		crc = crc32_combine(crc, deflatedParts[i].crc, static_cast<z_off_t>(deflatedParts[i].length));
+		totalLength += deflatedParts[i].length;
+	}
+
+	appendLittleEndian32(output, crc);
+	appendLittleEndian32(output, static_cast<unsigned long>(totalLength & 0xFFFFFFFF));
+	return output;
+}
+
+std::string PrecompressedPage::renderPlain(const std::vector<std::string>& values) const
+{
+	if (values.size() != valueCount())
+	{
+		throw std::invalid_argument("The number of values does not match the page.");
+	}
+
+	std::string output = plainParts[0];
+	for (size_t i = 0; i < values.size(); ++i)
+	{
+		output += values[i];
+		output += plainParts[i + 1];
+	}
+
+	return output;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A page of static text with per-request values spliced in, served gzip-compressed without compressing
+// anything per request. Each run of static text is deflated once into a byte-aligned, self-contained run of
+// deflate blocks; a response places the values between them as stored (uncompressed) blocks and combines the
+// per-part CRCs for the gzip trailer.
+class PrecompressedPage
+{
+	struct DeflatedText
+	{
+		std::string deflated;
+		unsigned long crc = 0;
+		size_t length = 0;
+	};
+
+	std::vector<DeflatedText> deflatedParts;
+	std::vector<std::string> plainParts;
+
+public:
+	// staticParts[i] comes before the i-th value; there is one more static part than there are values
+	explicit PrecompressedPage(const std::vector<std::string>& staticParts);
+
+	size_t valueCount() const
+	{
+		return plainParts.size() - 1;
+	}
+
+	std::string renderGzip(const std::vector<std::string>& values) const;
+	std::string renderPlain(const std::vector<std::string>& values) const;
+};
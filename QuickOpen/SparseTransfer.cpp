@@ -0,0 +1,23 @@
+#include "SparseTransfer.h"
+
+#include <cstring>
+
+bool SparseTransfer::isAllZero(const char* data, size_t length)
+{
+	uint64_t accumulated = 0;
+	size_t wordCount = length / sizeof(uint64_t);
+
+	for (size_t i = 0; i < wordCount; ++i)
+	{
+		uint64_t word;
+		std::memcpy(&word, data + i * sizeof(uint64_t), sizeof(uint64_t));
+		accumulated |= word;
+	}
+
+	for (size_t i = wordCount * sizeof(uint64_t); i < length; ++i)
+	{
+		accumulated |= static_cast<unsigned char>(data[i]);
+	}
+
+	return accumulated == 0;
+}
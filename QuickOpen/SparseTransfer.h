@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Sparse transfer: the sender describes a file as a sequence of data extents and holes (runs of zeros), so
+// that zero regions are neither sent nor written.
+namespace SparseTransfer
+{
+	// Record types of the sparse body; integers are little-endian
+	enum RecordType : uint8_t
+	{
+		// followed by a uint32 length and that many bytes of data
+		DATA_RECORD = 1,
+		// followed by a uint64 length of zeros
+		HOLE_RECORD = 2
+	};
+
+	static constexpr uint32_t MAX_DATA_LENGTH = 1U << 24;
+
+	// Granularity at which the receiver looks for zeros inside data extents; one page on common filesystems
+	static constexpr size_t ZERO_BLOCK_SIZE = 4096;
+
+	// Written as a branch-free OR reduction over machine words so that the compiler can vectorize it
+	bool isAllZero(const char* data, size_t length);
+}
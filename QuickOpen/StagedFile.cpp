@@ -0,0 +1,122 @@
+#include "StagedFile.h"
+
+#include "PlatformUtils.h"
+
+#include <filesystem>
+#include <iostream>
+
+StagedFile::StagedFile(const wxFileName& destination, const DurabilityPolicy& policy, const wxFileName& existingData) :
+	destination(destination),
+	tempFileName(destination.GetPath(), wxString() << wxT(".") << destination.GetFullName() << wxT(".")
+		<< generateCryptoRandomInteger<uint32_t>() << wxT(".part")),
+	policy(policy)
+{
+	bool appending = existingData.IsOk();
+	if (appending && !wxRenameFile(existingData.GetFullPath(), tempFileName.GetFullPath(), true))
+	{
+		throw std::ios_base::failure("The data already received could not be moved to the destination folder.");
+	}
+
+	try
+	{
+		outStream.exceptions(std::ofstream::failbit);
+		auto openMode = std::ofstream::binary | (appending ? std::ofstream::app : std::ofstream::trunc);
+#ifdef WIN32
+		outStream.open(tempFileName.GetFullPath().ToStdWstring(), openMode);
+#else
+		outStream.open(tempFileName.GetFullPath(), openMode);
+#endif
+
+		if (policy.mode != DurabilityPolicy::NONE)
+		{
+			syncHandle = std::make_unique<FileSyncHandle>(tempFileName);
+		}
+	}
+	catch (...)
+	{
+		outStream.exceptions(std::ofstream::goodbit);
+		outStream.close();
+		wxRemoveFile(tempFileName.GetFullPath());
+		throw;
+	}
+}
+
+StagedFile::~StagedFile()
+{
+	if (!published)
+	{
+		outStream.exceptions(std::ofstream::goodbit);
+		outStream.close();
+		syncHandle.reset();
+		wxRemoveFile(tempFileName.GetFullPath());
+	}
+}
+
+void StagedFile::wrote(unsigned long long endOffset)
+{
+	if (policy.mode != DurabilityPolicy::PERIODIC || endOffset < writebackEnd + policy.syncIntervalBytes)
+	{
+		return;
+	}
+
+	outStream.flush();
+
+	// The previous range has had a whole interval to be written back, so waiting for it rarely blocks, while
+	// no more than two intervals of the file are ever dirty
+	syncHandle->startWriteback(writebackEnd, endOffset - writebackEnd);
+	if (writebackEnd > writebackStart)
+	{
+		syncHandle->finishWriteback(writebackStart, writebackEnd - writebackStart);
+	}
+
+	writebackStart = writebackEnd;
+	writebackEnd = endOffset;
+}
+
+void StagedFile::resize(unsigned long long size)
+{
+	outStream.flush();
+
+	// Extending the file over a trailing hole (ftruncate/SetEndOfFile) allocates nothing
+	std::error_code resizeError;
+#ifdef WIN32
+	std::filesystem::resize_file(tempFileName.GetFullPath().ToStdWstring(), size, resizeError);
+#else
+	std::filesystem::resize_file(std::string(tempFileName.GetFullPath().ToUTF8()), size, resizeError);
+#endif
+	if (resizeError)
+	{
+		throw std::ios_base::failure("The file could not be extended to its full length.", resizeError);
+	}
+}
+
+void StagedFile::publish()
+{
+	outStream.close();
+
+	if (syncHandle)
+	{
+		syncHandle->syncData();
+		syncHandle.reset();
+	}
+
+	if (!wxRenameFile(tempFileName.GetFullPath(), destination.GetFullPath(), true))
+	{
+		throw std::ios_base::failure("The received file could not be moved to its destination.");
+	}
+
+	published = true;
+
+	// The file is complete and in place either way, so a failure here shouldn't fail the upload
+	if (policy.mode != DurabilityPolicy::NONE)
+	{
+		try
+		{
+			syncDirectory(destination);
+		}
+		catch (const std::system_error& ex)
+		{
+			std::cerr << "WARNING: Could not sync the destination folder: " << ex.what() << std::endl;
+		}
+	}
+}
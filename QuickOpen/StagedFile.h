@@ -0,0 +1,81 @@
+#pragma once
+
+#include <wx/filename.h>
+
+#include <nlohmann/json.hpp>
+
+#include <fstream>
+#include <memory>
+
+class FileSyncHandle;
+
+// When received files are forced to disk
+struct DurabilityPolicy
+{
+	enum Mode
+	{
+		// Left to the OS; a crash soon after an upload may lose it, but never leaves a partial file in its place
+		NONE,
+		// The file's data is synced before it is put in place, so a file that is there is complete
+		SYNC_ON_COMPLETE,
+		// As SYNC_ON_COMPLETE, and data is also written back every syncIntervalBytes while the upload runs, so
+		// that a large upload doesn't build up a backlog of dirty pages that stalls the system when flushed
+		PERIODIC
+	};
+
+	Mode mode = PERIODIC;
+	unsigned long long syncIntervalBytes = 8ULL << 20;
+
+	NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(DurabilityPolicy, mode, syncIntervalBytes)
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(DurabilityPolicy::Mode, {
+	{ DurabilityPolicy::NONE, "none" },
+	{ DurabilityPolicy::SYNC_ON_COMPLETE, "syncOnComplete" },
+	{ DurabilityPolicy::PERIODIC, "periodic" }
+})
+
+// A file written under a temporary name in its destination's folder, and only renamed over the destination by
+// publish() once it is complete. A staged file that is never published is deleted, so failed or interrupted
+// uploads leave nothing behind that looks like a finished file.
+class StagedFile
+{
+	wxFileName destination, tempFileName;
+	DurabilityPolicy policy;
+	std::ofstream outStream;
+	std::unique_ptr<FileSyncHandle> syncHandle;
+	// Writeback of [writebackStart, writebackEnd) has been started; data from writebackEnd onwards hasn't
+	unsigned long long writebackStart = 0,
+		writebackEnd = 0;
+	bool published = false;
+
+public:
+	// Data already received for the file (e.g. into quarantine before consent was given) can be passed as
+	// existingData; it is moved to the temporary name and appended to, in which case the stream can't seek.
+	StagedFile(const wxFileName& destination, const DurabilityPolicy& policy, const wxFileName& existingData = wxFileName());
+	~StagedFile();
+
+	StagedFile(const StagedFile&) = delete;
+	StagedFile& operator=(const StagedFile&) = delete;
+
+	// Throws std::ios_base::failure when a write fails
+	std::ofstream& stream()
+	{
+		return outStream;
+	}
+
+	const wxFileName& getTempFileName() const
+	{
+		return tempFileName;
+	}
+
+	// Tells the file that everything before endOffset has been written through stream(), so that it can be
+	// written back under the PERIODIC policy. Called from whichever thread writes.
+	void wrote(unsigned long long endOffset);
+
+	// Sets the file's length, e.g. to extend it over a trailing hole
+	void resize(unsigned long long size);
+
+	// Closes the file, syncs it as the policy asks and renames it over the destination
+	void publish();
+};
@@ -0,0 +1,234 @@
+#include "StreamingOpen.h"
+
+#include "PlatformUtils.h"
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+struct StreamingOpen::Feed
+{
+	std::unique_ptr<PipeWriter> pipe;
+	std::chrono::milliseconds stallTimeout;
+
+	std::mutex feedMutex;
+	std::condition_variable dataQueued, roomAvailable;
+	std::deque<std::vector<char>> chunks;
+	size_t queuedBytes = 0;
+	// inputEnded once the whole file has been queued; dropped once the program is no longer fed
+	bool inputEnded = false,
+		dropped = false;
+
+	// Called with feedMutex held
+	void drop()
+	{
+		dropped = true;
+		chunks.clear();
+		queuedBytes = 0;
+		dataQueued.notify_all();
+		roomAvailable.notify_all();
+	}
+
+	void run()
+	{
+		while (true)
+		{
+			std::vector<char> chunk;
+			{
+				std::unique_lock<std::mutex> lock(feedMutex);
+				dataQueued.wait(lock, [this] { return dropped || inputEnded || !chunks.empty(); });
+				if (dropped || chunks.empty())
+				{
+					break;
+				}
+
+				chunk = std::move(chunks.front());
+				chunks.pop_front();
+				queuedBytes -= chunk.size();
+				roomAvailable.notify_all();
+			}
+
+			try
+			{
+				if (!pipe->write(chunk.data(), chunk.size(), stallTimeout))
+				{
+					std::cerr << "WARNING: The program opening the file stopped reading it; the rest is only saved." << std::endl;
+					break;
+				}
+			}
+			catch (const std::system_error& ex)
+			{
+				std::cerr << "WARNING: Couldn't pass the file on to the program opening it: " << ex.what() << std::endl;
+				break;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(feedMutex);
+			drop();
+		}
+
+		// The program sees the end of its input
+		pipe.reset();
+	}
+};
+
+// Fills in the path the program reads from
+static std::vector<wxString> programArgs(const std::vector<wxString>& handlerArgs, const wxFileName& inputPath)
+{
+	std::vector<wxString> args = handlerArgs;
+	bool pathPassed = false;
+
+	for (auto& arg : args)
+	{
+		pathPassed |= (arg.Replace(wxT("%f"), inputPath.GetFullPath()) > 0);
+	}
+
+	if (!pathPassed)
+	{
+		args.push_back(inputPath.GetFullPath());
+	}
+
+	return args;
+}
+
+const StreamingOpenHandler* StreamingOpen::findHandler(const std::vector<StreamingOpenHandler>& handlers, const wxFileName& fileName)
+{
+	for (const auto& handler : handlers)
+	{
+		for (const auto& extension : handler.extensions)
+		{
+			if (fileName.GetExt().IsSameAs(extension, false))
+			{
+				return &handler;
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+StreamingOpen::StreamingOpen(const StreamingOpenHandler& handler, const wxFileName& destination, const wxFileName& growingFile,
+	std::chrono::milliseconds stallTimeout) :
+	feed(std::make_shared<Feed>())
+{
+	feed->stallTimeout = stallTimeout;
+	auto& pipe = feed->pipe;
+
+	StreamingOpenHandler::InputMode input = handler.input;
+#ifdef WIN32
+	if (input == StreamingOpenHandler::FIFO)
+	{
+		input = StreamingOpenHandler::GROWING_FILE;
+	}
+#endif
+
+	switch (input)
+	{
+	case StreamingOpenHandler::STDIN:
+		pipe = startSubprocessWithInput(handler.program, handler.args);
+		break;
+
+	case StreamingOpenHandler::GROWING_FILE:
+		startSubprocess(handler.program, programArgs(handler.args, growingFile));
+		break;
+
+#ifndef WIN32
+	case StreamingOpenHandler::FIFO:
+	{
+		// Named after the file, so that programs which go by the extension recognize it
+		wxFileName fifoPath(destination.GetPath(), wxString() << wxT(".") << generateCryptoRandomInteger<uint32_t>()
+			<< wxT(".") << destination.GetFullName());
+		createFIFO(fifoPath);
+
+		try
+		{
+			startSubprocess(handler.program, programArgs(handler.args, fifoPath));
+			pipe = openFIFOWriter(fifoPath, stallTimeout);
+		}
+		catch (...)
+		{
+			wxRemoveFile(fifoPath.GetFullPath());
+			throw;
+		}
+
+		// Once opened, the FIFO stays usable without its name
+		wxRemoveFile(fifoPath.GetFullPath());
+		if (pipe == nullptr)
+		{
+			std::cerr << "WARNING: \"" << handler.program << "\" did not open its input in time." << std::endl;
+		}
+		break;
+	}
+#endif
+	}
+
+	if (pipe == nullptr)
+	{
+		feed.reset();
+		return;
+	}
+
+	// Not joined, so that finishing the upload doesn't wait for the program to take in the end of the file;
+	// the thread only holds on to the feed, and ends once the queue is empty or the program is dropped
+	std::thread([feed = this->feed] { feed->run(); }).detach();
+}
+
+StreamingOpen::~StreamingOpen()
+{
+	if (feed != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(feed->feedMutex);
+		feed->inputEnded = true;
+		feed->dataQueued.notify_all();
+	}
+}
+
+void StreamingOpen::write(const char* data, size_t length)
+{
+	if (feed == nullptr)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(feed->feedMutex);
+	if (feed->dropped)
+	{
+		return;
+	}
+
+	if (feed->queuedBytes + length > MAX_QUEUED_BYTES)
+	{
+		std::cerr << "WARNING: The program opening the file fell behind; the rest is only saved." << std::endl;
+		feed->drop();
+		return;
+	}
+
+	feed->chunks.emplace_back(data, data + length);
+	feed->queuedBytes += length;
+	feed->dataQueued.notify_all();
+}
+
+std::chrono::steady_clock::duration StreamingOpen::writeWaiting(const char* data, size_t length)
+{
+	if (feed == nullptr)
+	{
+		return std::chrono::steady_clock::duration::zero();
+	}
+
+	auto startTime = std::chrono::steady_clock::now();
+	{
+		// A program that stops taking data is dropped after stallTimeout, which ends the wait
+		std::unique_lock<std::mutex> lock(feed->feedMutex);
+		feed->roomAvailable.wait(lock, [this, length]
+		{
+			return feed->dropped || feed->queuedBytes == 0 || feed->queuedBytes + length <= MAX_QUEUED_BYTES;
+		});
+	}
+
+	write(data, length);
+	return std::chrono::steady_clock::now() - startTime;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <wx/filename.h>
+
+#include <nlohmann/json.hpp>
+
+#include "Utils.h"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+// A program that opens received files of some types while they are still arriving, rather than once the
+// upload has finished. The file is still saved as usual.
+struct StreamingOpenHandler
+{
+	enum InputMode
+	{
+		// The data is piped into the program's standard input
+		STDIN,
+		// The program is given the path of a FIFO that the data is written into. Linux only; elsewhere the
+		// program is given the growing file instead.
+		FIFO,
+		// The program is given the path of the file being received, which it reads as it grows (like "tail -f").
+		// On Windows, the program must allow the file to be renamed while it has it open (FILE_SHARE_DELETE),
+		// or the file can't be put in place once the upload ends.
+		GROWING_FILE
+	};
+
+	// File extensions handled, without the dot; matched case-insensitively
+	std::vector<wxString> extensions;
+	wxString program;
+	// "%f" in an argument is replaced by the path the program reads from; if no argument has it, the path is
+	// passed last. With STDIN, the arguments are passed as they are.
+	std::vector<wxString> args;
+	InputMode input = STDIN;
+
+	NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(StreamingOpenHandler, extensions, program, args, input)
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(StreamingOpenHandler::InputMode, {
+	{ StreamingOpenHandler::STDIN, "stdin" },
+	{ StreamingOpenHandler::FIFO, "fifo" },
+	{ StreamingOpenHandler::GROWING_FILE, "growingFile" }
+})
+
+// Runs the program of a StreamingOpenHandler on a file that is being received, passing data on to it as it
+// arrives. The program is fed from a queue by a thread of its own, so that the upload never waits for it, and
+// only while it keeps up: once it exits, takes no data for stallTimeout or falls MAX_QUEUED_BYTES behind, it is
+// left with what it has and the upload carries on without it.
+class StreamingOpen
+{
+	// Shared with the thread feeding the program, which carries on with what is queued after this is destroyed
+	struct Feed;
+	std::shared_ptr<Feed> feed;
+
+public:
+	// How far the program may fall behind the upload before it is dropped
+	static constexpr size_t MAX_QUEUED_BYTES = 8 << 20;
+
+	// Returns the first handler for fileName's extension, or nullptr if there is none
+	static const StreamingOpenHandler* findHandler(const std::vector<StreamingOpenHandler>& handlers, const wxFileName& fileName);
+
+	// Starts the handler's program on the file that will be saved as destination. growingFile is the file the
+	// data is being written into until then. Throws std::system_error if the program can't be started.
+	StreamingOpen(const StreamingOpenHandler& handler, const wxFileName& destination, const wxFileName& growingFile,
+		std::chrono::milliseconds stallTimeout);
+	~StreamingOpen();
+
+	StreamingOpen(const StreamingOpen&) = delete;
+	StreamingOpen& operator=(const StreamingOpen&) = delete;
+
+	// Queues the next part of the file for the program, if it is still reading it
+	void write(const char* data, size_t length);
+	// Like write, but waits for room in the queue rather than giving up on the program, for data that was
+	// received before and so doesn't hold up the disk. Returns how long it waited, so that the time isn't blamed
+	// on the sender.
+	std::chrono::steady_clock::duration writeWaiting(const char* data, size_t length);
+};
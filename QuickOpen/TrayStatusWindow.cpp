@@ -97,6 +97,16 @@ TrayStatusWindow::FileUploadActivityEntry* TrayStatusWindow::addFileUploadActivi
 	return newActivity;
 }
 
+TrayStatusWindow::FileUploadActivityEntry* TrayStatusWindow::addDeduplicatedFileActivity(const wxFileName& filename)
+{
+	// Nothing is transferred, so there is nothing to cancel
+	static std::atomic<bool> unusedCancelFlag = false;
+
+	auto* newActivity = addFileUploadActivity(filename, unusedCancelFlag);
+	newActivity->setDeduplicated();
+	return newActivity;
+}
+
 void TrayStatusWindow::SetFocus()
 {
 	wxFrame::SetFocus();
@@ -151,6 +161,16 @@ WebpageOpenedActivityEntry(wxWindow* parent, const wxString& url) : ActivityEntr
 
 wxString TrayStatusWindow::FileUploadActivityEntry::getEntryText() const
 {
+	if (this->deduplicated)
+	{
+		return wxString() << wxT("Deduplicated \"") << this->filename.GetFullPath() << wxT("\" (already on this computer).");
+	}
+
+	if (this->waiting && !this->uploadCompleted)
+	{
+		return wxString() << wxT("Waiting for other uploads to receive \"") << this->filename.GetFullPath() << wxT("\"...");
+	}
+
 	return wxString() << (this->uploadCompleted ? wxT("Uploaded \"") : wxT("Uploading \"")) << this
 		->filename.GetFullPath()
 		<< wxT("\"")
@@ -272,6 +292,12 @@ void TrayStatusWindow::FileUploadActivityEntry::setProgress(double progress)
 	this->updateProgressBar();
 }
 
+void TrayStatusWindow::FileUploadActivityEntry::setWaiting(bool waiting)
+{
+	this->waiting = waiting;
+	this->updateProgressBar();
+}
+
 double TrayStatusWindow::FileUploadActivityEntry::getProgress() const
 {
 	return this->uploadProgress;
@@ -290,6 +316,12 @@ void TrayStatusWindow::FileUploadActivityEntry::setCompleted(bool completed)
 	}
 }
 
+void TrayStatusWindow::FileUploadActivityEntry::setDeduplicated()
+{
+	this->deduplicated = true;
+	this->setCompleted(true);
+}
+
 bool TrayStatusWindow::FileUploadActivityEntry::getCompleted() const
 {
 	return this->uploadCompleted;
@@ -54,7 +54,9 @@ public:
 		wxFileName filename;
 		double uploadProgress = 0.0;
 		bool uploadCompleted = false,
-			openWhenDone = false;
+			openWhenDone = false,
+			deduplicated = false,
+			waiting = false;
 
 		wxString getEntryText() const;
 
@@ -75,6 +77,9 @@ public:
 
 		void setProgress(double progress);
 
+		// Shown while the upload is held back by the upload scheduler
+		void setWaiting(bool waiting);
+
 		double getProgress() const;
 
 		void setCompleted(bool completed);
@@ -84,6 +89,9 @@ public:
 		void setError(const std::exception* error);
 
 		void setCancelCompleted();
+
+		// Marks the file as copied from an identical local file rather than transferred
+		void setDeduplicated();
 	};
 
 	class ActivityList : public wxScrolledWindow
@@ -150,6 +158,7 @@ public:
 	WebpageOpenedActivityEntry* addWebpageOpenedActivity(const wxString& url);
 
 	FileUploadActivityEntry* addFileUploadActivity(const wxFileName& filename, std::atomic<bool>& cancelRequestFlag);
+	FileUploadActivityEntry* addDeduplicatedFileActivity(const wxFileName& filename);
 
 	void SetFocus() override;
 
@@ -0,0 +1,159 @@
+#include "UploadScheduler.h"
+
+#include <algorithm>
+
+UploadScheduler::UploadScheduler(unsigned writerCount, std::function<void()> prepareWriter) :
+	writerCount(std::max(1u, writerCount)), prepareWriter(std::move(prepareWriter))
+{
+	for (unsigned i = 0; i < this->writerCount; ++i)
+	{
+		writers.emplace_back([this] { runWriter(); });
+	}
+}
+
+UploadScheduler::~UploadScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(schedulerMutex);
+		stopping = true;
+	}
+	writeAvailable.notify_all();
+
+	for (auto& writer : writers)
+	{
+		writer.join();
+	}
+}
+
+void UploadScheduler::enqueue(const std::string& sender, Priority priority, size_t bytes, std::function<void()> run)
+{
+	{
+		std::lock_guard<std::mutex> lock(schedulerMutex);
+		FlowKey key(priority, sender);
+		Flow& flow = flows[key];
+
+		if (flow.writes.empty())
+		{
+			activeFlows[static_cast<size_t>(priority)].push_back(key);
+		}
+
+		flow.writes.push_back({ bytes, std::move(run) });
+		flow.queuedBytes += bytes;
+	}
+
+	++globalStats().queuedWrites;
+	globalStats().queuedBytes += bytes;
+	writeAvailable.notify_one();
+}
+
+// Called with schedulerMutex held
+bool UploadScheduler::hasWaitingWrites() const
+{
+	return std::any_of(std::begin(activeFlows), std::end(activeFlows), [](const auto& priorityFlows) { return !priorityFlows.empty(); });
+}
+
+// Called with schedulerMutex held
+bool UploadScheduler::takeNextWrite(PendingWrite& write)
+{
+	// An upload usually has only one write waiting at a time, so a weighted share within one round of flows
+	// wouldn't let it get ahead; interactive writes are taken first instead
+	return takeNextWrite(activeFlows[static_cast<size_t>(Priority::INTERACTIVE)], write)
+		|| takeNextWrite(activeFlows[static_cast<size_t>(Priority::BULK)], write);
+}
+
+// Called with schedulerMutex held
+bool UploadScheduler::takeNextWrite(std::deque<FlowKey>& priorityFlows, PendingWrite& write)
+{
+	while (!priorityFlows.empty())
+	{
+		FlowKey key = priorityFlows.front();
+		Flow& flow = flows.at(key);
+
+		if (!flow.credited)
+		{
+			flow.deficit += QUANTUM;
+			flow.credited = true;
+		}
+
+		if (static_cast<long long>(flow.writes.front().bytes) <= flow.deficit)
+		{
+			write = std::move(flow.writes.front());
+			flow.writes.pop_front();
+			flow.deficit -= write.bytes;
+			flow.queuedBytes -= write.bytes;
+
+			// A flow doesn't get to save up its deficit while it has nothing to send
+			if (flow.writes.empty())
+			{
+				priorityFlows.pop_front();
+				flows.erase(key);
+			}
+
+			return true;
+		}
+
+		// This flow has used up its turn; what is left of its deficit carries over to the next one
+		flow.credited = false;
+		priorityFlows.pop_front();
+		priorityFlows.push_back(key);
+	}
+
+	return false;
+}
+
+void UploadScheduler::runWriter()
+{
+	if (prepareWriter)
+	{
+		prepareWriter();
+	}
+
+	while (true)
+	{
+		PendingWrite write;
+		{
+			std::unique_lock<std::mutex> lock(schedulerMutex);
+			writeAvailable.wait(lock, [this] { return stopping || hasWaitingWrites(); });
+
+			// Queued writes still run while stopping, since their uploads are waiting on them
+			if (!takeNextWrite(write))
+			{
+				return;
+			}
+
+			++activeWrites;
+		}
+
+		--globalStats().queuedWrites;
+		globalStats().queuedBytes -= write.bytes;
+		++globalStats().activeWrites;
+
+		write.run();
+
+		{
+			std::lock_guard<std::mutex> lock(schedulerMutex);
+			--activeWrites;
+			writtenBytes += write.bytes;
+		}
+
+		--globalStats().activeWrites;
+		globalStats().writtenBytes += write.bytes;
+	}
+}
+
+UploadScheduler::Snapshot UploadScheduler::snapshot()
+{
+	std::lock_guard<std::mutex> lock(schedulerMutex);
+
+	Snapshot state{ writerCount, activeWrites, writtenBytes, {} };
+	for (const auto& priorityFlows : activeFlows)
+	{
+		for (const auto& flowKey : priorityFlows)
+		{
+			const Flow& flow = flows.at(flowKey);
+			state.flows.push_back({ flowKey.second, flowKey.first, flow.writes.size(), flow.queuedBytes });
+		}
+	}
+
+	return state;
+}
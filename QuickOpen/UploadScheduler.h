@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs the disk writes of every upload in progress. At most writerCount writes run at once, so the disk sees
+// a few sequential streams instead of one per connection. Waiting writes are grouped into flows by sender and
+// priority. Interactive flows (small files) are served before any bulk one, so they overtake bulk transfers; since
+// an interactive file is at most SMALL_FILE_SIZE, this can only hold bulk transfers up for a while. Within a
+// priority, flows are served by deficit round-robin, so each sender gets the same share of the writers whether it
+// sends one file or many. Since an upload only reads its next chunk from the network once its previous write has
+// been taken, this also shares out receiving bandwidth.
+class UploadScheduler
+{
+public:
+	enum class Priority
+	{
+		INTERACTIVE,
+		BULK
+	};
+
+	// Files up to this size are sent as INTERACTIVE
+	static constexpr unsigned long long SMALL_FILE_SIZE = 4ULL << 20;
+	// Bytes a flow may write per round
+	static constexpr long long QUANTUM = 1LL << 20;
+
+	struct FlowState
+	{
+		std::string sender;
+		Priority priority;
+		size_t queuedWrites;
+		unsigned long long queuedBytes;
+	};
+
+	struct Snapshot
+	{
+		unsigned writerCount, activeWrites;
+		unsigned long long writtenBytes;
+		std::vector<FlowState> flows;
+	};
+
+	// Totals across all schedulers, for metrics
+	struct GlobalStats
+	{
+		std::atomic<unsigned long long> queuedWrites = 0,
+			queuedBytes = 0,
+			activeWrites = 0,
+			writtenBytes = 0;
+	};
+
+private:
+	typedef std::pair<Priority, std::string> FlowKey;
+
+	struct PendingWrite
+	{
+		size_t bytes;
+		std::function<void()> run;
+	};
+
+	struct Flow
+	{
+		std::deque<PendingWrite> writes;
+		unsigned long long queuedBytes = 0;
+		long long deficit = 0;
+		// Whether the flow has been given its quantum for its current turn at the front
+		bool credited = false;
+	};
+
+	const unsigned writerCount;
+	const std::function<void()> prepareWriter;
+
+	std::mutex schedulerMutex;
+	std::condition_variable writeAvailable;
+	std::map<FlowKey, Flow> flows;
+	// Flows with waiting writes, in round-robin order, for each priority (indexed by Priority); the front flow is
+	// the one being served
+	std::deque<FlowKey> activeFlows[2];
+	unsigned activeWrites = 0;
+	unsigned long long writtenBytes = 0;
+	bool stopping = false;
+	std::vector<std::thread> writers;
+
+	void enqueue(const std::string& sender, Priority priority, size_t bytes, std::function<void()> run);
+	bool hasWaitingWrites() const;
+	bool takeNextWrite(PendingWrite& write);
+	bool takeNextWrite(std::deque<FlowKey>& priorityFlows, PendingWrite& write);
+	void runWriter();
+
+public:
+	// prepareWriter runs on each writer thread before it takes its first write, e.g. to lower the thread's
+	// priority so that uploads don't slow down the rest of the system
+	explicit UploadScheduler(unsigned writerCount = 2, std::function<void()> prepareWriter = {});
+	// Runs the writes still queued, then stops the writers
+	~UploadScheduler();
+
+	static Priority priorityFor(unsigned long long fileSize)
+	{
+		return (fileSize <= SMALL_FILE_SIZE) ? Priority::INTERACTIVE : Priority::BULK;
+	}
+
+	// Queues write, which writes bytes to disk on behalf of sender. Its completion (or exception) is delivered
+	// through the returned future.
+	template<typename FuncType>
+	std::future<void> submit(const std::string& sender, Priority priority, size_t bytes, FuncType write)
+	{
+		auto packagedTask = std::make_shared<std::packaged_task<void()>>(std::move(write));
+		auto result = packagedTask->get_future();
+		enqueue(sender, priority, bytes, [packagedTask] { (*packagedTask)(); });
+		return result;
+	}
+
+	Snapshot snapshot();
+
+	static GlobalStats& globalStats()
+	{
+		static GlobalStats instance;
+		return instance;
+	}
+};
@@ -1 +1,202 @@
 #include "Utils.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+	const uint32_t SHA256_ROUND_CONSTANTS[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+	inline uint32_t rotateRight(uint32_t value, unsigned bits)
+	{
+		return (value >> bits) | (value << (32 - bits));
+	}
+}
+
+SHA256Hasher::SHA256Hasher() : state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 }
+{}
+
+void SHA256Hasher::processBlock(const uint8_t* block)
+{
+	uint32_t schedule[64];
+
+	for (size_t i = 0; i < 16; ++i)
+	{
+		schedule[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16)
+			| (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+	}
+
+	for (size_t i = 16; i < 64; ++i)
+	{
+		uint32_t s0 = rotateRight(schedule[i - 15], 7) ^ rotateRight(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+		uint32_t s1 = rotateRight(schedule[i - 2], 17) ^ rotateRight(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+		schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+		e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (size_t i = 0; i < 64; ++i)
+	{
+		uint32_t S1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+		uint32_t choice = (e & f) ^ (~e & g);
+		uint32_t temp1 = h + S1 + choice + SHA256_ROUND_CONSTANTS[i] + schedule[i];
+		uint32_t S0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+		uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t temp2 = S0 + majority;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + temp1;
+		d = c;
+		c = b;
+		b = a;
+		a = temp1 + temp2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void SHA256Hasher::update(const void* data, size_t length)
+{
+	const auto* bytes = static_cast<const uint8_t*>(data);
+	totalBytes += length;
+
+	if (pendingBytes > 0)
+	{
+		size_t toCopy = std::min(length, pendingBlock.size() - pendingBytes);
+		memcpy(pendingBlock.data() + pendingBytes, bytes, toCopy);
+		pendingBytes += toCopy;
+		bytes += toCopy;
+		length -= toCopy;
+
+		if (pendingBytes < pendingBlock.size())
+		{
+			return;
+		}
+
+		processBlock(pendingBlock.data());
+		pendingBytes = 0;
+	}
+
+	for (; length >= pendingBlock.size(); bytes += pendingBlock.size(), length -= pendingBlock.size())
+	{
+		processBlock(bytes);
+	}
+
+	memcpy(pendingBlock.data(), bytes, length);
+	pendingBytes = length;
+}
+
+std::string SHA256Hasher::finishHex()
+{
+	unsigned long long messageBits = totalBytes * 8;
+
+	uint8_t padding[72] = { 0x80 };
+	size_t paddingLength = ((pendingBytes < 56) ? 56 : 120) - pendingBytes;
+	for (size_t i = 0; i < 8; ++i)
+	{
+		padding[paddingLength + i] = static_cast<uint8_t>(messageBits >> (56 - i * 8));
+	}
+	update(padding, paddingLength + 8);
+
+	static const char HEX_DIGITS[] = "0123456789abcdef";
+	std::string digestStr;
+	for (uint32_t word : state)
+	{
+		for (int shift = 28; shift >= 0; shift -= 4)
+		{
+			digestStr += HEX_DIGITS[(word >> shift) & 0xF];
+		}
+	}
+
+	return digestStr;
+}
+
+wxFileName nonConflictingFileName(const wxFileName& folder, const wxString& fileName, const std::vector<wxFileName>& reserved)
+{
+	wxFileName candidate(folder);
+	candidate.SetFullName(wxFileName(fileName).GetFullName());
+	wxString baseName = candidate.GetName();
+
+	auto isTaken = [&reserved](const wxFileName& candidate)
+	{
+		return candidate.Exists() || std::any_of(reserved.begin(), reserved.end(),
+			[&candidate](const wxFileName& reservedName) { return reservedName.SameAs(candidate); });
+	};
+
+	for (unsigned suffix = 2; isTaken(candidate); ++suffix)
+	{
+		candidate.SetName(wxString() << baseName << wxT(" (") << suffix << wxT(")"));
+	}
+
+	return candidate;
+}
+
+TaskPool::TaskPool(unsigned threadCount)
+{
+	for (unsigned i = 0; i < threadCount; ++i)
+	{
+		threads.emplace_back(&TaskPool::runTasks, this);
+	}
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		stopping = true;
+	}
+	taskAvailable.notify_all();
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void TaskPool::post(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		tasks.push_back(std::move(task));
+	}
+	taskAvailable.notify_one();
+}
+
+void TaskPool::runTasks()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(queueMutex);
+			taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+			// Queued tasks are still run when stopping, so nothing waiting on one is left hanging
+			if (tasks.empty()) return;
+
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+
+		task();
+	}
+}
@@ -4,13 +4,24 @@
 #include <wx/crt.h>
 #include <wx/filename.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <shared_mutex>
+#include <thread>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <map>
 #include <optional>
+#include <array>
+#include <vector>
+#include <cstdint>
 
 #include "CivetWebIncludes.h"
 
@@ -58,11 +69,58 @@ inline wxFileName getDirName(const wxFileName& fileName)
 	return newFileName;
 }
 
+// Where a file called fileName can be saved in folder without replacing an existing file or one of the names in
+// reserved: fileName itself if it is free, otherwise the first free one of "name (2).ext", "name (3).ext" and so
+// on. For files saved without anyone there to confirm overwriting.
+wxFileName nonConflictingFileName(const wxFileName& folder, const wxString& fileName, const std::vector<wxFileName>& reserved = {});
+
 template<typename T>
 class WriterReadersLock
 {
 	std::shared_mutex rwLock;
 
+	// Bumped by every write before it releases the lock, so that a snapshot can tell whether it is still current
+	std::atomic<uint64_t> version = 0;
+
+	std::mutex snapshotMutex;
+	std::shared_ptr<const T> latestSnapshot;
+	uint64_t latestSnapshotVersion = 0;
+
+	// Tells this lock's entries in the per-thread snapshot caches apart from those of a lock that was destroyed
+	// and whose address was reused
+	const uint64_t instanceID = nextInstanceID();
+
+	struct CachedSnapshot
+	{
+		uint64_t instanceID,
+			version;
+		std::shared_ptr<const T> value;
+	};
+
+	// Beyond this many locks snapshotted by one thread, its cache is started over, which also drops the entries
+	// of locks that no longer exist
+	static constexpr size_t MAX_CACHED_SNAPSHOTS = 8;
+
+	static uint64_t nextInstanceID()
+	{
+		static std::atomic<uint64_t> lastInstanceID = 0;
+		return ++lastInstanceID;
+	}
+
+	CachedSnapshot takeSnapshot()
+	{
+		std::lock_guard<std::mutex> lock(snapshotMutex);
+		if (latestSnapshot == nullptr || latestSnapshotVersion != version.load(std::memory_order_acquire))
+		{
+			// Only waits for a write in progress; the version can't change while the lock is held for reading
+			ReadableReference ref(*this);
+			latestSnapshotVersion = version.load(std::memory_order_relaxed);
+			latestSnapshot = std::make_shared<const T>(*ref);
+		}
+
+		return { instanceID, latestSnapshotVersion, latestSnapshot };
+	}
+
 public:
 	class WritableReference
 	{
@@ -86,6 +144,7 @@ public:
 
 		~WritableReference()
 		{
+			owner.version.fetch_add(1, std::memory_order_release);
 			owner.unlockForWriting();
 		}
 	};
@@ -143,6 +202,44 @@ public:
 	{
 		rwLock.unlock();
 	}
+
+	// The object as of the last write that finished, for readers that would otherwise hold a ReadableReference
+	// across slow work (such as launching a process) or on every request. Holding a snapshot never holds up a
+	// writer. Each thread keeps the snapshot it was last given and hands it out again until the next write, so
+	// readers don't touch the lock at all between writes; the first of them to ask after a write makes the copy.
+	// Not to be called while holding a WritableReference on the same lock.
+	std::shared_ptr<const T> snapshot()
+	{
+		static thread_local std::vector<CachedSnapshot> threadSnapshots;
+
+		uint64_t currentVersion = version.load(std::memory_order_acquire);
+		for (const auto& thisSnapshot : threadSnapshots)
+		{
+			if (thisSnapshot.instanceID == instanceID && thisSnapshot.version == currentVersion)
+			{
+				return thisSnapshot.value;
+			}
+		}
+
+		CachedSnapshot newSnapshot = takeSnapshot();
+		auto existing = std::find_if(threadSnapshots.begin(), threadSnapshots.end(),
+			[this](const CachedSnapshot& thisSnapshot) { return thisSnapshot.instanceID == instanceID; });
+		if (existing != threadSnapshots.end())
+		{
+			*existing = newSnapshot;
+		}
+		else
+		{
+			if (threadSnapshots.size() >= MAX_CACHED_SNAPSHOTS)
+			{
+				threadSnapshots.clear();
+			}
+
+			threadSnapshots.push_back(newSnapshot);
+		}
+
+		return newSnapshot.value;
+	}
 };
 
 template<typename T, T defaultValue>
@@ -353,4 +450,86 @@ inline std::string fileReadAll(const wxFileName& path)
 	fileIn.close();
 
 	return dataStream.str();
-}
\ No newline at end of file
+}
+
+// Incremental SHA-256, used to identify file contents for deduplication
+class SHA256Hasher
+{
+	std::array<uint32_t, 8> state;
+	std::array<uint8_t, 64> pendingBlock;
+	size_t pendingBytes = 0;
+	unsigned long long totalBytes = 0;
+
+	void processBlock(const uint8_t* block);
+
+public:
+	SHA256Hasher();
+
+	void update(const void* data, size_t length);
+	std::string finishHex();
+};
+
+// A fixed set of threads running queued tasks in FIFO order
+class TaskPool
+{
+	std::mutex queueMutex;
+	std::condition_variable taskAvailable;
+	std::deque<std::function<void()>> tasks;
+	bool stopping = false;
+	std::vector<std::thread> threads;
+
+	void runTasks();
+
+public:
+	explicit TaskPool(unsigned threadCount);
+	~TaskPool();
+
+	void post(std::function<void()> task);
+
+	// Like post(), but the result (or exception) of task is delivered through the returned future
+	template<typename FuncType>
+	auto submit(FuncType task) -> std::future<decltype(task())>
+	{
+		auto packagedTask = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+		auto result = packagedTask->get_future();
+		this->post([packagedTask] { (*packagedTask)(); });
+		return result;
+	}
+};
+
+// How a background thread is scheduled, so that its work doesn't compete with the user's. Applied by
+// applyThreadPriority (see PlatformUtils.h) from the thread itself.
+struct ThreadPriority
+{
+	enum IOClass
+	{
+		IO_NORMAL,
+		// Lowest best-effort priority: still served when the disk is busy, but after everything else
+		IO_LOW,
+		// Only served when no other I/O is waiting
+		IO_IDLE
+	};
+
+	IOClass ioClass = IO_LOW;
+	// Nice value from 0 (unchanged) to 19 (lowest CPU priority)
+	int niceLevel = 10;
+	// CPUs the thread may run on; empty for any
+	std::vector<unsigned> cpuAffinity;
+
+	NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(ThreadPriority, ioClass, niceLevel, cpuAffinity)
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(ThreadPriority::IOClass, {
+	{ ThreadPriority::IO_NORMAL, "normal" },
+	{ ThreadPriority::IO_LOW, "low" },
+	{ ThreadPriority::IO_IDLE, "idle" }
+})
+
+// Free space on the filesystem holding a folder, from getFilesystemSpace (see PlatformUtils.h)
+struct FilesystemSpace
+{
+	// Identifies the filesystem, so that folders on the same one can be told apart from folders on others
+	std::string filesystemID;
+	// Bytes an unprivileged user can still write
+	unsigned long long availableBytes;
+};
@@ -1,6 +1,7 @@
 #include "WebServer.h"
 #include "WebServerUtils.h"
 #include "GUIUtils.h"
+#include "PlatformUtils.h"
 #include "Utils.h"
 
 #include <regex>
@@ -24,30 +25,114 @@ std::string StaticHandler::resolveServerExpression(mg_connection* conn, const st
 	}
 }
 
-void StaticHandler::sendProcessedPage(mg_connection* conn, const wxFileName& pagePath)
+static std::filesystem::file_time_type getModificationTime(const wxFileName& file)
+{
+	std::error_code error;
+#ifdef WIN32
+	auto modificationTime = std::filesystem::last_write_time(file.GetFullPath().ToStdWstring(), error);
+#else
+	auto modificationTime = std::filesystem::last_write_time(std::string(file.GetFullPath().ToUTF8()), error);
+#endif
+	return error ? std::filesystem::file_time_type::min() : modificationTime;
+}
+
+StaticHandler::CachedPage StaticHandler::loadPage(const wxFileName& pagePath)
 {
-	const std::regex serverExpressionRegex("\\[\\[(.*)\\]\\]");
+	const std::regex serverExpressionRegex("\\[\\[(.*?)\\]\\]");
+	static const std::string INCLUDE_PREFIX = "INCLUDE:";
 
-	try
+	CachedPage loadedPage;
+	std::vector<std::string> staticParts(1);
+
+	std::string pageString = fileReadAll(pagePath);
+	loadedPage.sourceModificationTimes[pagePath.GetFullPath()] = getModificationTime(pagePath);
+
+	auto it = std::sregex_iterator(pageString.begin(), pageString.end(), serverExpressionRegex);
+
+	long long lastEndIndex = 0;
+	for(; it != std::sregex_iterator(); ++it)
+	{
+		staticParts.back().append(pageString, lastEndIndex, it->position() - lastEndIndex);
+		std::string expr = (*it)[1];
+
+		// Included files are part of the static text, which lets the whole page arrive in one response
+		if (startsWith(expr, INCLUDE_PREFIX))
+		{
+			wxFileName includedPath = this->baseStaticPath / wxFileName(wxString::FromUTF8(expr.substr(INCLUDE_PREFIX.size())), wxPATH_UNIX);
+			if (expr.find("..") != std::string::npos)
+			{
+				throw std::ios::failure("Included files must be inside the static folder.");
+			}
+
+			staticParts.back() += fileReadAll(includedPath);
+			loadedPage.sourceModificationTimes[includedPath.GetFullPath()] = getModificationTime(includedPath);
+		}
+		else
+		{
+			loadedPage.expressions.push_back(expr);
+			staticParts.emplace_back();
+		}
+
+		lastEndIndex = it->position() + it->length();
+	}
+
+	staticParts.back().append(pageString, lastEndIndex);
+	loadedPage.page = std::make_shared<PrecompressedPage>(staticParts);
+
+	return loadedPage;
+}
+
+bool StaticHandler::isCachedPageCurrent(const CachedPage& cachedPage)
+{
+	for (const auto& [sourcePath, modificationTime] : cachedPage.sourceModificationTimes)
 	{
-		std::string pageString = fileReadAll(pagePath);
-		std::stringstream processedStream;
+		if (getModificationTime(wxFileName(sourcePath)) != modificationTime)
+		{
+			return false;
+		}
+	}
 
-		auto it = std::sregex_iterator(pageString.begin(), pageString.end(), serverExpressionRegex);
+	return true;
+}
 
-		long long lastEndIndex = 0;
-		for(; it != std::sregex_iterator(); ++it)
+void StaticHandler::sendProcessedPage(mg_connection* conn, const wxFileName& pagePath)
+{
+	try
+	{
+		CachedPage cachedPage;
 		{
-			processedStream << std::string_view(pageString.c_str() + lastEndIndex, it->position() - lastEndIndex)
-							<< resolveServerExpression(conn, (*it)[1]);
+			std::lock_guard<std::mutex> lock(pageCacheMutex);
+			auto cacheIter = pageCache.find(pagePath.GetFullPath());
+
+			if (cacheIter == pageCache.end() || !isCachedPageCurrent(cacheIter->second))
+			{
+				cacheIter = pageCache.insert_or_assign(pagePath.GetFullPath(), loadPage(pagePath)).first;
+			}
 
-			lastEndIndex = it->position() + it->length();
+			cachedPage = cacheIter->second;
 		}
 
-		processedStream << std::string_view(pageString.c_str() + lastEndIndex, pageString.size() - lastEndIndex);
+		std::vector<std::string> values;
+		for (const std::string& thisExpression : cachedPage.expressions)
+		{
+			values.push_back(resolveServerExpression(conn, thisExpression));
+		}
 
-		std::string processedStr = processedStream.str();
-		mg_send_http_ok(conn, "text/html", processedStr.size());
+		const char* acceptEncoding = mg_get_header(conn, "Accept-Encoding");
+		bool sendGzip = (acceptEncoding != nullptr && std::string(acceptEncoding).find("gzip") != std::string::npos);
+		std::string processedStr = sendGzip ? cachedPage.page->renderGzip(values) : cachedPage.page->renderPlain(values);
+
+		// Pages carry per-request values such as CSRF tokens, so they must not be cached
+		mg_response_header_start(conn, 200);
+		mg_response_header_add(conn, "Content-Type", "text/html; charset=utf-8", -1);
+		if (sendGzip)
+		{
+			mg_response_header_add(conn, "Content-Encoding", "gzip", -1);
+		}
+		mg_response_header_add(conn, "Content-Length", std::to_string(processedStr.size()).c_str(), -1);
+		mg_response_header_add(conn, "Cache-Control", "no-store", -1);
+		mg_response_header_add(conn, "Vary", "Accept-Encoding", -1);
+		mg_response_header_send(conn);
 		mg_write(conn, processedStr.c_str(), processedStr.size());
 	}
 	catch (const std::ios::failure&)
@@ -98,6 +183,96 @@ bool StaticHandler::handleGet(CivetServer* server, mg_connection* conn)
 	return true;
 }
 
+void ConsentPromptQueue::enqueue(Prompt prompt, Abandon abandon)
+{
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		if (isShutDown)
+		{
+			prompt = nullptr;
+		}
+		else if (promptActive)
+		{
+			pendingPrompts.push_back({ std::move(prompt), std::move(abandon) });
+			return;
+		}
+		else
+		{
+			promptActive = true;
+			activeAbandon = abandon;
+		}
+	}
+
+	if (!prompt)
+	{
+		if (abandon)
+		{
+			abandon();
+		}
+
+		return;
+	}
+
+	prompt([this] { this->promptFinished(); });
+}
+
+bool ConsentPromptQueue::idle()
+{
+	std::lock_guard<std::mutex> lock(queueMutex);
+	return !promptActive;
+}
+
+void ConsentPromptQueue::shutdown()
+{
+	std::deque<Entry> abandonedPrompts;
+	Abandon abandonActive;
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		isShutDown = true;
+		abandonedPrompts.swap(pendingPrompts);
+		std::swap(abandonActive, activeAbandon);
+	}
+
+	if (abandonActive)
+	{
+		abandonActive();
+	}
+
+	for (auto& thisEntry : abandonedPrompts)
+	{
+		if (thisEntry.abandon)
+		{
+			thisEntry.abandon();
+		}
+	}
+}
+
+bool ConsentPromptQueue::shutDown()
+{
+	std::lock_guard<std::mutex> lock(queueMutex);
+	return isShutDown;
+}
+
+void ConsentPromptQueue::promptFinished()
+{
+	Prompt nextPrompt;
+	{
+		std::lock_guard<std::mutex> lock(queueMutex);
+		activeAbandon = nullptr;
+		if (pendingPrompts.empty())
+		{
+			promptActive = false;
+			return;
+		}
+
+		nextPrompt = std::move(pendingPrompts.front().prompt);
+		activeAbandon = std::move(pendingPrompts.front().abandon);
+		pendingPrompts.pop_front();
+	}
+
+	nextPrompt([this] { this->promptFinished(); });
+}
+
 bool OpenWebpageAPIEndpoint::handlePost(CivetServer* server, mg_connection* conn)
 {
 	auto postParams = parseFormEncodedBody(conn);
@@ -109,23 +284,55 @@ bool OpenWebpageAPIEndpoint::handlePost(CivetServer* server, mg_connection* conn
 		if (std::regex_match(url, std::regex("^https?:(\\/\\/)?[a-z|\\d|-|\\.]+($|\\/\\S*$)",
 			std::regex_constants::icase | std::regex_constants::ECMAScript)))
 		{
-			bool openAllowed;
-			{
-				std::lock_guard<std::mutex> lock(consentDialogMutex);
+			bool openAllowed = false, senderBanned = false, clientGone = false, shuttingDown = false, timedOut = false;
+			ConsentRequest consentRequest{ ConsentRequest::WEBPAGE, std::string(senderIP.ToUTF8()), url, {} };
+			auto policyDecision = consentPolicy.evaluate(consentRequest);
 
-				bool thisIPBanned = false, banRequested = false;
+			if (policyDecision.action != ConsentRule::PROMPT)
+			{
+				// Decided without waiting for the prompts ahead of it, though bans still apply
+				WriterReadersLock<std::set<wxString>>::ReadableReference ref(bannedIPRef);
+				senderBanned = (ref->count(senderIP) > 0);
+				openAllowed = !senderBanned && policyDecision.action == ConsentRule::ACCEPT;
+			}
+			else
+			{
+				// Counted from the request's arrival, so that time spent waiting behind other prompts counts too
+				auto consentDeadline = std::chrono::steady_clock::now() + readConnectionDeadlines(wxAppRef).consentTimeout;
+				bool promptTurnCame = promptQueue.runExclusive([&]
 				{
-					WriterReadersLock<std::set<wxString>>::ReadableReference ref(bannedIPRef);
-					thisIPBanned = (ref->count(senderIP) > 0);
-				}
+					bool thisIPBanned = false, banRequested = false;
+					{
+						WriterReadersLock<std::set<wxString>>::ReadableReference ref(bannedIPRef);
+						thisIPBanned = (ref->count(senderIP) > 0);
+					}
 
-				if (!thisIPBanned)
-				{
-					openAllowed = wxAppRef.promptForWebpageOpen(url, wxT("the IP address ") + senderIP, banRequested);
-				}
+					// A request that waited past its deadline for its turn is turned away without being shown
+					timedOut = !thisIPBanned && std::chrono::steady_clock::now() >= consentDeadline;
+					if (!thisIPBanned && !timedOut)
+					{
+						// The dialog declines by itself at the deadline, in case it is already up when the wait ends
+						auto prompt = wxAppRef.promptForWebpageOpen(url, wxT("the IP address ") + senderIP, consentDeadline);
+						if (auto decision = awaitGUITask(prompt, conn, consentDeadline,
+							[this] { return promptQueue.shutDown(); }))
+						{
+							std::tie(openAllowed, banRequested) = *decision;
+							consentPolicy.recordAnswer(consentRequest, openAllowed);
+						}
+						else if (promptQueue.shutDown())
+						{
+							shuttingDown = true;
+						}
+						else if (std::chrono::steady_clock::now() >= consentDeadline)
+						{
+							timedOut = true;
+						}
+						else
+						{
+							clientGone = true;
+						}
+					}
 
-				if(thisIPBanned || banRequested)
-				{
 					if(banRequested)
 					{
 						WriterReadersLock<std::set<wxString>>::WritableReference ref(bannedIPRef);
@@ -136,15 +343,46 @@ bool OpenWebpageAPIEndpoint::handlePost(CivetServer* server, mg_connection* conn
 						}
 					}
 
-					auto jsonErrorInfo = nlohmann::json(FormErrorList{
-					{
-						{"", "This IP address is banned from sending or opening further content."}
-					}
-						});
-					sendJSONResponse(conn, 403, jsonErrorInfo);
+					senderBanned = thisIPBanned || banRequested;
+				});
+				shuttingDown = shuttingDown || !promptTurnCame;
+			}
+
+			if (shuttingDown)
+			{
+				sendJSONResponse(conn, 503, FormErrorList{ {
+					{"", "QuickOpen is shutting down on the receiving computer."}
+				} });
+				return true;
+			}
+
+			if (timedOut)
+			{
+				EvictionStats::global().record(EvictionStats::CONSENT_TIMEOUT);
+				sendJSONResponse(conn, 408, FormErrorList{ {
+					{"", "The request was not answered in time."}
+				} });
+				mg_close_connection(conn);
+				return true;
+			}
+
+			if (clientGone)
+			{
+				// Nobody is left to read a response
+				mg_close_connection(conn);
+				return true;
+			}
 
-					return true;
+			if (senderBanned)
+			{
+				auto jsonErrorInfo = nlohmann::json(FormErrorList{
+				{
+					{"", "This IP address is banned from sending or opening further content."}
 				}
+					});
+				sendJSONResponse(conn, 403, jsonErrorInfo);
+
+				return true;
 			}
 
 			if (openAllowed)
@@ -152,11 +390,11 @@ bool OpenWebpageAPIEndpoint::handlePost(CivetServer* server, mg_connection* conn
 				wxString wxURL = wxString::FromUTF8(postParams["url"]);
 
 				{
-					WriterReadersLock<AppConfig>::ReadableReference readRef(*wxAppRef.getConfigRef());
+					auto config = wxAppRef.getConfigRef()->snapshot();
 
-					if (readRef->browserID.empty())
+					if (config->browserID.empty())
 					{
-						if (readRef->customBrowserPath.empty())
+						if (config->customBrowserPath.empty())
 						{
 							auto defaultBrowserCommand = substituteFormatString(
 								getDefaultBrowserCommandLine(), wxUniChar('%'), { wxURL }, {});
@@ -165,13 +403,13 @@ bool OpenWebpageAPIEndpoint::handlePost(CivetServer* server, mg_connection* conn
 						else
 						{
 							auto browserCommand = substituteFormatString(
-								readRef->customBrowserPath, wxUniChar('$'), {}, { {"url", wxURL} });
+								config->customBrowserPath, wxUniChar('$'), {}, { {"url", wxURL} });
 							startSubprocess(browserCommand);
 						}
 					}
 					else
 					{
-						startSubprocess(getBrowserCommandLine(readRef->browserID) + " \"" + wxURL + "\"");
+						startSubprocess(getBrowserCommandLine(config->browserID) + " \"" + wxURL + "\"");
 					}
 				}
 
@@ -190,7 +428,9 @@ bool OpenWebpageAPIEndpoint::handlePost(CivetServer* server, mg_connection* conn
 			{
 				auto jsonErrorInfo = nlohmann::json(FormErrorList{
 					{
-						{"", "Opening of the webpage was denied by the user."}
+						{"", (policyDecision.action == ConsentRule::DENY)
+							? "Opening of the webpage was denied by the receiver's consent policy."
+							: "Opening of the webpage was denied by the user."}
 					}
 					});
 				sendJSONResponse(conn, 403, jsonErrorInfo);
@@ -223,186 +463,1390 @@ bool OpenWebpageAPIEndpoint::handlePost(CivetServer* server, mg_connection* conn
 	// boost::process::child(systemShell, "foo");
 }
 
-bool FileConsentTokenService::handlePost(CivetServer* server, mg_connection* conn)
+// Continuations of the registry's waits may go on to read a request body, so they don't run on the thread that
+// ended the wait
+static void runOnOwnThread(std::function<void()> func)
 {
-	std::string bodyStr = MGReadAll(conn);
-	auto rqFileInfo = FileConsentRequestInfo(nlohmann::json::parse(bodyStr));
+	std::thread(std::move(func)).detach();
+}
+
+bool SpeculativeUploadRegistry::PendingConsent::claimSpeculativeIndex(size_t fileIndex)
+{
+	std::lock_guard<std::mutex> lock(decisionMutex);
+	return fileIndex < fileSizes.size() && speculativeIndices.insert(fileIndex).second;
+}
+
+SpeculativeUploadRegistry::Decision SpeculativeUploadRegistry::PendingConsent::getDecision()
+{
+	std::lock_guard<std::mutex> lock(decisionMutex);
+	return decision;
+}
+
+ConsentToken SpeculativeUploadRegistry::PendingConsent::getToken()
+{
+	std::lock_guard<std::mutex> lock(decisionMutex);
+	return token;
+}
 
-	if(rqFileInfo.fileList.empty())
+bool SpeculativeUploadRegistry::PendingConsent::isStale(std::chrono::steady_clock::time_point now)
+{
+	std::lock_guard<std::mutex> lock(decisionMutex);
+	return decision != Decision::PENDING && (now - decisionTime) > RESOLVED_ENTRY_LIFETIME;
+}
+
+uint64_t SpeculativeUploadRegistry::PendingConsent::addDecisionWaiter(DecisionCallback onDecided)
+{
+	std::lock_guard<std::mutex> lock(decisionMutex);
+	if (decision != Decision::PENDING)
 	{
-		sendJSONResponse(conn, 400, FormErrorList {{
-				{"fileList", "At least one file must be specified."}
-		} });
-		return true;
+		return 0;
 	}
 
-	wxFileName defaultDestDir;
+	uint64_t waiterID = nextWaiterID++;
+	decisionWaiters.insert({ waiterID, std::move(onDecided) });
+	return waiterID;
+}
+
+SpeculativeUploadRegistry::DecisionCallback SpeculativeUploadRegistry::PendingConsent::takeDecisionWaiter(uint64_t waiterID)
+{
+	std::lock_guard<std::mutex> lock(decisionMutex);
+	auto waiter = decisionWaiters.find(waiterID);
+	if (waiter == decisionWaiters.end())
 	{
-		WriterReadersLock<AppConfig>::ReadableReference configRef(*wxAppRef.getConfigRef());
-		defaultDestDir = configRef->fileSavePath;
+		return {};
 	}
 
-	//for (auto& thisFile : rqFileInfo.fileList)
-	//{
-	//	thisFile.suggestedFileName = defaultDestDir;
-	//	thisFile.suggestedFileName.SetFullName(thisFile.filename);
-	//}
+	DecisionCallback onDecided = std::move(waiter->second);
+	decisionWaiters.erase(waiter);
+	return onDecided;
+}
 
-	//std::optional<FileOpenSaveConsentDialog::ResultCode> resultCode;
-	//std::condition_variable dialogResult;
-	//std::mutex dialogResultMutex;
-	//std::unique_lock<std::mutex> dialogResultLock(dialogResultMutex);
+void SpeculativeUploadRegistry::PendingConsent::resolve(Decision newDecision, ConsentToken newToken)
+{
+	std::map<uint64_t, DecisionCallback> waiters;
+	{
+		std::lock_guard<std::mutex> lock(decisionMutex);
+		decision = newDecision;
+		token = newToken;
+		decisionTime = std::chrono::steady_clock::now();
+		waiters.swap(decisionWaiters);
+	}
 
-	wxString remoteIP = mg_get_request_info(conn)->remote_addr;
+	for (auto& [waiterID, onDecided] : waiters)
+	{
+		runOnOwnThread([onDecided = std::move(onDecided), newDecision] { onDecided(newDecision); });
+	}
+}
+
+SpeculativeUploadRegistry::SpeculativeUploadRegistry() : timeoutThread(&SpeculativeUploadRegistry::runTimeouts, this)
+{}
 
-	ConsentDialog::ResultCode result;
-	bool denyFuture = false;
+SpeculativeUploadRegistry::~SpeculativeUploadRegistry()
+{
 	{
-		std::lock_guard<std::mutex> lock(consentDialogMutex);
+		std::lock_guard<std::mutex> lock(entryMutex);
+		stopping = true;
+	}
 
-		bool thisIPBanned = false;
+	timeoutsChanged.notify_all();
+	timeoutThread.join();
+}
+
+std::shared_ptr<SpeculativeUploadRegistry::PendingConsent> SpeculativeUploadRegistry::registerConsent(const std::string& remoteIP,
+	uint32_t uploadID, const std::vector<unsigned long long>& fileSizes)
+{
+	EntryKey key = { remoteIP, uploadID };
+	auto newEntry = std::make_shared<PendingConsent>(fileSizes);
+	std::vector<RegistrationCallback> waiters;
+	{
+		std::lock_guard<std::mutex> lock(entryMutex);
+
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = entries.begin(); it != entries.end();)
 		{
-			WriterReadersLock<std::set<wxString>>::ReadableReference ref(bannedIPRef);
-			thisIPBanned = (ref->count(remoteIP) > 0);
+			it = (it->second->isStale(now) ? entries.erase(it) : std::next(it));
 		}
 
-		if (!thisIPBanned)
+		if (!entries.insert({ key, newEntry }).second)
 		{
-			std::tie(result, denyFuture) = wxAppRef.promptForFileSave(defaultDestDir, wxT("the IP address ") + remoteIP, rqFileInfo);
-
-			if(denyFuture)
-			{
-				WriterReadersLock<std::set<wxString>>::WritableReference ref(bannedIPRef);
-
-				if(ref->count(remoteIP) == 0)
-				{
-					ref->insert(remoteIP);
-				}
-			}
+			return nullptr; // The client reused an ID that is still in use
 		}
 
-		if (thisIPBanned || denyFuture)
+		for (auto it = registrationWaiters.begin(); it != registrationWaiters.end();)
 		{
-			auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			if (it->second.key == key)
 			{
-				{"", "This IP address is banned from sending or opening further content."}
+				waiters.push_back(std::move(it->second.onRegistered));
+				it = registrationWaiters.erase(it);
+			}
+			else
+			{
+				++it;
 			}
-				});
-			sendJSONResponse(conn, 403, jsonErrorInfo);
-
-			return true;
 		}
 	}
-	//wxGetApp().CallAfter([&dialogResultMutex, &dialogResult, &resultCode, &destPath, &rqFileInfo]
-	//{
-	//	auto consentDlg = FileOpenSaveConsentDialog(destPath, rqFileInfo.fileSize);
-	//	auto dlgResult = static_cast<FileOpenSaveConsentDialog::ResultCode>(consentDlg.ShowModal());
-	//	// consentDlg.Show();
-	//	std::lock_guard<std::mutex> resultLock(dialogResultMutex);
-	//	resultCode = dlgResult;
 
-	//	if(resultCode.value() == FileOpenSaveConsentDialog::ACCEPT)
-	//	{
-	//		rqFileInfo.consentedFileName = consentDlg.getConsentedFilename();
-	//	}
-	//	dialogResult.notify_all();
-	//});
+	for (auto& onRegistered : waiters)
+	{
+		runOnOwnThread([onRegistered = std::move(onRegistered), newEntry] { onRegistered(newEntry); });
+	}
+
+	return newEntry;
+}
 
-	if (result == ConsentDialog::ACCEPT)
+void SpeculativeUploadRegistry::whenRegistered(const std::string& remoteIP, uint32_t uploadID,
+	std::chrono::steady_clock::time_point deadline, RegistrationCallback onRegistered)
+{
+	std::shared_ptr<PendingConsent> existingEntry;
+	uint64_t waiterID = 0;
 	{
-		ConsentToken newToken = generateCryptoRandomInteger<ConsentToken>();
+		std::lock_guard<std::mutex> lock(entryMutex);
+
+		auto entry = entries.find({ remoteIP, uploadID });
+		if (entry != entries.end())
 		{
-			WriterReadersLock<TokenMap>::WritableReference writeRef(tokenWRRef);
-			writeRef->insert({ newToken, rqFileInfo.fileList });
+			existingEntry = entry->second;
+		}
+		else
+		{
+			waiterID = nextWaiterID++;
+			registrationWaiters.insert({ waiterID, { { remoteIP, uploadID }, std::move(onRegistered) } });
 		}
+	}
 
-		sendJSONResponse(conn, 200, nlohmann::json{ {"consentToken", newToken } });
+	if (existingEntry != nullptr)
+	{
+		onRegistered(existingEntry);
+		return;
 	}
-	else
+
+	addTimeout(deadline, [this, waiterID]
 	{
-		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+		RegistrationCallback onRegistered;
+		{
+			std::lock_guard<std::mutex> lock(entryMutex);
+
+			auto waiter = registrationWaiters.find(waiterID);
+			if (waiter == registrationWaiters.end())
 			{
-				{"uploadFile", "The user declined to receive the file."}
+				return;
 			}
-		});
-		sendJSONResponse(conn, 403, jsonErrorInfo);
+
+			onRegistered = std::move(waiter->second.onRegistered);
+			registrationWaiters.erase(waiter);
+		}
+
+		runOnOwnThread([onRegistered = std::move(onRegistered)] { onRegistered(nullptr); });
+	});
+}
+
+void SpeculativeUploadRegistry::whenDecided(const std::shared_ptr<PendingConsent>& pendingConsent,
+	std::chrono::steady_clock::time_point deadline, DecisionCallback onDecided)
+{
+	uint64_t waiterID = pendingConsent->addDecisionWaiter(onDecided);
+	if (waiterID == 0)
+	{
+		onDecided(pendingConsent->getDecision());
+		return;
 	}
 
-	return true;
+	// An undecided entry is kept by the registry, so this only fails to lock once the registry is gone
+	addTimeout(deadline, [weakConsent = std::weak_ptr<PendingConsent>(pendingConsent), waiterID]
+	{
+		auto pendingConsent = weakConsent.lock();
+		DecisionCallback onDecided = (pendingConsent != nullptr) ? pendingConsent->takeDecisionWaiter(waiterID) : nullptr;
+		if (onDecided)
+		{
+			runOnOwnThread([onDecided = std::move(onDecided)] { onDecided(Decision::PENDING); });
+		}
+	});
 }
 
-void OpenSaveFileAPIEndpoint::MGStoreBodyChecked(mg_connection* conn, const wxFileName& fileName, unsigned long long targetFileSize,
-	TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef, std::atomic<bool>& cancelRequestFlag)
+void SpeculativeUploadRegistry::addTimeout(std::chrono::steady_clock::time_point deadline, std::function<void()> timeout)
 {
-	static const long long CHUNK_SIZE = 1LL << 20;
-	unsigned long long bytesWritten = 0;
-	auto bodyBuffer = std::make_unique<char[]>(CHUNK_SIZE);
+	{
+		std::lock_guard<std::mutex> lock(entryMutex);
+		timeouts.insert({ deadline, std::move(timeout) });
+	}
 
-	std::ofstream outFile;
-	outFile.exceptions(std::ofstream::failbit);
+	timeoutsChanged.notify_all();
+}
 
-	try
+void SpeculativeUploadRegistry::runTimeouts()
+{
+	std::unique_lock<std::mutex> lock(entryMutex);
+	while (!stopping)
 	{
-#ifdef WIN32
-		outFile.open(fileName.GetFullPath().ToStdWstring(), std::ofstream::binary);
-#else
-        outFile.open(fileName.GetFullPath(), std::ofstream::binary);
-#endif
+		if (timeouts.empty())
+		{
+			timeoutsChanged.wait(lock);
+			continue;
+		}
 
-		int bytesRead;
-		while ((bytesRead = mg_read(conn, bodyBuffer.get(), CHUNK_SIZE)) > 0)
+		auto nextTimeout = timeouts.begin();
+		if (std::chrono::steady_clock::now() < nextTimeout->first)
 		{
-			bytesWritten += bytesRead;
+			timeoutsChanged.wait_until(lock, nextTimeout->first);
+			continue;
+		}
 
-			if (bytesWritten > targetFileSize)
-			{
-				throw IncorrectFileLengthException();
-			}
-			else if (cancelRequestFlag)
-			{
-				progressReportingApp.CallAfter([uploadActivityEntryRef]
-				{
-					uploadActivityEntryRef->setCancelCompleted();
-				});
+		std::function<void()> timeout = std::move(nextTimeout->second);
+		timeouts.erase(nextTimeout);
 
-				throw OperationCanceledException();
-			}
+		lock.unlock();
+		timeout();
+		lock.lock();
+	}
+}
 
-			outFile.write(bodyBuffer.get(), bytesRead);
+bool SpeculativeUploadRegistry::tryReserveQuarantine(unsigned long long bytes, unsigned long long budget)
+{
+	std::lock_guard<std::mutex> lock(entryMutex);
+
+	if (quarantinedBytes + bytes > budget)
+	{
+		return false;
+	}
+
+	quarantinedBytes += bytes;
+	return true;
+}
+
+void SpeculativeUploadRegistry::releaseQuarantine(unsigned long long bytes)
+{
+	std::lock_guard<std::mutex> lock(entryMutex);
+	quarantinedBytes -= bytes;
+}
+
+FileConsentTokenService::ClaimResult FileConsentTokenService::claimFile(ConsentToken token, long long fileIndex,
+	FileConsentRequestInfo::RequestedFileInfo& fileInfo)
+{
+	WriterReadersLock<TokenMap>::WritableReference tokens(tokenWRRef);
+
+	if (tokens->count(token) == 0)
+	{
+		return ClaimResult::INVALID_TOKEN;
+	}
+
+	auto& fileList = tokens->at(token);
+	if (fileIndex < 0 || fileIndex >= fileList.size() || fileList.at(fileIndex).uploadStarted)
+	{
+		return ClaimResult::INVALID_INDEX;
+	}
+
+	fileList.at(fileIndex).uploadStarted = true;
+	fileInfo = fileList.at(fileIndex);
+	diskSpaceLedger.hold(token, fileIndex);
+	return ClaimResult::CLAIMED;
+}
+
+FileConsentTokenService::ClaimResult FileConsentTokenService::peekFile(ConsentToken token, long long fileIndex,
+	FileConsentRequestInfo::RequestedFileInfo& fileInfo)
+{
+	WriterReadersLock<TokenMap>::ReadableReference tokens(tokenWRRef);
+
+	if (tokens->count(token) == 0)
+	{
+		return ClaimResult::INVALID_TOKEN;
+	}
+
+	const auto& fileList = tokens->at(token);
+	if (fileIndex < 0 || fileIndex >= fileList.size() || fileList.at(fileIndex).uploadStarted)
+	{
+		return ClaimResult::INVALID_INDEX;
+	}
+
+	fileInfo = fileList.at(fileIndex);
+	return ClaimResult::CLAIMED;
+}
+
+void FileConsentTokenService::releaseFile(ConsentToken token, long long fileIndex)
+{
+	diskSpaceLedger.release(token, fileIndex);
+
+	WriterReadersLock<TokenMap>::WritableReference tokens(tokenWRRef);
+	tokens->at(token).at(fileIndex).uploadStarted = false;
+}
+
+bool FileConsentTokenService::markFileEnded(ConsentToken token, long long fileIndex, size_t& fileCount)
+{
+	// Once a file has ended, whatever it wrote is already counted as used space
+	diskSpaceLedger.release(token, fileIndex);
+
+	WriterReadersLock<TokenMap>::WritableReference tokens(tokenWRRef);
+	auto& fileList = tokens->at(token);
+	fileCount = fileList.size();
+
+	fileList.at(fileIndex).uploadEnded = true;
+
+	for (const FileConsentRequestInfo::RequestedFileInfo& thisFile : fileList)
+	{
+		if (!thisFile.uploadEnded)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+std::vector<size_t> FileConsentTokenService::deduplicateFiles(FileConsentRequestInfo& rqFileInfo, bool useHardlinks)
+{
+	std::vector<size_t> deduplicatedIndices;
+
+	for (size_t i = 0; i < rqFileInfo.fileList.size(); ++i)
+	{
+		auto& thisFile = rqFileInfo.fileList[i];
+		// A file that is only opened has to arrive to be opened, and its copy would be deleted with the store
+		if (thisFile.contentHash.empty() || thisFile.ephemeral)
+		{
+			continue;
+		}
+
+		auto existingFile = contentIndex.findFile(thisFile.contentHash, thisFile.fileSize);
+		if (!existingFile.has_value())
+		{
+			continue;
+		}
+
+		if (!existingFile->SameAs(thisFile.consentedFileName))
+		{
+			try
+			{
+				ContentIndex::materialize(*existingFile, thisFile.consentedFileName, useHardlinks);
+			}
+			catch (const std::system_error&)
+			{
+				// Fall back to having the client send the file
+				continue;
+			}
+
+			contentIndex.recordFile(thisFile.contentHash, thisFile.consentedFileName);
+		}
+
+		thisFile.uploadStarted = true;
+		thisFile.uploadEnded = true;
+		deduplicatedIndices.push_back(i);
+
+		QuickOpenApplication& appRef = wxAppRef;
+		wxAppRef.CallAfter([&appRef, fileName = thisFile.consentedFileName]
+		{
+			appRef.getTrayWindow()->addDeduplicatedFileActivity(fileName);
+		});
+	}
+
+	if (!deduplicatedIndices.empty() && deduplicatedIndices.size() == rqFileInfo.fileList.size())
+	{
+		QuickOpenApplication& appRef = wxAppRef;
+		size_t fileCount = deduplicatedIndices.size();
+		wxAppRef.CallAfter([&appRef, fileCount]
+		{
+			appRef.notifyUser(MessageSeverity::MSG_INFO, wxT("File Upload Completed"),
+				wxString() << fileCount << (fileCount > 1 ? wxT(" files were ") : wxT(" file was "))
+				<< wxT("already on this computer and copied locally."));
+		});
+	}
+
+	return deduplicatedIndices;
+}
+
+bool FileConsentTokenService::handlePost(CivetServer* server, mg_connection* conn)
+{
+	std::string bodyStr = MGReadAll(conn);
+	auto rqFileInfo = std::make_shared<FileConsentRequestInfo>(nlohmann::json::parse(bodyStr));
+
+	if(rqFileInfo->fileList.empty())
+	{
+		sendJSONResponse(conn, 400, FormErrorList {{
+				{"fileList", "At least one file must be specified."}
+		} });
+		return true;
+	}
+
+	wxFileName defaultDestDir;
+	bool speculativeUploadsEnabled = false;
+	ConsentSettings settings;
+	{
+		auto configRef = wxAppRef.getConfigRef()->snapshot();
+		defaultDestDir = configRef->fileSavePath;
+		speculativeUploadsEnabled = configRef->speculativeUploadsEnabled;
+		settings.deduplicationEnabled = configRef->deduplicationEnabled;
+		settings.deduplicationUseHardlinks = configRef->deduplicationUseHardlinks;
+		settings.maxConcurrentUploads = configRef->maxConcurrentUploads;
+		settings.diskSpaceSafetyMargin = configRef->diskSpaceSafetyMargin;
+		settings.ephemeralPolicy = configRef->ephemeralReceive;
+	}
+
+	// The consent dialog starts out with these files set to be opened only, and lets the user change that
+	for (auto& thisFile : rqFileInfo->fileList)
+	{
+		thisFile.ephemeral = settings.ephemeralPolicy.appliesTo(thisFile.filename, thisFile.fileSize);
+	}
+
+	// Register before prompting so that a speculative upload arriving on another connection can find this
+	// request and start streaming into quarantine while the user decides.
+	std::shared_ptr<SpeculativeUploadRegistry::PendingConsent> pendingConsent;
+	if (speculativeUploadsEnabled && rqFileInfo->speculativeUploadID != 0)
+	{
+		std::vector<unsigned long long> fileSizes;
+		for (const auto& thisFile : rqFileInfo->fileList)
+		{
+			fileSizes.push_back(thisFile.fileSize);
+		}
+
+		pendingConsent = speculativeUploads.registerConsent(mg_get_request_info(conn)->remote_addr,
+			rqFileInfo->speculativeUploadID, fileSizes);
+	}
+
+	wxString remoteIP = mg_get_request_info(conn)->remote_addr;
+
+	ConsentRequest consentRequest{ ConsentRequest::FILES, std::string(remoteIP.ToUTF8()), {}, {} };
+	for (const auto& thisFile : rqFileInfo->fileList)
+	{
+		consentRequest.files.push_back({ thisFile.filename, thisFile.fileSize });
+	}
+
+	auto policyDecision = consentPolicy.evaluate(consentRequest);
+	if (policyDecision.action != ConsentRule::PROMPT)
+	{
+		// Decided without waiting for the prompts ahead of it, though bans still apply
+		bool thisIPBanned = false;
+		{
+			WriterReadersLock<std::set<wxString>>::ReadableReference ref(bannedIPRef);
+			thisIPBanned = (ref->count(remoteIP) > 0);
+		}
+
+		if (thisIPBanned || policyDecision.action == ConsentRule::DENY)
+		{
+			if (pendingConsent != nullptr)
+			{
+				pendingConsent->resolve(SpeculativeUploadRegistry::Decision::DECLINED);
+			}
+
+			FormErrorList::FormError error = thisIPBanned
+				? FormErrorList::FormError{ "", "This IP address is banned from sending or opening further content." }
+				: FormErrorList::FormError{ "uploadFile", "The receiver's consent policy declined the file." };
+			sendJSONResponse(conn, 403, FormErrorList{ { error } });
+			return true;
+		}
+
+		// Saved where the consent dialog would have suggested, but under another name where that would replace a
+		// file, since nobody is there to confirm overwriting it as they would in the dialog
+		std::vector<wxFileName> chosenFileNames;
+		for (auto& thisFile : rqFileInfo->fileList)
+		{
+			if (!thisFile.ephemeral)
+			{
+				thisFile.consentedFileName = nonConflictingFileName(defaultDestDir, thisFile.filename, chosenFileNames);
+				chosenFileNames.push_back(thisFile.consentedFileName);
+			}
+		}
+
+		respondToConsent(conn, *rqFileInfo, true, settings, pendingConsent);
+		return true;
+	}
+
+	auto consentDeadline = std::chrono::steady_clock::now() + readConnectionDeadlines(wxAppRef).consentTimeout;
+
+	// The user may take minutes to answer, so rather than waiting on a thread for the prompt (and for the
+	// prompts queued ahead of it), the request is suspended and answered from the decision's continuation.
+	auto request = std::make_shared<SuspendedRequest>(conn);
+	auto rejectBanned = [this, request, pendingConsent]
+	{
+		if (pendingConsent != nullptr)
+		{
+			pendingConsent->resolve(SpeculativeUploadRegistry::Decision::DECLINED);
+		}
+
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+		{
+			{"", "This IP address is banned from sending or opening further content."}
+		}
+			});
+		sendJSONResponse(request->connection(), 403, jsonErrorInfo);
+		request->complete();
+	};
+
+	// Answered once, whether by the user's decision, on the prompt's turn or by the queue shutting down
+	auto answered = std::make_shared<std::atomic<bool>>(false);
+	auto abandon = [request, pendingConsent, answered]
+	{
+		if (answered->exchange(true))
+		{
+			return;
+		}
+
+		if (pendingConsent != nullptr)
+		{
+			pendingConsent->resolve(SpeculativeUploadRegistry::Decision::DECLINED);
+		}
+
+		sendJSONResponse(request->connection(), 503, FormErrorList{ {
+			{"", "QuickOpen is shutting down on the receiving computer."}
+		} });
+		request->complete();
+	};
+
+	promptQueue.enqueue([=](std::function<void()> promptFinished)
+	{
+		bool thisIPBanned = false;
+		{
+			WriterReadersLock<std::set<wxString>>::ReadableReference ref(bannedIPRef);
+			thisIPBanned = (ref->count(remoteIP) > 0);
+		}
+
+		if (thisIPBanned)
+		{
+			promptFinished();
+			if (!answered->exchange(true))
+			{
+				rejectBanned();
+			}
+			return;
+		}
+
+		// A client that gave up while waiting its turn shouldn't get a dialog nobody will answer for, and one
+		// that has waited past the consent deadline is turned away instead of being shown one
+		bool consentExpired = std::chrono::steady_clock::now() >= consentDeadline;
+		if (consentExpired || clientDisconnected(request->connection()))
+		{
+			promptFinished();
+			if (answered->exchange(true))
+			{
+				return;
+			}
+
+			if (pendingConsent != nullptr)
+			{
+				pendingConsent->resolve(SpeculativeUploadRegistry::Decision::DECLINED);
+			}
+
+			if (consentExpired)
+			{
+				EvictionStats::global().record(EvictionStats::CONSENT_TIMEOUT);
+				sendJSONResponse(request->connection(), 408, FormErrorList{ {
+					{"", "The request waited too long for other consent requests to be answered."}
+				} });
+			}
+
+			mg_close_connection(request->connection());
+			request->complete();
+			return;
+		}
+
+		// The dialog declines by itself once the deadline passes while it is up
+		wxAppRef.promptForFileSave(defaultDestDir, wxT("the IP address ") + remoteIP, rqFileInfo, consentDeadline,
+			[=](std::pair<ConsentDialog::ResultCode, bool> decision)
+		{
+			if (answered->exchange(true))
+			{
+				// Abandoned while the dialog was up
+				promptFinished();
+				return;
+			}
+
+			auto [result, denyFuture] = decision;
+			if (result != ConsentDialog::ACCEPT && !denyFuture && std::chrono::steady_clock::now() >= consentDeadline)
+			{
+				// Declined for want of an answer, which isn't the user's decision to record
+				promptFinished();
+				if (pendingConsent != nullptr)
+				{
+					pendingConsent->resolve(SpeculativeUploadRegistry::Decision::DECLINED);
+				}
+
+				EvictionStats::global().record(EvictionStats::CONSENT_TIMEOUT);
+				sendJSONResponse(request->connection(), 408, FormErrorList{ {
+					{"", "The request was not answered in time."}
+				} });
+				mg_close_connection(request->connection());
+				request->complete();
+				return;
+			}
+
+			consentPolicy.recordAnswer(consentRequest, result == ConsentDialog::ACCEPT && !denyFuture);
+			if (denyFuture)
+			{
+				// Recorded before the next prompt starts, so further requests from this address aren't shown
+				WriterReadersLock<std::set<wxString>>::WritableReference ref(bannedIPRef);
+
+				if(ref->count(remoteIP) == 0)
+				{
+					ref->insert(remoteIP);
+				}
+			}
+			promptFinished();
+
+			if (denyFuture)
+			{
+				rejectBanned();
+				return;
+			}
+
+			respondToConsent(request->connection(), *rqFileInfo, result == ConsentDialog::ACCEPT, settings, pendingConsent);
+			request->complete();
+		});
+	}, abandon);
+
+	return request->detach();
+}
+
+void FileConsentTokenService::respondToConsent(mg_connection* conn, FileConsentRequestInfo& rqFileInfo, bool accepted,
+	const ConsentSettings& settings, const std::shared_ptr<SpeculativeUploadRegistry::PendingConsent>& pendingConsent)
+{
+	if (accepted)
+	{
+		ConsentToken newToken = generateCryptoRandomInteger<ConsentToken>();
+
+		// Turn the request away now, rather than partway through, if the files won't fit where they're going.
+		// This comes before anything is put on disk for the files, so that nothing is left behind when they don't
+		// fit; files that are only opened go in the ephemeral store, whose own folders aren't made yet.
+		std::vector<DiskSpaceLedger::FileReservation> fileReservations;
+		for (const auto& thisFile : rqFileInfo.fileList)
+		{
+			wxFileName destination = thisFile.ephemeral ? ephemeralStore.getFolder() / wxFileName("", thisFile.filename)
+				: thisFile.consentedFileName;
+			fileReservations.push_back({ destination, thisFile.uploadEnded ? 0 : thisFile.fileSize });
+		}
+
+		if (auto shortfall = diskSpaceLedger.reserve(newToken, fileReservations, settings.diskSpaceSafetyMargin,
+			std::chrono::steady_clock::now() + UNCLAIMED_RESERVATION_LIFETIME))
+		{
+			if (pendingConsent != nullptr)
+			{
+				pendingConsent->resolve(SpeculativeUploadRegistry::Decision::DECLINED);
+			}
+
+			wxString reason = wxString() << wxT("Not enough disk space: the files need ")
+				<< wxFileName::GetHumanReadableSize(wxULongLong(shortfall->requiredBytes)) << wxT(" in \"")
+				<< shortfall->folder.GetPath() << wxT("\", but only ")
+				<< wxFileName::GetHumanReadableSize(wxULongLong(shortfall->usableBytes)) << wxT(" can be used there.");
+
+			QuickOpenApplication& appRef = wxAppRef;
+			wxAppRef.CallAfter([&appRef, reason]
+			{
+				appRef.notifyUser(MessageSeverity::MSG_ERROR, wxT("File Upload Refused"), reason);
+			});
+
+			sendJSONResponse(conn, 507, FormErrorList{ {
+				{"fileList", std::string(reason.ToUTF8())}
+			} });
+			return;
+		}
+
+		for (auto& thisFile : rqFileInfo.fileList)
+		{
+			if (thisFile.ephemeral)
+			{
+				thisFile.consentedFileName = ephemeralStore.allocate(thisFile.filename,
+					std::chrono::minutes(settings.ephemeralPolicy.lifetimeMinutes));
+			}
+		}
+
+		std::vector<size_t> deduplicatedIndices;
+		if (settings.deduplicationEnabled)
+		{
+			deduplicatedIndices = deduplicateFiles(rqFileInfo, settings.deduplicationUseHardlinks);
+		}
+
+		// Deduplicated files are already in place, so whatever they take up is counted as used space now
+		for (size_t fileIndex : deduplicatedIndices)
+		{
+			diskSpaceLedger.release(newToken, fileIndex);
+		}
+
+		{
+			WriterReadersLock<TokenMap>::WritableReference writeRef(tokenWRRef);
+			writeRef->insert({ newToken, rqFileInfo.fileList });
+		}
+
+		if (pendingConsent != nullptr)
+		{
+			pendingConsent->resolve(SpeculativeUploadRegistry::Decision::ACCEPTED, newToken);
+		}
+
+		sendJSONResponse(conn, 200, nlohmann::json{ {"consentToken", newToken }, {"deduplicatedIndices", deduplicatedIndices},
+			{"maxConcurrentUploads", settings.maxConcurrentUploads} });
+	}
+	else
+	{
+		if (pendingConsent != nullptr)
+		{
+			pendingConsent->resolve(SpeculativeUploadRegistry::Decision::DECLINED);
+		}
+
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", "The user declined to receive the file."}
+			}
+		});
+		sendJSONResponse(conn, 403, jsonErrorInfo);
+	}
+}
+
+void OpenSaveFileAPIEndpoint::checkCancelled(TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef,
+	std::atomic<bool>& cancelRequestFlag)
+{
+	if (cancelRequestFlag)
+	{
+		progressReportingApp.CallAfter([uploadActivityEntryRef]
+		{
+			uploadActivityEntryRef->setCancelCompleted();
+		});
+
+		throw OperationCanceledException();
+	}
+}
+
+void OpenSaveFileAPIEndpoint::reportProgress(TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef,
+	std::atomic<bool>& cancelRequestFlag, unsigned long long bytesWritten, unsigned long long targetFileSize)
+{
+	checkCancelled(uploadActivityEntryRef, cancelRequestFlag);
+
+	progressReportingApp.CallAfter([uploadActivityEntryRef, bytesWritten, targetFileSize]
+	{
+		uploadActivityEntryRef->setProgress((static_cast<double>(bytesWritten) / targetFileSize) * 100.0);
+	});
+}
+
+DurabilityPolicy OpenSaveFileAPIEndpoint::readDurabilityPolicy(const wxFileName& fileName)
+{
+	if (consentServiceRef.ephemeralStore.contains(fileName))
+	{
+		return { DurabilityPolicy::NONE };
+	}
+
+	auto configRef = progressReportingApp.getConfigRef()->snapshot();
+	return configRef->uploadDurability;
+}
+
+std::unique_ptr<StreamingOpen> OpenSaveFileAPIEndpoint::startStreamingOpen(const wxFileName& fileName, const wxFileName& growingFile)
+{
+	StreamingOpenHandler handler;
+	{
+		auto configRef = progressReportingApp.getConfigRef()->snapshot();
+		auto* configuredHandler = StreamingOpen::findHandler(configRef->streamingOpenHandlers, fileName);
+		if (configuredHandler == nullptr)
+		{
+			return nullptr;
+		}
+
+		handler = *configuredHandler;
+	}
+
+	// The file is saved either way, so a program that can't be started only costs the early look at it
+	try
+	{
+		return std::make_unique<StreamingOpen>(handler, fileName, growingFile,
+			readConnectionDeadlines(progressReportingApp).bodyIdleTimeout);
+	}
+	catch (const std::system_error& ex)
+	{
+		std::cerr << "WARNING: Couldn't start \"" << handler.program << "\" to open the file being received: " << ex.what() << std::endl;
+		return nullptr;
+	}
+}
+
+void OpenSaveFileAPIEndpoint::writeScheduled(BodyReader& body, unsigned long long targetFileSize, size_t length,
+	const std::function<void()>& write)
+{
+	consentServiceRef.uploadScheduler.submit(mg_get_request_info(body.connection())->remote_addr,
+		UploadScheduler::priorityFor(targetFileSize), length, write).get();
+}
+
+void OpenSaveFileAPIEndpoint::MGStoreBodyChecked(BodyReader& body, const wxFileName& fileName, unsigned long long targetFileSize,
+	TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef, std::atomic<bool>& cancelRequestFlag,
+	unsigned long long bytesAlreadyWritten, const wxFileName& existingData, SHA256Hasher* contentHasher)
+{
+	static const long long CHUNK_SIZE = 1LL << 20;
+	unsigned long long bytesWritten = bytesAlreadyWritten;
+	auto bodyBuffer = std::make_unique<char[]>(CHUNK_SIZE);
+
+	try
+	{
+		// Data that was already received (e.g. into quarantine before consent was given) is kept and appended to
+		StagedFile outFile(fileName, readDurabilityPolicy(fileName), existingData);
+		// Destroyed first, so that a program reading the file sees its end even when the upload fails
+		auto streamingOpen = startStreamingOpen(fileName, outFile.getTempFileName());
+
+		if ((contentHasher != nullptr || streamingOpen != nullptr) && bytesAlreadyWritten > 0)
+		{
+			std::ifstream existingDataStream;
+			existingDataStream.exceptions(std::ifstream::badbit);
+#ifdef WIN32
+			existingDataStream.open(outFile.getTempFileName().GetFullPath().ToStdWstring(), std::ifstream::binary);
+#else
+			existingDataStream.open(outFile.getTempFileName().GetFullPath(), std::ifstream::binary);
+#endif
+			while (existingDataStream.read(bodyBuffer.get(), CHUNK_SIZE) || existingDataStream.gcount() > 0)
+			{
+				if (contentHasher != nullptr)
+				{
+					contentHasher->update(bodyBuffer.get(), existingDataStream.gcount());
+				}
+
+				if (streamingOpen != nullptr)
+				{
+					body.paused(streamingOpen->writeWaiting(bodyBuffer.get(), existingDataStream.gcount()));
+				}
+			}
+		}
+
+		// Each chunk is written and hashed by the upload scheduler while the next one is received into the other
+		// buffer, so the connection only waits when its previous write hasn't been done a whole chunk later,
+		// either because the disk is slow or because other uploads had their turn first
+		auto receiveBuffer = std::make_unique<char[]>(CHUNK_SIZE);
+		std::future<void> pendingWrite;
+		std::string sender = mg_get_request_info(body.connection())->remote_addr;
+		auto priority = UploadScheduler::priorityFor(targetFileSize);
+		bool waitingShown = false;
+
+		try
+		{
+			int bytesRead;
+			while ((bytesRead = body.read(receiveBuffer.get(), CHUNK_SIZE)) > 0)
+			{
+				bytesWritten += bytesRead;
+
+				if (bytesWritten > targetFileSize)
+				{
+					throw IncorrectFileLengthException();
+				}
+
+				reportProgress(uploadActivityEntryRef, cancelRequestFlag, bytesWritten, targetFileSize);
+
+				if (pendingWrite.valid())
+				{
+					bool mustWait = pendingWrite.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+					if (mustWait != waitingShown)
+					{
+						waitingShown = mustWait;
+						progressReportingApp.CallAfter([uploadActivityEntryRef, mustWait]
+						{
+							uploadActivityEntryRef->setWaiting(mustWait);
+						});
+					}
+
+					pendingWrite.get();
+				}
+
+				std::swap(receiveBuffer, bodyBuffer);
+				pendingWrite = consentServiceRef.uploadScheduler.submit(sender, priority, bytesRead,
+					[&outFile, contentHasher, chunk = bodyBuffer.get(), bytesRead, chunkEnd = bytesWritten]
+				{
+					outFile.stream().write(chunk, bytesRead);
+					outFile.wrote(chunkEnd);
+
+					if (contentHasher != nullptr)
+					{
+						contentHasher->update(chunk, bytesRead);
+					}
+				});
+
+				// The program is given its own copy of the chunk, and is dropped rather than waited for if it falls behind
+				if (streamingOpen != nullptr)
+				{
+					streamingOpen->write(bodyBuffer.get(), bytesRead);
+				}
+			}
+
+			if (pendingWrite.valid())
+			{
+				pendingWrite.get();
+			}
+
+			if (bytesRead < 0)
+			{
+				throw ConnectionClosedException();
+			}
+		}
+		catch (...)
+		{
+			// The write in flight refers to outFile and bodyBuffer, so it must finish before they go away
+			if (pendingWrite.valid())
+			{
+				pendingWrite.wait();
+			}
+
+			throw;
+		}
+
+		// A file of the wrong length is discarded rather than left in place looking complete
+		if (bytesWritten != targetFileSize)
+		{
+			throw IncorrectFileLengthException();
+		}
+
+		outFile.publish();
+	}
+	catch (const std::ios_base::failure& ex)
+	{
+		// Received data that couldn't be taken over by the staged file is of no use either
+		if (existingData.IsOk())
+		{
+			wxRemoveFile(existingData.GetFullPath());
+		}
+
+#ifdef WIN32
+		WindowsException detailedError = getWinAPIError(GetLastError());
+#else
+        const auto& detailedError = ex;
+#endif
+		progressReportingApp.CallAfter([uploadActivityEntryRef, detailedError]
+		{
+			uploadActivityEntryRef->setError(&detailedError);
+		});
+
+		throw detailedError;
+	}
+
+	progressReportingApp.CallAfter([uploadActivityEntryRef]
+	{
+		uploadActivityEntryRef->setCompleted(true);
+	});
+}
+
+std::string OpenSaveFileAPIEndpoint::MGStoreDeltaChecked(BodyReader& body, const wxFileName& fileName, unsigned long long targetFileSize,
+	const std::string& expectedContentHash, TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef,
+	std::atomic<bool>& cancelRequestFlag)
+{
+	SHA256Hasher contentHasher;
+	std::string contentHash;
+	static const size_t CHUNK_SIZE = 1 << 20;
+	auto bodyBuffer = std::make_unique<char[]>(CHUNK_SIZE);
+	unsigned long long bytesWritten = 0,
+		baseSize = fileName.GetSize().GetValue();
+	uint32_t blockSize = DeltaTransfer::chooseBlockSize(baseSize);
+
+	auto readExact = [&body](char* dest, size_t length)
+	{
+		while (length > 0)
+		{
+			int bytesRead = body.read(dest, length);
+			if (bytesRead <= 0)
+			{
+				throw MalformedBodyException("The delta ended in the middle of a record.");
+			}
+
+			dest += bytesRead;
+			length -= bytesRead;
+		}
+	};
+
+	auto appendData = [&](const char* data, size_t length)
+	{
+		bytesWritten += length;
+		if (bytesWritten > targetFileSize)
+		{
+			throw IncorrectFileLengthException();
+		}
+
+		reportProgress(uploadActivityEntryRef, cancelRequestFlag, bytesWritten, targetFileSize);
+		return length;
+	};
+
+	try
+	{
+		// The new version is built next to the old one, which it only replaces once it has been checked
+		std::ifstream baseFile;
+		baseFile.exceptions(std::ifstream::failbit);
+#ifdef WIN32
+		baseFile.open(fileName.GetFullPath().ToStdWstring(), std::ifstream::binary);
+#else
+		baseFile.open(fileName.GetFullPath(), std::ifstream::binary);
+#endif
+		StagedFile outFile(fileName, readDurabilityPolicy(fileName));
+
+		char recordType;
+		while (body.read(&recordType, 1) == 1)
+		{
+			unsigned char valueBytes[4];
+			readExact(reinterpret_cast<char*>(valueBytes), sizeof(valueBytes));
+			uint32_t recordValue = valueBytes[0] | (valueBytes[1] << 8) | (valueBytes[2] << 16) | (uint32_t(valueBytes[3]) << 24);
+
+			switch (recordType)
+			{
+			case DeltaTransfer::LITERAL_RECORD:
+				if (recordValue > DeltaTransfer::MAX_LITERAL_LENGTH)
+				{
+					throw MalformedBodyException("A literal record in the delta was too long.");
+				}
+
+				for (size_t remaining = recordValue; remaining > 0;)
+				{
+					size_t chunkLength = std::min(remaining, CHUNK_SIZE);
+					readExact(bodyBuffer.get(), chunkLength);
+					appendData(bodyBuffer.get(), chunkLength);
+					writeScheduled(body, targetFileSize, chunkLength, [&]
+					{
+						outFile.stream().write(bodyBuffer.get(), chunkLength);
+						outFile.wrote(bytesWritten);
+					});
+					contentHasher.update(bodyBuffer.get(), chunkLength);
+
+					remaining -= chunkLength;
+				}
+				break;
+
+			case DeltaTransfer::BLOCK_RECORD:
+			{
+				unsigned long long blockOffset = static_cast<unsigned long long>(recordValue) * blockSize;
+				if (blockOffset >= baseSize)
+				{
+					throw MalformedBodyException("A block record in the delta referred to a block that does not exist.");
+				}
+
+				size_t blockLength = std::min<unsigned long long>(blockSize, baseSize - blockOffset);
+				appendData(bodyBuffer.get(), blockLength);
+				writeScheduled(body, targetFileSize, blockLength, [&]
+				{
+					baseFile.seekg(blockOffset);
+					baseFile.read(bodyBuffer.get(), blockLength);
+					outFile.stream().write(bodyBuffer.get(), blockLength);
+					outFile.wrote(bytesWritten);
+				});
+				contentHasher.update(bodyBuffer.get(), blockLength);
+				break;
+			}
+
+			default:
+				throw MalformedBodyException("The delta contained an unknown record type.");
+			}
+		}
+
+		baseFile.close();
+
+		if (bytesWritten != targetFileSize)
+		{
+			throw IncorrectFileLengthException();
+		}
+
+		// A delta is only as good as the base it was computed against, so check the result before replacing
+		// the previous version when the client said what it should be
+		contentHash = contentHasher.finishHex();
+		if (!expectedContentHash.empty() && contentHash != expectedContentHash)
+		{
+			throw MalformedBodyException("The rebuilt file does not match its content hash; the destination may have changed during the upload.");
+		}
+
+		outFile.publish();
+	}
+	catch (const std::ios_base::failure& ex)
+	{
+		progressReportingApp.CallAfter([uploadActivityEntryRef, ex]
+		{
+			uploadActivityEntryRef->setError(&ex);
+		});
+
+		throw;
+	}
+
+	progressReportingApp.CallAfter([uploadActivityEntryRef]
+	{
+		uploadActivityEntryRef->setCompleted(true);
+	});
+
+	return contentHash;
+}
+
+void OpenSaveFileAPIEndpoint::MGStoreSparseChecked(BodyReader& body, const wxFileName& fileName, unsigned long long targetFileSize,
+	TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef, std::atomic<bool>& cancelRequestFlag)
+{
+	static const size_t CHUNK_SIZE = 1 << 20;
+	auto bodyBuffer = std::make_unique<char[]>(CHUNK_SIZE);
+	unsigned long long fileOffset = 0, writeOffset = 0;
+
+	auto readExact = [&body](char* dest, size_t length)
+	{
+		while (length > 0)
+		{
+			int bytesRead = body.read(dest, length);
+			if (bytesRead <= 0)
+			{
+				throw MalformedBodyException("The sparse body ended in the middle of a record.");
+			}
+
+			dest += bytesRead;
+			length -= bytesRead;
+		}
+	};
+
+	auto advance = [&](unsigned long long length)
+	{
+		if (length > targetFileSize - fileOffset)
+		{
+			throw IncorrectFileLengthException();
+		}
+
+		fileOffset += length;
+		reportProgress(uploadActivityEntryRef, cancelRequestFlag, fileOffset, targetFileSize);
+	};
+
+	try
+	{
+		StagedFile outFile(fileName, readDurabilityPolicy(fileName));
+		markFileSparse(outFile.getTempFileName());
+
+		char recordType;
+		while (body.read(&recordType, 1) == 1)
+		{
+			switch (recordType)
+			{
+			case SparseTransfer::DATA_RECORD:
+			{
+				unsigned char lengthBytes[4];
+				readExact(reinterpret_cast<char*>(lengthBytes), sizeof(lengthBytes));
+				uint32_t dataLength = lengthBytes[0] | (lengthBytes[1] << 8) | (lengthBytes[2] << 16) | (uint32_t(lengthBytes[3]) << 24);
+
+				if (dataLength > SparseTransfer::MAX_DATA_LENGTH)
+				{
+					throw MalformedBodyException("A data record in the sparse body was too long.");
+				}
+
+				for (size_t remaining = dataLength; remaining > 0;)
+				{
+					size_t chunkLength = std::min(remaining, CHUNK_SIZE);
+					readExact(bodyBuffer.get(), chunkLength);
+					unsigned long long chunkOffset = fileOffset;
+					advance(chunkLength);
+
+					// Senders that cannot see holes in their files send the zeros as data; skip those too
+					writeScheduled(body, targetFileSize, chunkLength, [&]
+					{
+						for (size_t blockStart = 0; blockStart < chunkLength; blockStart += SparseTransfer::ZERO_BLOCK_SIZE)
+						{
+							size_t blockLength = std::min(chunkLength - blockStart, SparseTransfer::ZERO_BLOCK_SIZE);
+							if (SparseTransfer::isAllZero(bodyBuffer.get() + blockStart, blockLength))
+							{
+								continue;
+							}
+
+							if (writeOffset != chunkOffset + blockStart)
+							{
+								outFile.stream().seekp(chunkOffset + blockStart);
+							}
+
+							outFile.stream().write(bodyBuffer.get() + blockStart, blockLength);
+							writeOffset = chunkOffset + blockStart + blockLength;
+						}
+
+						outFile.wrote(writeOffset);
+					});
+
+					remaining -= chunkLength;
+				}
+				break;
+			}
 
-			progressReportingApp.CallAfter([uploadActivityEntryRef, bytesWritten, targetFileSize]
+			case SparseTransfer::HOLE_RECORD:
 			{
-				uploadActivityEntryRef->setProgress((static_cast<double>(bytesWritten) / targetFileSize) * 100.0);
-			});
+				unsigned char lengthBytes[8];
+				readExact(reinterpret_cast<char*>(lengthBytes), sizeof(lengthBytes));
+
+				unsigned long long holeLength = 0;
+				for (int i = 7; i >= 0; --i)
+				{
+					holeLength = (holeLength << 8) | lengthBytes[i];
+				}
+
+				advance(holeLength);
+				break;
+			}
+
+			default:
+				throw MalformedBodyException("The sparse body contained an unknown record type.");
+			}
+		}
+
+		if (fileOffset != targetFileSize)
+		{
+			throw IncorrectFileLengthException();
 		}
+
+		outFile.resize(targetFileSize);
+		outFile.publish();
 	}
 	catch (const std::ios_base::failure& ex)
 	{
-#ifdef WIN32
-		WindowsException detailedError = getWinAPIError(GetLastError());
-#else
-        const auto& detailedError = ex;
-#endif
-		progressReportingApp.CallAfter([uploadActivityEntryRef, detailedError]
+		progressReportingApp.CallAfter([uploadActivityEntryRef, ex]
 		{
-			uploadActivityEntryRef->setError(&detailedError);
+			uploadActivityEntryRef->setError(&ex);
 		});
 
-		throw detailedError;
+		throw;
 	}
 
-	// delete[] bodyBuffer;
-	outFile.close();
+	progressReportingApp.CallAfter([uploadActivityEntryRef]
+	{
+		uploadActivityEntryRef->setCompleted(true);
+	});
+}
+
+void OpenSaveFileAPIEndpoint::storeFileAndRespond(mg_connection* conn, ConsentToken token, long long fileIndex,
+	const FileConsentRequestInfo::RequestedFileInfo& consentedFileInfo, unsigned long long bytesAlreadyWritten,
+	const wxFileName& existingData, BodyEncoding encoding)
+{
+	// TrayStatusWindow::FileUploadActivityEntry* activityEntryRef = nullptr;
+	std::atomic<bool> cancelFlag = false;
+	auto createActivity = [this, consentedFileInfo, &cancelFlag]
+	{
+		return this->progressReportingApp.getTrayWindow()->addFileUploadActivity(consentedFileInfo.consentedFileName, cancelFlag);
+	};
+
+	auto activityTask = callOnGUIThread(progressReportingApp, createActivity);
+	auto activityEntry = activityTask.waitUntil(std::chrono::steady_clock::now() + GUI_CALL_TIMEOUT);
+
+	// A GUI thread stuck behind a modal dialog shouldn't hold the connection indefinitely. If the call has
+	// already started, though, it captured cancelFlag by reference and must be waited for.
+	if (!activityEntry && activityTask.cancel())
+	{
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", "The receiving application is busy; try again shortly."}
+			}
+			});
+		sendJSONResponse(conn, 503, jsonErrorInfo, { {"Retry-After", "5"} });
+		mg_close_connection(conn);
+		consentServiceRef.releaseFile(token, fileIndex);
 
-	if (bytesWritten != targetFileSize)
+		// The client will send the whole file again
+		if (existingData.IsOk())
+		{
+			wxRemoveFile(existingData.GetFullPath());
+		}
+		return;
+	}
+
+	TrayStatusWindow::FileUploadActivityEntry* activityEntryRef = activityEntry ? *activityEntry : activityTask.get();
+
+	bool deduplicationEnabled;
 	{
-		throw IncorrectFileLengthException();
+		auto configRef = progressReportingApp.getConfigRef()->snapshot();
+		deduplicationEnabled = configRef->deduplicationEnabled;
 	}
-	else
+
+	BodyReader body(conn, readConnectionDeadlines(progressReportingApp), [this, activityEntryRef, &cancelFlag]
 	{
-		progressReportingApp.CallAfter([uploadActivityEntryRef]
+		checkCancelled(activityEntryRef, cancelFlag);
+	}, &consentServiceRef.bandwidthLimiter);
+
+	try
+	{
+		std::string contentHash;
+		if (encoding == BodyEncoding::DELTA)
+		{
+			contentHash = MGStoreDeltaChecked(body, consentedFileInfo.consentedFileName, consentedFileInfo.fileSize,
+			                                  consentedFileInfo.contentHash, activityEntryRef, cancelFlag);
+		}
+		else if (encoding == BodyEncoding::SPARSE)
+		{
+			// Hashing the holes would cost as much as writing them, so sparse uploads are not indexed
+			MGStoreSparseChecked(body, consentedFileInfo.consentedFileName, consentedFileInfo.fileSize,
+			                     activityEntryRef, cancelFlag);
+		}
+		else
+		{
+			SHA256Hasher contentHasher;
+			MGStoreBodyChecked(body, consentedFileInfo.consentedFileName, consentedFileInfo.fileSize, activityEntryRef,
+			                   cancelFlag, bytesAlreadyWritten, existingData, deduplicationEnabled ? &contentHasher : nullptr);
+			contentHash = contentHasher.finishHex();
+		}
+		mg_send_http_ok(conn, "text/plain", 0);
+
+		if (consentedFileInfo.ephemeral)
+		{
+			// Nobody would open the file later, since it goes away on its own
+			QuickOpenApplication& appRef = progressReportingApp;
+			progressReportingApp.CallAfter([&appRef, fileName = consentedFileInfo.consentedFileName]
+			{
+				appRef.openReceivedFile(fileName);
+			});
+		}
+		else if (deduplicationEnabled && !contentHash.empty())
+		{
+			consentServiceRef.contentIndex.recordFile(contentHash, consentedFileInfo.consentedFileName);
+		}
+	}
+	catch (const std::system_error& ex)
+	{
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{
+					"uploadFile",
+					std::string("An error occurred while attempting to write the file: ") + ex.what()
+				}
+			}
+		});
+		sendJSONResponse(conn, 500, jsonErrorInfo);
+	}
+	catch (const IncorrectFileLengthException& ex)
+	{
+		progressReportingApp.CallAfter([activityEntryRef, ex] { activityEntryRef->setError(&ex); });
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", "The file sent did not have the length specified by the consent token used."}
+			}
+		});
+		sendJSONResponse(conn, 400, jsonErrorInfo);
+	}
+	catch (const OperationCanceledException& ex)
+	{
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", "The upload was canceled by the receiving user."}
+			}
+		});
+		sendJSONResponse(conn, 500, jsonErrorInfo);
+	}
+	catch (const MalformedBodyException& ex)
+	{
+		progressReportingApp.CallAfter([activityEntryRef, ex] { activityEntryRef->setError(&ex); });
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", ex.what()}
+			}
+		});
+		sendJSONResponse(conn, 400, jsonErrorInfo);
+	}
+	catch (const ConnectionClosedException& ex)
+	{
+		progressReportingApp.CallAfter([activityEntryRef, ex]{ activityEntryRef->setError(&ex); });
+
+		// The client never saw a response, so let it send the file again
+		mg_close_connection(conn);
+		consentServiceRef.releaseFile(token, fileIndex);
+		return;
+	}
+	catch (const TransferStalledException& ex)
+	{
+		progressReportingApp.CallAfter([activityEntryRef, ex]{ activityEntryRef->setError(&ex); });
+
+		// The rest of the body may never arrive, so the connection can't be reused; a client that is merely
+		// on a bad network can still send the file again
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", ex.what()}
+			}
+		});
+		sendJSONResponse(conn, 408, jsonErrorInfo);
+		mg_close_connection(conn);
+		consentServiceRef.releaseFile(token, fileIndex);
+		return;
+	}
+
+    mg_close_connection(conn);
+
+	size_t fileCount = 0;
+	bool allEnded = consentServiceRef.markFileEnded(token, fileIndex, fileCount);
+
+	if (allEnded)
+	{
+		QuickOpenApplication& appRef = this->progressReportingApp;
+		this->progressReportingApp.CallAfter([&appRef, fileCount]
 		{
-			uploadActivityEntryRef->setCompleted(true);
+			appRef.notifyUser(MessageSeverity::MSG_INFO, wxT("File Upload Completed"),
+				wxString() << fileCount << (fileCount > 1 ? wxT(" files were ") : wxT(" file was "))
+				<< wxT("uploaded."));
 		});
 	}
 }
@@ -423,214 +1867,641 @@ bool OpenSaveFileAPIEndpoint::handlePost(CivetServer* server, mg_connection* con
 
 	auto queryStringMap = parseQueryString(conn);
 
-	if (queryStringMap.count("consentToken") == 0)
+	if (queryStringMap.count("consentToken") == 0)
+	{
+		// mg_send_http_error(conn, 401, "No consent token was provided.");
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"consentToken", "No consent token was provided."}
+			}
+			});
+		sendJSONResponse(conn, 401, jsonErrorInfo);
+
+		return true;
+	}
+	ConsentToken parsedToken = atoll(queryStringMap["consentToken"].c_str());
+
+
+	if (queryStringMap.count("fileIndex") == 0)
+	{
+		// mg_send_http_error(conn, 401, "No consent token was provided.");
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"fileIndex", "No file index was provided."}
+			}
+			});
+		sendJSONResponse(conn, 400, jsonErrorInfo);
+
+		return true;
+	}
+	long long fileIndex = atoll(queryStringMap["fileIndex"].c_str());
+
+
+	FileConsentRequestInfo::RequestedFileInfo consentedFileInfo;
+	auto claimResult = consentServiceRef.claimFile(parsedToken, fileIndex, consentedFileInfo);
+
+	if (claimResult == FileConsentTokenService::ClaimResult::INVALID_TOKEN)
+	{
+		// mg_send_http_error(conn, 403, "The consent token provided was not valid.");
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"consentToken", "The consent token provided was not valid."}
+			}
+			});
+		sendJSONResponse(conn, 403, jsonErrorInfo);
+		return true;
+	}
+
+	if (claimResult == FileConsentTokenService::ClaimResult::INVALID_INDEX)
+	{
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"fileIndex", "The file index provided was not valid."}
+			}
+			});
+		sendJSONResponse(conn, 403, jsonErrorInfo);
+		return true;
+	}
+
+	/*mg_form_data_handler formDataHandler;
+	formDataHandler.field_found = getFieldInfo;
+	formDataHandler.field_get = nullptr;
+	formDataHandler.field_store = onFileStore;
+	formDataHandler.user_data = &consentedFileInfo;
+	
+
+	mg_handle_form_request(conn, &formDataHandler);*/
+
+	//wxFileName destPath;
+	//{
+	//	WriterReadersLock<AppConfig>::ReadableReference configRef(configLock);
+	//	destPath = wxFileName(configRef->fileSavePath);
+	//	destPath.SetFullName(consentedFileInfo.filename);
+	//}
+
+	BodyEncoding encoding = BodyEncoding::RAW;
+	if (queryStringMap["encoding"] == "delta")
+	{
+		encoding = BodyEncoding::DELTA;
+	}
+	else if (queryStringMap["encoding"] == "sparse")
+	{
+		encoding = BodyEncoding::SPARSE;
+	}
+
+	if (encoding == BodyEncoding::DELTA)
+	{
+		// The delta was computed against the signature of the destination as it was then; if it has changed
+		// since, refuse before the body is sent and let the client fall back to a full upload.
+		unsigned long long baseSize = strtoull(queryStringMap["baseSize"].c_str(), nullptr, 10);
+
+		if (!consentedFileInfo.consentedFileName.FileExists() || consentedFileInfo.consentedFileName.GetSize() != baseSize)
+		{
+			consentServiceRef.releaseFile(parsedToken, fileIndex);
+
+			auto jsonErrorInfo = nlohmann::json(FormErrorList{
+				{
+					{"baseSize", "The destination file has changed since its signature was requested."}
+				}
+				});
+			sendJSONResponse(conn, 409, jsonErrorInfo);
+			return true;
+		}
+	}
+
+	unsigned maxConcurrentUploads;
+	{
+		auto configRef = progressReportingApp.getConfigRef()->snapshot();
+		maxConcurrentUploads = configRef->maxConcurrentUploads;
+	}
+
+	// Turn away uploads beyond the limit before the body is sent; the file stays claimable for the retry
+	if (activeUploads.fetch_add(1) >= maxConcurrentUploads)
+	{
+		--activeUploads;
+		consentServiceRef.releaseFile(parsedToken, fileIndex);
+
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", "Too many files are being received at once; try again shortly."}
+			}
+			});
+		sendJSONResponse(conn, 503, jsonErrorInfo, { {"Retry-After", "1"} });
+		return true;
+	}
+
+	if (acceptRequestBody(conn, (encoding == BodyEncoding::RAW) ? std::optional(consentedFileInfo.fileSize) : std::nullopt))
+	{
+		storeFileAndRespond(conn, parsedToken, fileIndex, consentedFileInfo, 0, wxFileName(), encoding);
+	}
+	else
+	{
+		// Nothing was received, so the file stays claimable for a retry with a correct request
+		consentServiceRef.releaseFile(parsedToken, fileIndex);
+	}
+
+	--activeUploads;
+
+	return true;
+
+	// std::ofstream outFile(destPath, std::ofstream::binary);
+
+	/*static const long long CHUNK_SIZE = 1LL << 20;
+	char* bodyBuffer = new char[CHUNK_SIZE];
+	
+	int bytesRead;
+	while ((bytesRead = mg_read(conn, bodyBuffer, CHUNK_SIZE)) > 0)
+	{
+		outFile.write(bodyBuffer, bytesRead);
+	}
+
+	delete[] bodyBuffer;
+	outFile.close();
+	return true;*/
+}
+
+bool FileSignatureEndpoint::handleGet(CivetServer* server, mg_connection* conn)
+{
+	auto queryStringMap = parseQueryString(conn);
+
+	if (!requireParameter(conn, queryStringMap, "consentToken") || !requireParameter(conn, queryStringMap, "fileIndex"))
+	{
+		return true;
+	}
+
+	FileConsentRequestInfo::RequestedFileInfo consentedFileInfo;
+	auto peekResult = consentServiceRef.peekFile(atoll(queryStringMap["consentToken"].c_str()),
+		atoll(queryStringMap["fileIndex"].c_str()), consentedFileInfo);
+
+	if (peekResult != FileConsentTokenService::ClaimResult::CLAIMED)
 	{
-		// mg_send_http_error(conn, 401, "No consent token was provided.");
 		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
-				{"consentToken", "No consent token was provided."}
+				(peekResult == FileConsentTokenService::ClaimResult::INVALID_TOKEN)
+					? FormErrorList::FormError{"consentToken", "The consent token provided was not valid."}
+					: FormErrorList::FormError{"fileIndex", "The file index provided was not valid."}
 			}
 			});
-		sendJSONResponse(conn, 401, jsonErrorInfo);
-
+		sendJSONResponse(conn, 403, jsonErrorInfo);
 		return true;
 	}
-	ConsentToken parsedToken = atoll(queryStringMap["consentToken"].c_str());
 
+	if (!consentedFileInfo.consentedFileName.FileExists())
+	{
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"fileIndex", "There is no previous version of this file to compute a delta against."}
+			}
+			});
+		sendJSONResponse(conn, 404, jsonErrorInfo);
+		return true;
+	}
 
-	if (queryStringMap.count("fileIndex") == 0)
+	try
+	{
+		sendJSONResponse(conn, 200, nlohmann::json(DeltaTransfer::computeSignature(consentedFileInfo.consentedFileName)));
+	}
+	catch (const std::ios_base::failure& ex)
 	{
-		// mg_send_http_error(conn, 401, "No consent token was provided.");
 		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
-				{"fileIndex", "No file index was provided."}
+				{"fileIndex", std::string("An error occurred while reading the previous version of the file: ") + ex.what()}
 			}
 			});
-		sendJSONResponse(conn, 400, jsonErrorInfo);
+		sendJSONResponse(conn, 500, jsonErrorInfo);
+	}
+
+	return true;
+}
+
+bool SpeculativeUploadEndpoint::handlePost(CivetServer* server, mg_connection* conn)
+{
+	auto queryStringMap = parseQueryString(conn);
 
+	if (!requireParameter(conn, queryStringMap, "speculativeUploadID") || !requireParameter(conn, queryStringMap, "fileIndex"))
+	{
 		return true;
 	}
-	long long fileIndex = atoll(queryStringMap["fileIndex"].c_str());
-
 
-	FileConsentRequestInfo::RequestedFileInfo consentedFileInfo;
-	bool tokenValid = false, indexValid = false;
+	auto uploadID = static_cast<uint32_t>(strtoul(queryStringMap["speculativeUploadID"].c_str(), nullptr, 10));
+	long long fileIndex = atoll(queryStringMap["fileIndex"].c_str());
 
+	unsigned long long quarantineBudget;
 	{
-		WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
-			tokens(consentServiceRef.tokenWRRef);
+		auto configRef = progressReportingApp.getConfigRef()->snapshot();
 
-		if (tokens->count(parsedToken) > 0)
+		if (!configRef->speculativeUploadsEnabled)
 		{
-			tokenValid = true;
-
-			if (fileIndex >= 0 && fileIndex < tokens->at(parsedToken).size() && !tokens->at(parsedToken).at(fileIndex).uploadStarted)
-			{
-				indexValid = true;
-				tokens->at(parsedToken).at(fileIndex).uploadStarted = true;
-				consentedFileInfo = tokens->at(parsedToken).at(fileIndex);
-			}
+			auto jsonErrorInfo = nlohmann::json(FormErrorList{
+				{
+					{"speculativeUploadID", "Speculative uploads are disabled on this computer."}
+				}
+			});
+			sendJSONResponse(conn, 404, jsonErrorInfo);
+			return true;
 		}
+
+		quarantineBudget = configRef->speculativeUploadBudget;
 	}
 
-	if (!tokenValid)
+	auto rejectUnmatched = [](mg_connection* conn)
 	{
-		// mg_send_http_error(conn, 403, "The consent token provided was not valid.");
 		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
-				{"consentToken", "The consent token provided was not valid."}
+				{"speculativeUploadID", "No consent request matching the speculative upload ID was found."}
 			}
-			});
-		sendJSONResponse(conn, 403, jsonErrorInfo);
+		});
+		sendJSONResponse(conn, 404, jsonErrorInfo);
+	};
+
+	if (uploadID == 0)
+	{
+		rejectUnmatched(conn);
 		return true;
 	}
 
-	if (!indexValid)
+	// The client may send this before its consent request has arrived on another connection, and the user may
+	// take minutes to decide, so the request is suspended rather than holding a thread while it waits for either
+	++suspendedRequests;
+	auto request = std::make_shared<SuspendedRequest>(conn);
+	consentServiceRef.speculativeUploads.whenRegistered(mg_get_request_info(conn)->remote_addr, uploadID,
+		std::chrono::steady_clock::now() + REGISTRATION_TIMEOUT,
+		[this, request, fileIndex, quarantineBudget, rejectUnmatched](std::shared_ptr<SpeculativeUploadRegistry::PendingConsent> pendingConsent)
+	{
+		if (pendingConsent == nullptr)
+		{
+			rejectUnmatched(request->connection());
+			complete(request);
+			return;
+		}
+
+		quarantine(request, pendingConsent, fileIndex, quarantineBudget);
+	});
+
+	return request->detach();
+}
+
+void SpeculativeUploadEndpoint::quarantine(std::shared_ptr<SuspendedRequest> request,
+	std::shared_ptr<SpeculativeUploadRegistry::PendingConsent> pendingConsent, long long fileIndex, unsigned long long quarantineBudget)
+{
+	mg_connection* conn = request->connection();
+	auto& registry = consentServiceRef.speculativeUploads;
+
+	if (fileIndex < 0 || !pendingConsent->claimSpeculativeIndex(fileIndex))
 	{
 		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
 				{"fileIndex", "The file index provided was not valid."}
 			}
-			});
+		});
 		sendJSONResponse(conn, 403, jsonErrorInfo);
-		return true;
+		complete(request);
+		return;
 	}
 
-	/*mg_form_data_handler formDataHandler;
-	formDataHandler.field_found = getFieldInfo;
-	formDataHandler.field_get = nullptr;
-	formDataHandler.field_store = onFileStore;
-	formDataHandler.user_data = &consentedFileInfo;
-	
+	if (!acceptRequestBody(conn, pendingConsent->fileSizes.at(fileIndex)))
+	{
+		complete(request);
+		return;
+	}
 
-	mg_handle_form_request(conn, &formDataHandler);*/
+	QuarantinedPart part;
+	part.fileName = quarantineFolder / wxFileName(".", wxString() << wxT("speculative-")
+		<< generateCryptoRandomInteger<uint64_t>() << wxT(".part"));
+	unsigned long long fileSize = pendingConsent->fileSizes.at(fileIndex);
 
-	//wxFileName destPath;
-	//{
-	//	WriterReadersLock<AppConfig>::ReadableReference configRef(configLock);
-	//	destPath = wxFileName(configRef->fileSavePath);
-	//	destPath.SetFullName(consentedFileInfo.filename);
-	//}
+	ConnectionDeadlines deadlines = readConnectionDeadlines(progressReportingApp);
+	auto consentDeadline = std::chrono::steady_clock::now() + deadlines.consentTimeout;
+	BodyReader body(conn, deadlines, {}, &consentServiceRef.bandwidthLimiter);
 
-	// TrayStatusWindow::FileUploadActivityEntry* activityEntryRef = nullptr;
-	std::atomic<bool> cancelFlag = false;
-	auto createActivity = [this, consentedFileInfo, &cancelFlag]
+	try
 	{
-		return this->progressReportingApp.getTrayWindow()->addFileUploadActivity(consentedFileInfo.consentedFileName, cancelFlag);
-	};
+		static const long long CHUNK_SIZE = 1LL << 20;
+		auto bodyBuffer = std::make_unique<char[]>(CHUNK_SIZE);
 
-	TrayStatusWindow::FileUploadActivityEntry* activityEntryRef =
-		wxCallAfterSync<QuickOpenApplication, decltype(createActivity), TrayStatusWindow::
-		                FileUploadActivityEntry*>(progressReportingApp, createActivity);
+		if (!quarantineFolder.DirExists() && !quarantineFolder.Mkdir())
+		{
+			throw std::ios_base::failure("The quarantine folder does not exist and could not be created.");
+		}
 
-	try
-	{
-		MGStoreBodyChecked(conn, consentedFileInfo.consentedFileName, consentedFileInfo.fileSize,
-		                   activityEntryRef, cancelFlag);
-		mg_send_http_ok(conn, "text/plain", 0);
+		std::ofstream quarantineFile;
+		quarantineFile.exceptions(std::ofstream::failbit);
+#ifdef WIN32
+		quarantineFile.open(part.fileName.GetFullPath().ToStdWstring(), std::ofstream::binary);
+#else
+		quarantineFile.open(part.fileName.GetFullPath(), std::ofstream::binary);
+#endif
+
+		while (pendingConsent->getDecision() == SpeculativeUploadRegistry::Decision::PENDING)
+		{
+			long long chunkSize = std::min<unsigned long long>(CHUNK_SIZE, fileSize - part.receivedBytes);
+
+			// Once the whole file is quarantined or the budget is used up, stop reading; the client then
+			// stalls on TCP flow control until the user makes a decision.
+			if (chunkSize == 0 || !registry.tryReserveQuarantine(chunkSize, quarantineBudget))
+			{
+				break;
+			}
+
+			part.reservedBytes += chunkSize;
+
+			int bytesRead = body.read(bodyBuffer.get(), chunkSize);
+			if (bytesRead <= 0)
+			{
+				break;
+			}
+
+			writeScheduled(body, fileSize, bytesRead, [&] { quarantineFile.write(bodyBuffer.get(), bytesRead); });
+			part.receivedBytes += bytesRead;
+		}
 	}
-	catch (const std::system_error& ex)
+	catch (const std::ios_base::failure& ex)
 	{
+		discardQuarantined(part);
+
 		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
-				{
-					"uploadFile",
-					std::string("An error occurred while attempting to write the file: ") + ex.what()
-				}
+				{"uploadFile", std::string("An error occurred while attempting to quarantine the file: ") + ex.what()}
 			}
 		});
 		sendJSONResponse(conn, 500, jsonErrorInfo);
+		complete(request);
+		return;
 	}
-	catch (const IncorrectFileLengthException& ex)
+	catch (const TransferStalledException& ex)
 	{
-		progressReportingApp.CallAfter([activityEntryRef, ex] { activityEntryRef->setError(&ex); });
+		discardQuarantined(part);
+
 		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
-				{"uploadFile", "The file sent did not have the length specified by the consent token used."}
+				{"uploadFile", ex.what()}
 			}
 		});
-		sendJSONResponse(conn, 400, jsonErrorInfo);
+		sendJSONResponse(conn, 408, jsonErrorInfo);
+		mg_close_connection(conn);
+		complete(request);
+		return;
 	}
-	catch (const OperationCanceledException& ex)
+
+	registry.whenDecided(pendingConsent, consentDeadline,
+		[this, request, pendingConsent, fileIndex, part](SpeculativeUploadRegistry::Decision decision)
+	{
+		finishQuarantined(request, pendingConsent, fileIndex, part, decision);
+	});
+}
+
+void SpeculativeUploadEndpoint::finishQuarantined(std::shared_ptr<SuspendedRequest> request,
+	std::shared_ptr<SpeculativeUploadRegistry::PendingConsent> pendingConsent, long long fileIndex, const QuarantinedPart& part,
+	SpeculativeUploadRegistry::Decision decision)
+{
+	mg_connection* conn = request->connection();
+
+	// The file stays claimable, so the client can still send it normally once the user has decided
+	if (decision == SpeculativeUploadRegistry::Decision::PENDING)
 	{
+		EvictionStats::global().record(EvictionStats::CONSENT_TIMEOUT);
+		discardQuarantined(part);
+
 		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
-				{"uploadFile", "The upload was canceled by the receiving user."}
+				{"uploadFile", "No decision was made on the consent request in time."}
 			}
 		});
-		sendJSONResponse(conn, 500, jsonErrorInfo);
-	}
-	catch (const ConnectionClosedException& ex)
-	{
-		progressReportingApp.CallAfter([activityEntryRef, ex]{ activityEntryRef->setError(&ex); });
+		sendJSONResponse(conn, 408, jsonErrorInfo);
+		mg_close_connection(conn);
+		complete(request);
+		return;
 	}
 
-    mg_close_connection(conn);
-
-	bool allEnded = true;
-	size_t fileCount = 0;
+	if (decision == SpeculativeUploadRegistry::Decision::DECLINED)
 	{
-		WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
-			tokens(consentServiceRef.tokenWRRef);
-		fileCount = tokens->at(parsedToken).size();
+		discardQuarantined(part);
 
-		tokens->at(parsedToken).at(fileIndex).uploadEnded = true;
-
-		for(const FileConsentRequestInfo::RequestedFileInfo& thisFile : tokens->at(parsedToken))
-		{
-			if(!thisFile.uploadEnded)
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
 			{
-				allEnded = false;
-				break;
+				{"uploadFile", "The user declined to receive the file."}
 			}
-		}
+		});
+		sendJSONResponse(conn, 403, jsonErrorInfo);
+		complete(request);
+		return;
 	}
 
-	if (allEnded)
+	ConsentToken token = pendingConsent->getToken();
+	FileConsentRequestInfo::RequestedFileInfo consentedFileInfo;
+
+	if (consentServiceRef.claimFile(token, fileIndex, consentedFileInfo) != FileConsentTokenService::ClaimResult::CLAIMED)
 	{
-		QuickOpenApplication& appRef = this->progressReportingApp;
-		this->progressReportingApp.CallAfter([&appRef, fileCount]
-		{
-			appRef.notifyUser(MessageSeverity::MSG_INFO, wxT("File Upload Completed"),
-				wxString() << fileCount << (fileCount > 1 ? wxT(" files were ") : wxT(" file was "))
-				<< wxT("uploaded."));
+		discardQuarantined(part);
+
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"fileIndex", "The file index provided was not valid."}
+			}
 		});
+		sendJSONResponse(conn, 403, jsonErrorInfo);
+		complete(request);
+		return;
 	}
 
-	return true;
+	// Consented data no longer counts against the budget. It becomes the start of the staged file, so nothing
+	// appears at the destination until the rest has arrived.
+	consentServiceRef.speculativeUploads.releaseQuarantine(part.reservedBytes);
+	storeFileAndRespond(conn, token, fileIndex, consentedFileInfo, part.receivedBytes, part.fileName);
+	complete(request);
+}
 
-	// std::ofstream outFile(destPath, std::ofstream::binary);
+void SpeculativeUploadEndpoint::discardQuarantined(const QuarantinedPart& part)
+{
+	// The budget bounds what quarantine takes up on disk, so it is only given back once the file is gone
+	wxRemoveFile(part.fileName.GetFullPath());
+	consentServiceRef.speculativeUploads.releaseQuarantine(part.reservedBytes);
+}
 
-	/*static const long long CHUNK_SIZE = 1LL << 20;
-	char* bodyBuffer = new char[CHUNK_SIZE];
-	
-	int bytesRead;
-	while ((bytesRead = mg_read(conn, bodyBuffer, CHUNK_SIZE)) > 0)
+void SpeculativeUploadEndpoint::complete(const std::shared_ptr<SuspendedRequest>& request)
+{
+	// Once the request is complete, the server may be destroyed along with this endpoint
+	--suspendedRequests;
+	request->complete();
+}
+
+ConnectionDeadlines readConnectionDeadlines(QuickOpenApplication& wxAppRef)
+{
+	auto configRef = wxAppRef.getConfigRef()->snapshot();
+
+	ConnectionDeadlines deadlines;
+	deadlines.headerTimeout = std::chrono::seconds(configRef->headerTimeoutSeconds);
+	deadlines.consentTimeout = std::chrono::seconds(configRef->consentTimeoutSeconds);
+	deadlines.bodyIdleTimeout = std::chrono::seconds(configRef->uploadIdleTimeoutSeconds);
+	deadlines.minBodyBytesPerSecond = configRef->minUploadBytesPerSecond;
+	return deadlines;
+}
+
+BandwidthLimits readBandwidthLimits(QuickOpenApplication& wxAppRef)
+{
+	auto configRef = wxAppRef.getConfigRef()->snapshot();
+
+	BandwidthLimits limits;
+	limits.globalBytesPerSecond = configRef->globalUploadLimit;
+	limits.perSenderBytesPerSecond = configRef->perSenderUploadLimit;
+	for (const auto& subnetLimit : configRef->subnetUploadLimits)
 	{
-		outFile.write(bodyBuffer, bytesRead);
+		limits.subnetLimits.push_back({ subnetLimit.subnet, subnetLimit.bytesPerSecond });
 	}
 
-	delete[] bodyBuffer;
-	outFile.close();
-	return true;*/
+	return limits;
+}
+
+std::vector<ConsentRule> readConsentRules(QuickOpenApplication& wxAppRef)
+{
+	auto configRef = wxAppRef.getConfigRef()->snapshot();
+	return configRef->consentRules;
 }
 
-QuickOpenWebServer::QuickOpenWebServer(QuickOpenApplication& wxAppRef, unsigned port):
-	CivetServer({
+static std::vector<std::string> webServerOptions(QuickOpenApplication& wxAppRef, unsigned port)
+{
+	ConnectionDeadlines deadlines = readConnectionDeadlines(wxAppRef);
+
+	// Body reads are normally bounded by BodyReader, but CivetWeb can only bound them with a socket timeout
+	std::vector<std::string> options = {
 		"document_root", STATIC_PATH.generic_string(),
-		"listening_ports", '+' + std::to_string(port)
-	}),
-	wxAppRef(wxAppRef),
-	staticHandler("/", &this->csrfHandler),
-	webpageAPIEndpoint(wxAppRef, consentDialogMutex, bannedIPs),
-	fileConsentTokenService(consentDialogMutex, wxAppRef, bannedIPs),
-	fileAPIEndpoint(fileConsentTokenService, wxAppRef),
+		"listening_ports", '+' + std::to_string(port),
+		"request_timeout_ms", std::to_string(deadlines.bodyIdleTimeout.count())
+	};
+
+#ifdef MG_CAN_LIMIT_HEADER_TIME
+	options.insert(options.end(), { "header_timeout_ms", std::to_string(deadlines.headerTimeout.count()) });
+#endif
+
+	return options;
+}
+
+QuickOpenServerState::QuickOpenServerState(QuickOpenApplication& wxAppRef) :
+	consentPolicy([&wxAppRef] { return readConsentRules(wxAppRef); },
+		InstallationInfo::detectInstallation().configFolder / wxFileName(".", "consentAudit.log")),
 	bannedIPs(std::make_unique<std::set<wxString>>()),
+	fileConsentTokenService(consentPrompts, consentPolicy, wxAppRef, bannedIPs)
+{}
+
+QuickOpenWebServer::QuickOpenWebServer(QuickOpenApplication& wxAppRef, unsigned port, std::shared_ptr<QuickOpenServerState> previousState):
+	CivetServer(webServerOptions(wxAppRef, port)),
+	wxAppRef(wxAppRef),
+	state(previousState != nullptr ? std::move(previousState) : std::make_shared<QuickOpenServerState>(wxAppRef)),
+	staticHandler("/", &state->csrfHandler),
+	webpageAPIEndpoint(wxAppRef, state->consentPrompts, state->consentPolicy, state->bannedIPs),
+	fileAPIEndpoint(state->fileConsentTokenService, wxAppRef),
+	speculativeUploadEndpoint(state->fileConsentTokenService, wxAppRef),
+	fileSignatureEndpoint(state->fileConsentTokenService),
+	gatedStaticHandler(handoffGate.refusing(staticHandler)),
+	gatedWebpageAPIEndpoint(handoffGate.refusing(webpageAPIEndpoint)),
+	gatedFileConsentTokenService(handoffGate.refusing(state->fileConsentTokenService)),
+	gatedFileAPIEndpoint(handoffGate.admitting(fileAPIEndpoint)),
+	gatedSpeculativeUploadEndpoint(handoffGate.admitting(speculativeUploadEndpoint)),
+	gatedFileSignatureEndpoint(handoffGate.admitting(fileSignatureEndpoint)),
 	port(port)
 {
-	this->addHandler("/", staticHandler);
-	this->addAuthHandler("/api/", this->csrfHandler);
-	this->addHandler("/api/openWebpage", webpageAPIEndpoint);
-	this->addHandler("/api/openSaveFile", fileAPIEndpoint);
-	this->addHandler("/api/openSaveFile/getConsent", fileConsentTokenService);
-}
\ No newline at end of file
+	this->addHandler("/", gatedStaticHandler);
+	this->addAuthHandler("/api/", state->csrfHandler);
+	this->addHandler("/api/openWebpage", gatedWebpageAPIEndpoint);
+	this->addHandler("/api/openSaveFile", gatedFileAPIEndpoint);
+	this->addHandler("/api/openSaveFile/getConsent", gatedFileConsentTokenService);
+	this->addHandler("/api/openSaveFile/speculative", gatedSpeculativeUploadEndpoint);
+	this->addHandler("/api/openSaveFile/signature", gatedFileSignatureEndpoint);
+}
+
+bool QuickOpenWebServer::handoffComplete()
+{
+	// Only the uploads running on this server are waited for; consented files that haven't started uploading
+	// can still be sent to the replacement, which honours the same tokens. Consent requests and speculative
+	// uploads are answered after their handlers return, so the prompt queue and the speculative upload endpoint
+	// are asked about them. The prompt queue is shared with the replacement, which makes this conservative
+	// rather than exact.
+	return handoffGate.isClosed() && handoffGate.requestsInProgress() == 0 && speculativeUploadEndpoint.requestsInProgress() == 0
+		&& state->consentPrompts.idle();
+}
+
+void ServerHandoff::retire(std::unique_ptr<QuickOpenWebServer> server, unsigned newPort, std::chrono::seconds timeout)
+{
+	server->beginHandoff(newPort);
+
+	std::lock_guard<std::mutex> lock(retiredMutex);
+	retiredServers.push_back({ std::move(server), std::chrono::steady_clock::now() + timeout });
+	if (!reaperThread.joinable())
+	{
+		reaperThread = std::thread(&ServerHandoff::reap, this);
+	}
+}
+
+std::unique_ptr<QuickOpenWebServer> ServerHandoff::reclaim(unsigned port)
+{
+	std::lock_guard<std::mutex> lock(retiredMutex);
+	for (auto serverIt = retiredServers.begin(); serverIt != retiredServers.end(); ++serverIt)
+	{
+		if (serverIt->server->getPort() == port)
+		{
+			std::unique_ptr<QuickOpenWebServer> server = std::move(serverIt->server);
+			retiredServers.erase(serverIt);
+			server->cancelHandoff();
+			return server;
+		}
+	}
+
+	return nullptr;
+}
+
+size_t ServerHandoff::retiredCount()
+{
+	std::lock_guard<std::mutex> lock(retiredMutex);
+	return retiredServers.size();
+}
+
+void ServerHandoff::reap()
+{
+	std::unique_lock<std::mutex> lock(retiredMutex);
+	while (!stopRequested.wait_for(lock, CHECK_INTERVAL, [this] { return stopping; }))
+	{
+		auto now = std::chrono::steady_clock::now();
+		std::list<RetiredServer> finished;
+		for (auto serverIt = retiredServers.begin(); serverIt != retiredServers.end();)
+		{
+			auto nextIt = std::next(serverIt);
+			if (now >= serverIt->deadline || serverIt->server->handoffComplete())
+			{
+				finished.splice(finished.end(), retiredServers, serverIt);
+			}
+
+			serverIt = nextIt;
+		}
+
+		if (!finished.empty())
+		{
+			// Closing a server waits for its threads, which must not hold up retire()
+			lock.unlock();
+			for (const auto& thisServer : finished)
+			{
+				if (!thisServer.server->handoffComplete())
+				{
+					std::cerr << "WARNING: Closing the server on port " << thisServer.server->getPort()
+						<< " before its transfers finished, as its handoff deadline has passed." << std::endl;
+				}
+			}
+
+			finished.clear();
+			lock.lock();
+		}
+	}
+}
+
+ServerHandoff::~ServerHandoff()
+{
+	{
+		std::lock_guard<std::mutex> lock(retiredMutex);
+		stopping = true;
+	}
+
+	stopRequested.notify_all();
+	if (reaperThread.joinable())
+	{
+		reaperThread.join();
+	}
+}
@@ -9,7 +9,18 @@
 
 #include "AppGUIIncludes.h"
 #include "AppConfig.h"
+#include "BandwidthLimiter.h"
+#include "ConsentPolicy.h"
 #include "WebServerUtils.h"
+#include "ContentIndex.h"
+#include "DeltaTransfer.h"
+#include "DiskSpaceLedger.h"
+#include "EphemeralStore.h"
+#include "SparseTransfer.h"
+#include "StagedFile.h"
+#include "StreamingOpen.h"
+#include "UploadScheduler.h"
+#include "PrecompressedPage.h"
 #include "Utils.h"
 
 #include <atomic>
@@ -27,9 +38,15 @@
 #include <map>
 #include <sstream>
 #include <condition_variable>
+#include <deque>
+#include <list>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <optional>
 #include <set>
+#include <chrono>
+#include <thread>
 
 #include "PlatformUtils.h"
 
@@ -52,6 +69,21 @@ private:
     const wxFileName baseStaticPath;
 
 	CSRFAuthHandler* csrfHandler;
+
+	// A page with its [[INCLUDE:file]] expressions inlined and its static text precompressed, kept until the
+	// page or one of the files it includes changes
+	struct CachedPage
+	{
+		std::shared_ptr<const PrecompressedPage> page;
+		std::vector<std::string> expressions;
+		std::map<wxString, std::filesystem::file_time_type> sourceModificationTimes;
+	};
+
+	std::mutex pageCacheMutex;
+	std::map<wxString, CachedPage> pageCache;
+
+	CachedPage loadPage(const wxFileName& pagePath);
+	static bool isCachedPageCurrent(const CachedPage& cachedPage);
 public:
 	StaticHandler(const std::string& staticPrefix, CSRFAuthHandler* csrfHandler = nullptr) : staticPrefix(staticPrefix),
 		baseStaticPath(InstallationInfo::detectInstallation().dataFolder / wxFileName("static", "")),
@@ -64,17 +96,99 @@ public:
 	bool handleGet(CivetServer* server, mg_connection* conn) override;
 };
 
+// Shows consent prompts one at a time. Prompts waiting for their turn are queued rather than each holding a thread.
+class ConsentPromptQueue
+{
+public:
+	// Called when it is this prompt's turn, with a callback to invoke once the prompt has been answered
+	typedef std::function<void(std::function<void()>)> Prompt;
+	// Called once the queue shuts down, instead of the prompt if its turn hasn't come yet, or while it is being
+	// shown; answers the request without the user
+	typedef std::function<void()> Abandon;
+
+private:
+	struct Entry
+	{
+		Prompt prompt;
+		Abandon abandon;
+	};
+
+	std::mutex queueMutex;
+	std::deque<Entry> pendingPrompts;
+	Abandon activeAbandon;
+	bool promptActive = false,
+		isShutDown = false;
+
+	void promptFinished();
+
+public:
+	// A prompt without an abandon function is dropped if the queue shuts down before its turn
+	void enqueue(Prompt prompt, Abandon abandon = {});
+
+	// Whether no prompt is being shown or waiting for its turn
+	bool idle();
+
+	// Abandons the prompts waiting for their turn, the one being shown and any enqueued from now on, so that the
+	// requests behind them can be finished without the GUI thread, which won't get to them once the application
+	// is exiting
+	void shutdown();
+	bool shutDown();
+
+	// Waits for a turn on the calling thread, then runs func; for handlers that prompt synchronously. Returns
+	// false without running func if the queue shuts down first.
+	template<typename FuncType>
+	bool runExclusive(FuncType func)
+	{
+		// Shared with the abandon function, which the queue may still be calling after this returns
+		auto turnStarted = std::make_shared<std::promise<std::function<void()>>>();
+		auto turnFuture = turnStarted->get_future();
+		this->enqueue([turnStarted](std::function<void()> finished) { turnStarted->set_value(std::move(finished)); },
+			[turnStarted]
+		{
+			try
+			{
+				turnStarted->set_value(nullptr);
+			}
+			catch (const std::future_error&)
+			{
+				// The turn had already started; func checks shutDown() itself
+			}
+		});
+
+		std::function<void()> finished = turnFuture.get();
+		if (!finished)
+		{
+			return false;
+		}
+
+		try
+		{
+			func();
+		}
+		catch (...)
+		{
+			finished();
+			throw;
+		}
+		finished();
+		return true;
+	}
+};
+
 class OpenWebpageAPIEndpoint : public CivetHandler
 {
 	QuickOpenApplication& wxAppRef;
-	std::mutex& consentDialogMutex;
+	ConsentPromptQueue& promptQueue;
+	ConsentPolicy& consentPolicy;
 	WriterReadersLock<std::set<wxString>>& bannedIPRef;
 	// IQuickOpenApplication 
 
 public:
-	OpenWebpageAPIEndpoint(QuickOpenApplication& wxAppRef, std::mutex& consentDialogMutex, WriterReadersLock<std::set<wxString>>& bannedIPRef):
+	OpenWebpageAPIEndpoint(QuickOpenApplication& wxAppRef, ConsentPromptQueue& promptQueue, ConsentPolicy& consentPolicy,
+		WriterReadersLock<std::set<wxString>>& bannedIPRef):
 		wxAppRef(wxAppRef),
-		consentDialogMutex(consentDialogMutex),
+		promptQueue(promptQueue),
+		consentPolicy(consentPolicy),
 		bannedIPRef(bannedIPRef)
 	{}
 
@@ -89,11 +203,26 @@ struct FileConsentRequestInfo
 		wxString filename;
 		unsigned long long fileSize;
 
+		// Optional hex SHA-256 of the file, used to find an identical file that was already received
+		std::string contentHash;
+
 		wxFileName consentedFileName;
+		// Received into the EphemeralStore to be opened, rather than saved; see EphemeralReceivePolicy
+		bool ephemeral = false;
 		bool uploadStarted = false,
 			uploadEnded = false;
 
-		NLOHMANN_DEFINE_TYPE_INTRUSIVE(RequestedFileInfo, filename, fileSize)
+		friend void to_json(nlohmann::json& json, const RequestedFileInfo& fileInfo)
+		{
+			json = { {"filename", fileInfo.filename}, {"fileSize", fileInfo.fileSize}, {"contentHash", fileInfo.contentHash} };
+		}
+
+		friend void from_json(const nlohmann::json& json, RequestedFileInfo& fileInfo)
+		{
+			json.at("filename").get_to(fileInfo.filename);
+			json.at("fileSize").get_to(fileInfo.fileSize);
+			fileInfo.contentHash = json.value("contentHash", std::string());
+		}
 
 			//static RequestedFileInfo fromJSON(const nlohmann::json& json)
 			//{
@@ -111,9 +240,107 @@ struct FileConsentRequestInfo
 
 	std::vector<RequestedFileInfo> fileList;
 
-	NLOHMANN_DEFINE_TYPE_INTRUSIVE(FileConsentRequestInfo, fileList)
+	// Nonzero if the client intends to stream the first file to /api/openSaveFile/speculative while the
+	// consent dialog is open
+	uint32_t speculativeUploadID = 0;
+
+	NLOHMANN_DEFINE_TYPE_INTRUSIVE_WITH_DEFAULT(FileConsentRequestInfo, fileList, speculativeUploadID)
+};
+
+// Speculative uploads wait here for their consent request to be registered and then decided. Waiting holds no
+// thread: the callbacks passed to whenRegistered and whenDecided are kept until the wait is over, then called on
+// a thread of their own so that they may go on to read a request body. One whose wait is already over is called
+// before whenRegistered or whenDecided returns, on the calling thread.
+class SpeculativeUploadRegistry
+{
+public:
+	enum class Decision
+	{
+		PENDING,
+		ACCEPTED,
+		DECLINED
+	};
+
+	// Called with PENDING if the deadline passes before the decision is made
+	typedef std::function<void(Decision)> DecisionCallback;
+
+	class PendingConsent
+	{
+		std::mutex decisionMutex;
+		Decision decision = Decision::PENDING;
+		ConsentToken token = 0;
+		std::chrono::steady_clock::time_point decisionTime;
+		std::set<size_t> speculativeIndices;
+		std::map<uint64_t, DecisionCallback> decisionWaiters;
+		uint64_t nextWaiterID = 1;
+
+	public:
+		const std::vector<unsigned long long> fileSizes;
+
+		PendingConsent(const std::vector<unsigned long long>& fileSizes) : fileSizes(fileSizes)
+		{}
+
+		bool claimSpeculativeIndex(size_t fileIndex);
+
+		Decision getDecision();
+		ConsentToken getToken();
+		bool isStale(std::chrono::steady_clock::time_point now);
+
+		// Returns 0 without keeping onDecided if the decision has already been made
+		uint64_t addDecisionWaiter(DecisionCallback onDecided);
+		// Returns an empty function if the waiter has already been called
+		DecisionCallback takeDecisionWaiter(uint64_t waiterID);
+
+		void resolve(Decision newDecision, ConsentToken newToken = 0);
+	};
+
+	// Called with nullptr if the deadline passes before the consent request is registered
+	typedef std::function<void(std::shared_ptr<PendingConsent>)> RegistrationCallback;
+
+private:
+	static constexpr std::chrono::seconds RESOLVED_ENTRY_LIFETIME = std::chrono::seconds(60);
+
+	typedef std::pair<std::string, uint32_t> EntryKey;
+
+	struct RegistrationWaiter
+	{
+		EntryKey key;
+		RegistrationCallback onRegistered;
+	};
+
+	std::mutex entryMutex;
+	std::map<EntryKey, std::shared_ptr<PendingConsent>> entries;
+	std::map<uint64_t, RegistrationWaiter> registrationWaiters;
+	uint64_t nextWaiterID = 1;
+	unsigned long long quarantinedBytes = 0;
+
+	// Run by timeoutThread once their deadline passes; a timeout whose waiter was called first does nothing
+	std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> timeouts;
+	std::condition_variable timeoutsChanged;
+	bool stopping = false;
+	std::thread timeoutThread;
+
+	void addTimeout(std::chrono::steady_clock::time_point deadline, std::function<void()> timeout);
+	void runTimeouts();
+
+public:
+	SpeculativeUploadRegistry();
+	~SpeculativeUploadRegistry();
+
+	std::shared_ptr<PendingConsent> registerConsent(const std::string& remoteIP, uint32_t uploadID, const std::vector<unsigned long long>& fileSizes);
+
+	void whenRegistered(const std::string& remoteIP, uint32_t uploadID, std::chrono::steady_clock::time_point deadline,
+		RegistrationCallback onRegistered);
+	void whenDecided(const std::shared_ptr<PendingConsent>& pendingConsent, std::chrono::steady_clock::time_point deadline,
+		DecisionCallback onDecided);
+
+	bool tryReserveQuarantine(unsigned long long bytes, unsigned long long budget);
+	void releaseQuarantine(unsigned long long bytes);
 };
 
+BandwidthLimits readBandwidthLimits(QuickOpenApplication& wxAppRef);
+std::vector<ConsentRule> readConsentRules(QuickOpenApplication& wxAppRef);
+
 class FileConsentTokenService : public CivetHandler
 {
 	// static const size_t MAX_REQUEST_BODY_SIZE = 1 << 16;
@@ -121,17 +348,72 @@ class FileConsentTokenService : public CivetHandler
 public:
 	typedef std::map<ConsentToken, std::vector<FileConsentRequestInfo::RequestedFileInfo>> TokenMap;
 	WriterReadersLock<TokenMap> tokenWRRef;
+	SpeculativeUploadRegistry speculativeUploads;
+	ContentIndex contentIndex;
+	// Shared by every upload endpoint, so that its limits apply to all uploads at once. Its writers run at the
+	// configured lowered priority; request threads, which also serve consent prompts and static files, don't.
+	UploadScheduler uploadScheduler;
+	// Likewise shared, and kept up to date with the configuration while uploads run
+	BandwidthLimiter bandwidthLimiter;
+	// Space on the destination drives promised to consented files that haven't finished uploading
+	DiskSpaceLedger diskSpaceLedger;
+	// Where files that are only opened are received
+	EphemeralStore ephemeralStore;
+
+	enum class ClaimResult
+	{
+		CLAIMED,
+		INVALID_TOKEN,
+		INVALID_INDEX
+	};
+
+	ClaimResult claimFile(ConsentToken token, long long fileIndex, FileConsentRequestInfo::RequestedFileInfo& fileInfo);
+	// Looks up a file that has not started uploading yet, without claiming it
+	ClaimResult peekFile(ConsentToken token, long long fileIndex, FileConsentRequestInfo::RequestedFileInfo& fileInfo);
+	// Undoes a claim for an upload that was refused or cut short, so the client can retry. The file's reserved
+	// space is given back, since the client may never return for it.
+	void releaseFile(ConsentToken token, long long fileIndex);
+	bool markFileEnded(ConsentToken token, long long fileIndex, size_t& fileCount);
 private:
+	// How long the disk space reserved for a consented file is kept for it if its upload doesn't start
+	static constexpr std::chrono::minutes UNCLAIMED_RESERVATION_LIFETIME = std::chrono::minutes(30);
+
 	// TokenMap tokens;
 	QuickOpenApplication& wxAppRef;
-	std::mutex& consentDialogMutex;
+	ConsentPromptQueue& promptQueue;
+	ConsentPolicy& consentPolicy;
 	WriterReadersLock<std::set<wxString>>& bannedIPRef;
 
+	// Configuration read when a consent request arrives, applied once the user has answered it
+	struct ConsentSettings
+	{
+		bool deduplicationEnabled = false,
+			deduplicationUseHardlinks = false;
+		unsigned maxConcurrentUploads = 0;
+		unsigned long long diskSpaceSafetyMargin = 0;
+		EphemeralReceivePolicy ephemeralPolicy;
+	};
+
+	void respondToConsent(mg_connection* conn, FileConsentRequestInfo& rqFileInfo, bool accepted,
+		const ConsentSettings& settings, const std::shared_ptr<SpeculativeUploadRegistry::PendingConsent>& pendingConsent);
+
+	// Materializes files the client sent a known content hash for; returns the indices that no longer need to be uploaded
+	std::vector<size_t> deduplicateFiles(FileConsentRequestInfo& rqFileInfo, bool useHardlinks);
+
 public:
-	FileConsentTokenService(std::mutex& consentDialogMutex, QuickOpenApplication& wxAppRef, WriterReadersLock<std::set<wxString>>& bannedIPRef) :
+	FileConsentTokenService(ConsentPromptQueue& promptQueue, ConsentPolicy& consentPolicy, QuickOpenApplication& wxAppRef,
+		WriterReadersLock<std::set<wxString>>& bannedIPRef) :
 		tokenWRRef(std::make_unique<TokenMap>()),
-		consentDialogMutex(consentDialogMutex),
+		uploadScheduler(WriterReadersLock<AppConfig>::ReadableReference(*wxAppRef.getConfigRef())->maxDiskWriters,
+			[priority = WriterReadersLock<AppConfig>::ReadableReference(*wxAppRef.getConfigRef())->diskWriterPriority]
+			{
+				applyThreadPriority(priority);
+			}),
+		bandwidthLimiter([&wxAppRef] { return readBandwidthLimits(wxAppRef); }),
+		ephemeralStore(getEphemeralFolder()),
 		wxAppRef(wxAppRef),
+		promptQueue(promptQueue),
+		consentPolicy(consentPolicy),
 		bannedIPRef(bannedIPRef)
 	{}
 
@@ -140,6 +422,17 @@ public:
 
 class OpenSaveFileAPIEndpoint : public CivetHandler
 {
+public:
+	enum class BodyEncoding
+	{
+		RAW,
+		// See DeltaTransfer.h
+		DELTA,
+		// See SparseTransfer.h
+		SPARSE
+	};
+
+protected:
 	// WriterReadersLock<AppConfig>& configLock;
 	FileConsentTokenService& consentServiceRef;
 	QuickOpenApplication& progressReportingApp;
@@ -165,9 +458,55 @@ class OpenSaveFileAPIEndpoint : public CivetHandler
 		{}
 	};
 
-	void MGStoreBodyChecked(mg_connection* conn, const wxFileName& fileName, unsigned long long targetFileSize,
+	class MalformedBodyException : public std::runtime_error
+	{
+	public:
+		MalformedBodyException(const std::string& description) : std::runtime_error(description)
+		{}
+	};
+
+	// How long an upload waits for the GUI thread to add its activity entry before turning the client away
+	static constexpr std::chrono::seconds GUI_CALL_TIMEOUT{ 10 };
+
+	// Throws OperationCanceledException once the user has asked for the upload to be cancelled
+	void checkCancelled(TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef, std::atomic<bool>& cancelRequestFlag);
+
+	void reportProgress(TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef, std::atomic<bool>& cancelRequestFlag,
+		unsigned long long bytesWritten, unsigned long long targetFileSize);
+
+	// Files that are only opened are never synced, since they aren't meant to outlive the session anyway
+	DurabilityPolicy readDurabilityPolicy(const wxFileName& fileName);
+	// Starts the program configured to open files like fileName while they are received, if there is one
+	std::unique_ptr<StreamingOpen> startStreamingOpen(const wxFileName& fileName, const wxFileName& growingFile);
+
+	// Files are received into a StagedFile and only appear under fileName once complete. bytesAlreadyWritten
+	// bytes of the file may have been received into existingData already, which is then appended to.
+	void MGStoreBodyChecked(BodyReader& body, const wxFileName& fileName, unsigned long long targetFileSize,
+		TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef, std::atomic<bool>& cancelRequestFlag,
+		unsigned long long bytesAlreadyWritten = 0, const wxFileName& existingData = wxFileName(),
+		SHA256Hasher* contentHasher = nullptr);
+
+	// Rebuilds fileName from a delta against its current contents in a temporary file, then swaps it in.
+	// Returns the SHA-256 of the rebuilt file.
+	std::string MGStoreDeltaChecked(BodyReader& body, const wxFileName& fileName, unsigned long long targetFileSize,
+		const std::string& expectedContentHash, TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef,
+		std::atomic<bool>& cancelRequestFlag);
+
+	// Writes a body of data and hole records, leaving holes and all-zero blocks of data unallocated
+	void MGStoreSparseChecked(BodyReader& body, const wxFileName& fileName, unsigned long long targetFileSize,
 		TrayStatusWindow::FileUploadActivityEntry* uploadActivityEntryRef, std::atomic<bool>& cancelRequestFlag);
 
+	void storeFileAndRespond(mg_connection* conn, ConsentToken token, long long fileIndex,
+		const FileConsentRequestInfo::RequestedFileInfo& consentedFileInfo, unsigned long long bytesAlreadyWritten = 0,
+		const wxFileName& existingData = wxFileName(), BodyEncoding encoding = BodyEncoding::RAW);
+
+	// Uploads currently being received through handlePost, for admission control
+	std::atomic<unsigned> activeUploads = 0;
+
+	// Writes length bytes through the upload scheduler on behalf of the request being read by body, and waits
+	// for the write to finish
+	void writeScheduled(BodyReader& body, unsigned long long targetFileSize, size_t length, const std::function<void()>& write);
+
 	// TrayStatusWindow* statusWindow = nullptr;
 public:
 	OpenSaveFileAPIEndpoint(FileConsentTokenService& consentServiceRef, QuickOpenApplication& progressReportingApp) : consentServiceRef(consentServiceRef),
@@ -177,37 +516,172 @@ public:
 	bool handlePost(CivetServer* server, mg_connection* conn) override;
 };
 
-class QuickOpenWebServer : public CivetServer
+// Serves the block signature of a consented file's existing destination, for delta uploads
+class FileSignatureEndpoint : public CivetHandler
 {
-	QuickOpenApplication& wxAppRef;
+	FileConsentTokenService& consentServiceRef;
+
+public:
+	FileSignatureEndpoint(FileConsentTokenService& consentServiceRef) : consentServiceRef(consentServiceRef)
+	{}
+
+	bool handleGet(CivetServer* server, mg_connection* conn) override;
+};
+
+class SpeculativeUploadEndpoint : public OpenSaveFileAPIEndpoint
+{
+	static constexpr std::chrono::seconds REGISTRATION_TIMEOUT = std::chrono::seconds(10);
+
+	const wxFileName quarantineFolder;
+
+	// What was received of a file before the user decided on it
+	struct QuarantinedPart
+	{
+		wxFileName fileName;
+		unsigned long long receivedBytes = 0;
+		// Of the speculative upload budget
+		unsigned long long reservedBytes = 0;
+	};
+
+	// Requests suspended while they wait for their consent request to be registered or decided
+	std::atomic<unsigned> suspendedRequests = 0;
+
+	// The continuations of handlePost, run once the consent request is registered and once it is decided
+	void quarantine(std::shared_ptr<SuspendedRequest> request, std::shared_ptr<SpeculativeUploadRegistry::PendingConsent> pendingConsent,
+		long long fileIndex, unsigned long long quarantineBudget);
+	void finishQuarantined(std::shared_ptr<SuspendedRequest> request, std::shared_ptr<SpeculativeUploadRegistry::PendingConsent> pendingConsent,
+		long long fileIndex, const QuarantinedPart& part, SpeculativeUploadRegistry::Decision decision);
+
+	void discardQuarantined(const QuarantinedPart& part);
+	void complete(const std::shared_ptr<SuspendedRequest>& request);
+
+public:
+	SpeculativeUploadEndpoint(FileConsentTokenService& consentServiceRef, QuickOpenApplication& progressReportingApp,
+		const wxFileName& quarantineFolder = InstallationInfo::detectInstallation().configFolder / wxFileName("./quarantine", "")) :
+		OpenSaveFileAPIEndpoint(consentServiceRef, progressReportingApp),
+		quarantineFolder(quarantineFolder)
+	{}
+
+	bool handlePost(CivetServer* server, mg_connection* conn) override;
+
+	unsigned requestsInProgress() const
+	{
+		return suspendedRequests;
+	}
+};
 
-	std::mutex consentDialogMutex;
+ConnectionDeadlines readConnectionDeadlines(QuickOpenApplication& wxAppRef);
+
+// What a QuickOpenWebServer passes on to the server replacing it when the port changes, so that consent tokens,
+// bans and CSRF tokens stay valid and uploads in progress keep their scheduling and bandwidth shares
+struct QuickOpenServerState
+{
+	ConsentPromptQueue consentPrompts;
+	ConsentPolicy consentPolicy;
 
 	WriterReadersLock<std::set<wxString>> bannedIPs;
 
 	CSRFAuthHandler csrfHandler;
+	FileConsentTokenService fileConsentTokenService;
+
+	explicit QuickOpenServerState(QuickOpenApplication& wxAppRef);
+};
+
+class QuickOpenWebServer : public CivetServer
+{
+	QuickOpenApplication& wxAppRef;
+	std::shared_ptr<QuickOpenServerState> state;
 
 	StaticHandler staticHandler;
 	OpenWebpageAPIEndpoint webpageAPIEndpoint;
-	FileConsentTokenService fileConsentTokenService;
 	OpenSaveFileAPIEndpoint fileAPIEndpoint;
+	SpeculativeUploadEndpoint speculativeUploadEndpoint;
+	FileSignatureEndpoint fileSignatureEndpoint;
+
+	// Pages, webpage requests and consent requests start something new, so they are refused once the server is
+	// being replaced; uploads, and the signatures of their destinations, are for consents already given
+	HandoffGate handoffGate;
+	HandoffGate::Handler gatedStaticHandler,
+		gatedWebpageAPIEndpoint,
+		gatedFileConsentTokenService,
+		gatedFileAPIEndpoint,
+		gatedSpeculativeUploadEndpoint,
+		gatedFileSignatureEndpoint;
 
 	void onWebpageOpened(const wxString& url);
 	unsigned port;
 public:
-	QuickOpenWebServer(QuickOpenApplication& wxAppRef, unsigned port);
+	// Takes over previousState from the server this one replaces, if there is one
+	QuickOpenWebServer(QuickOpenApplication& wxAppRef, unsigned port, std::shared_ptr<QuickOpenServerState> previousState = nullptr);
 
 	unsigned getPort() const
 	{
 		return this->port;
 	}
 
+	const std::shared_ptr<QuickOpenServerState>& getState() const
+	{
+		return this->state;
+	}
+
+	// Stops taking new work, telling clients that ask for some to go to newPort instead
+	void beginHandoff(unsigned newPort)
+	{
+		handoffGate.close(newPort);
+	}
+
+	void cancelHandoff()
+	{
+		handoffGate.reopen();
+	}
+
+	// Whether a server that has begun handing off has nothing left in progress that closing it would cut short
+	bool handoffComplete();
+
 	~QuickOpenWebServer() override
 	{
 		this->close();
 	}
 };
 
+// Keeps servers replaced on a port change running, with their listening socket still open, until what they
+// were doing has finished or their handoff deadline passes. A reaper thread checks on them once a second.
+class ServerHandoff
+{
+	struct RetiredServer
+	{
+		std::unique_ptr<QuickOpenWebServer> server;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	static constexpr std::chrono::seconds CHECK_INTERVAL{ 1 };
+
+	std::mutex retiredMutex;
+	std::condition_variable stopRequested;
+	std::list<RetiredServer> retiredServers;
+	bool stopping = false;
+	std::thread reaperThread;
+
+	void reap();
+
+public:
+	ServerHandoff() = default;
+	ServerHandoff(const ServerHandoff&) = delete;
+	ServerHandoff& operator=(const ServerHandoff&) = delete;
+
+	// Begins handing server off to the one listening on newPort, and closes it once done
+	void retire(std::unique_ptr<QuickOpenWebServer> server, unsigned newPort, std::chrono::seconds timeout);
+
+	// Takes back the server still handing off on port, if there is one, so that switching back to a port
+	// doesn't have to wait for it to be released
+	std::unique_ptr<QuickOpenWebServer> reclaim(unsigned port);
+
+	size_t retiredCount();
+
+	// Closes the servers still handing off, cutting short whatever they were doing
+	~ServerHandoff();
+};
+
 //int updateSessionCookie(mg_connection* conn)
 //{
 //	static const std::string SESSION_COOKIE_NAME = "_session_id", SESSION_VAR_NAME = "id";
@@ -1,7 +1,10 @@
 #include "PlatformUtils.h"
 #include "WebServerUtils.h"
 
+#include <algorithm>
+#include <cctype>
 #include <sstream>
+#include <thread>
 
 std::string URLDecode(const std::string& encodedStr, bool decodePlus)
 {
@@ -121,10 +124,15 @@ std::map<std::string, std::string> parseQueryString(mg_connection* conn)
 	return resultMap;
 }
 
-void sendJSONResponse(mg_connection* conn, int status, const nlohmann::json& json)
+void sendJSONResponse(mg_connection* conn, int status, const nlohmann::json& json,
+	const std::vector<std::pair<std::string, std::string>>& extraHeaders)
 {
 	mg_response_header_start(conn, status);
 	mg_response_header_add(conn, "Content-Type", "application/json", -1);
+	for (const auto& [headerName, headerValue] : extraHeaders)
+	{
+		mg_response_header_add(conn, headerName.c_str(), headerValue.c_str(), -1);
+	}
 	mg_response_header_send(conn);
 	std::string jsonString = json.dump();
 	mg_write(conn, jsonString.c_str(), jsonString.size());
@@ -149,6 +157,171 @@ bool requireParameter(mg_connection* conn, const std::map<std::string, std::stri
 	}
 }
 
+bool acceptRequestBody(mg_connection* conn, std::optional<unsigned long long> expectedLength)
+{
+	long long contentLength = mg_get_request_info(conn)->content_length;
+
+	if (expectedLength.has_value() && contentLength >= 0 && static_cast<unsigned long long>(contentLength) != *expectedLength)
+	{
+		auto jsonErrorInfo = nlohmann::json(FormErrorList{
+			{
+				{"uploadFile", "The file sent did not have the length specified by the consent token used."}
+			}
+			});
+		sendJSONResponse(conn, (static_cast<unsigned long long>(contentLength) > *expectedLength) ? 413 : 400, jsonErrorInfo);
+		return false;
+	}
+
+	// The interim response is only sent once the request has been validated, so clients that wait for it
+	// never put the body of a rejected upload on the wire.
+	const char* expectHeader = mg_get_header(conn, "Expect");
+	if (expectHeader != nullptr)
+	{
+		std::string expectValue = expectHeader;
+		std::transform(expectValue.begin(), expectValue.end(), expectValue.begin(), [](unsigned char c) { return std::tolower(c); });
+
+		if (expectValue == "100-continue")
+		{
+			mg_printf(conn, "HTTP/1.1 100 Continue\r\n\r\n");
+		}
+	}
+
+	return true;
+}
+
+bool clientDisconnected(mg_connection* conn)
+{
+#ifdef MG_CAN_DETECT_DISCONNECT
+	return mg_client_disconnected(conn) != 0;
+#else
+	return false;
+#endif
+}
+
+int waitForBody(mg_connection* conn, std::chrono::milliseconds timeout)
+{
+#ifdef MG_CAN_WAIT_FOR_BODY
+	return mg_wait_for_body(conn, static_cast<int>(timeout.count()));
+#else
+	return 1;
+#endif
+}
+
+BodyReader::BodyReader(mg_connection* conn, const ConnectionDeadlines& deadlines, std::function<void()> checkCancelled,
+	BandwidthLimiter* limiter) :
+	conn(conn), deadlines(deadlines), checkCancelled(std::move(checkCancelled)), limiter(limiter),
+	sender(mg_get_request_info(conn)->remote_addr), startTime(std::chrono::steady_clock::now()), lastDataTime(startTime)
+{}
+
+void BodyReader::throttle(std::chrono::steady_clock::duration wait)
+{
+	auto resumeTime = std::chrono::steady_clock::now() + wait;
+
+	// Sleeps in slices so that a cancellation still takes effect promptly under a low limit
+	for (auto now = std::chrono::steady_clock::now(); now < resumeTime; now = std::chrono::steady_clock::now())
+	{
+		if (checkCancelled)
+		{
+			checkCancelled();
+		}
+
+		std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(resumeTime - now, POLL_INTERVAL));
+	}
+
+	paused(wait);
+}
+
+void BodyReader::paused(std::chrono::steady_clock::duration time)
+{
+	pausedTime += time;
+	lastDataTime = std::chrono::steady_clock::now();
+}
+
+int BodyReader::read(void* buf, size_t len)
+{
+	if (limiter)
+	{
+		len = limiter->readSizeFor(sender, len);
+	}
+
+	while (true)
+	{
+		if (checkCancelled)
+		{
+			checkCancelled();
+		}
+
+		int readiness = waitForBody(conn, POLL_INTERVAL);
+		if (readiness < 0)
+		{
+			return -1;
+		}
+		else if (readiness > 0)
+		{
+			break;
+		}
+
+		if (std::chrono::steady_clock::now() - lastDataTime >= deadlines.bodyIdleTimeout)
+		{
+			EvictionStats::global().record(EvictionStats::BODY_IDLE);
+			throw TransferStalledException(EvictionStats::BODY_IDLE, "The upload stopped sending data.");
+		}
+	}
+
+	int bytesRead = mg_read(conn, buf, len);
+	if (bytesRead > 0)
+	{
+		bytesReceived += bytesRead;
+		lastDataTime = std::chrono::steady_clock::now();
+
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(lastDataTime - startTime - pausedTime);
+		if (deadlines.minBodyBytesPerSecond > 0 && elapsed >= deadlines.bodyIdleTimeout
+			&& bytesReceived * 1000 < deadlines.minBodyBytesPerSecond * static_cast<unsigned long long>(elapsed.count()))
+		{
+			EvictionStats::global().record(EvictionStats::BODY_TOO_SLOW);
+			throw TransferStalledException(EvictionStats::BODY_TOO_SLOW, "The upload was being sent too slowly.");
+		}
+
+		if (limiter)
+		{
+			auto wait = limiter->consume(sender, bytesRead);
+			if (wait > std::chrono::steady_clock::duration::zero())
+			{
+				throttle(wait);
+			}
+		}
+	}
+
+	return bytesRead;
+}
+
+SuspendedRequest::SuspendedRequest(mg_connection* conn) : conn(conn)
+{
+#ifdef MG_CAN_SUSPEND_REQUESTS
+	mg_suspend_request(conn);
+#endif
+}
+
+void SuspendedRequest::complete()
+{
+#ifdef MG_CAN_SUSPEND_REQUESTS
+	mg_resume_request(conn);
+#else
+	std::lock_guard<std::mutex> lock(completionMutex);
+	isComplete = true;
+	completed.notify_all();
+#endif
+}
+
+bool SuspendedRequest::detach()
+{
+#ifndef MG_CAN_SUSPEND_REQUESTS
+	std::unique_lock<std::mutex> lock(completionMutex);
+	completed.wait(lock, [this] { return isComplete; });
+#endif
+	return true;
+}
+
 uint64_t CSRFAuthHandler::addToken(const std::string& ipAddress)
 {
 	auto tokenMapRef = decltype(tokenMap)::WritableReference(tokenMap);
@@ -199,4 +372,47 @@ bool CSRFAuthHandler::authorize(CivetServer* server, mg_connection* conn)
 	{
 		return false; // requireParameter sent Bad Request
 	}
-}
\ No newline at end of file
+}
+
+template<typename HandleFunc>
+bool HandoffGate::Handler::handle(CivetServer* server, mg_connection* conn, HandleFunc handleFunc)
+{
+	unsigned newPort = gate.replacementPort;
+	if (newPort != 0 && !admitsWhileClosed)
+	{
+		std::string message = "QuickOpen has moved to port " + std::to_string(newPort) + ". Please reload the page from there.";
+		if (startsWith(std::string(mg_get_request_info(conn)->request_uri), "/api/"))
+		{
+			sendJSONResponse(conn, 503, FormErrorList{ { {"", message} } });
+		}
+		else
+		{
+			mg_send_http_error(conn, 503, message.c_str());
+		}
+
+		return true;
+	}
+
+	++gate.activeRequests;
+	try
+	{
+		bool handled = handleFunc(server, conn);
+		--gate.activeRequests;
+		return handled;
+	}
+	catch (...)
+	{
+		--gate.activeRequests;
+		throw;
+	}
+}
+
+bool HandoffGate::Handler::handleGet(CivetServer* server, mg_connection* conn)
+{
+	return handle(server, conn, [this](CivetServer* server, mg_connection* conn) { return inner.handleGet(server, conn); });
+}
+
+bool HandoffGate::Handler::handlePost(CivetServer* server, mg_connection* conn)
+{
+	return handle(server, conn, [this](CivetServer* server, mg_connection* conn) { return inner.handlePost(server, conn); });
+}
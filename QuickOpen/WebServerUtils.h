@@ -1,10 +1,17 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <string>
 
 #include <nlohmann/json.hpp>
 
+#include "BandwidthLimiter.h"
 #include "CivetWebIncludes.h"
+#include "GUITask.h"
 #include "Utils.h"
 
 struct FormErrorList
@@ -24,8 +31,164 @@ struct FormErrorList
 
 std::map<std::string, std::string> parseFormEncodedBody(mg_connection* conn);
 std::map<std::string, std::string> parseQueryString(mg_connection* conn);
-void sendJSONResponse(mg_connection* conn, int status, const nlohmann::json& json);
+void sendJSONResponse(mg_connection* conn, int status, const nlohmann::json& json,
+	const std::vector<std::pair<std::string, std::string>>& extraHeaders = {});
 bool requireParameter(mg_connection* conn, const std::map<std::string, std::string>& paramMap, const std::string& parameter);
+bool acceptRequestBody(mg_connection* conn, std::optional<unsigned long long> expectedLength);
+
+// Always false with CivetWeb, which has no way to ask
+bool clientDisconnected(mg_connection* conn);
+
+// Waits for a GUI call made on behalf of a request, giving up (and cancelling the call if it hasn't started)
+// once the deadline passes, the client goes away or abandoned returns true.
+template<typename ResultType>
+std::optional<ResultType> awaitGUITask(GUITask<ResultType>& task, mg_connection* conn,
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(),
+	const std::function<bool()>& abandoned = {})
+{
+	constexpr auto DISCONNECT_POLL_INTERVAL = std::chrono::milliseconds(250);
+
+	while (true)
+	{
+		auto now = std::chrono::steady_clock::now();
+		auto waitDeadline = (deadline - now > DISCONNECT_POLL_INTERVAL) ? now + DISCONNECT_POLL_INTERVAL : deadline;
+		if (auto result = task.waitUntil(waitDeadline))
+		{
+			return result;
+		}
+
+		if (std::chrono::steady_clock::now() >= deadline || clientDisconnected(conn) || (abandoned && abandoned()))
+		{
+			task.cancel();
+			return std::nullopt;
+		}
+	}
+}
+
+// How long a request may spend in each phase before its connection is dropped
+struct ConnectionDeadlines
+{
+	// Applied by the server itself, from the first byte of a request head until its last
+	std::chrono::milliseconds headerTimeout{ 15000 };
+	// How long a request may wait for the user to answer (or reach) the consent dialog
+	std::chrono::milliseconds consentTimeout{ 300000 };
+	// How long an upload may go without receiving a single byte
+	std::chrono::milliseconds bodyIdleTimeout{ 30000 };
+	// Average rate an upload must keep up once it has run for bodyIdleTimeout, so that a client trickling
+	// bytes can't avoid the idle timeout; 0 disables the check
+	unsigned long long minBodyBytesPerSecond = 1024;
+};
+
+// Counts of connections dropped for missing a deadline, for diagnosing misbehaving clients and networks
+class EvictionStats
+{
+public:
+	enum Reason
+	{
+		CONSENT_TIMEOUT,
+		BODY_IDLE,
+		BODY_TOO_SLOW,
+		REASON_COUNT
+	};
+
+private:
+	std::atomic<unsigned long long> counts[REASON_COUNT] = {};
+
+public:
+	void record(Reason reason)
+	{
+		++counts[reason];
+	}
+
+	unsigned long long count(Reason reason) const
+	{
+		return counts[reason];
+	}
+
+	static EvictionStats& global()
+	{
+		static EvictionStats instance;
+		return instance;
+	}
+};
+
+class TransferStalledException : public std::runtime_error
+{
+public:
+	const EvictionStats::Reason reason;
+
+	TransferStalledException(EvictionStats::Reason reason, const std::string& description) :
+		std::runtime_error(description), reason(reason)
+	{}
+};
+
+// Returns 1 once body data (or its end) can be read without blocking, 0 if timeout passes first and -1 on error.
+// With CivetWeb, which can't wait for readiness, this always returns 1 and mg_read blocks for up to the
+// server's request_timeout_ms instead.
+int waitForBody(mg_connection* conn, std::chrono::milliseconds timeout);
+
+// Reads a request body like mg_read, but throws TransferStalledException when the client misses the body
+// deadlines. While waiting for data it calls checkCancelled every poll interval, so a cancellation (which
+// checkCancelled reports by throwing) takes effect even when the client has stopped sending.
+// With a limiter, reads are also held to the sender's bandwidth limits by sleeping between them; time spent
+// throttled doesn't count against the client's deadlines.
+class BodyReader
+{
+	static constexpr std::chrono::milliseconds POLL_INTERVAL{ 100 };
+
+	mg_connection* conn;
+	ConnectionDeadlines deadlines;
+	std::function<void()> checkCancelled;
+	BandwidthLimiter* limiter;
+	std::string sender;
+	std::chrono::steady_clock::time_point startTime, lastDataTime;
+	// Time the reader was held up by throttling or by whatever consumes the body, which the client isn't to blame for
+	std::chrono::steady_clock::duration pausedTime = std::chrono::steady_clock::duration::zero();
+	unsigned long long bytesReceived = 0;
+
+	void throttle(std::chrono::steady_clock::duration wait);
+
+public:
+	BodyReader(mg_connection* conn, const ConnectionDeadlines& deadlines, std::function<void()> checkCancelled = {},
+		BandwidthLimiter* limiter = nullptr);
+
+	mg_connection* connection() const
+	{
+		return conn;
+	}
+
+	int read(void* buf, size_t len);
+
+	// Records time spent passing the body on to something slower than the client, such as a program reading it
+	// as it arrives, so that it doesn't count against the client's deadlines
+	void paused(std::chrono::steady_clock::duration time);
+};
+
+// A request that is answered after its handler has returned, by a continuation running on another thread.
+// The handler returns detach(); the continuation writes the response and then calls complete().
+// CivetWeb cannot take a connection back once its handler returns, so with that backend detach() waits for
+// complete() instead of releasing the thread.
+class SuspendedRequest
+{
+	mg_connection* conn;
+
+#ifndef MG_CAN_SUSPEND_REQUESTS
+	std::mutex completionMutex;
+	std::condition_variable completed;
+	bool isComplete = false;
+#endif
+
+public:
+	explicit SuspendedRequest(mg_connection* conn);
+
+	mg_connection* connection() const
+	{
+		return conn;
+	}
+
+	void complete();
+	bool detach();
+};
 
 class CSRFAuthHandler : public CivetAuthHandler
 {
@@ -36,4 +199,65 @@ public:
 	{}
 
 	uint64_t addToken(const std::string& ipAddress);
+};
+
+// Counts the requests a server's handlers are working on, and once the server is being replaced by one on
+// another port, turns away the requests that would start something new on it. Handlers registered through
+// admitting() always go through, so that transfers already consented to can finish where they started.
+class HandoffGate
+{
+	std::atomic<unsigned> activeRequests = 0;
+	// Nonzero once the server is being replaced
+	std::atomic<unsigned> replacementPort = 0;
+
+public:
+	class Handler : public CivetHandler
+	{
+		HandoffGate& gate;
+		CivetHandler& inner;
+		const bool admitsWhileClosed;
+
+		template<typename HandleFunc>
+		bool handle(CivetServer* server, mg_connection* conn, HandleFunc handleFunc);
+
+	public:
+		Handler(HandoffGate& gate, CivetHandler& inner, bool admitsWhileClosed) : gate(gate), inner(inner),
+			admitsWhileClosed(admitsWhileClosed)
+		{}
+
+		bool handleGet(CivetServer* server, mg_connection* conn) override;
+		bool handlePost(CivetServer* server, mg_connection* conn) override;
+	};
+
+	Handler refusing(CivetHandler& inner)
+	{
+		return Handler(*this, inner, false);
+	}
+
+	Handler admitting(CivetHandler& inner)
+	{
+		return Handler(*this, inner, true);
+	}
+
+	// Refuses new work from now on, pointing clients to newPort
+	void close(unsigned newPort)
+	{
+		replacementPort = newPort;
+	}
+
+	// Takes new work again, for a server that is kept after all
+	void reopen()
+	{
+		replacementPort = 0;
+	}
+
+	bool isClosed() const
+	{
+		return replacementPort != 0;
+	}
+
+	unsigned requestsInProgress() const
+	{
+		return activeRequests;
+	}
 };
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <wx/stdpaths.h>
 
 #include <map>
+#include <winioctl.h>
 
 std::wstring UTF8StrToWideStr(const std::string& UTF8Str)
 {
@@ -149,6 +150,83 @@ DWORD startSubprocess(const wxString& exePath, const std::vector<wxString>& args
 	return startSubprocess(commandLine);
 }
 
+PipeWriter::~PipeWriter()
+{
+	CloseHandle(pipeHandle);
+}
+
+bool PipeWriter::write(const char* data, size_t length, std::chrono::milliseconds timeout)
+{
+	while (length > 0)
+	{
+		DWORD chunkLength = (length > MAXDWORD) ? MAXDWORD : static_cast<DWORD>(length),
+			bytesWritten;
+		if (!WriteFile(pipeHandle, data, chunkLength, &bytesWritten, nullptr))
+		{
+			DWORD lastError = GetLastError();
+			if (lastError == ERROR_BROKEN_PIPE || lastError == ERROR_NO_DATA)
+			{
+				return false;
+			}
+
+			throw getWinAPIError(lastError);
+		}
+
+		data += bytesWritten;
+		length -= bytesWritten;
+	}
+
+	return true;
+}
+
+std::unique_ptr<PipeWriter> startSubprocessWithInput(const wxString& exePath, const std::vector<wxString>& args)
+{
+	SECURITY_ATTRIBUTES pipeAttributes = {};
+	pipeAttributes.nLength = sizeof(pipeAttributes);
+	pipeAttributes.bInheritHandle = TRUE;
+
+	HANDLE readHandle, writeHandle;
+	handleWinAPIError(ERROR_SUCCESS, !CreatePipe(&readHandle, &writeHandle, &pipeAttributes, 0));
+
+	// Only the reading end goes to the child; if it inherited the writing end, it would never see its input end
+	if (!SetHandleInformation(writeHandle, HANDLE_FLAG_INHERIT, 0))
+	{
+		DWORD lastError = GetLastError();
+		CloseHandle(readHandle);
+		CloseHandle(writeHandle);
+		throw getWinAPIError(lastError);
+	}
+
+	tstring commandLine = escapeArg(exePath).ToStdWstring();
+	for (const wxString& thisArg : args)
+	{
+		commandLine += TEXT(' ') + escapeArg(thisArg).ToStdWstring();
+	}
+
+	STARTUPINFO startupInfo = {};
+	startupInfo.cb = sizeof(startupInfo);
+	startupInfo.dwFlags = STARTF_USESTDHANDLES;
+	startupInfo.hStdInput = readHandle;
+	startupInfo.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	startupInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	PROCESS_INFORMATION newProcInfo = {};
+	BOOL created = CreateProcess(nullptr, commandLine.data(), nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startupInfo,
+		&newProcInfo);
+	DWORD lastError = GetLastError();
+	CloseHandle(readHandle);
+
+	if (!created)
+	{
+		CloseHandle(writeHandle);
+		throw getWinAPIError(lastError);
+	}
+
+	CloseHandle(newProcInfo.hThread);
+	CloseHandle(newProcInfo.hProcess);
+	return std::make_unique<PipeWriter>(writeHandle);
+}
+
 tstring substituteWinShellFormatString(const tstring& format, const std::vector<tstring>& args)
 {
 	tstring resultStr, currentNumStr;
@@ -465,6 +543,176 @@ std::vector<NetworkInterfaceInfo> getPhysicalNetworkInterfaces()
 	return resultList;
 }
 
+void cloneFileContents(const wxFileName& source, const wxFileName& dest)
+{
+	COPYFILE2_EXTENDED_PARAMETERS copyParams = {};
+	copyParams.dwSize = sizeof(copyParams);
+
+	HRESULT copyResult = CopyFile2(source.GetFullPath().ToStdWstring().c_str(), dest.GetFullPath().ToStdWstring().c_str(), &copyParams);
+	if (FAILED(copyResult))
+	{
+		throw getWinAPIError(HRESULT_CODE(copyResult));
+	}
+}
+
+void markFileSparse(const wxFileName& file)
+{
+	HANDLE fileHandle = CreateFile(wxStringToTString(file.GetFullPath()).c_str(), GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	handleWinAPIError(ERROR_SUCCESS, fileHandle == INVALID_HANDLE_VALUE);
+
+	DWORD bytesReturned;
+	BOOL succeeded = DeviceIoControl(fileHandle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr);
+	DWORD lastError = GetLastError();
+	CloseHandle(fileHandle);
+
+	// FAT and exFAT volumes have no sparse files; the upload still works, just without the savings
+	if (!succeeded && lastError != ERROR_INVALID_FUNCTION)
+	{
+		throw getWinAPIError(lastError);
+	}
+}
+
+FileSyncHandle::FileSyncHandle(const wxFileName& file)
+{
+	fileHandle = CreateFile(wxStringToTString(file.GetFullPath()).c_str(), GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	handleWinAPIError(ERROR_SUCCESS, fileHandle == INVALID_HANDLE_VALUE);
+}
+
+FileSyncHandle::~FileSyncHandle()
+{
+	CloseHandle(fileHandle);
+}
+
+void FileSyncHandle::syncData()
+{
+	handleWinAPIError(ERROR_SUCCESS, !FlushFileBuffers(fileHandle));
+}
+
+DirectoryChangeWatcher::DirectoryChangeWatcher(std::function<void(const wxFileName&)> onFileChanged) :
+	onFileChanged(std::move(onFileChanged))
+{}
+
+DirectoryChangeWatcher::~DirectoryChangeWatcher()
+{
+	stopRequested = true;
+
+	std::lock_guard<std::mutex> lock(watchMutex);
+	for (WatchedDirectory& thisDir : watchedDirs)
+	{
+		// Unblocks the synchronous ReadDirectoryChangesW call the watch thread is waiting in
+		CancelSynchronousIo(thisDir.watchThread.native_handle());
+		thisDir.watchThread.join();
+		CloseHandle(thisDir.dirHandle);
+	}
+}
+
+void DirectoryChangeWatcher::watchDirectory(const wxFileName& directory)
+{
+	HANDLE dirHandle = CreateFile(wxStringToTString(directory.GetFullPath()).c_str(), FILE_LIST_DIRECTORY,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	handleWinAPIError(ERROR_SUCCESS, dirHandle == INVALID_HANDLE_VALUE);
+
+	std::lock_guard<std::mutex> lock(watchMutex);
+	WatchedDirectory& newDir = watchedDirs.emplace_back();
+	newDir.directory = directory;
+	newDir.dirHandle = dirHandle;
+	newDir.watchThread = std::thread(&DirectoryChangeWatcher::watchLoop, this, &newDir);
+}
+
+void DirectoryChangeWatcher::watchLoop(WatchedDirectory* watchedDir)
+{
+	alignas(DWORD) BYTE changeBuffer[16384];
+
+	while (!stopRequested)
+	{
+		DWORD bytesReturned = 0;
+		if (!ReadDirectoryChangesW(watchedDir->dirHandle, changeBuffer, sizeof(changeBuffer), FALSE,
+			FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE, &bytesReturned, nullptr, nullptr))
+		{
+			break;
+		}
+
+		for (BYTE* recordPtr = changeBuffer; bytesReturned > 0;)
+		{
+			const auto* record = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(recordPtr);
+			std::wstring changedName(record->FileName, record->FileNameLength / sizeof(WCHAR));
+			onFileChanged(wxFileName(watchedDir->directory.GetFullPath(), changedName));
+
+			if (record->NextEntryOffset == 0)
+			{
+				break;
+			}
+
+			recordPtr += record->NextEntryOffset;
+		}
+	}
+}
+
+FilesystemSpace getFilesystemSpace(const wxFileName& folder)
+{
+	std::wstring folderPath = folder.GetPath().ToStdWstring();
+	if (folderPath.empty())
+	{
+		folderPath = L".";
+	}
+
+	ULARGE_INTEGER availableBytes;
+	handleWinAPIError(ERROR_SUCCESS, !GetDiskFreeSpaceExW(folderPath.c_str(), &availableBytes, nullptr, nullptr));
+
+	wchar_t volumePath[MAX_PATH + 1];
+	handleWinAPIError(ERROR_SUCCESS, !GetVolumePathNameW(folderPath.c_str(), volumePath, MAX_PATH + 1));
+
+	// Drive letters aren't case sensitive
+	return { std::string(wxString(volumePath).Lower().ToUTF8()), availableBytes.QuadPart };
+}
+
+wxFileName getEphemeralFolder()
+{
+	return wxFileName(wxStandardPaths::Get().GetTempDir(), "") / wxFileName("QuickOpen-Received", "");
+}
+
+void applyThreadPriority(const ThreadPriority& priority)
+{
+	HANDLE currentThread = GetCurrentThread();
+
+	if (priority.ioClass != ThreadPriority::IO_NORMAL)
+	{
+		if (!SetThreadPriority(currentThread, THREAD_MODE_BACKGROUND_BEGIN))
+		{
+			std::cerr << "WARNING: Could not put thread into background mode: " << getWinAPIError(GetLastError()).what() << std::endl;
+		}
+	}
+	else if (priority.niceLevel > 0)
+	{
+		int threadPriority = (priority.niceLevel >= 15) ? THREAD_PRIORITY_IDLE
+			: (priority.niceLevel >= 5) ? THREAD_PRIORITY_LOWEST
+			: THREAD_PRIORITY_BELOW_NORMAL;
+		if (!SetThreadPriority(currentThread, threadPriority))
+		{
+			std::cerr << "WARNING: Could not set thread priority: " << getWinAPIError(GetLastError()).what() << std::endl;
+		}
+	}
+
+	if (!priority.cpuAffinity.empty())
+	{
+		DWORD_PTR affinityMask = 0;
+		for (unsigned cpu : priority.cpuAffinity)
+		{
+			if (cpu < sizeof(DWORD_PTR) * 8)
+			{
+				affinityMask |= static_cast<DWORD_PTR>(1) << cpu;
+			}
+		}
+
+		if (SetThreadAffinityMask(currentThread, affinityMask) == 0)
+		{
+			std::cerr << "WARNING: Could not set thread CPU affinity: " << getWinAPIError(GetLastError()).what() << std::endl;
+		}
+	}
+}
+
 InstallationInfo InstallationInfo::detectInstallation()
 {
 	wxFileName appExePath = getAppExecutablePath();
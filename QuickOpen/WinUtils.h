@@ -15,8 +15,15 @@
 #include <bcrypt.h>
 #include <Psapi.h>
 
+#include <chrono>
 #include <filesystem>
 #include <iostream>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #ifdef UNICODE
 typedef std::wstring tstring;
@@ -54,6 +61,28 @@ void handleWinAPIError(LSTATUS retVal, bool checkGLE = true);
 tstring readRegistryStringValue(HKEY key, const tstring& subkeyName, const tstring& valueName);
 DWORD startSubprocess(const wxString& commandLine);
 DWORD startSubprocess(const wxString& exePath, const std::vector<wxString>& args);
+
+// The writing end of a pipe that a program reads from. The program sees the end of its input once this is
+// destroyed.
+class PipeWriter
+{
+	HANDLE pipeHandle = INVALID_HANDLE_VALUE;
+
+public:
+	explicit PipeWriter(HANDLE pipeHandle) : pipeHandle(pipeHandle)
+	{}
+	~PipeWriter();
+
+	PipeWriter(const PipeWriter&) = delete;
+	PipeWriter& operator=(const PipeWriter&) = delete;
+
+	// Returns false if the reader has gone away. Anonymous pipes can't be written with a timeout, so a reader
+	// that stops taking data holds the writer up until it exits.
+	bool write(const char* data, size_t length, std::chrono::milliseconds timeout);
+};
+
+// Starts exePath with args, reading its standard input from the returned pipe
+std::unique_ptr<PipeWriter> startSubprocessWithInput(const wxString& exePath, const std::vector<wxString>& args);
 tstring substituteWinShellFormatString(const tstring& format, const std::vector<tstring>& args);
 
 void initializeCOM();
@@ -198,6 +227,80 @@ struct InstallationInfo
 	static InstallationInfo detectInstallation();
 };
 
+// Copies a file's contents into a new file; CopyFile2 lets the filesystem clone blocks (ReFS) when it can
+void cloneFileContents(const wxFileName& source, const wxFileName& dest);
+
+// Sets the sparse attribute on an NTFS file, so that regions seeked over rather than written are not
+// allocated and zero-filled
+void markFileSparse(const wxFileName& file);
+
+// A second handle on a file that is being written through a stream, for pushing its data to disk as it is
+// written. Windows can't start writeback of part of a file without waiting for it, so each finished range
+// flushes the whole file instead. Data must be flushed from the stream first.
+class FileSyncHandle
+{
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+
+public:
+	explicit FileSyncHandle(const wxFileName& file);
+	~FileSyncHandle();
+
+	FileSyncHandle(const FileSyncHandle&) = delete;
+	FileSyncHandle& operator=(const FileSyncHandle&) = delete;
+
+	void startWriteback(unsigned long long offset, unsigned long long length)
+	{}
+
+	void finishWriteback(unsigned long long offset, unsigned long long length)
+	{
+		syncData();
+	}
+
+	void syncData();
+};
+
+// NTFS journals renames itself, and flushing a folder needs administrator rights, so there is nothing to do
+inline void syncDirectory(const wxFileName& folder)
+{}
+
+// Filesystems are told apart by the root of their volume
+FilesystemSpace getFilesystemSpace(const wxFileName& folder);
+
+// Where files received only to be opened are kept. Windows has no memory-backed folder for ordinary use, so
+// this is under the user's temp folder.
+wxFileName getEphemeralFolder();
+
+// Lowers the calling thread's priority. Any lowered I/O class puts the thread into background mode, which
+// lowers its I/O, memory and CPU priority together (Windows has no separate idle I/O class for threads);
+// otherwise the nice value is mapped onto the thread priority levels below normal. Settings the system refuses
+// are reported as warnings.
+void applyThreadPriority(const ThreadPriority& priority);
+
+// Reports files that are created, modified, moved or deleted in a set of directories, from background
+// threads. Backed by ReadDirectoryChangesW.
+class DirectoryChangeWatcher
+{
+	struct WatchedDirectory
+	{
+		wxFileName directory;
+		HANDLE dirHandle;
+		std::thread watchThread;
+	};
+
+	std::mutex watchMutex;
+	std::list<WatchedDirectory> watchedDirs;
+	std::function<void(const wxFileName&)> onFileChanged;
+	std::atomic<bool> stopRequested = false;
+
+	void watchLoop(WatchedDirectory* watchedDir);
+
+public:
+	explicit DirectoryChangeWatcher(std::function<void(const wxFileName&)> onFileChanged);
+	~DirectoryChangeWatcher();
+
+	void watchDirectory(const wxFileName& directory);
+};
+
 enum StartupEntryState
 {
 	ABSENT,
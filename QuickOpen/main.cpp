@@ -7,5 +7,16 @@
 #else
 #include "AppGUI.h"
 
+#ifdef __linux__
+wxIMPLEMENT_APP_NO_MAIN(QuickOpenApplication);
+
+int main(int argc, char** argv)
+{
+    // Before wxWidgets and the servers start their threads and grow the process
+    startSpawnHelper();
+    return wxEntry(argc, argv);
+}
+#else
 wxIMPLEMENT_APP(QuickOpenApplication);
+#endif
 #endif
\ No newline at end of file
@@ -0,0 +1,152 @@
+// Builds an rsync-style delta of a file against the signature of the receiver's existing copy: a stream of
+// BLOCK records (byte 2, uint32 block index) and LITERAL records (byte 1, uint32 length, data), little-endian.
+// Requires sha256.js.
+const computeDeltaBlob = (() =>
+{
+    const LITERAL_RECORD = 1;
+    const BLOCK_RECORD = 2;
+    const SLICE_SIZE = 4 * 1024 * 1024;
+    const MAX_LITERAL_FLUSH = 1024 * 1024;
+
+    function concatBytes(first, second)
+    {
+        let bytes = new Uint8Array(first.length + second.length);
+        bytes.set(first);
+        bytes.set(second, first.length);
+        return bytes;
+    }
+
+    return async function (file, signature, onProgress = () => {})
+    {
+        const blockSize = signature.blockSize;
+
+        // Blocks the receiver has, by weak checksum. A short trailing block can never match a full window.
+        let blocksByWeakChecksum = new Map();
+        signature.weakChecksums.forEach((weak, blockIndex) =>
+        {
+            if (Math.min(blockSize, signature.baseSize - blockIndex * blockSize) !== blockSize)
+            {
+                return;
+            }
+
+            if (!blocksByWeakChecksum.has(weak))
+            {
+                blocksByWeakChecksum.set(weak, []);
+            }
+            blocksByWeakChecksum.get(weak).push(blockIndex);
+        });
+
+        let parts = [];
+        function emitLiteral(data)
+        {
+            for (let offset = 0; offset < data.length; offset += MAX_LITERAL_FLUSH)
+            {
+                let chunk = data.subarray(offset, offset + MAX_LITERAL_FLUSH);
+                let header = new DataView(new ArrayBuffer(5));
+                header.setUint8(0, LITERAL_RECORD);
+                header.setUint32(1, chunk.length, true);
+                parts.push(header, chunk);
+            }
+        }
+
+        function emitBlock(blockIndex)
+        {
+            let header = new DataView(new ArrayBuffer(5));
+            header.setUint8(0, BLOCK_RECORD);
+            header.setUint32(1, blockIndex, true);
+            parts.push(header);
+        }
+
+        let bytes = new Uint8Array(0);
+        let filePosition = 0;
+
+        // Appends the next slice of the file, dropping everything before the pending literal data
+        async function loadMore(literalStart)
+        {
+            if (filePosition >= file.size)
+            {
+                return false;
+            }
+
+            let slice = new Uint8Array(await file.slice(filePosition, filePosition + SLICE_SIZE).arrayBuffer());
+            filePosition += slice.length;
+            bytes = concatBytes(bytes.subarray(literalStart), slice);
+            onProgress(filePosition / file.size);
+            return true;
+        }
+
+        let position = 0, literalStart = 0;
+        let a = 0, b = 0, windowValid = false;
+
+        while (true)
+        {
+            while (position + blockSize + 1 > bytes.length)
+            {
+                // Keep at most one flush worth of literal data buffered across slices
+                if (position - literalStart >= MAX_LITERAL_FLUSH)
+                {
+                    emitLiteral(bytes.subarray(literalStart, position));
+                    literalStart = position;
+                }
+
+                let oldLiteralStart = literalStart;
+                if (!await loadMore(literalStart))
+                {
+                    break;
+                }
+
+                position -= oldLiteralStart;
+                literalStart = 0;
+            }
+
+            if (position + blockSize > bytes.length)
+            {
+                break;
+            }
+
+            if (!windowValid)
+            {
+                a = 0;
+                b = 0;
+                for (let i = 0; i < blockSize; ++i)
+                {
+                    a += bytes[position + i];
+                    b += (blockSize - i) * bytes[position + i];
+                }
+                a &= 0xFFFF;
+                b &= 0xFFFF;
+                windowValid = true;
+            }
+
+            let candidates = blocksByWeakChecksum.get((a | (b << 16)) >>> 0);
+            if (candidates)
+            {
+                let strong = hashBytesSHA256(bytes.subarray(position, position + blockSize)).substring(0, 32);
+                let matchedBlock = candidates.find(blockIndex => signature.strongChecksums[blockIndex] === strong);
+
+                if (matchedBlock !== undefined)
+                {
+                    emitLiteral(bytes.subarray(literalStart, position));
+                    emitBlock(matchedBlock);
+                    position += blockSize;
+                    literalStart = position;
+                    windowValid = false;
+                    continue;
+                }
+            }
+
+            if (position + blockSize >= bytes.length)
+            {
+                break;
+            }
+
+            let outgoing = bytes[position], incoming = bytes[position + blockSize];
+            a = (a - outgoing + incoming) & 0xFFFF;
+            b = (b - Math.imul(blockSize, outgoing) + a) & 0xFFFF;
+            ++position;
+        }
+
+        emitLiteral(bytes.subarray(literalStart));
+        return new Blob(parts, { type: 'application/octet-stream' });
+    };
+})();
@@ -1,78 +1,62 @@
-(function($)
+// A list of file inputs that the user can add entries to and remove entries from
+class MultiFilePicker
 {
-    
-    const entryMarkup = `<div class="mfp-entry"><input type="file" class="mfp-input" multiple />
-        <button type="button" class="mfp-add-button">Add</button>
-        <button type="button" class="mfp-remove-button">Remove</button></div>`;
+    constructor(containerElement)
+    {
+        this.container = containerElement;
+        this.container.append(this.createEntry());
+        this.updateRemoveButtons();
+    }
 
-    function createEntry()
+    createEntry()
     {
-        let entryObj = $(entryMarkup);
-        entryObj.children('.mfp-add-button').click(() => {
-            entryObj.parent().multiFilePicker('insertEntry', entryObj);
-        });
-        entryObj.children('.mfp-remove-button').click(() => {
-            entryObj.parent().multiFilePicker('removeEntry', entryObj);
-        });
+        let entry = document.createElement('div');
+        entry.className = 'mfp-entry';
+        entry.innerHTML = `<input type="file" class="mfp-input" multiple />
+            <button type="button" class="mfp-add-button">Add</button>
+            <button type="button" class="mfp-remove-button">Remove</button>`;
+
+        entry.querySelector('.mfp-add-button').addEventListener('click', () => this.insertEntry(entry));
+        entry.querySelector('.mfp-remove-button').addEventListener('click', () => this.removeEntry(entry));
 
-        return entryObj;
+        return entry;
     }
 
-    $.fn.multiFilePicker = function(action, param2, param3)
+    getFiles()
     {
-        switch (action)
-        {
-            case undefined:
-            case null:
-            case '':
-            {
-                let firstEntry = createEntry();
-                firstEntry.children('.mfp-remove-button').hide();
-                $(this).append(firstEntry);
-
-                break;
-            }
-            case 'getFiles':
-            {
-                let fileList = [];
-                $(this).children('.mfp-entry').children('.mfp-input').each(function()
-                {
-                    fileList = fileList.concat(Array.from(this.files));
-                });
-                return fileList;
-            }
-            case 'appendEntry':
-            {
-                return $(this).multiFilePicker('insertEntry', $(this).children('.mfp-entry:last'), param2);
-            }
-            case 'insertEntry':
-            {
-                let newEntry = createEntry();
-                let insertAfterNode = param2;
-                newEntry.insertAfter(insertAfterNode);
-                $(this).children('.mfp-entry:first').children('.mfp-remove-button').show();
+        return Array.from(this.container.querySelectorAll(':scope > .mfp-entry > .mfp-input'))
+            .flatMap(input => Array.from(input.files));
+    }
 
-                let files = param3;
-                if (files && files.length > 0) {
-                    newEntry.children('.mfp-input:first')[0].files = files;
-                }
+    appendEntry(files)
+    {
+        return this.insertEntry(this.container.querySelector(':scope > .mfp-entry:last-child'), files);
+    }
 
-                break;
-            }
-            case 'removeEntry':
-            {
-                let entryToRemove = $(param2);
-                entryToRemove.remove();
+    insertEntry(insertAfterEntry, files)
+    {
+        let newEntry = this.createEntry();
+        insertAfterEntry.after(newEntry);
 
-                let remainingChildren = $(this).children('.mfp-entry');
-                if (remainingChildren.length <= 1)
-                {
-                    remainingChildren.children('.mfp-remove-button').hide();
-                }
-                break;
-            }
-            default:
-                throw new Error(`"${action}" is not a valid action.`);
+        if (files && files.length > 0)
+        {
+            newEntry.querySelector('.mfp-input').files = files;
         }
+
+        this.updateRemoveButtons();
+        return newEntry;
+    }
+
+    removeEntry(entry)
+    {
+        entry.remove();
+        this.updateRemoveButtons();
+    }
+
+    // The last remaining entry cannot be removed
+    updateRemoveButtons()
+    {
+        let entries = this.container.querySelectorAll(':scope > .mfp-entry');
+        entries.forEach(entry => entry.querySelector('.mfp-remove-button').hidden = (entries.length <= 1));
     }
-})(jQuery)
\ No newline at end of file
+}
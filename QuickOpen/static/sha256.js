@@ -0,0 +1,122 @@
+// Incremental SHA-256 over File/Blob objects. crypto.subtle is unavailable on plain-HTTP pages and cannot
+// hash incrementally, so the digest is computed here in 4 MiB slices. hashBytesSHA256 hashes a byte array
+// synchronously.
+const [hashFileSHA256, hashBytesSHA256] = (() =>
+{
+    const ROUND_CONSTANTS = new Uint32Array([
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    ]);
+    const SLICE_SIZE = 4 << 20;
+
+    // Processes every complete 64-byte block of bytes[0, length) into state
+    function processBlocks(state, schedule, bytes, length)
+    {
+        for (let offset = 0; offset + 64 <= length; offset += 64)
+        {
+            for (let i = 0; i < 16; ++i)
+            {
+                let base = offset + i * 4;
+                schedule[i] = (bytes[base] << 24) | (bytes[base + 1] << 16) | (bytes[base + 2] << 8) | bytes[base + 3];
+            }
+
+            for (let i = 16; i < 64; ++i)
+            {
+                let w15 = schedule[i - 15], w2 = schedule[i - 2];
+                let s0 = ((w15 >>> 7) | (w15 << 25)) ^ ((w15 >>> 18) | (w15 << 14)) ^ (w15 >>> 3);
+                let s1 = ((w2 >>> 17) | (w2 << 15)) ^ ((w2 >>> 19) | (w2 << 13)) ^ (w2 >>> 10);
+                schedule[i] = (schedule[i - 16] + s0 + schedule[i - 7] + s1) | 0;
+            }
+
+            let [a, b, c, d, e, f, g, h] = state;
+
+            for (let i = 0; i < 64; ++i)
+            {
+                let S1 = ((e >>> 6) | (e << 26)) ^ ((e >>> 11) | (e << 21)) ^ ((e >>> 25) | (e << 7));
+                let temp1 = (h + S1 + ((e & f) ^ (~e & g)) + ROUND_CONSTANTS[i] + schedule[i]) | 0;
+                let S0 = ((a >>> 2) | (a << 30)) ^ ((a >>> 13) | (a << 19)) ^ ((a >>> 22) | (a << 10));
+                let temp2 = (S0 + ((a & b) ^ (a & c) ^ (b & c))) | 0;
+
+                h = g;
+                g = f;
+                f = e;
+                e = (d + temp1) | 0;
+                d = c;
+                c = b;
+                b = a;
+                a = (temp1 + temp2) | 0;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+    }
+
+    function finish(state, schedule, carry, totalLength)
+    {
+        let paddedLength = (carry.length < 56) ? 64 : 128;
+        let finalBlocks = new Uint8Array(paddedLength);
+        finalBlocks.set(carry);
+        finalBlocks[carry.length] = 0x80;
+
+        let messageBits = totalLength * 8;
+        let view = new DataView(finalBlocks.buffer);
+        view.setUint32(paddedLength - 8, Math.floor(messageBits / 0x100000000));
+        view.setUint32(paddedLength - 4, messageBits >>> 0);
+        processBlocks(state, schedule, finalBlocks, paddedLength);
+
+        return Array.from(state, word => word.toString(16).padStart(8, '0')).join('');
+    }
+
+    function initialState()
+    {
+        return new Uint32Array([0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19]);
+    }
+
+    async function hashFile(file, onProgress = () => {})
+    {
+        let state = initialState();
+        let schedule = new Int32Array(64);
+        let carry = new Uint8Array(0);
+
+        for (let position = 0; position < file.size; position += SLICE_SIZE)
+        {
+            let slice = new Uint8Array(await file.slice(position, position + SLICE_SIZE).arrayBuffer());
+            let bytes = new Uint8Array(carry.length + slice.length);
+            bytes.set(carry);
+            bytes.set(slice, carry.length);
+
+            let wholeBlockLength = bytes.length - (bytes.length % 64);
+            processBlocks(state, schedule, bytes, wholeBlockLength);
+            carry = bytes.slice(wholeBlockLength);
+
+            onProgress(Math.min(position + SLICE_SIZE, file.size) / file.size);
+        }
+
+        return finish(state, schedule, carry, file.size);
+    }
+
+    function hashBytes(bytes)
+    {
+        let state = initialState();
+        let schedule = new Int32Array(64);
+        let wholeBlockLength = bytes.length - (bytes.length % 64);
+
+        processBlocks(state, schedule, bytes, wholeBlockLength);
+        return finish(state, schedule, bytes.subarray(wholeBlockLength), bytes.length);
+    }
+
+    return [hashFile, hashBytes];
+})();
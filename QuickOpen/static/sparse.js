@@ -0,0 +1,97 @@
+// Describes a file as DATA records (byte 1, uint32 length, data) and HOLE records (byte 2, uint64 length)
+// for runs of zeros, little-endian. Browsers cannot ask the filesystem where a file's holes are, so the file
+// is scanned for all-zero blocks instead; data records refer to slices of the file rather than copies of it.
+const computeSparseBlob = (() =>
+{
+    const DATA_RECORD = 1;
+    const HOLE_RECORD = 2;
+    const MAX_DATA_LENGTH = 1 << 24;
+    const SLICE_SIZE = 4 * 1024 * 1024;
+    // Shorter zero runs are sent as data; the receiver still leaves their pages unallocated
+    const HOLE_GRANULARITY = 64 * 1024;
+
+    function isAllZero(bytes, start, end)
+    {
+        let words = new Uint32Array(bytes.buffer, bytes.byteOffset + start, (end - start) >> 2);
+        let accumulated = 0;
+        for (let i = 0; i < words.length; ++i)
+        {
+            accumulated |= words[i];
+        }
+        for (let i = start + words.length * 4; i < end; ++i)
+        {
+            accumulated |= bytes[i];
+        }
+        return accumulated === 0;
+    }
+
+    return async function (file, onProgress = () => {})
+    {
+        let parts = [];
+        let holeBytes = 0;
+
+        function emitData(start, end)
+        {
+            for (let offset = start; offset < end; offset += MAX_DATA_LENGTH)
+            {
+                let chunkEnd = Math.min(offset + MAX_DATA_LENGTH, end);
+                let header = new DataView(new ArrayBuffer(5));
+                header.setUint8(0, DATA_RECORD);
+                header.setUint32(1, chunkEnd - offset, true);
+                parts.push(header, file.slice(offset, chunkEnd));
+            }
+        }
+
+        function emitHole(length)
+        {
+            let header = new DataView(new ArrayBuffer(9));
+            header.setUint8(0, HOLE_RECORD);
+            header.setUint32(1, length % 0x100000000, true);
+            header.setUint32(5, Math.floor(length / 0x100000000), true);
+            parts.push(header);
+            holeBytes += length;
+        }
+
+        // Start of the current run, and whether it is a run of zeros
+        let runStart = 0, runIsHole = false;
+        for (let position = 0; position < file.size; position += SLICE_SIZE)
+        {
+            let slice = new Uint8Array(await file.slice(position, position + SLICE_SIZE).arrayBuffer());
+
+            for (let blockStart = 0; blockStart < slice.length; blockStart += HOLE_GRANULARITY)
+            {
+                let blockEnd = Math.min(blockStart + HOLE_GRANULARITY, slice.length);
+                let blockIsHole = isAllZero(slice, blockStart, blockEnd);
+
+                if (blockIsHole !== runIsHole)
+                {
+                    let runEnd = position + blockStart;
+                    if (runIsHole)
+                    {
+                        emitHole(runEnd - runStart);
+                    }
+                    else if (runEnd > runStart)
+                    {
+                        emitData(runStart, runEnd);
+                    }
+
+                    runStart = runEnd;
+                    runIsHole = blockIsHole;
+                }
+            }
+
+            onProgress(Math.min(position + SLICE_SIZE, file.size) / file.size);
+        }
+
+        if (runIsHole)
+        {
+            emitHole(file.size - runStart);
+        }
+        else if (file.size > runStart)
+        {
+            emitData(runStart, file.size);
+        }
+
+        return { blob: new Blob(parts, { type: 'application/octet-stream' }), holeBytes: holeBytes };
+    };
+})();
@@ -1,5 +1,14 @@
+# With CivetWeb, every consent request waiting for the user to answer holds one of the server's worker threads;
+# the native engine suspends those requests instead
+option(QUICKOPEN_NATIVE_HTTP "Serve HTTP with the built-in epoll engine instead of CivetWeb (Linux only)" OFF)
+
+# Arguments after the target name are the wxWidgets libraries to link, "core base" if none are given
 macro(apply_QuickOpen_build_settings target_name)
-    find_package(wxWidgets REQUIRED core base)
+    set(QuickOpen_wxWidgets_components ${ARGN})
+    if(NOT QuickOpen_wxWidgets_components)
+        set(QuickOpen_wxWidgets_components core base)
+    endif()
+    find_package(wxWidgets REQUIRED ${QuickOpen_wxWidgets_components})
     include(${wxWidgets_USE_FILE})
     target_include_directories(${target_name} PRIVATE ${wxWidgets_INCLUDE_DIRS})
     target_link_libraries(${target_name} PRIVATE ${wxWidgets_LIBRARIES})
@@ -7,8 +16,17 @@ macro(apply_QuickOpen_build_settings target_name)
     find_package(nlohmann_json CONFIG REQUIRED)
     target_link_libraries(${target_name} PRIVATE nlohmann_json nlohmann_json::nlohmann_json)
 
-    find_package(civetweb REQUIRED)
-    target_link_libraries(${target_name} PRIVATE civetweb::civetweb civetweb::civetweb-cpp)
+    if(QUICKOPEN_NATIVE_HTTP)
+        find_package(Threads REQUIRED)
+        target_link_libraries(${target_name} PRIVATE Threads::Threads)
+        target_compile_definitions(${target_name} PRIVATE QUICKOPEN_NATIVE_HTTP=1)
+    else()
+        find_package(civetweb REQUIRED)
+        target_link_libraries(${target_name} PRIVATE civetweb::civetweb civetweb::civetweb-cpp)
+    endif()
+
+    find_package(ZLIB REQUIRED)
+    target_link_libraries(${target_name} PRIVATE ZLIB::ZLIB)
 
     if(MSVC)
         target_link_libraries(${target_name} PRIVATE "bcrypt.lib" "wbemuuid.lib")
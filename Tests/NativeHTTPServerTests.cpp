@@ -0,0 +1,344 @@
+#include "catch.hpp"
+
+#include "NativeHTTPServer.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace
+{
+	class TestHandler : public CivetHandler
+	{
+	public:
+		typedef std::function<bool(mg_connection*)> HandleFunc;
+
+		HandleFunc onRequest;
+
+		explicit TestHandler(HandleFunc onRequest) : onRequest(std::move(onRequest))
+		{}
+
+		bool handleGet(CivetServer* server, mg_connection* conn) override
+		{
+			return onRequest(conn);
+		}
+
+		bool handlePost(CivetServer* server, mg_connection* conn) override
+		{
+			return onRequest(conn);
+		}
+	};
+
+	void sendText(mg_connection* conn, const std::string& text)
+	{
+		mg_send_http_ok(conn, "text/plain", static_cast<long long>(text.size()));
+		mg_write(conn, text.data(), text.size());
+	}
+
+	// Answers with what the server made of the request, fields separated by '|'
+	bool echoRequest(mg_connection* conn)
+	{
+		const mg_request_info* rqInfo = mg_get_request_info(conn);
+
+		std::string body;
+		char buffer[3];
+		int bytesRead;
+		while ((bytesRead = mg_read(conn, buffer, sizeof(buffer))) > 0)
+		{
+			body.append(buffer, bytesRead);
+		}
+
+		const char* testHeader = mg_get_header(conn, "X-Test");
+		sendText(conn, std::string(rqInfo->request_method) + "|" + rqInfo->request_uri + "|"
+			+ (rqInfo->query_string != nullptr ? rqInfo->query_string : "(none)") + "|" + rqInfo->http_version + "|"
+			+ (testHeader != nullptr ? testHeader : "(none)") + "|" + rqInfo->remote_addr + "|"
+			+ std::to_string(rqInfo->content_length) + "|" + (bytesRead < 0 ? "(error)" : body));
+		return true;
+	}
+
+	// The engine doesn't report which port it was given, so the first free one from 18080 up is used
+	std::unique_ptr<CivetServer> startTestServer(std::vector<std::string> options, int& port)
+	{
+		for (port = 18080; port < 18180; ++port)
+		{
+			std::vector<std::string> portOptions = options;
+			portOptions.insert(portOptions.end(), { "listening_ports", "127.0.0.1:" + std::to_string(port) });
+
+			try
+			{
+				return std::make_unique<CivetServer>(portOptions);
+			}
+			catch (const CivetException&)
+			{
+			}
+		}
+
+		FAIL("No free port to listen on");
+		return nullptr;
+	}
+
+	class TestClient
+	{
+		int fd;
+		std::string received;
+
+		bool receiveMore()
+		{
+			char chunk[4096];
+			ssize_t receivedBytes = recv(fd, chunk, sizeof(chunk), 0);
+			if (receivedBytes <= 0)
+			{
+				return false;
+			}
+
+			received.append(chunk, receivedBytes);
+			return true;
+		}
+
+	public:
+		struct Response
+		{
+			// 0 if the connection ended before a whole response arrived
+			int status = 0;
+			std::string head, body;
+		};
+
+		explicit TestClient(int port)
+		{
+			fd = socket(AF_INET, SOCK_STREAM, 0);
+
+			sockaddr_in address{};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(port);
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+
+			timeval timeout{ 5, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		}
+
+		~TestClient()
+		{
+			close();
+		}
+
+		void send(const std::string& data)
+		{
+			REQUIRE(::send(fd, data.data(), data.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(data.size()));
+		}
+
+		void close()
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+				fd = -1;
+			}
+		}
+
+		// Reads one response, whose body is delimited by its Content-Length
+		Response readResponse()
+		{
+			size_t headEnd;
+			while ((headEnd = received.find("\r\n\r\n")) == std::string::npos)
+			{
+				if (!receiveMore())
+				{
+					return {};
+				}
+			}
+
+			Response response;
+			response.head = received.substr(0, headEnd);
+			size_t bodyStart = headEnd + 4, contentLength = 0;
+			size_t lengthPos = response.head.find("Content-Length: ");
+			if (lengthPos != std::string::npos)
+			{
+				contentLength = std::stoul(response.head.substr(lengthPos + strlen("Content-Length: ")));
+			}
+
+			while (received.size() < bodyStart + contentLength)
+			{
+				if (!receiveMore())
+				{
+					return {};
+				}
+			}
+
+			response.status = std::stoi(response.head.substr(strlen("HTTP/1.1 "), 3));
+			response.body = received.substr(bodyStart, contentLength);
+			received.erase(0, bodyStart + contentLength);
+			return response;
+		}
+
+		// Whether the server closes the connection without sending anything more
+		bool closedByServer()
+		{
+			return received.empty() && !receiveMore();
+		}
+	};
+}
+
+TEST_CASE("NativeHTTPServer")
+{
+	int port;
+	auto server = startTestServer({ "num_threads", "1", "header_timeout_ms", "300" }, port);
+
+	TestHandler echoHandler(echoRequest);
+	server->addHandler("/echo", echoHandler);
+
+	TestClient client(port);
+
+	SECTION("request heads are parsed")
+	{
+		client.send("GET /echo/some%20path?a=1&b=2 HTTP/1.1\r\nHost: localhost\r\nx-test:  spaced value \r\n\r\n");
+		auto response = client.readResponse();
+		REQUIRE(response.status == 200);
+		REQUIRE(response.body == "GET|/echo/some path|a=1&b=2|1.1|spaced value|127.0.0.1|-1|");
+		REQUIRE(response.head.find("Connection: keep-alive") != std::string::npos);
+
+		// A handler covers the paths beneath its own, but not others that merely start the same way
+		client.send("GET /echoes HTTP/1.1\r\n\r\n");
+		REQUIRE(client.readResponse().status == 404);
+
+		client.send("BROKEN\r\n\r\n");
+		REQUIRE(client.readResponse().status == 400);
+		REQUIRE(client.closedByServer());
+	}
+	SECTION("oversized heads are refused")
+	{
+		// Sent whole, so that the server has read all of it by the time it closes the connection
+		client.send("GET /echo HTTP/1.1\r\nX-Test: " + std::string(17000, 'a'));
+		REQUIRE(client.readResponse().status == 431);
+		REQUIRE(client.closedByServer());
+	}
+	SECTION("heads that take too long to arrive are timed out")
+	{
+		auto timeoutsBefore = mg_get_header_timeout_count();
+
+		client.send("GET /echo HTTP/1.1\r\nHost: loc");
+		REQUIRE(client.readResponse().status == 408);
+		REQUIRE(client.closedByServer());
+		REQUIRE(mg_get_header_timeout_count() == timeoutsBefore + 1);
+	}
+	SECTION("connections are kept alive and pipelined requests are answered in order")
+	{
+		client.send("GET /echo/first HTTP/1.1\r\n\r\nPOST /echo/second HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody");
+		REQUIRE(client.readResponse().body == "GET|/echo/first|(none)|1.1|(none)|127.0.0.1|-1|");
+		REQUIRE(client.readResponse().body == "POST|/echo/second|(none)|1.1|(none)|127.0.0.1|4|body");
+
+		// Still open after going back to the event loop
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		client.send("GET /echo/third HTTP/1.1\r\nConnection: close\r\n\r\n");
+		auto response = client.readResponse();
+		REQUIRE(response.body == "GET|/echo/third|(none)|1.1|(none)|127.0.0.1|-1|");
+		REQUIRE(response.head.find("Connection: close") != std::string::npos);
+		REQUIRE(client.closedByServer());
+	}
+	SECTION("a body that is only partly read closes the connection")
+	{
+		TestHandler partialHandler([](mg_connection* conn)
+		{
+			char buffer[3];
+			mg_read(conn, buffer, sizeof(buffer));
+			sendText(conn, "partial");
+			return true;
+		});
+		server->addHandler("/partial", partialHandler);
+
+		// The rest of the body can't be told apart from the next request, so that one is never answered
+		client.send("POST /partial HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123456789GET /echo HTTP/1.1\r\n\r\n");
+		auto response = client.readResponse();
+		REQUIRE(response.status == 200);
+		REQUIRE(response.body == "partial");
+		REQUIRE(response.head.find("Connection: keep-alive") != std::string::npos);
+		REQUIRE(client.closedByServer());
+	}
+	SECTION("chunked bodies are decoded")
+	{
+		client.send("POST /echo HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+			"5;name=value\r\nhello\r\n7\r\n, world\r\n0\r\nX-Trailer: ignored\r\n\r\n"
+			"GET /echo/next HTTP/1.1\r\n\r\n");
+		REQUIRE(client.readResponse().body == "POST|/echo|(none)|1.1|(none)|127.0.0.1|-1|hello, world");
+		REQUIRE(client.readResponse().body == "GET|/echo/next|(none)|1.1|(none)|127.0.0.1|-1|");
+
+		client.send("POST /echo HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nnot a size\r\n");
+		REQUIRE(client.readResponse().body == "POST|/echo|(none)|1.1|(none)|127.0.0.1|-1|(error)");
+		REQUIRE(client.closedByServer());
+
+		TestClient conflictingClient(port);
+		conflictingClient.send("POST /echo HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n0\r\n\r\n");
+		REQUIRE(conflictingClient.readResponse().status == 400);
+
+		TestClient gzipClient(port);
+		gzipClient.send("POST /echo HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n");
+		REQUIRE(gzipClient.readResponse().status == 400);
+	}
+	SECTION("a suspended request is resumed from another thread without holding a worker")
+	{
+		std::promise<void> releaseResponse;
+		std::thread responder;
+		TestHandler suspendingHandler([&releaseResponse, &responder](mg_connection* conn)
+		{
+			mg_suspend_request(conn);
+			responder = std::thread([conn, releaseFuture = releaseResponse.get_future()]
+			{
+				releaseFuture.wait();
+				sendText(conn, "resumed");
+				mg_resume_request(conn);
+			});
+			return true;
+		});
+		server->addHandler("/suspend", suspendingHandler);
+
+		client.send("GET /suspend HTTP/1.1\r\n\r\n");
+
+		// The only worker is free again while the first request waits
+		TestClient otherClient(port);
+		otherClient.send("GET /echo HTTP/1.1\r\n\r\n");
+		REQUIRE(otherClient.readResponse().status == 200);
+
+		releaseResponse.set_value();
+		auto response = client.readResponse();
+		REQUIRE(response.status == 200);
+		REQUIRE(response.body == "resumed");
+		responder.join();
+
+		client.send("GET /echo/after HTTP/1.1\r\n\r\n");
+		REQUIRE(client.readResponse().body == "GET|/echo/after|(none)|1.1|(none)|127.0.0.1|-1|");
+	}
+	SECTION("handlers can tell when the client has gone away")
+	{
+		std::atomic<bool> sawConnected = false, sawDisconnected = false;
+		TestHandler watchingHandler([&sawConnected, &sawDisconnected](mg_connection* conn)
+		{
+			sawConnected = !mg_client_disconnected(conn);
+			for (int i = 0; i < 500 && !sawDisconnected; ++i)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				sawDisconnected = mg_client_disconnected(conn) != 0;
+			}
+			return true;
+		});
+		server->addHandler("/watch", watchingHandler);
+
+		client.send("GET /watch HTTP/1.1\r\n\r\n");
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		client.close();
+
+		for (int i = 0; i < 500 && !sawDisconnected; ++i)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		REQUIRE(sawConnected);
+		REQUIRE(sawDisconnected);
+	}
+}
@@ -8,9 +8,20 @@
 
 #include <wx/process.h>
 
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <set>
 #include <regex>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 TEST_CASE("getAppExecutablePath function")
 {
     wxFileName result = getAppExecutablePath();
@@ -95,4 +106,158 @@ TEST_CASE("InstallationInfo::detectInstallation function")
     REQUIRE(installInfo.configFolder.IsDirWritable());
     REQUIRE(installInfo.dataFolder.DirExists());
     REQUIRE(installInfo.dataFolder.IsDirReadable());
-}
\ No newline at end of file
+}
+
+#ifdef __linux__
+TEST_CASE("applyThreadPriority function")
+{
+    // Lowering priority is allowed without privileges, and is only done to a separate thread here so that the
+    // rest of the tests run as before
+    int ioPriority = -1, niceValue = -1;
+    bool onlyChosenCPU = false;
+
+    // The test may be confined to CPUs that don't include CPU 0 (e.g. by taskset or a container), so pin to the
+    // first CPU this thread is allowed to run on
+    cpu_set_t allowedCPUs;
+    REQUIRE(sched_getaffinity(0, sizeof(allowedCPUs), &allowedCPUs) == 0);
+    unsigned firstCPU = 0;
+    while (!CPU_ISSET(firstCPU, &allowedCPUs))
+    {
+        ++firstCPU;
+    }
+
+    std::thread([&ioPriority, &niceValue, &onlyChosenCPU, firstCPU]
+    {
+        ThreadPriority priority;
+        priority.ioClass = ThreadPriority::IO_IDLE;
+        priority.niceLevel = 5;
+        priority.cpuAffinity = { firstCPU };
+        applyThreadPriority(priority);
+
+        auto threadID = static_cast<pid_t>(syscall(SYS_gettid));
+        ioPriority = static_cast<int>(syscall(SYS_ioprio_get, 1, threadID));
+        niceValue = getpriority(PRIO_PROCESS, static_cast<id_t>(threadID));
+
+        cpu_set_t cpuSet;
+        sched_getaffinity(0, sizeof(cpuSet), &cpuSet);
+        onlyChosenCPU = CPU_COUNT(&cpuSet) == 1 && CPU_ISSET(firstCPU, &cpuSet);
+    }).join();
+
+    // IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+    REQUIRE(ioPriority == (3 << 13));
+    REQUIRE(niceValue == 5);
+    REQUIRE(onlyChosenCPU);
+}
+#endif
+
+#ifdef __linux__
+TEST_CASE("startSubprocess function - errors and input")
+{
+    // Both with programs started directly and through the spawn helper
+    bool throughHelper = GENERATE(false, true);
+    if (throughHelper)
+    {
+        startSpawnHelper();
+    }
+
+    REQUIRE_THROWS_AS(startSubprocess(wxT("quickopen-nonexistent-program"), {}), LinuxException);
+    REQUIRE(startSubprocess(wxT("quickopen-nonexistent-program \"https://example.com\"")) == 0);
+
+    std::filesystem::path outputPath = std::filesystem::temp_directory_path()
+        / ("quickopen-subprocess-test-" + std::to_string(getpid()));
+    std::filesystem::remove(outputPath);
+
+    // The program only has the descriptors it was given
+    auto pipe = startSubprocessWithInput(wxT("sh"), { wxT("-c"),
+        wxString::FromUTF8("cat > '" + outputPath.string() + "'; ls /proc/self/fd | wc -l >> '" + outputPath.string() + "'") });
+    REQUIRE(pipe->write("input\n", 6, std::chrono::seconds(5)));
+    pipe.reset();
+
+    std::string output;
+    for (int i = 0; i < 50 && output.find('\n', 6) == std::string::npos; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::ifstream outputFile(outputPath);
+        output.assign(std::istreambuf_iterator<char>(outputFile), std::istreambuf_iterator<char>());
+    }
+
+    // stdin, stdout, stderr and the one ls reads /proc/self/fd through
+    REQUIRE(output == "input\n4\n");
+    std::filesystem::remove(outputPath);
+
+    // Programs get the working directory and environment as they are now, not as they were when the spawn helper
+    // was started
+    auto originalDirectory = std::filesystem::current_path();
+    auto workingDirectory = std::filesystem::canonical(std::filesystem::temp_directory_path());
+    std::filesystem::current_path(workingDirectory);
+    setenv("QUICKOPEN_TEST_VARIABLE", "test value", 1);
+
+    startSubprocess(wxT("sh"), { wxT("-c"),
+        wxString::FromUTF8("pwd -P > '" + outputPath.string() + "'; echo \"$QUICKOPEN_TEST_VARIABLE\" >> '" + outputPath.string() + "'") });
+
+    std::string expectedOutput = workingDirectory.string() + "\ntest value\n";
+    output.clear();
+    for (int i = 0; i < 50 && output != expectedOutput; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        std::ifstream outputFile(outputPath);
+        output.assign(std::istreambuf_iterator<char>(outputFile), std::istreambuf_iterator<char>());
+    }
+
+    std::filesystem::current_path(originalDirectory);
+    unsetenv("QUICKOPEN_TEST_VARIABLE");
+    REQUIRE(output == expectedOutput);
+    std::filesystem::remove(outputPath);
+
+    if (throughHelper)
+    {
+        stopSpawnHelper();
+    }
+}
+
+// How long opening a URL takes once the process has grown large, through the spawn helper, with posix_spawn()
+// from this process, and with fork() and exec as programs used to be started; hidden, since it takes a while.
+// Run with: test_driver "[.benchmark]"
+TEST_CASE("startSubprocess URL-open latency under a large resident set", "[.benchmark]")
+{
+    const size_t RESIDENT_BYTES = 1ULL << 30;
+    const wxString OPEN_COMMAND = wxT("true \"https://example.com/\"");
+
+    startSpawnHelper();
+    std::vector<char> residentMemory(RESIDENT_BYTES);
+    for (size_t i = 0; i < residentMemory.size(); i += 4096)
+    {
+        residentMemory[i] = 1;
+    }
+
+    BENCHMARK("spawn helper")
+    {
+        return startSubprocess(OPEN_COMMAND);
+    };
+
+    stopSpawnHelper();
+    BENCHMARK("posix_spawn")
+    {
+        return startSubprocess(OPEN_COMMAND);
+    };
+
+    std::vector<pid_t> forkedChildren;
+    BENCHMARK("fork and exec")
+    {
+        pid_t childPID = fork();
+        if (childPID == 0)
+        {
+            execlp("true", "true", "https://example.com/", nullptr);
+            _exit(127);
+        }
+
+        forkedChildren.push_back(childPID);
+        return childPID;
+    };
+
+    for (pid_t thisChild : forkedChildren)
+    {
+        waitpid(thisChild, nullptr, 0);
+    }
+}
+#endif
@@ -1,9 +1,16 @@
 #include "catch.hpp"
 
+#include <thread>
+
+#include "ActivityRing.h"
+#include "ConfigWatcher.h"
+#include "ConsentApprovalQueue.h"
 #include "WebServer.h"
 #include "WebServerUtils.h"
 #include "AppGUIIncludes.h"
 
+#include <zlib.h>
+
 TEST_CASE("sendJSONResponse function")
 {
 	nlohmann::json testJSON = { { "key1", "value1" }, 5 };
@@ -50,18 +57,65 @@ TEST_CASE("StaticHandler class - happy path")
 	}
 }
 
+TEST_CASE("PrecompressedPage class")
+{
+    auto gunzip = [](const std::string& compressed)
+    {
+        z_stream stream = {};
+        REQUIRE(inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK);
+
+        std::string output(1 << 20, '\0');
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+        stream.avail_in = compressed.size();
+        stream.next_out = reinterpret_cast<Bytef*>(output.data());
+        stream.avail_out = output.size();
+
+        // Z_STREAM_END is only returned once the CRC and length in the trailer have been checked
+        REQUIRE(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+        REQUIRE(stream.avail_in == 0);
+        output.resize(stream.total_out);
+        inflateEnd(&stream);
+        return output;
+    };
+
+    std::string repeatedText;
+    for (int i = 0; i < 1000; ++i)
+    {
+        repeatedText += "<li>Some repetitive markup</li>\n";
+    }
+
+    PrecompressedPage page({ "<p>Token: ", "</p>" + repeatedText, "" });
+    REQUIRE(page.valueCount() == 2);
+
+    // The second value is longer than a single stored block can hold
+    std::vector<std::string> values = { "12345", std::string(70000, 'x') };
+    std::string expected = "<p>Token: 12345</p>" + repeatedText + values[1];
+
+    REQUIRE(page.renderPlain(values) == expected);
+
+    REQUIRE(gunzip(page.renderGzip(values)) == expected);
+
+    // Empty values and a page without any values
+    std::string compressedWithoutValues = page.renderGzip({ "", "" });
+    REQUIRE(compressedWithoutValues.size() < repeatedText.size() / 10);
+    REQUIRE(gunzip(compressedWithoutValues) == "<p>Token: </p>" + repeatedText);
+    REQUIRE(gunzip(PrecompressedPage({ repeatedText }).renderGzip({})) == repeatedText);
+    REQUIRE_THROWS_AS(page.renderGzip({ "1" }), std::invalid_argument);
+}
+
 TEST_CASE("OpenWebpageAPIEndpoint tests")
 {
 	CivetServer testServer({});
 	auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
-	std::mutex dlgMutex;
+	ConsentPromptQueue promptQueue;
+	ConsentPolicy consentPolicy({}, wxFileName(".", "consentAudit.log"));
 	mg_connection testConn;
 	testConn.requestInfo = mg_request_info { "", "/api/openWebpage", "::1" };
 
 	SECTION("happy path")
 	{
 		auto wxTestApp = QuickOpenApplication(true, false);
-		OpenWebpageAPIEndpoint endpoint(wxTestApp, dlgMutex, bannedSetLock);
+		OpenWebpageAPIEndpoint endpoint(wxTestApp, promptQueue, consentPolicy, bannedSetLock);
 
 		testConn.inputBuffer = "url=http://example.com";
 		REQUIRE(endpoint.handlePost(&testServer, &testConn));
@@ -79,7 +133,7 @@ TEST_CASE("OpenWebpageAPIEndpoint tests")
 	SECTION("unhappy path - request denied")
 	{
 		auto wxTestApp = QuickOpenApplication(false, false);
-		OpenWebpageAPIEndpoint endpoint(wxTestApp, dlgMutex, bannedSetLock);
+		OpenWebpageAPIEndpoint endpoint(wxTestApp, promptQueue, consentPolicy, bannedSetLock);
 
 		testConn.inputBuffer = "url=http://example.com";
 		REQUIRE(endpoint.handlePost(&testServer, &testConn));
@@ -96,7 +150,7 @@ TEST_CASE("OpenWebpageAPIEndpoint tests")
 	SECTION("unhappy path - request denied and user banned")
 	{
 		auto wxTestApp = QuickOpenApplication(false, true);
-		OpenWebpageAPIEndpoint endpoint(wxTestApp, dlgMutex, bannedSetLock);
+		OpenWebpageAPIEndpoint endpoint(wxTestApp, promptQueue, consentPolicy, bannedSetLock);
 
 		testConn.inputBuffer = "url=http://example.com";
 		REQUIRE(endpoint.handlePost(&testServer, &testConn));
@@ -124,10 +178,44 @@ TEST_CASE("OpenWebpageAPIEndpoint tests")
 
 		REQUIRE(*bannedSetLock.obj == std::set<wxString> { wxT("::1") });
 	}
+	SECTION("unhappy path - client disconnects while the GUI is busy")
+	{
+		auto wxTestApp = QuickOpenApplication(true, false);
+		wxTestApp.deferCalls = true;
+		OpenWebpageAPIEndpoint endpoint(wxTestApp, promptQueue, consentPolicy, bannedSetLock);
+
+		testConn.inputBuffer = "url=http://example.com";
+		testConn.clientDisconnected = true;
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(!testConn.responseStatus);
+		REQUIRE(!testConn.isOpen);
+
+		// The prompt was cancelled before the GUI thread got to it
+		wxTestApp.runDeferredCalls();
+		REQUIRE(!wxTestApp.promptedForWebpage);
+	}
+	SECTION("unhappy path - nobody answers in time")
+	{
+		auto wxTestApp = QuickOpenApplication(true, false);
+		wxTestApp.deferCalls = true;
+		{
+			WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+			configRef->consentTimeoutSeconds = 1;
+		}
+		OpenWebpageAPIEndpoint endpoint(wxTestApp, promptQueue, consentPolicy, bannedSetLock);
+
+		testConn.inputBuffer = "url=http://example.com";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 408);
+		REQUIRE(!testConn.isOpen);
+
+		wxTestApp.runDeferredCalls();
+		REQUIRE(!wxTestApp.promptedForWebpage);
+	}
 	SECTION("unhappy path - invalid URL")
 	{
 		auto wxTestApp = QuickOpenApplication(true, false);
-		OpenWebpageAPIEndpoint endpoint(wxTestApp, dlgMutex, bannedSetLock);
+		OpenWebpageAPIEndpoint endpoint(wxTestApp, promptQueue, consentPolicy, bannedSetLock);
 
 		testConn.inputBuffer = "url=ftp://example.com";
 		REQUIRE(endpoint.handlePost(&testServer, &testConn));
@@ -139,6 +227,40 @@ TEST_CASE("OpenWebpageAPIEndpoint tests")
 		REQUIRE(!wxTestApp.promptedForWebpage);
 		REQUIRE(decltype(bannedSetLock)::ReadableReference(bannedSetLock)->empty());
 	}
+	SECTION("consent policy decides without prompting")
+	{
+		auto wxTestApp = QuickOpenApplication(false, false);
+		OpenWebpageAPIEndpoint endpoint(wxTestApp, promptQueue, consentPolicy, bannedSetLock);
+
+		ConsentRule blockRule, trustRule;
+		blockRule.name = "blocked";
+		blockRule.action = ConsentRule::DENY;
+		blockRule.urlDomains = { "*.blocked.example" };
+		trustRule.name = "lab";
+		trustRule.action = ConsentRule::ACCEPT;
+		trustRule.senderSubnets = { "::1" };
+		consentPolicy.setRules({ blockRule, trustRule });
+
+		testConn.inputBuffer = "url=https://www.Blocked.example/page";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 403);
+		REQUIRE(!wxTestApp.promptedForWebpage);
+
+		mg_connection testConn2;
+		testConn2.requestInfo = mg_request_info { "", "/api/openWebpage", "::1" };
+		testConn2.inputBuffer = "url=http://example.com";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn2));
+		REQUIRE(testConn2.responseStatus == 200);
+		REQUIRE(!wxTestApp.promptedForWebpage);
+
+		// Senders the rules don't cover are still asked about
+		mg_connection testConn3;
+		testConn3.requestInfo = mg_request_info { "", "/api/openWebpage", "10.0.0.1" };
+		testConn3.inputBuffer = "url=http://example.com";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn3));
+		REQUIRE(testConn3.responseStatus == 403);
+		REQUIRE(wxTestApp.promptedForWebpage);
+	}
 }
 
 TEST_CASE("FileConsentTokenService tests")
@@ -147,14 +269,15 @@ TEST_CASE("FileConsentTokenService tests")
 
 	CivetServer testServer({});
 	auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
-	std::mutex dlgMutex;
+	ConsentPromptQueue promptQueue;
+	ConsentPolicy consentPolicy({}, wxFileName(".", "consentAudit.log"));
 	mg_connection testConn;
 	testConn.requestInfo = mg_request_info { "", "/api/saveFile", "::1" };
 
 	SECTION("happy path")
 	{
 		auto wxTestApp = QuickOpenApplication(true, false);
-		FileConsentTokenService endpoint(dlgMutex, wxTestApp, bannedSetLock);
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
 
 		testConn.inputBuffer = testFileInfo;
 		auto jsonInput = nlohmann::json::parse(testConn.inputBuffer);
@@ -163,6 +286,7 @@ TEST_CASE("FileConsentTokenService tests")
 		REQUIRE(testConn.inputBuffer.empty());
 		REQUIRE(testConn.responseStatus == 200);
 		REQUIRE(!testConn.isOpen);
+		REQUIRE(!testConn.suspended);
 
 		ConsentToken tokenVal = nlohmann::json::parse(testConn.outputBuffer)["consentToken"];
 		REQUIRE(decltype(bannedSetLock)::ReadableReference(bannedSetLock)->empty());
@@ -180,7 +304,7 @@ TEST_CASE("FileConsentTokenService tests")
 	SECTION("unhappy path - request denied")
 	{
 		auto wxTestApp = QuickOpenApplication(false, false);
-		FileConsentTokenService endpoint(dlgMutex, wxTestApp, bannedSetLock);
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
 
 		testConn.inputBuffer = testFileInfo;
 		auto jsonInput = nlohmann::json::parse(testConn.inputBuffer);
@@ -199,7 +323,7 @@ TEST_CASE("FileConsentTokenService tests")
 	SECTION("unhappy path - request denied and user banned")
 	{
 		auto wxTestApp = QuickOpenApplication(false, true);
-		FileConsentTokenService endpoint(dlgMutex, wxTestApp, bannedSetLock);
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
 
 		testConn.inputBuffer = testFileInfo;
 		auto jsonInput = nlohmann::json::parse(testConn.inputBuffer);
@@ -232,76 +356,1801 @@ TEST_CASE("FileConsentTokenService tests")
 
 		REQUIRE(*bannedSetLock.obj.get() == std::set<wxString> { wxT("::1") });
 	}
+	SECTION("unhappy path - consent deadline passes before the prompt")
+	{
+		auto wxTestApp = QuickOpenApplication(true, false);
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+		{
+			WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+			configRef->consentTimeoutSeconds = 0;
+		}
+
+		auto consentEvictionsBefore = EvictionStats::global().count(EvictionStats::CONSENT_TIMEOUT);
+
+		testConn.inputBuffer = testFileInfo;
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 408);
+		REQUIRE(!testConn.isOpen);
+		REQUIRE(EvictionStats::global().count(EvictionStats::CONSENT_TIMEOUT) == consentEvictionsBefore + 1);
+
+		REQUIRE(!wxTestApp.promptedForFileSave);
+		REQUIRE(endpoint.tokenWRRef.obj->empty());
+	}
+	SECTION("unhappy path - consent deadline passes while the prompt is shown")
+	{
+		auto wxTestApp = QuickOpenApplication(true, false);
+		wxTestApp.answerDelay = std::chrono::milliseconds(1100);
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+		{
+			WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+			configRef->consentTimeoutSeconds = 1;
+		}
+
+		auto consentEvictionsBefore = EvictionStats::global().count(EvictionStats::CONSENT_TIMEOUT);
+
+		testConn.inputBuffer = testFileInfo;
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 408);
+		REQUIRE(!testConn.isOpen);
+		REQUIRE(EvictionStats::global().count(EvictionStats::CONSENT_TIMEOUT) == consentEvictionsBefore + 1);
+
+		REQUIRE(wxTestApp.promptedForFileSave);
+		REQUIRE(endpoint.tokenWRRef.obj->empty());
+		REQUIRE(decltype(bannedSetLock)::ReadableReference(bannedSetLock)->empty());
+	}
+	SECTION("unhappy path - files don't fit on the destination drive")
+	{
+		auto wxTestApp = QuickOpenApplication(true, false);
+		{
+			WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+			configRef->ephemeralReceive.extensions = { wxT("txt") };
+		}
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+		auto refusedBefore = DiskSpaceLedger::globalStats().refusedRequests.load();
+
+		testConn.inputBuffer = R"eos({"fileList": [{"filename": "test.txt", "fileSize": 2000}, {"filename": "huge.bin", "fileSize": 4611686018427387904}]})eos";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 507);
+		REQUIRE(nlohmann::json::parse(testConn.outputBuffer)["errors"][0]["errorString"].get<std::string>().find("Not enough disk space") == 0);
+		REQUIRE(DiskSpaceLedger::globalStats().refusedRequests == refusedBefore + 1);
+
+		REQUIRE(wxTestApp.promptedForFileSave);
+		REQUIRE(endpoint.tokenWRRef.obj->empty());
+		REQUIRE(endpoint.diskSpaceLedger.reservedOn(wxFileName::DirName(".")) == 0);
+		// The file that would only have been opened wasn't given a place in the ephemeral store
+		auto storePath = endpoint.ephemeralStore.getFolder().GetPath().ToStdString();
+		REQUIRE(std::filesystem::directory_iterator(storePath) == std::filesystem::directory_iterator());
+	}
+	SECTION("files matching the ephemeral policy are only opened")
+	{
+		auto wxTestApp = QuickOpenApplication(true, false);
+		{
+			WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+			configRef->ephemeralReceive.extensions = { wxT("TXT"), wxT("zip") };
+		}
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+
+		testConn.inputBuffer = testFileInfo;
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 200);
+
+		const auto& fileList = endpoint.tokenWRRef.obj->begin()->second;
+		REQUIRE(fileList.at(0).ephemeral);
+		REQUIRE(endpoint.ephemeralStore.contains(fileList.at(0).consentedFileName));
+		REQUIRE(fileList.at(0).consentedFileName.GetFullName() == wxT("test.txt"));
+		// Too large to be kept in memory
+		REQUIRE(!fileList.at(1).ephemeral);
+		REQUIRE(!endpoint.ephemeralStore.contains(fileList.at(1).consentedFileName));
+	}
+	SECTION("user chooses to only open the files")
+	{
+		auto wxTestApp = QuickOpenApplication(true, false);
+		wxTestApp.openOnlyChoice = true;
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+
+		testConn.inputBuffer = R"eos({"fileList": [{"filename": "test.txt", "fileSize": 2000}]})eos";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 200);
+		REQUIRE(endpoint.ephemeralStore.contains(endpoint.tokenWRRef.obj->begin()->second.at(0).consentedFileName));
+	}
+	SECTION("consent policy accepts or declines files without prompting")
+	{
+		auto wxTestApp = QuickOpenApplication(false, false);
+		wxFileName saveFolder = wxFileName::DirName(wxT("."));
+		{
+			WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+			configRef->fileSavePath = saveFolder;
+		}
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+
+		ConsentRule smallFilesRule;
+		smallFilesRule.name = "small files";
+		smallFilesRule.action = ConsentRule::ACCEPT;
+		smallFilesRule.senderSubnets = { "::1/128" };
+		smallFilesRule.fileExtensions = { ".TXT" };
+		smallFilesRule.maxFileSize = 4096;
+		ConsentRule executablesRule;
+		executablesRule.name = "no executables";
+		executablesRule.action = ConsentRule::DENY;
+		executablesRule.fileExtensions = { "exe" };
+		consentPolicy.setRules({ smallFilesRule, executablesRule });
+
+		testConn.inputBuffer = R"eos({"fileList": [{"filename": "notes.txt", "fileSize": 2000}]})eos";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 200);
+		REQUIRE(!wxTestApp.promptedForFileSave);
+		const wxFileName& consentedFileName = endpoint.tokenWRRef.obj->begin()->second.at(0).consentedFileName;
+		REQUIRE(consentedFileName.GetPath() == saveFolder.GetPath());
+		REQUIRE(consentedFileName.GetFullName() == wxT("notes.txt"));
+
+		mg_connection testConn2;
+		testConn2.requestInfo = mg_request_info { "", "/api/saveFile", "::1" };
+		testConn2.inputBuffer = R"eos({"fileList": [{"filename": "setup.exe", "fileSize": 2000}]})eos";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn2));
+		REQUIRE(testConn2.responseStatus == 403);
+		REQUIRE(!wxTestApp.promptedForFileSave);
+
+		// One file too large for the rule leaves the whole request to the user
+		mg_connection testConn3;
+		testConn3.requestInfo = mg_request_info { "", "/api/saveFile", "::1" };
+		testConn3.inputBuffer = R"eos({"fileList": [{"filename": "notes.txt", "fileSize": 2000}, {"filename": "big.txt", "fileSize": 5000}]})eos";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn3));
+		REQUIRE(testConn3.responseStatus == 403);
+		REQUIRE(wxTestApp.promptedForFileSave);
+		REQUIRE(endpoint.tokenWRRef.obj->size() == 1);
+	}
+	SECTION("files accepted by the consent policy don't replace existing ones")
+	{
+		auto wxTestApp = QuickOpenApplication(false, false);
+		{
+			WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+			configRef->fileSavePath = wxFileName::DirName(wxT("."));
+		}
+		FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+		OpenSaveFileAPIEndpoint saveEndpoint(endpoint, wxTestApp);
+
+		ConsentRule acceptRule;
+		acceptRule.name = "everything";
+		acceptRule.action = ConsentRule::ACCEPT;
+		consentPolicy.setRules({ acceptRule });
+
+		wxFileName existingFile(".", "existing.txt");
+		std::ofstream(existingFile.GetFullPath().ToStdString()) << "keep me";
+
+		// Nor does the second file of the same name replace the first
+		testConn.inputBuffer = R"eos({"fileList": [{"filename": "existing.txt", "fileSize": 3}, {"filename": "existing.txt", "fileSize": 3}]})eos";
+		REQUIRE(endpoint.handlePost(&testServer, &testConn));
+		REQUIRE(testConn.responseStatus == 200);
+		REQUIRE(!wxTestApp.promptedForFileSave);
+
+		ConsentToken tokenVal = nlohmann::json::parse(testConn.outputBuffer)["consentToken"];
+		wxFileName firstFileName = endpoint.tokenWRRef.obj->at(tokenVal).at(0).consentedFileName,
+			secondFileName = endpoint.tokenWRRef.obj->at(tokenVal).at(1).consentedFileName;
+		REQUIRE(firstFileName.GetFullName() == wxT("existing (2).txt"));
+		REQUIRE(secondFileName.GetFullName() == wxT("existing (3).txt"));
+
+		std::string uploadQuery = "consentToken=" + std::to_string(tokenVal) + "&fileIndex=0";
+		mg_connection uploadConn;
+		uploadConn.requestInfo = mg_request_info { uploadQuery.c_str(), "/api/saveFile", "::1" };
+		uploadConn.inputBuffer = "new";
+		REQUIRE(saveEndpoint.handlePost(&testServer, &uploadConn));
+		REQUIRE(uploadConn.responseStatus == 200);
+		REQUIRE(fileReadAll(existingFile) == "keep me");
+		REQUIRE(fileReadAll(firstFileName) == "new");
+
+		wxRemoveFile(existingFile.GetFullPath());
+		wxRemoveFile(firstFileName.GetFullPath());
+	}
 }
 
-TEST_CASE("OpenSaveFileAPIEndpoint tests")
+TEST_CASE("ConfigChanges")
 {
-    CivetServer testServer({});
-    auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
-    std::mutex dlgMutex;
-    std::string testContent = "The brown fox jumped over the lazy dog.";
+	AppConfig oldConfig, newConfig;
+	REQUIRE_FALSE(ConfigChanges::between(oldConfig, newConfig).any());
 
-    auto wxTestApp = QuickOpenApplication(true, false);
-    FileConsentTokenService consentEndpoint(dlgMutex, wxTestApp, bannedSetLock);
-    ConsentToken testToken = 3;
+	newConfig.serverPort = 8081;
+	newConfig.customBrowserPath = wxT("/usr/bin/firefox %1");
+	auto changes = ConfigChanges::between(oldConfig, newConfig);
+	REQUIRE(changes.serverPort);
+	REQUIRE(changes.webpageOpen);
+	REQUIRE_FALSE(changes.fileSavePath);
+	REQUIRE_FALSE(changes.diskWriters);
+	REQUIRE_FALSE(changes.otherSettings);
 
-    OpenSaveFileAPIEndpoint saveEndpoint(consentEndpoint, wxTestApp);
+	// Setting the port to its default doesn't move the server
+	newConfig = oldConfig;
+	newConfig.serverPort = decltype(newConfig.serverPort)::DEFAULT_VALUE;
+	REQUIRE_FALSE(ConfigChanges::between(oldConfig, newConfig).serverPort);
 
-    SECTION("happy path")
-    {
-        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
-        testFileInfo.filename = wxT("testFile.txt");
-        testFileInfo.fileSize = testContent.size();
-        testFileInfo.consentedFileName = wxT("testFileConsented.txt");
+	newConfig = oldConfig;
+	newConfig.fileSavePath.AssignDir(wxT("/tmp/received"));
+	newConfig.maxDiskWriters = 8;
+	newConfig.globalUploadLimit = 1 << 20;
+	changes = ConfigChanges::between(oldConfig, newConfig);
+	REQUIRE(changes.fileSavePath);
+	REQUIRE(changes.diskWriters);
+	REQUIRE(changes.otherSettings);
+	REQUIRE_FALSE(changes.serverPort);
+	REQUIRE(changes.describe() == std::vector<std::string>{ "disk writers", "save folder", "other settings" });
+}
 
-        {
-            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
-                    tokens(consentEndpoint.tokenWRRef);
-            tokens->insert({ testToken, { testFileInfo } });
-        }
+TEST_CASE("ConfigWatcher")
+{
+	wxFileName configFolder("./configWatcherTest/", "");
+	configFolder.Mkdir(wxS_DIR_DEFAULT, wxPATH_MKDIR_FULL);
+	wxFileName configFile(configFolder.GetFullPath(), "config.json");
 
-        mg_connection testConn;
-        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
-        testConn.inputBuffer = testContent;
+	AppConfig savedConfig;
+	savedConfig.serverPort = 9000;
+	savedConfig.saveConfig(configFile);
 
-        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
-        REQUIRE(testConn.inputBuffer.empty());
-        REQUIRE(testConn.responseStatus == 200);
-        REQUIRE(!testConn.isOpen);
-        REQUIRE(testFileInfo.consentedFileName.FileExists());
-        REQUIRE(testFileInfo.consentedFileName.GetSize() == testContent.size());
-        std::string actualContent = fileReadAll(testFileInfo.consentedFileName);
-        REQUIRE(actualContent == testContent);
+	std::mutex loadedMutex;
+	std::vector<unsigned> loadedPorts;
+	{
+		ConfigWatcher watcher([&](AppConfig newConfig)
+		{
+			std::lock_guard<std::mutex> lock(loadedMutex);
+			loadedPorts.push_back(newConfig.serverPort);
+		}, configFile);
+
+		auto waitForLoads = [&](size_t count)
+		{
+			for (int i = 0; i < 100; ++i)
+			{
+				{
+					std::lock_guard<std::mutex> lock(loadedMutex);
+					if (loadedPorts.size() >= count)
+					{
+						return;
+					}
+				}
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			}
+		};
+
+		// Several saves in quick succession are loaded once they settle
+		for (unsigned port = 9001; port <= 9003; ++port)
+		{
+			savedConfig.serverPort = port;
+			savedConfig.saveConfig(configFile);
+		}
+
+		waitForLoads(1);
+		std::this_thread::sleep_for(ConfigWatcher::SETTLE_TIME * 2);
+		{
+			std::lock_guard<std::mutex> lock(loadedMutex);
+			REQUIRE(loadedPorts == std::vector<unsigned>{ 9003 });
+		}
+
+		// Other files in the folder are ignored, and a broken file is skipped
+		std::ofstream((configFolder / wxFileName(".", "other.json")).GetFullPath().ToStdString()) << "{}";
+		std::ofstream(configFile.GetFullPath().ToStdString()) << "{ not json";
+		std::this_thread::sleep_for(ConfigWatcher::SETTLE_TIME * 3);
+		{
+			std::lock_guard<std::mutex> lock(loadedMutex);
+			REQUIRE(loadedPorts.size() == 1);
+		}
+	}
+
+	configFolder.Rmdir(wxPATH_RMDIR_RECURSIVE);
+}
+
+TEST_CASE("EphemeralStore")
+{
+	wxFileName rootFolder("./ephemeralRoot/", ""),
+		staleStore("./ephemeralRoot/999999999.1/", ""),
+		otherLiveStore(wxString() << wxT("./ephemeralRoot/") << wxGetProcessId() << wxT(".1/"), "");
+	staleStore.Mkdir(0700, wxPATH_MKDIR_FULL);
+	otherLiveStore.Mkdir(0700, wxPATH_MKDIR_FULL);
+	wxFileName storeFolder;
+	{
+		EphemeralStore store(rootFolder);
+		storeFolder = store.getFolder();
+		REQUIRE(storeFolder.DirExists());
+		// Only the folders of stores whose process has exited are cleared out
+		REQUIRE(!staleStore.DirExists());
+		REQUIRE(otherLiveStore.DirExists());
+
+		wxFileName shortLived = store.allocate(wxT("a.pdf"), std::chrono::minutes(0)),
+			longLived = store.allocate(wxT("a.pdf"), std::chrono::minutes(10));
+		REQUIRE(shortLived.GetFullName() == wxT("a.pdf"));
+		REQUIRE(shortLived != longLived);
+		REQUIRE(store.contains(longLived));
+		REQUIRE(!store.contains(wxFileName("./", "a.pdf")));
+
+		{
+			std::ofstream(longLived.GetFullPath().ToStdString()) << "kept";
+		}
+
+		// Expired files are deleted in the background
+		for (int i = 0; i < 50 && shortLived.DirExists(); ++i)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+		REQUIRE(!wxFileName(shortLived.GetPath(), "").DirExists());
+		REQUIRE(longLived.FileExists());
+	}
+
+	// Nothing is left once the store is gone
+	REQUIRE(!storeFolder.DirExists());
+	REQUIRE(otherLiveStore.DirExists());
+	rootFolder.Rmdir(wxPATH_RMDIR_RECURSIVE);
+
+	EphemeralReceivePolicy policy;
+	policy.extensions = { wxT("pdf") };
+	REQUIRE(policy.appliesTo(wxT("print.PDF"), 1000));
+	REQUIRE(!policy.appliesTo(wxT("print.pdf"), policy.maxFileSize + 1));
+	REQUIRE(!policy.appliesTo(wxT("notes.txt"), 1000));
+}
+
+TEST_CASE("ConsentPromptQueue")
+{
+	ConsentPromptQueue promptQueue;
+	std::vector<std::string> events;
+	std::function<void()> finishFirst;
+
+	promptQueue.enqueue([&](std::function<void()> finished)
+	{
+		events.emplace_back("first shown");
+		finishFirst = finished;
+	});
+	promptQueue.enqueue([&](std::function<void()> finished)
+	{
+		events.emplace_back("second shown");
+		finished();
+	});
+
+	// The second prompt waits for the first to be answered, without blocking the caller
+	REQUIRE(events == std::vector<std::string>{ "first shown" });
+	REQUIRE_FALSE(promptQueue.idle());
+
+	finishFirst();
+	REQUIRE(events == std::vector<std::string>{ "first shown", "second shown" });
+	REQUIRE(promptQueue.idle());
+
+	promptQueue.runExclusive([&] { events.emplace_back("exclusive"); });
+	REQUIRE(events.back() == "exclusive");
+
+	REQUIRE_THROWS_AS(promptQueue.runExclusive([] { throw std::runtime_error("prompt failed"); }), std::runtime_error);
+	promptQueue.enqueue([&](std::function<void()> finished)
+	{
+		events.emplace_back("after failure");
+		finished();
+	});
+	REQUIRE(events.back() == "after failure");
+
+	SECTION("Shutting down abandons the shown and queued prompts")
+	{
+		events.clear();
+		promptQueue.enqueue([&](std::function<void()> finished) { events.emplace_back("shown"); },
+			[&] { events.emplace_back("shown abandoned"); });
+		promptQueue.enqueue([&](std::function<void()> finished) { events.emplace_back("queued shown"); },
+			[&] { events.emplace_back("queued abandoned"); });
+
+		promptQueue.shutdown();
+		REQUIRE(promptQueue.shutDown());
+		REQUIRE(events == std::vector<std::string>{ "shown", "shown abandoned", "queued abandoned" });
+
+		promptQueue.enqueue([&](std::function<void()> finished) { events.emplace_back("late shown"); },
+			[&] { events.emplace_back("late abandoned"); });
+		REQUIRE(events.back() == "late abandoned");
+		REQUIRE_FALSE(promptQueue.runExclusive([&] { events.emplace_back("late exclusive"); }));
+		REQUIRE(events.back() == "late abandoned");
+	}
+}
+
+TEST_CASE("HandoffGate")
+{
+	struct RecordingHandler : public CivetHandler
+	{
+		unsigned calls = 0;
+		std::function<void()> duringCall;
+
+		bool handlePost(CivetServer* server, mg_connection* conn) override
+		{
+			++calls;
+			if (duringCall)
+			{
+				duringCall();
+			}
+
+			mg_send_http_ok(conn, "text/plain", 0);
+			return true;
+		}
+	};
+
+	CivetServer testServer({});
+	HandoffGate gate;
+	RecordingHandler consentHandler, uploadHandler;
+	HandoffGate::Handler gatedConsent = gate.refusing(consentHandler),
+		gatedUpload = gate.admitting(uploadHandler);
+
+	mg_connection testConn;
+	testConn.requestInfo = mg_request_info{ "", "/api/openSaveFile/getConsent", "10.0.0.2" };
+
+	// Requests are counted while their handlers run
+	consentHandler.duringCall = [&gate] { REQUIRE(gate.requestsInProgress() == 1); };
+	REQUIRE(gatedConsent.handlePost(&testServer, &testConn));
+	REQUIRE(consentHandler.calls == 1);
+	REQUIRE(gate.requestsInProgress() == 0);
+
+	SECTION("once closed, new work is refused and consented uploads still go through")
+	{
+		gate.close(8081);
+		REQUIRE(gate.isClosed());
+
+		mg_connection refusedConn;
+		refusedConn.requestInfo = mg_request_info{ "", "/api/openSaveFile/getConsent", "10.0.0.2" };
+		REQUIRE(gatedConsent.handlePost(&testServer, &refusedConn));
+		REQUIRE(consentHandler.calls == 1);
+		REQUIRE(refusedConn.responseStatus.value() == 503);
+		REQUIRE(refusedConn.outputBuffer.find("8081") != std::string::npos);
+
+		// The uploads running on this server are what its handoff waits for
+		uploadHandler.duringCall = [&gate] { REQUIRE(gate.requestsInProgress() == 1); };
+		mg_connection uploadConn;
+		uploadConn.requestInfo = mg_request_info{ "", "/api/openSaveFile", "10.0.0.2" };
+		REQUIRE(gatedUpload.handlePost(&testServer, &uploadConn));
+		REQUIRE(uploadHandler.calls == 1);
+		REQUIRE(uploadConn.responseStatus.value() == 200);
+		REQUIRE(gate.requestsInProgress() == 0);
+	}
+
+	SECTION("a reopened gate takes new work again")
+	{
+		gate.close(8081);
+		gate.reopen();
+		REQUIRE_FALSE(gate.isClosed());
+
+		mg_connection reopenedConn;
+		reopenedConn.requestInfo = mg_request_info{ "", "/api/openSaveFile/getConsent", "10.0.0.2" };
+		REQUIRE(gatedConsent.handlePost(&testServer, &reopenedConn));
+		REQUIRE(consentHandler.calls == 2);
+	}
+}
+
+TEST_CASE("GUITask")
+{
+	auto wxTestApp = QuickOpenApplication(true, false);
+	wxTestApp.deferCalls = true;
+
+	SECTION("result is delivered once the GUI thread runs the call")
+	{
+		auto callsBefore = GUIQueueLatency::global().snapshot().callCount;
+		auto task = callOnGUIThread(wxTestApp, [] { return 42; });
+		REQUIRE(!task.waitUntil(std::chrono::steady_clock::now()));
+
+		wxTestApp.runDeferredCalls();
+		REQUIRE(task.waitUntil(std::chrono::steady_clock::now()) == 42);
+		REQUIRE(task.get() == 42);
+		REQUIRE(GUIQueueLatency::global().snapshot().callCount == callsBefore + 1);
+	}
+	SECTION("cancelled call is skipped")
+	{
+		bool called = false;
+		auto task = callOnGUIThread(wxTestApp, [&called] { called = true; return 0; });
+		REQUIRE(task.cancel());
+
+		wxTestApp.runDeferredCalls();
+		REQUIRE(!called);
+		REQUIRE(!task.waitUntil(std::chrono::steady_clock::now()));
+	}
+	SECTION("cancelling a started call reports that it ran")
+	{
+		auto task = callOnGUIThread(wxTestApp, [] { return 1; });
+		wxTestApp.runDeferredCalls();
+		REQUIRE(!task.cancel());
+	}
+	SECTION("exceptions are rethrown to the waiter")
+	{
+		auto task = callOnGUIThread(wxTestApp, []() -> int { throw std::runtime_error("dialog failed"); });
+		wxTestApp.runDeferredCalls();
+		REQUIRE_THROWS_AS(task.get(), std::runtime_error);
+	}
+	SECTION("awaitGUITask gives up at the deadline")
+	{
+		mg_connection testConn;
+		auto task = callOnGUIThread(wxTestApp, [] { return 1; });
+		REQUIRE(!awaitGUITask(task, &testConn, std::chrono::steady_clock::now() + std::chrono::milliseconds(10)));
+
+		// It was cancelled, so the GUI thread skips it
+		wxTestApp.runDeferredCalls();
+		REQUIRE(!task.waitUntil(std::chrono::steady_clock::now()));
+	}
+}
+
+TEST_CASE("FileConsentTokenService deduplication")
+{
+    CivetServer testServer({});
+    auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
+    ConsentPromptQueue promptQueue;
+    ConsentPolicy consentPolicy({}, wxFileName(".", "consentAudit.log"));
+    std::string testContent = "These bytes were already received once.";
+
+    SHA256Hasher contentHasher;
+    contentHasher.update(testContent.data(), testContent.size());
+    std::string contentHash = contentHasher.finishHex();
+
+    wxFileName sourceFileName("./", "dedupSource.txt"), destFileName("./dedupDest/", "dedupCopy.txt");
+    {
+        std::ofstream sourceFile(sourceFileName.GetFullPath().ToStdString(), std::ofstream::binary);
+        sourceFile << testContent;
     }
-    SECTION("unhappy path - invalid consent token or file index")
+    if (!destFileName.DirExists())
     {
-        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
-        testFileInfo.filename = wxT("testFile.txt");
-        testFileInfo.fileSize = testContent.size();
-        testFileInfo.consentedFileName = wxT("testFileConsented2.txt");
+        wxFileName("./dedupDest/", "").Mkdir();
+    }
 
-        {
-            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
-                    tokens(consentEndpoint.tokenWRRef);
-            tokens->insert({ testToken, { testFileInfo } });
-        }
+    auto wxTestApp = QuickOpenApplication(true, false);
+    wxTestApp.fileDestFolder = wxFileName("./dedupDest/", "");
+    FileConsentTokenService endpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+    endpoint.contentIndex.recordFile(contentHash, sourceFileName);
 
-        mg_connection testConn;
-        testConn.requestInfo = mg_request_info { "consentToken=4&fileIndex=0", "/api/saveFile", "::1" };
-        testConn.inputBuffer = testContent;
+    mg_connection testConn;
+    testConn.requestInfo = mg_request_info { "", "/api/openSaveFile/getConsent", "::1" };
+    testConn.inputBuffer = nlohmann::json{ {"fileList", {
+        { {"filename", "dedupCopy.txt"}, {"fileSize", testContent.size()}, {"contentHash", contentHash} },
+        { {"filename", "other.txt"}, {"fileSize", 5}, {"contentHash", std::string(64, '0')} }
+    } } }.dump();
 
-        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
-        REQUIRE(testConn.responseStatus == 403);
-        REQUIRE(!testConn.isOpen);
-        REQUIRE(!testFileInfo.consentedFileName.FileExists());
+    REQUIRE(endpoint.handlePost(&testServer, &testConn));
+    REQUIRE(testConn.responseStatus == 200);
 
-        mg_connection testConn2;
-        testConn2.requestInfo = mg_request_info { "consentToken=3&fileIndex=1", "/api/saveFile", "::1" };
-        testConn2.inputBuffer = testContent;
+    auto response = nlohmann::json::parse(testConn.outputBuffer);
+    REQUIRE(response["deduplicatedIndices"] == nlohmann::json{ 0 });
+    REQUIRE(fileReadAll(destFileName) == testContent);
+
+    auto* tokenMap = endpoint.tokenWRRef.obj.get();
+    const auto& fileList = tokenMap->at(response["consentToken"].get<ConsentToken>());
+    REQUIRE(fileList.at(0).uploadEnded);
+    REQUIRE(!fileList.at(1).uploadStarted);
+
+    // A file that is only opened is always sent, so that it arrives to be opened
+    wxTestApp.openOnlyChoice = true;
+    mg_connection openOnlyConn;
+    openOnlyConn.requestInfo = mg_request_info { "", "/api/openSaveFile/getConsent", "::1" };
+    openOnlyConn.inputBuffer = nlohmann::json{ {"fileList", {
+        { {"filename", "dedupCopy.txt"}, {"fileSize", testContent.size()}, {"contentHash", contentHash} }
+    } } }.dump();
+
+    REQUIRE(endpoint.handlePost(&testServer, &openOnlyConn));
+    REQUIRE(openOnlyConn.responseStatus == 200);
+    auto openOnlyResponse = nlohmann::json::parse(openOnlyConn.outputBuffer);
+    REQUIRE(openOnlyResponse["deduplicatedIndices"].empty());
+    REQUIRE(!tokenMap->at(openOnlyResponse["consentToken"].get<ConsentToken>()).at(0).uploadStarted);
+
+    // Nothing is copied for a request that is refused for lack of disk space
+    wxTestApp.openOnlyChoice = false;
+    wxFileName refusedCopyName("./dedupDest/", "refusedCopy.txt");
+    mg_connection refusedConn;
+    refusedConn.requestInfo = mg_request_info { "", "/api/openSaveFile/getConsent", "::1" };
+    refusedConn.inputBuffer = nlohmann::json{ {"fileList", {
+        { {"filename", "refusedCopy.txt"}, {"fileSize", testContent.size()}, {"contentHash", contentHash} },
+        { {"filename", "huge.bin"}, {"fileSize", 4611686018427387904ULL} }
+    } } }.dump();
+
+    REQUIRE(endpoint.handlePost(&testServer, &refusedConn));
+    REQUIRE(refusedConn.responseStatus == 507);
+    REQUIRE(!refusedCopyName.FileExists());
+
+    // Once the source changes, it can no longer stand in for the content hash
+    {
+        std::ofstream sourceFile(sourceFileName.GetFullPath().ToStdString(), std::ofstream::binary | std::ofstream::app);
+        sourceFile << "changed";
+    }
+    wxRemoveFile(destFileName.GetFullPath());
+    REQUIRE(endpoint.contentIndex.findFile(contentHash, testContent.size()) == std::nullopt);
+
+    wxRemoveFile(sourceFileName.GetFullPath());
+}
+
+TEST_CASE("UploadScheduler")
+{
+	UploadScheduler scheduler(1);
+	std::mutex orderMutex;
+	std::vector<std::string> order;
+
+	// Holds the only writer until everything else has been queued
+	std::promise<void> gateStarted, releaseGate;
+	auto gate = scheduler.submit("gate", UploadScheduler::Priority::BULK, 1,
+		[&gateStarted, gateOpened = releaseGate.get_future().share()]
+	{
+		gateStarted.set_value();
+		gateOpened.wait();
+	});
+	gateStarted.get_future().wait();
+
+	std::vector<std::future<void>> writes;
+	auto queueWrite = [&](const std::string& sender, UploadScheduler::Priority priority, const std::string& name)
+	{
+		writes.push_back(scheduler.submit(sender, priority, UploadScheduler::QUANTUM, [&orderMutex, &order, name]
+		{
+			std::lock_guard<std::mutex> lock(orderMutex);
+			order.push_back(name);
+		}));
+	};
+
+	for (int i = 1; i <= 3; ++i)
+	{
+		queueWrite("10.0.0.1", UploadScheduler::Priority::BULK, "bulk" + std::to_string(i));
+	}
+	queueWrite("10.0.0.2", UploadScheduler::Priority::BULK, "other");
+	for (int i = 1; i <= 2; ++i)
+	{
+		queueWrite("10.0.0.3", UploadScheduler::Priority::INTERACTIVE, "small" + std::to_string(i));
+	}
+
+	auto queued = scheduler.snapshot();
+	REQUIRE(queued.activeWrites == 1);
+	REQUIRE(queued.flows.size() == 3);
+	REQUIRE(queued.flows[0].sender == "10.0.0.3");
+	REQUIRE(queued.flows[1].sender == "10.0.0.1");
+	REQUIRE(queued.flows[1].queuedWrites == 3);
+	REQUIRE(queued.flows[1].queuedBytes == 3 * UploadScheduler::QUANTUM);
+
+	releaseGate.set_value();
+	gate.get();
+	for (auto& write : writes)
+	{
+		write.get();
+	}
+
+	// The interactive flow goes first, then one quantum per turn keeps the first bulk sender from holding up the second
+	REQUIRE(order == std::vector<std::string>{ "small1", "small2", "bulk1", "other", "bulk2", "bulk3" });
+	REQUIRE(scheduler.snapshot().flows.empty());
+
+	REQUIRE(UploadScheduler::priorityFor(UploadScheduler::SMALL_FILE_SIZE) == UploadScheduler::Priority::INTERACTIVE);
+	REQUIRE(UploadScheduler::priorityFor(UploadScheduler::SMALL_FILE_SIZE + 1) == UploadScheduler::Priority::BULK);
+
+	auto failedWrite = scheduler.submit("10.0.0.1", UploadScheduler::Priority::BULK, 1, [] { throw std::ios_base::failure("disk full"); });
+	REQUIRE_THROWS_AS(failedWrite.get(), std::ios_base::failure);
+
+	// Each writer is prepared (e.g. has its priority lowered) on its own thread
+	std::mutex preparedMutex;
+	std::set<std::thread::id> preparedThreads;
+	{
+		UploadScheduler preparedScheduler(3, [&preparedMutex, &preparedThreads]
+		{
+			std::lock_guard<std::mutex> lock(preparedMutex);
+			preparedThreads.insert(std::this_thread::get_id());
+		});
+	}
+	REQUIRE(preparedThreads.size() == 3);
+	REQUIRE(preparedThreads.count(std::this_thread::get_id()) == 0);
+}
+
+
+TEST_CASE("UploadScheduler with one write outstanding per upload")
+{
+	UploadScheduler scheduler(1);
+	std::mutex orderMutex;
+	std::vector<std::string> order;
+
+	std::promise<void> gateStarted, releaseGate;
+	auto gate = scheduler.submit("gate", UploadScheduler::Priority::BULK, 1,
+		[&gateStarted, gateOpened = releaseGate.get_future().share()]
+	{
+		gateStarted.set_value();
+		gateOpened.wait();
+	});
+	gateStarted.get_future().wait();
+
+	// Like an upload, each write only queues the next chunk once it has been taken
+	std::vector<std::promise<void>> uploadsDone(2);
+	std::function<void(const std::string&, UploadScheduler::Priority, int, std::promise<void>&)> queueChunk;
+	queueChunk = [&](const std::string& name, UploadScheduler::Priority priority, int chunk, std::promise<void>& done)
+	{
+		scheduler.submit(name, priority, 64 * 1024, [&, name, priority, chunk]
+		{
+			{
+				std::lock_guard<std::mutex> lock(orderMutex);
+				order.push_back(name + std::to_string(chunk));
+			}
+
+			if (chunk < 3)
+			{
+				queueChunk(name, priority, chunk + 1, done);
+			}
+			else
+			{
+				done.set_value();
+			}
+		});
+	};
+
+	queueChunk("bulk", UploadScheduler::Priority::BULK, 1, uploadsDone[0]);
+	queueChunk("small", UploadScheduler::Priority::INTERACTIVE, 1, uploadsDone[1]);
+
+	releaseGate.set_value();
+	gate.get();
+	for (auto& done : uploadsDone)
+	{
+		done.get_future().wait();
+	}
+
+	REQUIRE(order == std::vector<std::string>{ "small1", "small2", "small3", "bulk1", "bulk2", "bulk3" });
+}
+
+TEST_CASE("DiskSpaceLedger")
+{
+	// Two filesystems: everything in "ledgerBig" has 10000 bytes free, everything else 1000
+	DiskSpaceLedger ledger([](const wxFileName& folder)
+	{
+		return folder.GetPath().Contains(wxT("ledgerBig")) ? FilesystemSpace{ "big", 10000 } : FilesystemSpace{ "small", 1000 };
+	});
+	wxFileName bigFolder("./ledgerBig/", ""),
+		smallFolder("./ledgerSmall/", "");
+	bigFolder.Mkdir();
+	smallFolder.Mkdir();
+
+	SECTION("reservations count against later requests until released")
+	{
+		REQUIRE(!ledger.reserve(1, { { wxFileName("./ledgerBig/", "a.bin"), 6000 }, { wxFileName("./ledgerSmall/", "b.bin"), 500 } }, 100));
+		REQUIRE(ledger.reservedOn(bigFolder) == 6000);
+		REQUIRE(ledger.reservedOn(smallFolder) == 500);
+
+		// Folders that don't exist yet are taken to be on the filesystem of their nearest existing parent
+		auto shortfall = ledger.reserve(2, { { wxFileName("./ledgerSmall/", "c.bin"), 0 }, { wxFileName("./ledgerBig/new/", "d.bin"), 4000 } }, 100);
+		REQUIRE(shortfall);
+		REQUIRE(shortfall->folder.GetPath().Contains(wxT("new")));
+		REQUIRE(shortfall->requiredBytes == 4000);
+		REQUIRE(shortfall->usableBytes == 3900);
+		// A refused request reserves nothing, even on filesystems it would have fit on
+		REQUIRE(ledger.reservedOn(smallFolder) == 500);
+
+		ledger.release(1, 0);
+		ledger.release(1, 0);
+		REQUIRE(ledger.reservedOn(bigFolder) == 0);
+		REQUIRE(!ledger.reserve(2, { { wxFileName("./ledgerSmall/", "c.bin"), 0 }, { wxFileName("./ledgerBig/new/", "d.bin"), 4000 } }, 100));
+		REQUIRE(ledger.reservedOn(bigFolder) == 4000);
+	}
+
+	SECTION("files on the same filesystem are checked together, with the safety margin")
+	{
+		auto shortfall = ledger.reserve(1, { { wxFileName("./ledgerSmall/", "a.bin"), 400 }, { wxFileName("./ledgerSmall/", "b.bin"), 400 } }, 300);
+		REQUIRE(shortfall);
+		REQUIRE(shortfall->requiredBytes == 800);
+		REQUIRE(shortfall->usableBytes == 700);
+		REQUIRE(!ledger.reserve(1, { { wxFileName("./ledgerSmall/", "a.bin"), 400 }, { wxFileName("./ledgerSmall/", "b.bin"), 400 } }, 200));
+	}
+
+	SECTION("files that aren't held by the time their reservation expires give their space back")
+	{
+		auto expiresAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+		REQUIRE(!ledger.reserve(1, { { wxFileName("./ledgerBig/", "a.bin"), 3000 }, { wxFileName("./ledgerBig/", "b.bin"), 4000 } }, 0, expiresAt));
+		ledger.hold(1, 1);
+		REQUIRE(ledger.reservedOn(bigFolder) == 7000);
+
+		std::this_thread::sleep_until(expiresAt);
+		REQUIRE(ledger.reservedOn(bigFolder) == 4000);
+
+		ledger.release(1, 1);
+		REQUIRE(ledger.reservedOn(bigFolder) == 0);
+	}
+
+	bigFolder.Rmdir();
+	smallFolder.Rmdir();
+}
+
+TEST_CASE("BandwidthLimiter")
+{
+	SECTION("token bucket lets a burst through, then paces to its rate")
+	{
+		auto start = std::chrono::steady_clock::now();
+		TokenBucket bucket(1000, start);
+
+		REQUIRE(bucket.take(1000, start) == std::chrono::steady_clock::duration::zero());
+		// Going into debt tells the taker how long to wait for it to be paid off
+		REQUIRE(bucket.take(500, start) == std::chrono::milliseconds(500));
+		REQUIRE(bucket.take(500, start + std::chrono::milliseconds(500)) == std::chrono::milliseconds(500));
+		REQUIRE(!bucket.isFull(start + std::chrono::seconds(1)));
+		REQUIRE(bucket.isFull(start + std::chrono::seconds(2)));
+	}
+
+	SECTION("limits apply per sender, per subnet and globally")
+	{
+		BandwidthLimits limits;
+		limits.perSenderBytesPerSecond = 100000;
+		limits.subnetLimits = { { "192.168.1.0/24", 1000 }, { "192.168.1.7", 500 }, { "fd00::/8", 2000 }, { "bogus/8", 1 } };
+		BandwidthLimiter limiter([&limits] { return limits; });
+
+		REQUIRE(BandwidthLimiter::parseAddress("192.168.1.7") == BandwidthLimiter::parseAddress("::ffff:192.168.1.7"));
+		REQUIRE(!BandwidthLimiter::parseAddress("192.168.1"));
+
+		// Reads are kept to a tenth of a second at the tightest applicable rate
+		REQUIRE(limiter.readSizeFor("10.0.0.1", 1 << 20) == 10000);
+		REQUIRE(limiter.readSizeFor("192.168.1.20", 1 << 20) == BandwidthLimiter::MIN_READ_SIZE);
+		REQUIRE(limiter.readSizeFor("fd12::1", 100) == 100);
+
+		// Senders in a subnet share its allowance, except those with a more specific rule of their own
+		REQUIRE(limiter.consume("192.168.1.20", 1000) == std::chrono::steady_clock::duration::zero());
+		REQUIRE(limiter.consume("192.168.1.21", 1000) > std::chrono::milliseconds(900));
+		REQUIRE(limiter.consume("192.168.1.7", 500) == std::chrono::steady_clock::duration::zero());
+		REQUIRE(limiter.consume("10.0.0.1", 100000) == std::chrono::steady_clock::duration::zero());
+		REQUIRE(limiter.consume("10.0.0.2", 100000) == std::chrono::steady_clock::duration::zero());
+
+		// Limits read from the source are picked up while uploads are running
+		limits = BandwidthLimits();
+		limits.globalBytesPerSecond = 100;
+		std::this_thread::sleep_for(BandwidthLimiter::REFRESH_INTERVAL + std::chrono::milliseconds(50));
+		REQUIRE(limiter.consume("10.0.0.1", 100) == std::chrono::steady_clock::duration::zero());
+		REQUIRE(limiter.consume("10.0.0.2", 100) > std::chrono::milliseconds(900));
+		REQUIRE(limiter.getLimits() == limits);
+	}
+}
+
+TEST_CASE("ConsentPolicy")
+{
+	wxFileName auditLogFile(".", "consentPolicyAudit.log");
+	wxRemoveFile(auditLogFile.GetFullPath());
+
+	std::vector<ConsentRule> rules(3);
+	rules[0].name = "trusted lab";
+	rules[0].action = ConsentRule::ACCEPT;
+	rules[0].senderSubnets = { "192.168.1.0/24", "fd00::/8" };
+	rules[0].urlDomains = { "intranet.example", "*.lab.example" };
+	rules[1].name = "broken";
+	rules[1].action = ConsentRule::ACCEPT;
+	rules[1].senderSubnets = { "bogus/8" };
+	rules[2].name = "everything else";
+	rules[2].action = ConsentRule::DENY;
+	rules[2].maxFileCount = 2;
+
+	{
+		ConsentPolicy policy([&rules] { return rules; }, auditLogFile);
+
+		REQUIRE(ConsentPolicy::urlHost("https://user@Docs.Lab.Example:8443/a?b") == "docs.lab.example");
+		REQUIRE(ConsentPolicy::urlHost("http:intranet.example") == "intranet.example");
+		REQUIRE(ConsentPolicy::urlHost("http://[fd00::1]:80/") == "[fd00::1]");
+
+		auto decide = [&policy](ConsentRequest request) { return policy.evaluate(request).action; };
+
+		REQUIRE(decide({ ConsentRequest::WEBPAGE, "192.168.1.7", "http://intranet.example/", {} }) == ConsentRule::ACCEPT);
+		REQUIRE(decide({ ConsentRequest::WEBPAGE, "fd12::1", "https://docs.lab.example/", {} }) == ConsentRule::ACCEPT);
+		// A pattern for subdomains doesn't cover the domain itself
+		REQUIRE(decide({ ConsentRequest::WEBPAGE, "fd12::1", "https://lab.example/", {} }) == ConsentRule::PROMPT);
+		REQUIRE(decide({ ConsentRequest::WEBPAGE, "10.0.0.1", "http://intranet.example/", {} }) == ConsentRule::PROMPT);
+
+		// The rule with a subnet that can't be parsed is dropped rather than matching every sender, and a rule
+		// with file conditions never matches webpages
+		auto decision = policy.evaluate({ ConsentRequest::FILES, "10.0.0.1", "", { { wxT("a.txt"), 1 } } });
+		REQUIRE(decision.action == ConsentRule::DENY);
+		REQUIRE(decision.ruleName == "everything else");
+		REQUIRE(decide({ ConsentRequest::FILES, "10.0.0.1", "", { { wxT("a.txt"), 1 }, { wxT("b.txt"), 1 }, { wxT("c.txt"), 1 } } }) == ConsentRule::PROMPT);
+
+		// Rule changes are picked up from the source
+		rules.erase(rules.begin());
+		std::this_thread::sleep_for(ConsentPolicy::REFRESH_INTERVAL + std::chrono::milliseconds(50));
+		REQUIRE(decide({ ConsentRequest::WEBPAGE, "192.168.1.7", "http://intranet.example/", {} }) == ConsentRule::PROMPT);
+		REQUIRE(policy.getRules() == rules);
+
+		policy.recordAnswer({ ConsentRequest::WEBPAGE, "192.168.1.7", "http://intranet.example/", {} }, true);
+	}
+
+	std::ifstream auditLog(auditLogFile.GetFullPath());
+	std::vector<nlohmann::json> entries;
+	for (std::string line; std::getline(auditLog, line);)
+	{
+		entries.push_back(nlohmann::json::parse(line));
+	}
+
+	REQUIRE(entries.size() == 8);
+	REQUIRE(entries[0]["decision"] == "accept");
+	REQUIRE(entries[0]["decidedBy"] == "policy");
+	REQUIRE(entries[0]["rule"] == "trusted lab");
+	REQUIRE(entries[0]["url"] == "http://intranet.example/");
+	REQUIRE(entries[4]["files"][0]["filename"] == "a.txt");
+	REQUIRE(entries[7]["decidedBy"] == "user");
+	REQUIRE(entries[7]["sender"] == "192.168.1.7");
+	auditLog.close();
+
+	// Once the log is full it is moved aside, replacing what was moved aside before
+	wxString rotatedPath = auditLogFile.GetFullPath() + wxT(".1");
+	{
+		ConsentPolicy policy({}, auditLogFile, 1000);
+		for (int i = 0; i < 20; ++i)
+		{
+			policy.recordAnswer({ ConsentRequest::WEBPAGE, "192.168.1.7", "http://intranet.example/", {} }, true);
+		}
+	}
+
+	REQUIRE(wxFileExists(rotatedPath));
+	REQUIRE(auditLogFile.GetSize() <= 1000);
+	REQUIRE(wxFileName(rotatedPath).GetSize() <= 1000);
+
+	wxRemoveFile(auditLogFile.GetFullPath());
+	wxRemoveFile(rotatedPath);
+}
+
+TEST_CASE("ConsentApprovalQueue")
+{
+	ConsentApprovalQueue approvalQueue;
+	std::vector<std::string> answers;
+	auto recordAnswer = [&answers](std::string name)
+	{
+		return [&answers, name](bool accepted, bool banSender, const nlohmann::json& choices)
+		{
+			answers.push_back(name + (accepted ? " accepted" : " declined") + (banSender ? " and banned" : "")
+				+ (choices.contains("openOnly") ? " to open" : ""));
+		};
+	};
+
+	auto now = std::chrono::steady_clock::now();
+	bool clientGone = false;
+	uint64_t webpageID = approvalQueue.add("the IP address 10.0.0.2", { {"url", "https://example.com/"} },
+		now + std::chrono::seconds(30), recordAnswer("webpage"));
+	uint64_t filesID = approvalQueue.add("the IP address 10.0.0.3", { {"files", { { {"filename", "a.txt"}, {"fileSize", 3} } }} },
+		now + std::chrono::seconds(10), recordAnswer("files"));
+	uint64_t abandonedID = approvalQueue.add("the IP address 10.0.0.4", { {"url", "https://example.org/"} },
+		now + std::chrono::seconds(30), recordAnswer("abandoned"), [&clientGone] { return clientGone; });
+
+	auto pending = approvalQueue.pending();
+	REQUIRE(pending.size() == 3);
+	REQUIRE(pending[0].id == webpageID);
+	REQUIRE(pending[1].details["files"][0]["filename"] == "a.txt");
+	REQUIRE(nlohmann::json(pending[0])["requester"] == "the IP address 10.0.0.2");
+
+	// Prompts whose request went away are dropped from the list, but still answered once
+	clientGone = true;
+	pending = approvalQueue.pending();
+	REQUIRE(pending.size() == 2);
+	REQUIRE(answers == std::vector<std::string>{ "abandoned declined" });
+	REQUIRE_FALSE(approvalQueue.answer(abandonedID, true, false));
+
+	REQUIRE(approvalQueue.answer(webpageID, false, true));
+	REQUIRE_FALSE(approvalQueue.answer(webpageID, true, false));
+	REQUIRE(answers.back() == "webpage declined and banned");
+
+	approvalQueue.expire(now + std::chrono::seconds(5));
+	REQUIRE(approvalQueue.pending().size() == 1);
+	approvalQueue.expire(now + std::chrono::seconds(10));
+	REQUIRE(approvalQueue.pending().empty());
+	REQUIRE(answers.back() == "files declined");
+	REQUIRE_FALSE(approvalQueue.answer(filesID, true, false));
+	REQUIRE(answers.size() == 3);
+
+	// What else the approver chose is passed along with the answer
+	uint64_t choiceID = approvalQueue.add("the IP address 10.0.0.5", { {"files", nlohmann::json::array()} },
+		now + std::chrono::seconds(30), recordAnswer("chosen"));
+	REQUIRE(approvalQueue.answer(choiceID, true, false, { {"openOnly", true} }));
+	REQUIRE(answers.back() == "chosen accepted to open");
+}
+
+TEST_CASE("ActivityRing")
+{
+	ActivityRing ring;
+	std::vector<ActivityEvent> events;
+
+	REQUIRE(ring.consume(events) == 0);
+	REQUIRE(events.empty());
+
+	ring.publish(ActivityEvent(ActivityEvent::UPLOAD_STARTED, 7, "/home/user/Downloads/report.pdf"));
+	ring.publish(ActivityEvent(ActivityEvent::UPLOAD_PROGRESS, 7, "/home/user/Downloads/report.pdf", 0.5));
+	ring.publish(ActivityEvent(ActivityEvent::UPLOAD_FAILED, 7, "/home/user/Downloads/report.pdf", 1.0, "disk full"));
+
+	REQUIRE(ring.consume(events) == 0);
+	REQUIRE(events.size() == 3);
+	REQUIRE(events[0].kind == ActivityEvent::UPLOAD_STARTED);
+	REQUIRE(events[0].entryID == 7);
+	REQUIRE(events[0].getText() == "/home/user/Downloads/report.pdf");
+	REQUIRE(events[1].progress == 0.5);
+	REQUIRE(events[2].getDetail() == "disk full");
+
+	// Already read events aren't returned again
+	events.clear();
+	REQUIRE(ring.consume(events) == 0);
+	REQUIRE(events.empty());
+
+	SECTION("long text is cut short at a character boundary")
+	{
+		std::string longURL = "https://example.com/" + std::string(ActivityEvent::TEXT_SIZE, 'a') + "\xC3\xA9";
+		ring.publish(ActivityEvent(ActivityEvent::WEBPAGE_OPENED, 0, std::string(ActivityEvent::TEXT_SIZE - 2, 'a') + "\xC3\xA9"));
+		ring.publish(ActivityEvent(ActivityEvent::WEBPAGE_OPENED, 0, longURL));
+
+		ring.consume(events);
+		REQUIRE(events.size() == 2);
+		REQUIRE(events[0].getText() == std::string(ActivityEvent::TEXT_SIZE - 2, 'a'));
+		REQUIRE(events[1].getText() == longURL.substr(0, ActivityEvent::TEXT_SIZE - 1));
+	}
+
+	SECTION("a reader that falls behind skips what was overwritten")
+	{
+		for (uint64_t i = 0; i < ActivityRing::CAPACITY + 10; ++i)
+		{
+			ring.publish(ActivityEvent(ActivityEvent::UPLOAD_PROGRESS, i, "file"));
+		}
+
+		REQUIRE(ring.consume(events) == 10);
+		REQUIRE(events.size() == ActivityRing::CAPACITY);
+		REQUIRE(events.front().entryID == 10);
+		REQUIRE(events.back().entryID == ActivityRing::CAPACITY + 9);
+	}
+
+#ifdef PLATFORM_SHARED_MEMORY_SUPPORTED
+	SECTION("shared with another process")
+	{
+		std::string ringName = userSharedMemoryName("activity-test");
+		auto publisher = ActivityRing::createShared(ringName);
+		publisher->publish(ActivityEvent(ActivityEvent::WEBPAGE_OPENED, 0, "https://example.com/"));
+
+		auto reader = ActivityRing::openShared(ringName);
+		REQUIRE(reader != nullptr);
+		REQUIRE(reader->ownerRunning());
+
+		// Reading starts with what the ring already holds
+		publisher->publish(ActivityEvent(ActivityEvent::CONSENT_PROMPT, 3, "the IP address 10.0.0.2"));
+		reader->consume(events);
+		REQUIRE(events.size() == 2);
+		REQUIRE(events[0].getText() == "https://example.com/");
+		REQUIRE(events[1].kind == ActivityEvent::CONSENT_PROMPT);
+
+		// Publishing from another thread while reading
+		events.clear();
+		std::thread publishThread([&publisher]
+		{
+			for (uint64_t i = 0; i < 100000; ++i)
+			{
+				publisher->publish(ActivityEvent(ActivityEvent::UPLOAD_PROGRESS, i, "file", static_cast<double>(i)));
+			}
+		});
+
+		uint64_t missed = 0;
+		while (events.size() + missed < 100000)
+		{
+			missed += reader->consume(events);
+		}
+		publishThread.join();
+
+		bool intact = true;
+		for (size_t i = 1; i < events.size(); ++i)
+		{
+			intact &= events[i].entryID > events[i - 1].entryID && events[i].progress == static_cast<double>(events[i].entryID);
+		}
+		REQUIRE(intact);
+
+		publisher.reset();
+		REQUIRE(ActivityRing::openShared(ringName) == nullptr);
+	}
+#endif
+}
+
+// Stands in for the consent that getConsent would have recorded for the file
+static void insertTestToken(FileConsentTokenService& consentEndpoint, ConsentToken token,
+    const FileConsentRequestInfo::RequestedFileInfo& fileInfo)
+{
+    WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference tokens(consentEndpoint.tokenWRRef);
+    tokens->insert({ token, { fileInfo } });
+}
+
+static FileConsentRequestInfo::RequestedFileInfo makeTestFileInfo(const wxString& filename,
+    unsigned long long fileSize, const wxFileName& consentedFileName)
+{
+    FileConsentRequestInfo::RequestedFileInfo fileInfo;
+    fileInfo.filename = filename;
+    fileInfo.fileSize = fileSize;
+    fileInfo.consentedFileName = consentedFileName;
+    return fileInfo;
+}
+
+static mg_connection makeUploadConnection(const char* query, const std::string& body)
+{
+    mg_connection conn;
+    conn.requestInfo = mg_request_info { query, "/api/saveFile", "::1" };
+    conn.inputBuffer = body;
+    return conn;
+}
+
+TEST_CASE("OpenSaveFileAPIEndpoint tests")
+{
+    CivetServer testServer({});
+    auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
+    ConsentPromptQueue promptQueue;
+    ConsentPolicy consentPolicy({}, wxFileName(".", "consentAudit.log"));
+    std::string testContent = "The brown fox jumped over the lazy dog.";
+
+    auto wxTestApp = QuickOpenApplication(true, false);
+    FileConsentTokenService consentEndpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+    ConsentToken testToken = 3;
+
+    OpenSaveFileAPIEndpoint saveEndpoint(consentEndpoint, wxTestApp);
+
+    SECTION("happy path")
+    {
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("testFile.txt");
+        testFileInfo.fileSize = testContent.size();
+        testFileInfo.consentedFileName = wxT("testFileConsented.txt");
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = testContent;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.inputBuffer.empty());
+        REQUIRE(testConn.responseStatus == 200);
+        REQUIRE(!testConn.isOpen);
+        REQUIRE(testFileInfo.consentedFileName.FileExists());
+        REQUIRE(testFileInfo.consentedFileName.GetSize() == testContent.size());
+        std::string actualContent = fileReadAll(testFileInfo.consentedFileName);
+        REQUIRE(actualContent == testContent);
+
+        SHA256Hasher contentHasher;
+        contentHasher.update(testContent.data(), testContent.size());
+        REQUIRE(consentEndpoint.contentIndex.findFile(contentHasher.finishHex(), testContent.size()).has_value());
+    }
+    SECTION("file received only to be opened")
+    {
+        std::string printContent = "Printed once, then thrown away.";
+
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("print.pdf");
+        testFileInfo.fileSize = printContent.size();
+        testFileInfo.ephemeral = true;
+        testFileInfo.consentedFileName = consentEndpoint.ephemeralStore.allocate(testFileInfo.filename, std::chrono::minutes(1));
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = printContent;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 200);
+        REQUIRE(fileReadAll(testFileInfo.consentedFileName) == printContent);
+        REQUIRE(wxTestApp.openedFiles == std::vector<wxFileName>{ testFileInfo.consentedFileName });
+
+        // It won't be around to stand in for later uploads of the same content
+        SHA256Hasher contentHasher;
+        contentHasher.update(printContent.data(), printContent.size());
+        REQUIRE(!consentEndpoint.contentIndex.findFile(contentHasher.finishHex(), printContent.size()).has_value());
+    }
+    SECTION("unhappy path - invalid consent token or file index")
+    {
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("testFile.txt");
+        testFileInfo.fileSize = testContent.size();
+        testFileInfo.consentedFileName = wxT("testFileConsented2.txt");
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=4&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = testContent;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 403);
+        REQUIRE(!testConn.isOpen);
+        REQUIRE(!testFileInfo.consentedFileName.FileExists());
+
+        mg_connection testConn2;
+        testConn2.requestInfo = mg_request_info { "consentToken=3&fileIndex=1", "/api/saveFile", "::1" };
+        testConn2.inputBuffer = testContent;
 
         REQUIRE(saveEndpoint.handlePost(&testServer, &testConn2));
         REQUIRE(testConn2.responseStatus == 403);
         REQUIRE(!testConn2.isOpen);
         REQUIRE(!testFileInfo.consentedFileName.FileExists());
     }
-}
\ No newline at end of file
+    SECTION("Expect: 100-continue - interim response sent after validation")
+    {
+        auto testFileInfo = makeTestFileInfo(wxT("testFile.txt"), testContent.size(), wxFileName(wxT("testFileConsented3.txt")));
+        insertTestToken(consentEndpoint, testToken, testFileInfo);
+
+        auto testConn = makeUploadConnection("consentToken=3&fileIndex=0", testContent);
+        testConn.requestInfo.content_length = testContent.size();
+        testConn.requestHeaders = { { "expect", "100-Continue" } };
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 200);
+        REQUIRE(testConn.outputBuffer.rfind("HTTP/1.1 100 Continue\r\n\r\n", 0) == 0);
+        REQUIRE(fileReadAll(testFileInfo.consentedFileName) == testContent);
+
+        wxRemoveFile(testFileInfo.consentedFileName.GetFullPath());
+    }
+    SECTION("Expect: 100-continue - oversized upload refused before the body is read")
+    {
+        auto testFileInfo = makeTestFileInfo(wxT("testFile.txt"), testContent.size(), wxFileName(wxT("testFileConsented4.txt")));
+        insertTestToken(consentEndpoint, testToken, testFileInfo);
+
+        auto testConn = makeUploadConnection("consentToken=3&fileIndex=0", testContent);
+        testConn.requestInfo.content_length = 4000000000LL;
+        testConn.requestHeaders = { { "Expect", "100-continue" } };
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 413);
+        REQUIRE(!testConn.isOpen);
+        REQUIRE(testConn.inputBuffer == testContent);
+        REQUIRE(testConn.outputBuffer.find("100 Continue") == std::string::npos);
+        REQUIRE(!testFileInfo.consentedFileName.FileExists());
+
+        // The consent isn't used up by the refusal, so a corrected request goes through
+        auto retryConn = makeUploadConnection("consentToken=3&fileIndex=0", testContent);
+        retryConn.requestInfo.content_length = testContent.size();
+        retryConn.requestHeaders = { { "Expect", "100-continue" } };
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &retryConn));
+        REQUIRE(retryConn.responseStatus == 200);
+        REQUIRE(fileReadAll(testFileInfo.consentedFileName) == testContent);
+
+        wxRemoveFile(testFileInfo.consentedFileName.GetFullPath());
+    }
+    SECTION("unhappy path - too many concurrent uploads")
+    {
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("testFile.txt");
+        testFileInfo.fileSize = testContent.size();
+        testFileInfo.consentedFileName = wxT("testFileConsented5.txt");
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+        {
+            WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+            configRef->maxConcurrentUploads = 0;
+        }
+        REQUIRE(!consentEndpoint.diskSpaceLedger.reserve(testToken, { { wxFileName("./", "testFileConsented5.txt"), testFileInfo.fileSize } }, 0));
+        REQUIRE(consentEndpoint.diskSpaceLedger.reservedOn(wxFileName("./", "")) == testFileInfo.fileSize);
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = testContent;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 503);
+        REQUIRE(testConn.responseHeaders == std::vector<std::pair<std::string, std::string>>{ { "Retry-After", "1" } });
+        REQUIRE(testConn.inputBuffer == testContent);
+        REQUIRE(!testFileInfo.consentedFileName.FileExists());
+        // The sender may never come back for the file, so its space isn't kept for it
+        REQUIRE(consentEndpoint.diskSpaceLedger.reservedOn(wxFileName("./", "")) == 0);
+
+        // The retry is admitted once there is room
+        {
+            WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+            configRef->maxConcurrentUploads = 1;
+        }
+
+        mg_connection retryConn;
+        retryConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        retryConn.inputBuffer = testContent;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &retryConn));
+        REQUIRE(retryConn.responseStatus == 200);
+        REQUIRE(fileReadAll(testFileInfo.consentedFileName) == testContent);
+
+        wxRemoveFile(testFileInfo.consentedFileName.GetFullPath());
+    }
+    SECTION("throttled upload is paced to its sender's limit")
+    {
+        std::string throttledContent(200, 'x');
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("testFile.txt");
+        testFileInfo.fileSize = throttledContent.size();
+        testFileInfo.consentedFileName = wxT("testFileConsented7.txt");
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+
+        BandwidthLimits limits;
+        limits.perSenderBytesPerSecond = 100;
+        consentEndpoint.bandwidthLimiter.setLimits(limits);
+        auto throttledReadsBefore = BandwidthLimiter::globalStats().throttledReads.load();
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = throttledContent;
+
+        auto startTime = std::chrono::steady_clock::now();
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(std::chrono::steady_clock::now() - startTime >= std::chrono::milliseconds(900));
+        REQUIRE(testConn.responseStatus == 200);
+        REQUIRE(BandwidthLimiter::globalStats().throttledReads > throttledReadsBefore);
+        REQUIRE(fileReadAll(testFileInfo.consentedFileName) == throttledContent);
+
+        wxRemoveFile(testFileInfo.consentedFileName.GetFullPath());
+    }
+#ifndef WIN32
+    SECTION("file is passed to a configured program while it is received")
+    {
+        wxFileName streamedCopy(wxT("streamedCopy.txt"));
+        auto input = GENERATE(StreamingOpenHandler::STDIN, StreamingOpenHandler::FIFO);
+        {
+            WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+            configRef->streamingOpenHandlers = { { { wxT("LOG") }, wxT("/bin/sh"),
+                (input == StreamingOpenHandler::STDIN) ? std::vector<wxString>{ wxT("-c"), wxT("cat > streamedCopy.txt") }
+                    : std::vector<wxString>{ wxT("-c"), wxT("cat \"$0\" > streamedCopy.txt"), wxT("%f") },
+                input } };
+        }
+
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("streamed.log");
+        testFileInfo.fileSize = testContent.size();
+        testFileInfo.consentedFileName = wxT("streamed.log");
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = testContent;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 200);
+        // Still saved as usual
+        REQUIRE(fileReadAll(testFileInfo.consentedFileName) == testContent);
+
+        // The program sees the end of its input once the upload is done, and may finish writing a moment later
+        for (int i = 0; i < 50 && (!streamedCopy.FileExists() || fileReadAll(streamedCopy) != testContent); ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        REQUIRE(fileReadAll(streamedCopy) == testContent);
+
+        wxRemoveFile(streamedCopy.GetFullPath());
+        wxRemoveFile(testFileInfo.consentedFileName.GetFullPath());
+    }
+#endif
+    SECTION("unhappy path - body shorter than consented leaves no file behind")
+    {
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("testFile.txt");
+        testFileInfo.fileSize = testContent.size();
+        testFileInfo.consentedFileName = wxT("testFileConsented8.txt");
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = testContent.substr(0, 10);
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 400);
+        REQUIRE(!testFileInfo.consentedFileName.FileExists());
+        for (const auto& entry : std::filesystem::directory_iterator("."))
+        {
+            REQUIRE(!startsWith(entry.path().filename().string(), std::string(".testFileConsented8.txt.")));
+        }
+    }
+    SECTION("unhappy path - upload stalls partway")
+    {
+        FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+        testFileInfo.filename = wxT("testFile.txt");
+        testFileInfo.fileSize = testContent.size();
+        testFileInfo.consentedFileName = wxT("testFileConsented6.txt");
+
+        {
+            WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference
+                    tokens(consentEndpoint.tokenWRRef);
+            tokens->insert({ testToken, { testFileInfo } });
+        }
+        {
+            WriterReadersLock<AppConfig>::WritableReference configRef(*wxTestApp.getConfigRef());
+            configRef->uploadIdleTimeoutSeconds = 1;
+        }
+
+        auto idleEvictionsBefore = EvictionStats::global().count(EvictionStats::BODY_IDLE);
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        testConn.inputBuffer = testContent.substr(0, 10);
+        testConn.bodyStallsWhenDrained = true;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 408);
+        REQUIRE(!testConn.isOpen);
+        REQUIRE(EvictionStats::global().count(EvictionStats::BODY_IDLE) == idleEvictionsBefore + 1);
+
+        // The file is released so that it can be sent again
+        mg_connection retryConn;
+        retryConn.requestInfo = mg_request_info { "consentToken=3&fileIndex=0", "/api/saveFile", "::1" };
+        retryConn.inputBuffer = testContent;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &retryConn));
+        REQUIRE(retryConn.responseStatus == 200);
+        REQUIRE(fileReadAll(testFileInfo.consentedFileName) == testContent);
+
+        wxRemoveFile(testFileInfo.consentedFileName.GetFullPath());
+    }
+}
+
+TEST_CASE("Delta uploads")
+{
+    CivetServer testServer({});
+    auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
+    ConsentPromptQueue promptQueue;
+    ConsentPolicy consentPolicy({}, wxFileName(".", "consentAudit.log"));
+
+    auto wxTestApp = QuickOpenApplication(true, false);
+    FileConsentTokenService consentEndpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+    OpenSaveFileAPIEndpoint saveEndpoint(consentEndpoint, wxTestApp);
+    FileSignatureEndpoint signatureEndpoint(consentEndpoint);
+    ConsentToken testToken = 7;
+
+    // Three blocks at the minimum block size, each with distinct contents
+    std::string baseContent;
+    for (char blockFill : { 'a', 'b', 'c' })
+    {
+        baseContent += std::string(2048, blockFill);
+    }
+    std::string newContent = baseContent.substr(0, 2048) + "changed" + baseContent.substr(4096);
+
+    wxFileName destFileName("./", "deltaDest.txt");
+    {
+        std::ofstream destFile(destFileName.GetFullPath().ToStdString(), std::ofstream::binary);
+        destFile << baseContent;
+    }
+
+    SHA256Hasher newContentHasher;
+    newContentHasher.update(newContent.data(), newContent.size());
+
+    FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+    testFileInfo.filename = wxT("deltaDest.txt");
+    testFileInfo.fileSize = newContent.size();
+    testFileInfo.contentHash = newContentHasher.finishHex();
+    testFileInfo.consentedFileName = destFileName;
+
+    {
+        WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference tokens(consentEndpoint.tokenWRRef);
+        tokens->insert({ testToken, { testFileInfo } });
+    }
+
+    mg_connection signatureConn;
+    signatureConn.requestInfo = mg_request_info { "consentToken=7&fileIndex=0", "/api/openSaveFile/signature", "::1" };
+    REQUIRE(signatureEndpoint.handleGet(&testServer, &signatureConn));
+    REQUIRE(signatureConn.responseStatus == 200);
+
+    auto signature = nlohmann::json::parse(signatureConn.outputBuffer).get<DeltaTransfer::FileSignature>();
+    REQUIRE(signature.blockSize == 2048);
+    REQUIRE(signature.baseSize == baseContent.size());
+    REQUIRE(signature.weakChecksums.size() == 3);
+    REQUIRE(signature.weakChecksums[1] == DeltaTransfer::weakChecksum(reinterpret_cast<const uint8_t*>(baseContent.data()) + 2048, 2048));
+    REQUIRE(signature.strongChecksums[2] == DeltaTransfer::strongChecksum(reinterpret_cast<const uint8_t*>(baseContent.data()) + 4096, 2048));
+
+    auto appendRecord = [](std::string& delta, uint8_t recordType, uint32_t value)
+    {
+        delta += static_cast<char>(recordType);
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            delta += static_cast<char>((value >> shift) & 0xFF);
+        }
+    };
+
+    std::string delta;
+    appendRecord(delta, DeltaTransfer::BLOCK_RECORD, 0);
+    appendRecord(delta, DeltaTransfer::LITERAL_RECORD, 7);
+    delta += "changed";
+    appendRecord(delta, DeltaTransfer::BLOCK_RECORD, 2);
+
+    SECTION("happy path")
+    {
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=7&fileIndex=0&encoding=delta&baseSize=6144", "/api/openSaveFile", "::1" };
+        testConn.inputBuffer = delta;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 200);
+        REQUIRE(fileReadAll(destFileName) == newContent);
+    }
+    SECTION("unhappy path - destination changed since the signature was taken")
+    {
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=7&fileIndex=0&encoding=delta&baseSize=6000", "/api/openSaveFile", "::1" };
+        testConn.inputBuffer = delta;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 409);
+        REQUIRE(testConn.inputBuffer == delta);
+        REQUIRE(fileReadAll(destFileName) == baseContent);
+
+        // The file can still be sent in full
+        FileConsentRequestInfo::RequestedFileInfo claimedInfo;
+        REQUIRE(consentEndpoint.claimFile(testToken, 0, claimedInfo) == FileConsentTokenService::ClaimResult::CLAIMED);
+    }
+    SECTION("unhappy path - block reference out of range")
+    {
+        std::string badDelta;
+        appendRecord(badDelta, DeltaTransfer::BLOCK_RECORD, 3);
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=7&fileIndex=0&encoding=delta&baseSize=6144", "/api/openSaveFile", "::1" };
+        testConn.inputBuffer = badDelta;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 400);
+        REQUIRE(fileReadAll(destFileName) == baseContent);
+    }
+
+    wxRemoveFile(destFileName.GetFullPath());
+}
+
+TEST_CASE("Sparse uploads")
+{
+    CivetServer testServer({});
+    auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
+    ConsentPromptQueue promptQueue;
+    ConsentPolicy consentPolicy({}, wxFileName(".", "consentAudit.log"));
+
+    auto wxTestApp = QuickOpenApplication(true, false);
+    FileConsentTokenService consentEndpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+    OpenSaveFileAPIEndpoint saveEndpoint(consentEndpoint, wxTestApp);
+    ConsentToken testToken = 8;
+
+    auto appendRecord = [](std::string& body, uint8_t recordType, unsigned long long value, int valueBytes)
+    {
+        body += static_cast<char>(recordType);
+        for (int i = 0; i < valueBytes; ++i)
+        {
+            body += static_cast<char>((value >> (i * 8)) & 0xFF);
+        }
+    };
+
+    // Data, a hole, data that is partly zeros, then a trailing hole
+    std::string zeroPadded = std::string(SparseTransfer::ZERO_BLOCK_SIZE, '\0') + "tail";
+    std::string body;
+    appendRecord(body, SparseTransfer::DATA_RECORD, 4, 4);
+    body += "head";
+    appendRecord(body, SparseTransfer::HOLE_RECORD, 10000, 8);
+    appendRecord(body, SparseTransfer::DATA_RECORD, zeroPadded.size(), 4);
+    body += zeroPadded;
+    appendRecord(body, SparseTransfer::HOLE_RECORD, 500, 8);
+
+    std::string expectedContent = "head" + std::string(10000, '\0') + zeroPadded + std::string(500, '\0');
+
+    wxFileName destFileName("./", "sparseDest.bin");
+    FileConsentRequestInfo::RequestedFileInfo testFileInfo;
+    testFileInfo.filename = wxT("sparseDest.bin");
+    testFileInfo.fileSize = expectedContent.size();
+    testFileInfo.consentedFileName = destFileName;
+
+    {
+        WriterReadersLock<FileConsentTokenService::TokenMap>::WritableReference tokens(consentEndpoint.tokenWRRef);
+        tokens->insert({ testToken, { testFileInfo } });
+    }
+
+    SECTION("happy path")
+    {
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=8&fileIndex=0&encoding=sparse", "/api/openSaveFile", "::1" };
+        testConn.inputBuffer = body;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 200);
+        REQUIRE(fileReadAll(destFileName) == expectedContent);
+    }
+    SECTION("unhappy path - hole runs past the consented length")
+    {
+        std::string badBody;
+        appendRecord(badBody, SparseTransfer::HOLE_RECORD, expectedContent.size() + 1, 8);
+
+        mg_connection testConn;
+        testConn.requestInfo = mg_request_info { "consentToken=8&fileIndex=0&encoding=sparse", "/api/openSaveFile", "::1" };
+        testConn.inputBuffer = badBody;
+
+        REQUIRE(saveEndpoint.handlePost(&testServer, &testConn));
+        REQUIRE(testConn.responseStatus == 400);
+    }
+
+    wxRemoveFile(destFileName.GetFullPath());
+}
+
+TEST_CASE("StagedFile")
+{
+	wxFileName destination(wxT("stagedDestination.txt"));
+	std::string content(3000, 'y');
+
+	SECTION("file only appears at its destination once published")
+	{
+		DurabilityPolicy policy;
+		policy.mode = DurabilityPolicy::PERIODIC;
+		policy.syncIntervalBytes = 1000;
+
+		wxFileName tempFileName;
+		{
+			StagedFile stagedFile(destination, policy);
+			tempFileName = stagedFile.getTempFileName();
+			REQUIRE(tempFileName.GetPath() == destination.GetPath());
+
+			for (size_t offset = 0; offset < content.size(); offset += 500)
+			{
+				stagedFile.stream().write(content.data() + offset, 500);
+				stagedFile.wrote(offset + 500);
+			}
+
+			REQUIRE(tempFileName.FileExists());
+			REQUIRE(!destination.FileExists());
+
+			stagedFile.publish();
+		}
+
+		REQUIRE(!tempFileName.FileExists());
+		REQUIRE(fileReadAll(destination) == content);
+		wxRemoveFile(destination.GetFullPath());
+	}
+
+	SECTION("unpublished file is discarded and leaves the destination alone")
+	{
+		{
+			std::ofstream previousVersion(destination.GetFullPath().ToStdString());
+			previousVersion << "previous";
+		}
+
+		wxFileName tempFileName;
+		{
+			StagedFile stagedFile(destination, DurabilityPolicy());
+			tempFileName = stagedFile.getTempFileName();
+			stagedFile.stream().write(content.data(), 100);
+		}
+
+		REQUIRE(!tempFileName.FileExists());
+		REQUIRE(fileReadAll(destination) == "previous");
+		wxRemoveFile(destination.GetFullPath());
+	}
+
+	SECTION("existing data is taken over and appended to")
+	{
+		wxFileName existingData(wxT("stagedExistingData.part"));
+		{
+			std::ofstream existingOut(existingData.GetFullPath().ToStdString());
+			existingOut << content.substr(0, 1000);
+		}
+
+		DurabilityPolicy policy;
+		policy.mode = DurabilityPolicy::NONE;
+		StagedFile stagedFile(destination, policy, existingData);
+		REQUIRE(!existingData.FileExists());
+
+		stagedFile.stream().write(content.data() + 1000, 2000);
+		stagedFile.publish();
+
+		REQUIRE(fileReadAll(destination) == content);
+		wxRemoveFile(destination.GetFullPath());
+	}
+}
+
+TEST_CASE("SparseTransfer::isAllZero")
+{
+    std::string zeros(1000, '\0');
+    REQUIRE(SparseTransfer::isAllZero(zeros.data(), zeros.size()));
+    REQUIRE(SparseTransfer::isAllZero(zeros.data(), 0));
+
+    // A single set byte in the unaligned tail or in the word-wise part is found
+    zeros[999] = 1;
+    REQUIRE_FALSE(SparseTransfer::isAllZero(zeros.data(), zeros.size()));
+    zeros[999] = 0;
+    zeros[8] = '\x80';
+    REQUIRE_FALSE(SparseTransfer::isAllZero(zeros.data() + 1, 20));
+}
+
+TEST_CASE("SpeculativeUploadEndpoint tests")
+{
+    CivetServer testServer({});
+    auto bannedSetLock = WriterReadersLock(std::make_unique<std::set<wxString>>());
+    ConsentPromptQueue promptQueue;
+    ConsentPolicy consentPolicy({}, wxFileName(".", "consentAudit.log"));
+    std::string testContent = "The quick brown fox sent this file before the user said yes.";
+    std::string testFileInfo = R"eos({"fileList": [{"filename": "speculativeFile.txt", "fileSize": )eos"
+            + std::to_string(testContent.size()) + R"eos(}], "speculativeUploadID": 77})eos";
+    wxFileName destFileName("./", "speculativeFile.txt");
+
+    mg_connection specConn;
+    specConn.requestInfo = mg_request_info { "speculativeUploadID=77&fileIndex=0", "/api/openSaveFile/speculative", "::1" };
+    specConn.inputBuffer = testContent;
+
+    mg_connection consentConn;
+    consentConn.requestInfo = mg_request_info { "", "/api/openSaveFile/getConsent", "::1" };
+    consentConn.inputBuffer = testFileInfo;
+
+    // Nothing is left in quarantine, on disk or against the budget
+    auto quarantineEmpty = [](FileConsentTokenService& consentEndpoint)
+    {
+        if (!consentEndpoint.speculativeUploads.tryReserveQuarantine(1, 1))
+        {
+            return false;
+        }
+
+        consentEndpoint.speculativeUploads.releaseQuarantine(1);
+        return std::filesystem::is_empty("./quarantine");
+    };
+
+    SECTION("happy path")
+    {
+        auto wxTestApp = QuickOpenApplication(true, false);
+        wxTestApp.fileDestFolder = wxFileName("./", "");
+        FileConsentTokenService consentEndpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+        SpeculativeUploadEndpoint specEndpoint(consentEndpoint, wxTestApp, wxFileName("./quarantine/", ""));
+
+        // Waiting for the consent request to arrive doesn't hold the request's thread
+        REQUIRE(specEndpoint.handlePost(&testServer, &specConn));
+        REQUIRE(specConn.suspended);
+        REQUIRE(!specConn.responseStatus.has_value());
+        REQUIRE(specEndpoint.requestsInProgress() == 1);
+
+        REQUIRE(consentEndpoint.handlePost(&testServer, &consentConn));
+        REQUIRE(consentConn.responseStatus == 200);
+
+        REQUIRE(waitUntilResumed(&specConn));
+        REQUIRE(specConn.inputBuffer.empty());
+        REQUIRE(specConn.responseStatus == 200);
+        REQUIRE(!specConn.isOpen);
+        REQUIRE(specEndpoint.requestsInProgress() == 0);
+        REQUIRE(destFileName.FileExists());
+        REQUIRE(fileReadAll(destFileName) == testContent);
+        REQUIRE(quarantineEmpty(consentEndpoint));
+
+        wxRemoveFile(destFileName.GetFullPath());
+    }
+    SECTION("happy path - consent requested first")
+    {
+        auto wxTestApp = QuickOpenApplication(true, false);
+        wxTestApp.fileDestFolder = wxFileName("./", "");
+        FileConsentTokenService consentEndpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+        SpeculativeUploadEndpoint specEndpoint(consentEndpoint, wxTestApp, wxFileName("./quarantine/", ""));
+
+        REQUIRE(consentEndpoint.handlePost(&testServer, &consentConn));
+        REQUIRE(consentConn.responseStatus == 200);
+
+        // Already decided, so the upload is answered before the handler returns
+        REQUIRE(specEndpoint.handlePost(&testServer, &specConn));
+        REQUIRE(!specConn.suspended);
+        REQUIRE(specConn.responseStatus == 200);
+        REQUIRE(fileReadAll(destFileName) == testContent);
+        REQUIRE(quarantineEmpty(consentEndpoint));
+
+        wxRemoveFile(destFileName.GetFullPath());
+    }
+    SECTION("unhappy path - request denied")
+    {
+        auto wxTestApp = QuickOpenApplication(false, false);
+        FileConsentTokenService consentEndpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+        SpeculativeUploadEndpoint specEndpoint(consentEndpoint, wxTestApp, wxFileName("./quarantine/", ""));
+
+        REQUIRE(specEndpoint.handlePost(&testServer, &specConn));
+
+        REQUIRE(consentEndpoint.handlePost(&testServer, &consentConn));
+        REQUIRE(consentConn.responseStatus == 403);
+
+        REQUIRE(waitUntilResumed(&specConn));
+        REQUIRE(specConn.responseStatus == 403);
+        REQUIRE(!specConn.isOpen);
+        REQUIRE(!destFileName.FileExists());
+        REQUIRE(quarantineEmpty(consentEndpoint));
+    }
+    SECTION("unhappy path - no matching consent request")
+    {
+        auto wxTestApp = QuickOpenApplication(true, false);
+        FileConsentTokenService consentEndpoint(promptQueue, consentPolicy, wxTestApp, bannedSetLock);
+        SpeculativeUploadEndpoint specEndpoint(consentEndpoint, wxTestApp, wxFileName("./quarantine/", ""));
+
+        specConn.requestInfo = mg_request_info { "speculativeUploadID=0&fileIndex=0", "/api/openSaveFile/speculative", "::1" };
+        REQUIRE(specEndpoint.handlePost(&testServer, &specConn));
+
+        REQUIRE(specConn.responseStatus == 404);
+        REQUIRE(!specConn.isOpen);
+    }
+}